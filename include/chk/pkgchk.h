@@ -16,6 +16,11 @@
 #define MAX_IDENT_LEN 1024
 #define MAX_FILENAME_LEN 256
 #define MAX_HASH_LEN 64
+// Children per interior node, manifests without an arity line are binary
+#define BPKG_ARITY_DEFAULT 2
+#define BPKG_ARITY_MAX 8
+// Nodes covering a chunk range, arity - 1 from each side on up to 33 levels
+#define BPKG_RANGE_MAX (2 * (BPKG_ARITY_MAX - 1) * 33)
 
 /**
  * Structure representing a chunk in the package.
@@ -36,6 +41,7 @@ struct chunk {
  * - ident: The identifier of the package.
  * - filename: The name of the file associated with the package.
  * - size: The size of the package.
+ * - arity: The number of children of every interior node, 2, 4 or 8.
  * - nhashes: The number of hashes in the package.
  * - hashes: An array of hash strings.
  * - nchunks: The number of chunks in the package.
@@ -45,6 +51,7 @@ struct bpkg_obj {
     char ident[MAX_IDENT_LEN + 1];
     char filename[MAX_FILENAME_LEN + 1];
     uint32_t size;
+    uint32_t arity;
     uint32_t nhashes;
     char** hashes;
     uint32_t nchunks;
@@ -65,12 +72,66 @@ struct bpkg_query {
     char** hashes;    
 };
 
+/**
+ * Result of comparing two packages, the indices of the chunks that differ
+ * in ascending order.
+ * - len: number of differing chunks, -1 if the packages cannot be compared.
+ * - indices: array of len chunk indices.
+ */
+struct bpkg_diff {
+    int len;
+    uint32_t* indices;
+};
+
 
 /**
  * Loads the package for when a value path is given
  */
 struct bpkg_obj* bpkg_load(const char* path);
 
+/**
+ * Reads the header lines of a manifest, from ident up to and including the
+ * "hashes:" line, leaving the file at the first hash.
+ * @param file The manifest, at its start.
+ * @param head Receives the header fields, its arrays are left empty.
+ * @return int 0 on success, -1 if a line is missing or invalid.
+ */
+int bpkg_read_header(FILE* file, struct bpkg_obj* head);
+
+/**
+ * Checks that the manifest holds a complete tree of its arity, every
+ * interior node having arity children and every chunk on the last level.
+ * @param bpkg, constructed bpkg object
+ * @return the number of levels above the chunks, -1 if the tree is not
+ * 		complete
+ */
+int bpkg_tree_height(struct bpkg_obj* bpkg);
+
+/**
+ * Finds the run of chunks below a node of a complete tree, the node's
+ * leftmost descendant on the last level and the ones after it.
+ * @param bpkg, constructed bpkg object, only the counts are used
+ * @param node, level order index of the node
+ * @param first, receives the index of the first chunk below the node
+ * @param count, receives the number of chunks below the node
+ */
+void bpkg_subtree_span(struct bpkg_obj* bpkg, uint32_t node, uint32_t* first,
+    uint32_t* count);
+
+/**
+ * Finds the minimal set of tree nodes that together cover exactly the
+ * chunks in [start, end), ordered left to right, in O(log n) from the
+ * counts of the level order layout alone.
+ * @param bpkg, constructed bpkg object, only the counts are used
+ * @param start, index of the first chunk in the range
+ * @param end, index one past the last chunk in the range
+ * @param nodes, receives up to BPKG_RANGE_MAX level order node indices
+ * @return the number of nodes, 0 if the range is empty or out of bounds or
+ * 		the tree is not complete
+ */
+int bpkg_range_nodes(struct bpkg_obj* bpkg, uint32_t start, uint32_t end,
+    uint32_t* nodes);
+
 /**
  * Checks to see if the referenced filename in the bpkg file
  * exists or not.
@@ -125,6 +186,79 @@ struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg);
  */
 struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, char* hash);
 
+/**
+ * Retrieves all chunk hashes below the node with a hash, as
+ * bpkg_get_all_chunk_hashes_from_hash does, from the tree image kept next
+ * to the manifest. The tree is only built if there is no valid image.
+ * @param bpkg, constructed bpkg object
+ * @param path, path the manifest was loaded from
+ * @param hash, hash of the node
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved
+ */
+struct bpkg_query bpkg_get_cached_chunk_hashes_from_hash(struct bpkg_obj* bpkg,
+    const char* path, char* hash);
+
+/**
+ * Retrieves the minimal set of tree nodes that together cover exactly the
+ * chunks in [start, end), ordered left to right. Works on the level order
+ * layout of the manifest in O(log n) without building the tree.
+ * Example: On an 8 chunk package, the range [0, 8) gives the root and
+ * [2, 7) gives the parent of chunks 2 and 3, the parent of chunks 4 and 5,
+ * and chunk 6.
+ * @param bpkg, constructed bpkg object
+ * @param start, index of the first chunk in the range
+ * @param end, index one past the last chunk in the range
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved, none if the
+ * 		range is empty or out of bounds or the tree is not complete
+ */
+struct bpkg_query bpkg_get_range_hashes(struct bpkg_obj* bpkg, uint32_t start,
+    uint32_t end);
+
+/**
+ * Finds the chunks that differ between two versions of a package with the
+ * same chunk geometry. Both trees are walked from the root and every
+ * subtree whose hashes match is skipped, so k changed chunks cost
+ * O(k log n) comparisons.
+ * Example: If only chunk 5 of the data was rewritten, the root and the
+ * ancestors of chunk 5 differ and the result is [5].
+ * @param from, constructed bpkg object of the old version
+ * @param to, constructed bpkg object of the new version
+ * @return diff_result, the differing chunk indices, len is -1 if the
+ * 		packages differ in size, number of chunks or arity, or a tree is not
+ * 		complete
+ */
+struct bpkg_diff bpkg_diff_chunks(struct bpkg_obj* from, struct bpkg_obj* to);
+
+/**
+ * Hashes a single chunk of the package data.
+ * @param bpkg, constructed bpkg object
+ * @param fd, descriptor of the data file opened for reading
+ * @param index, index of the chunk to hash
+ * @param hex, receives the 64 character digest
+ * @return 1 if the chunk could be read, 0 otherwise
+ */
+int bpkg_chunk_digest(struct bpkg_obj* bpkg, int fd, uint32_t index, char* hex);
+
+/**
+ * Hashes chunk data held in memory, such as a chunk received from a peer.
+ * @param data, the chunk data
+ * @param size, number of bytes in data
+ * @param hex, receives the 64 character digest
+ */
+void bpkg_data_digest(const uint8_t* data, uint32_t size, char* hex);
+
+/**
+ * Hashes a single chunk of the package data and compares the digest
+ * against the chunk hash recorded in the manifest.
+ * @param bpkg, constructed bpkg object
+ * @param fd, descriptor of the data file opened for reading
+ * @param index, index of the chunk to check
+ * @return 1 if the chunk is present and matches, 0 otherwise
+ */
+int bpkg_chunk_verify(struct bpkg_obj* bpkg, int fd, uint32_t index);
+
 
 /**
  * Deallocates the query result after it has been constructed from
@@ -132,6 +266,11 @@ struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, cha
  */
 void bpkg_query_destroy(struct bpkg_query* qry);
 
+/**
+ * Deallocates the result of bpkg_diff_chunks.
+ */
+void bpkg_diff_destroy(struct bpkg_diff* diff);
+
 /**
  * Deallocates memory at the end of the program,
  * make sure it has been completely deallocated
@@ -0,0 +1,105 @@
+/*
+ ============================================================================
+ Name        : pkgindex.h
+ ============================================================================
+ */
+
+#ifndef PKG_INDEX_H
+#define PKG_INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "chk/pkgchk.h"
+
+#define BPKG_INDEX_SUFFIX ".idx"
+// Lines of a section between two recorded line offsets
+#define BPKG_INDEX_STRIDE (64)
+// Manifests smaller than this are indexed in a temporary file only
+#define BPKG_INDEX_PERSIST_MIN (1 << 20)
+
+/**
+ * Manifest opened without parsing its hashes and chunks. The first open
+ * scans the manifest once and writes an index next to it: the offset of
+ * every BPKG_INDEX_STRIDE-th line of both sections and a table of node
+ * hashes sorted by their leading bits. Later opens read the header lines
+ * and the index header only, and every query reads just the lines it
+ * needs.
+ * - head: the header fields and counts, hashes and chunks are NULL.
+ * - file: the manifest.
+ * - index: the index, a deleted temporary file if it is not persisted.
+ * - nhash_offs, nchunk_offs: number of recorded offsets per section.
+ */
+struct bpkg_index {
+    struct bpkg_obj head;
+    FILE* file;
+    FILE* index;
+    uint32_t nhash_offs;
+    uint32_t nchunk_offs;
+};
+
+/**
+ * Opens a manifest lazily, building its index if there is no valid one.
+ * @param path The path to the package file.
+ * @return struct bpkg_index* The opened manifest, NULL if it cannot be read.
+ */
+struct bpkg_index* bpkg_index_open(const char* path);
+
+/**
+ * Reads the hash of a node in level order, interior nodes first and then
+ * the chunks.
+ * @param idx The opened manifest.
+ * @param node Level order index of the node.
+ * @param hash Receives the hash and a terminator.
+ * @return int 0 on success, -1 if the node does not exist or cannot be read.
+ */
+int bpkg_index_node(struct bpkg_index* idx, uint32_t node, char hash[MAX_HASH_LEN + 1]);
+
+/**
+ * Reads a run of consecutive chunks.
+ * @param idx The opened manifest.
+ * @param first Index of the first chunk.
+ * @param count Number of chunks.
+ * @param chunks Receives count chunks.
+ * @return int 0 on success, -1 if a chunk does not exist or cannot be read.
+ */
+int bpkg_index_chunks(struct bpkg_index* idx, uint32_t first, uint32_t count,
+    struct chunk* chunks);
+
+/**
+ * Finds a node by its hash.
+ * @param idx The opened manifest.
+ * @param hash The hash to look for.
+ * @return int64_t Level order index of the first node with the hash, -1 if
+ *         there is none.
+ */
+int64_t bpkg_index_find(struct bpkg_index* idx, const char* hash);
+
+/**
+ * Retrieves all chunk hashes below the node with a hash, reading only the
+ * chunks below it.
+ * @param idx The opened manifest.
+ * @param hash Hash of the node.
+ * @return query_result, len is -1 if no node has the hash or the tree is
+ *         not complete.
+ */
+struct bpkg_query bpkg_index_hashes_of(struct bpkg_index* idx, const char* hash);
+
+/**
+ * Retrieves the minimal set of tree nodes that cover the chunks in
+ * [start, end), reading only those nodes.
+ * @param idx The opened manifest.
+ * @param start Index of the first chunk in the range.
+ * @param end Index one past the last chunk in the range.
+ * @return query_result, none if the range is empty or out of bounds or
+ *         the tree is not complete.
+ */
+struct bpkg_query bpkg_index_range_hashes(struct bpkg_index* idx, uint32_t start,
+    uint32_t end);
+
+/**
+ * Closes a lazily opened manifest.
+ * @param idx The opened manifest, may be NULL.
+ */
+void bpkg_index_close(struct bpkg_index* idx);
+
+#endif
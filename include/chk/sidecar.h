@@ -0,0 +1,100 @@
+/*
+ ============================================================================
+ Name        : sidecar.h
+ ============================================================================
+ */
+
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SIDECAR_PATH_LEN 1100
+// Files modified this close to the time they were examined may change
+// again without a visible change in mtime
+#define SIDECAR_RACY_NS (2000000000LL)
+
+/**
+ * Identity of a file a sidecar was derived from, every field must match
+ * for the sidecar to be trusted.
+ */
+struct file_identity {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+/**
+ * Sidecar file being written next to the file it describes.
+ * - file: the temporary file, NULL once the sidecar is committed.
+ * - path: where the sidecar is published.
+ * - tmppath: where it is written until then.
+ */
+struct sidecar {
+    FILE* file;
+    char path[SIDECAR_PATH_LEN];
+    char tmppath[SIDECAR_PATH_LEN + 4];
+};
+
+/**
+ * Reads the identity of an open file.
+ * @param fd The file.
+ * @param id Receives the identity.
+ * @return int 0 on success, -1 if the file cannot be examined.
+ */
+int file_identity_of(int fd, struct file_identity* id);
+
+/**
+ * Reads the identity of a file by its path.
+ * @param path Path of the file.
+ * @param id Receives the identity.
+ * @return int 0 on success, -1 if the file cannot be examined.
+ */
+int file_identity_at(const char* path, struct file_identity* id);
+
+/**
+ * Returns the wall clock time, comparable with file modification times.
+ * @return int64_t Nanoseconds since the epoch.
+ */
+int64_t file_wall_ns(void);
+
+/**
+ * Checks whether a file was quiet when its identity was read, so that a
+ * later write is certain to change its identity.
+ * @param id The identity.
+ * @param examined_ns Wall clock time at which it was read.
+ * @return int 1 if the file is quiet, 0 if a sidecar of it must not be kept.
+ */
+int file_identity_quiet(const struct file_identity* id, int64_t examined_ns);
+
+/**
+ * Starts writing a sidecar, in a temporary file next to its final path.
+ * @param sc The sidecar.
+ * @param path Path the sidecar is published at.
+ * @param mode fopen mode, "wb" or "w+b" to read it back after publishing.
+ * @return FILE* The file to write, NULL on failure.
+ */
+FILE* sidecar_begin(struct sidecar* sc, const char* path, const char* mode);
+
+/**
+ * Publishes a sidecar if it was written completely, leaving it open.
+ * On failure the temporary file is closed and removed.
+ * @param sc The sidecar.
+ * @param ok Whether every write succeeded.
+ * @return FILE* The published file, NULL on failure.
+ */
+FILE* sidecar_publish(struct sidecar* sc, int ok);
+
+/**
+ * Closes and publishes a sidecar if it was written completely, removing
+ * the temporary file otherwise.
+ * @param sc The sidecar.
+ * @param ok Whether every write succeeded.
+ * @return int 0 on success, -1 on failure.
+ */
+int sidecar_commit(struct sidecar* sc, int ok);
+
+#endif // SIDECAR_H
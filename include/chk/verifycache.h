@@ -0,0 +1,84 @@
+/*
+ ============================================================================
+ Name        : verifycache.h
+ ============================================================================
+ */
+
+#ifndef VERIFY_CACHE_H
+#define VERIFY_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "chk/pkgchk.h"
+#include "chk/sidecar.h"
+
+#define VCACHE_SUFFIX ".vcache"
+#define VCACHE_DIGEST_LEN (32)
+
+/**
+ * Digests computed for the chunks of one data file, persisted next to it.
+ * A digest is only reused while the file keeps the identity it had when
+ * the digests were computed, any change to the file discards them all.
+ * - known: one bit per chunk with a cached digest.
+ * - digests: binary digest of every chunk marked in known.
+ * - dirty: digests were added since the cache was loaded.
+ * - examined_ns: wall clock time at which the identity was read.
+ */
+struct verify_cache {
+    pthread_mutex_t lock;
+    struct file_identity id;
+    uint32_t nchunks;
+    uint8_t* known;
+    uint8_t (*digests)[VCACHE_DIGEST_LEN];
+    int dirty;
+    int64_t examined_ns;
+};
+
+/**
+ * Loads the cache of a data file. If there is no valid cache for the file
+ * as it is now, the cache starts empty.
+ * @param vc The cache to initialise.
+ * @param datapath Path of the data file.
+ * @param fd The data file, opened for reading.
+ * @param nchunks Number of chunks in the package.
+ * @return int 0 on success, -1 if the file cannot be examined or on
+ * 		allocation failure.
+ */
+int vcache_load(struct verify_cache* vc, const char* datapath, int fd, uint32_t nchunks);
+
+/**
+ * Checks a chunk against the manifest, hashing it only if the cache has
+ * no digest for it, and records the digest of a hashed chunk.
+ * @param vc The cache.
+ * @param bpkg, constructed bpkg object
+ * @param fd, descriptor of the data file opened for reading
+ * @param index, index of the chunk to check
+ * @param hashed, set to 1 if the chunk had to be hashed, may be NULL
+ * @return 1 if the chunk is present and matches, 0 otherwise
+ */
+int vcache_verify(struct verify_cache* vc, struct bpkg_obj* bpkg, int fd,
+    uint32_t index, int* hashed);
+
+/**
+ * Writes the cache next to the data file if digests were added. Nothing
+ * is written if the file changed since the cache was loaded.
+ * @param vc The cache.
+ * @param datapath Path of the data file.
+ * @return int 0 on success or if there was nothing to write, -1 otherwise.
+ */
+int vcache_save(struct verify_cache* vc, const char* datapath);
+
+/**
+ * Deletes the cache of a data file, for when chunks are found to have
+ * changed without a change to the file's identity.
+ * @param datapath Path of the data file.
+ */
+void vcache_discard(const char* datapath);
+
+/**
+ * Frees the memory of a cache.
+ * @param vc The cache.
+ */
+void vcache_free(struct verify_cache* vc);
+
+#endif
@@ -30,5 +30,44 @@ void sha256_finalize(struct sha256_compute_data* data,
 void sha256_output_hex(struct sha256_compute_data* data, 
 		char hexbuf[SHA256_CHUNK_SZ]);
 
+/**
+ * Hashes the concatenation of two hex digests, the parent of two nodes in a
+ * Merkle tree. Gives the same result as hashing the 128 bytes with
+ * sha256_update, with the padding block precomputed.
+ * @param left The 64 character left digest.
+ * @param right The 64 character right digest.
+ * @param out Receives the 64 character digest, may alias left or right.
+ */
+void sha256_hash_pair(const char* left, const char* right, char* out);
+
+/**
+ * Hashes many sibling pairs, several at a time with their rounds
+ * interleaved. Equivalent to calling sha256_hash_pair on each pair.
+ * @param pairs n pairs of 64 character digests, stored back to back.
+ * @param out Receives n digests of 64 characters, must not overlap pairs.
+ * @param n Number of pairs.
+ */
+void sha256_hash_pairs(const char* pairs, char* out, uint32_t n);
+
+/**
+ * Hashes the concatenation of several hex digests, the parent of the
+ * children of one node in a tree of any arity.
+ * @param digests count digests of 64 characters, stored back to back.
+ * @param count Number of digests.
+ * @param out Receives the 64 character digest, must not overlap digests.
+ */
+void sha256_hash_digests(const char* digests, uint32_t count, char* out);
+
+/**
+ * Hashes many groups of width digests, several groups at a time with their
+ * rounds interleaved. Equivalent to calling sha256_hash_digests on each.
+ * @param digests n * width digests of 64 characters, stored back to back.
+ * @param width Number of digests in a group.
+ * @param out Receives n digests of 64 characters, must not overlap digests.
+ * @param n Number of groups.
+ */
+void sha256_hash_digest_groups(const char* digests, uint32_t width, char* out,
+		uint32_t n);
+
 #endif
 
@@ -4,28 +4,135 @@
 #include <stdint.h>
 
 #define PAYLOAD_MAX (4092)
+// Size of every packet on the wire
+#define PACKET_SIZE (4096)
 
 #define PKT_MSG_ACK 0x0c
 #define PKT_MSG_ACP 0x02
 #define PKT_MSG_DSN 0x03
 #define PKT_MSG_REQ 0x06
 #define PKT_MSG_RES 0x07
+#define PKT_MSG_PRF 0x08
+#define PKT_MSG_BMP 0x09
+#define PKT_MSG_HAV 0x0a
+#define PKT_MSG_CCL 0x0b
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
 
+#define PKT_HASH_LEN (64)
+#define PKT_IDENT_LEN (1024)
+#define PKT_RES_DATA_MAX (2998)
+// Position of the RES data within an encoded packet
+#define PKT_RES_DATA_POS (8)
+// Siblings that fit in a PRF payload after its fixed fields
+#define PKT_PROOF_MAX (46)
+// Bitmap bytes that fit in a BMP payload after its fixed fields
+#define PKT_BMP_MAX (3056)
+// Chunk indices that fit in a HAV payload after its fixed fields
+#define PKT_HAV_MAX (766)
+
+// BMP flags: the sender holds every chunk, bits is empty
+#define PKT_BMP_COMPLETE 0x01
+// BMP flags: the sender asks for the receiver's bitmap in return
+#define PKT_BMP_REPLY 0x02
+
+/**
+ * Request for a range of a chunk, the range must lie within the chunk
+ * identified by chunk_hash. A CCL carries the same fields and withdraws
+ * the request, responses still queued for the range are dropped.
+ */
+struct btide_req {
+    uint32_t file_offset;
+    uint32_t data_len;
+    char chunk_hash[PKT_HASH_LEN];
+    char identifier[PKT_IDENT_LEN];
+};
+
+/**
+ * Response carrying up to PKT_RES_DATA_MAX bytes of a requested range.
+ * A request for more data is answered with several responses.
+ */
+struct btide_res {
+    uint32_t file_offset;
+    uint8_t data[PKT_RES_DATA_MAX];
+    uint16_t data_len;
+    char chunk_hash[PKT_HASH_LEN];
+    char identifier[PKT_IDENT_LEN];
+};
+
+/**
+ * Merkle inclusion proof of a chunk, for peers that check chunks against
+ * the root hash alone. A PRF with nleaves 0 asks the peer for the proof of
+ * the chunk at file_offset, with an empty chunk_hash if the requester's
+ * manifest lacks it. btide answers these requests but never sends them,
+ * as its manifests list every chunk hash.
+ * Siblings are listed from the leaf level up, arity - 1 on each level of
+ * the sender's tree.
+ */
+struct btide_prf {
+    uint32_t file_offset;
+    uint32_t chunk_index;
+    uint32_t nleaves;
+    uint16_t len;
+    char chunk_hash[PKT_HASH_LEN];
+    char identifier[PKT_IDENT_LEN];
+    char siblings[PKT_PROOF_MAX][PKT_HASH_LEN];
+};
+
+/**
+ * Chunks of a package held by the sender, sent for every ready package
+ * once a connection is established and when a package becomes ready.
+ * Bit i of bits, least significant bit first, stands for chunk first + i.
+ * A package with more chunks than fit is described by several packets.
+ */
+struct btide_bmp {
+    uint32_t nchunks;
+    uint32_t first;
+    uint16_t len;
+    uint8_t flags;
+    char identifier[PKT_IDENT_LEN];
+    uint8_t bits[PKT_BMP_MAX];
+};
+
+/**
+ * Chunks of a package the sender has verified since its last BMP.
+ */
+struct btide_hav {
+    uint16_t count;
+    char identifier[PKT_IDENT_LEN];
+    uint32_t indices[PKT_HAV_MAX];
+};
 
 union btide_payload {
     uint8_t data[PAYLOAD_MAX];
-
+    struct btide_req req;
+    struct btide_res res;
+    struct btide_prf prf;
+    struct btide_bmp bmp;
+    struct btide_hav hav;
 };
 
 struct btide_packet {
     uint16_t msg_code;
-    uint16_t error
+    uint16_t error;
     union btide_payload pl;
 };
 
+/**
+ * Serialises a packet into its fixed size wire format. Integer fields are
+ * written in network byte order at fixed offsets so the layout does not
+ * depend on structure padding.
+ * @param pkt The packet to encode.
+ * @param out Buffer receiving PACKET_SIZE bytes.
+ */
+void pkt_encode(const struct btide_packet* pkt, uint8_t out[PACKET_SIZE]);
 
-
+/**
+ * Parses a packet from its fixed size wire format.
+ * @param in Buffer holding PACKET_SIZE bytes.
+ * @param pkt The packet to fill.
+ * @return int 0 on success, -1 if the packet is malformed.
+ */
+int pkt_decode(const uint8_t in[PACKET_SIZE], struct btide_packet* pkt);
 
 #endif
@@ -0,0 +1,129 @@
+/*
+ ============================================================================
+ Name        : pool.h
+ ============================================================================
+ */
+#ifndef SCHED_POOL_H
+#define SCHED_POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Fixed size pool of worker threads. Each worker owns a Chase-Lev deque:
+ * tasks submitted from a worker go on its own deque, which it runs newest
+ * first while idle workers steal the oldest. Tasks submitted from other
+ * threads go through a shared queue in submission order.
+ */
+struct pool;
+
+typedef void (*pool_task_fn)(void* arg);
+
+/**
+ * Function run on a sub-range by pool_parallel_for.
+ * @param arg Argument passed to pool_parallel_for.
+ * @param begin First index of the sub-range.
+ * @param end One past the last index of the sub-range.
+ */
+typedef void (*pool_range_fn)(void* arg, uint64_t begin, uint64_t end);
+
+/**
+ * Set of tasks that can be joined without waiting for the rest of the
+ * pool. Initialise with pool_group_init, it may live on the stack of the
+ * thread that joins it.
+ * - pending: tasks of the group not yet finished.
+ */
+struct pool_group {
+    atomic_int pending;
+};
+
+/**
+ * Returns the default number of workers, one per online processor.
+ * @return int The number of workers to use when none is configured.
+ */
+int pool_default_size(void);
+
+/**
+ * Creates a pool and starts its worker threads.
+ * @param nthreads Number of workers, pool_default_size() if less than 1.
+ * @return struct pool* The pool, or NULL if it could not be created.
+ */
+struct pool* pool_create(int nthreads);
+
+/**
+ * Returns the number of workers of a pool.
+ * @param pool The pool, may be NULL.
+ * @return int The number of workers, 0 for no pool.
+ */
+int pool_size(struct pool* pool);
+
+/**
+ * Queues a task for execution on one of the workers.
+ * @param pool The pool to submit to.
+ * @param fn The function to run.
+ * @param arg Argument passed to fn.
+ * @return int 0 on success, -1 if the task could not be queued.
+ */
+int pool_submit(struct pool* pool, pool_task_fn fn, void* arg);
+
+/**
+ * Blocks until every submitted task, including tasks submitted by other
+ * tasks while waiting, has finished. Must not be called from a task, join
+ * a group instead.
+ * @param pool The pool to wait on.
+ */
+void pool_wait(struct pool* pool);
+
+/**
+ * Returns the number of tasks queued or running.
+ * @param pool The pool.
+ * @return int The number of unfinished tasks.
+ */
+int pool_pending(struct pool* pool);
+
+/**
+ * Initialises an empty task group.
+ * @param group The group.
+ */
+void pool_group_init(struct pool_group* group);
+
+/**
+ * Queues a task belonging to a group.
+ * @param pool The pool to submit to.
+ * @param group The group the task joins.
+ * @param fn The function to run.
+ * @param arg Argument passed to fn.
+ * @return int 0 on success, -1 if the task could not be queued.
+ */
+int pool_group_submit(struct pool* pool, struct pool_group* group,
+    pool_task_fn fn, void* arg);
+
+/**
+ * Blocks until every task of a group has finished, running queued tasks
+ * of the pool meanwhile, so tasks may join groups of their own.
+ * @param pool The pool the tasks were submitted to.
+ * @param group The group to join.
+ */
+void pool_group_wait(struct pool* pool, struct pool_group* group);
+
+/**
+ * Runs fn over [begin, end) split into sub-ranges of about grain indices,
+ * spread over the pool and the calling thread, and returns once all of
+ * them are done. May be called from a task.
+ * @param pool The pool, NULL to run the whole range on the calling thread.
+ * @param begin First index.
+ * @param end One past the last index.
+ * @param grain Indices per sub-range, 0 to pick one from the pool size.
+ * @param fn The function to run on each sub-range.
+ * @param arg Argument passed to fn.
+ */
+void pool_parallel_for(struct pool* pool, uint64_t begin, uint64_t end,
+    uint64_t grain, pool_range_fn fn, void* arg);
+
+/**
+ * Finishes all queued tasks, stops the workers and frees the pool.
+ * @param pool The pool to destroy.
+ */
+void pool_destroy(struct pool* pool);
+
+#endif
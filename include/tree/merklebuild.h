@@ -0,0 +1,34 @@
+/*
+ ============================================================================
+ Name        : merklebuild.h
+ ============================================================================
+ */
+
+#ifndef MERKLE_BUILD_H
+#define MERKLE_BUILD_H
+
+#include <stdint.h>
+#include "tree/merkletree.h"
+#include "sched/pool.h"
+
+/**
+ * Hashes of a complete tree stored in level order, the layout of the hashes
+ * and chunks sections of a .bpkg: with arity k node i has children k * i + 1
+ * to k * i + k, and the nleaves leaves start at index (nleaves - 1) / (k - 1).
+ * Hashes are lowercase hex without a terminator.
+ */
+typedef char merkle_hex[SHA256_HEXLEN];
+
+/**
+ * Fills in every interior node from the leaves, one level at a time.
+ * Levels wide enough are split into ranges hashed on the pool's workers.
+ * @param nodes Array of (arity * nleaves - 1) / (arity - 1) hashes with the
+ *        leaves filled in.
+ * @param nleaves Number of leaves, a power of arity.
+ * @param arity Number of children of every interior node.
+ * @param pool Workers to use, NULL to build on the calling thread.
+ */
+void merkle_build_levels(merkle_hex* nodes, uint32_t nleaves, uint32_t arity,
+    struct pool* pool);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ ============================================================================
+ Name        : merkleimage.h
+ ============================================================================
+ */
+
+#ifndef MERKLE_IMAGE_H
+#define MERKLE_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "tree/merkletree.h"
+
+#define MERKLE_IMAGE_SUFFIX ".tree"
+// Child index of a node without that child
+#define MERKLE_IMAGE_NONE UINT32_MAX
+// Manifests smaller than this are imaged in memory only
+#define MERKLE_IMAGE_PERSIST_MIN (1 << 20)
+
+/**
+ * Node of a tree image, a merkle_tree_node with its children as indices.
+ * - hash: The expected hash, without a terminator.
+ * - left, right: Indices of the children, MERKLE_IMAGE_NONE if absent.
+ * - is_leaf: 1 for a chunk, 0 for an interior node.
+ */
+struct merkle_image_node {
+    char hash[SHA256_HEXLEN];
+    uint32_t left;
+    uint32_t right;
+    uint32_t is_leaf;
+    uint32_t reserved;
+};
+
+/**
+ * A tree built by create_merkle_tree in a form that needs no pointers, so
+ * it can be written next to the manifest and mapped back in by later runs.
+ * Nodes are stored level by level, the root first, followed by the node
+ * indices sorted by hash. An image is only reused while the manifest has
+ * the size, counts and root hash it was built from.
+ * - base, len: The mapped file or the allocated buffer holding the image.
+ * - mapped: 1 if base is a mapping, 0 if it was allocated.
+ * - nnodes: Number of nodes.
+ * - nodes: The nodes, the root at index 0.
+ * - order: Node indices sorted by hash.
+ */
+struct merkle_image {
+    void* base;
+    size_t len;
+    int mapped;
+    uint32_t nnodes;
+    const struct merkle_image_node* nodes;
+    const uint32_t* order;
+};
+
+/**
+ * Flattens a tree into an image held in memory.
+ * @param tree A tree built by create_merkle_tree from obj.
+ * @param obj The manifest the tree was built from.
+ * @return struct merkle_image* The image, NULL on allocation failure.
+ */
+struct merkle_image* merkle_image_build(const struct merkle_tree* tree,
+    const struct bpkg_obj* obj);
+
+/**
+ * Writes an image to a file, replacing any previous one atomically.
+ * @param img The image.
+ * @param path Path of the file.
+ * @return int 0 on success, -1 on a write failure.
+ */
+int merkle_image_save(const struct merkle_image* img, const char* path);
+
+/**
+ * Maps an image written by merkle_image_save.
+ * @param path Path of the file.
+ * @param obj The manifest the image must have been built from.
+ * @return struct merkle_image* The image, NULL if there is no file or it
+ *         is not a valid image of this manifest.
+ */
+struct merkle_image* merkle_image_open(const char* path, const struct bpkg_obj* obj);
+
+/**
+ * Returns the image of a manifest's tree, mapping the one next to the
+ * manifest if it is still valid. Otherwise the tree is built, and its
+ * image kept next to the manifest if the manifest is large.
+ * @param obj The manifest.
+ * @param bpkgpath Path of the manifest.
+ * @return struct merkle_image* The image, NULL on failure.
+ */
+struct merkle_image* merkle_image_load(struct bpkg_obj* obj, const char* bpkgpath);
+
+/**
+ * Finds a node by its hash in O(log n).
+ * @param img The image.
+ * @param hash The hash to look for, with a terminator.
+ * @return int64_t Index of a node with the hash, -1 if there is none.
+ */
+int64_t merkle_image_find(const struct merkle_image* img, const char* hash);
+
+/**
+ * Adds the hashes of the leaves below a node, left to right, to a query,
+ * as inorder does for a tree.
+ * @param img The image.
+ * @param node Index of the node.
+ * @param qry The query, hashes grown as needed.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int merkle_image_leaves(const struct merkle_image* img, uint32_t node,
+    struct bpkg_query* qry);
+
+/**
+ * Unmaps or frees an image.
+ * @param img The image, may be NULL.
+ */
+void merkle_image_close(struct merkle_image* img);
+
+#endif
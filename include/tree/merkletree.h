@@ -18,6 +18,9 @@
 #include <math.h>
 
 #define SHA256_HEXLEN (64)
+// Most siblings on a path, 7 on each of the 10 levels of an 8-ary tree
+// with a 32 bit count of chunks
+#define MERKLE_PROOF_MAX (70)
 
 /**
  * Structure representing a node in the Merkle tree.
@@ -56,9 +59,27 @@ struct merkle_tree {
 };
 
 
+/**
+ * Inclusion proof of one chunk: the hashes of the siblings on the path
+ * from the chunk's leaf up to the root, leaf level first and each level's
+ * siblings left to right.
+ * - index: Index of the chunk.
+ * - nleaves: Number of chunks in the package.
+ * - arity: Number of children of every interior node.
+ * - len: Number of siblings, arity - 1 per level above the leaves.
+ * - siblings: The sibling hashes.
+ */
+struct merkle_proof {
+    uint32_t index;
+    uint32_t nleaves;
+    uint32_t arity;
+    uint32_t len;
+    char siblings[MERKLE_PROOF_MAX][SHA256_HEXLEN];
+};
+
 /**
  * The create_merkle_tree function constructs a Merkle tree from a 
- * given bpkg_obj structure. It calculates the required depth and 
+ * given bpkg_obj structure with a binary tree. It calculates the required depth and 
  * width of the tree, allocates memory for the tree nodes, initializes 
  * the tree with hashes and chunk hashes, links the nodes appropriately, 
  * and returns the constructed Merkle tree.
@@ -98,4 +119,51 @@ void inordersearch(struct merkle_tree_node* node, char* h, struct merkle_tree_no
  * @param qry A pointer to the bpkg_query structure where the hashes will be stored.
  */
 void inorder(struct merkle_tree_node* node, struct bpkg_query* qry);
+
+/**
+ * Computes the parent of two nodes, the SHA-256 of their concatenated
+ * hex digests.
+ * @param left Hash of the left child.
+ * @param right Hash of the right child.
+ * @param out Receives the parent hash.
+ */
+void merkle_hash_pair(const char* left, const char* right, char* out);
+
+/**
+ * Computes the parent of a node's children, the SHA-256 of their
+ * concatenated hex digests.
+ * @param children arity hashes of 64 characters, stored back to back.
+ * @param arity Number of children.
+ * @param out Receives the parent hash, must not overlap children.
+ */
+void merkle_hash_children(const char* children, uint32_t arity, char* out);
+
+/**
+ * Returns the root hash of a package's tree.
+ * @param obj The package manifest.
+ * @return const char* The root hash.
+ */
+const char* merkle_root(struct bpkg_obj* obj);
+
+/**
+ * The merkle_get_proof function collects the sibling path of a chunk in
+ * O(log n), indexing the manifest's level order hashes directly instead
+ * of building the tree.
+ * @param obj The package manifest.
+ * @param index Index of the chunk.
+ * @param proof Receives the proof.
+ * @return int 0 on success, -1 if the index is out of range or the
+ *         manifest is not a complete tree of its arity.
+ */
+int merkle_get_proof(struct bpkg_obj* obj, uint32_t index, struct merkle_proof* proof);
+
+/**
+ * The merkle_verify_proof function hashes a leaf up its sibling path and
+ * compares the result against a trusted root, no manifest is needed.
+ * @param leaf Hash of the chunk's data.
+ * @param proof The chunk's inclusion proof.
+ * @param root The trusted root hash.
+ * @return int 1 if the leaf belongs to the tree at proof->index, 0 otherwise.
+ */
+int merkle_verify_proof(const char* leaf, const struct merkle_proof* proof, const char* root);
 #endif
\ No newline at end of file
@@ -79,11 +79,75 @@ for infile in $hashes_of_files; do
     fi
 done
 
+range_hashes_files=("testingp1/input/range_hashes/*.bpkg")
+range="1 7"
+flag="-range_hashes"
+passed_tests[$flag]=0
+total_tests[$flag]=0
+
+for infile in $range_hashes_files; do
+    outfile="${infile%.bpkg}.out"
+
+    # Execute package_main with input, flag, and chunk range, capture the output
+    ./pkgmain "$infile" $flag $range > temp_output.txt
+
+    # Ensure temp_output.txt ends with a newline
+    sed -i -e '$a\' temp_output.txt
+
+    # Ensure outfile ends with a newline
+    sed -i -e '$a\' "$outfile"
+
+    # Increment the total tests counter
+    ((total_tests[$flag]++))
+    ((overall_total++))
+
+    # Compare the output to the expected output file
+    if cmp -s temp_output.txt "$outfile"; then
+        echo "Test $(basename "$infile") with flag $flag and range $range PASSED"
+        ((passed_tests[$flag]++))
+        ((overall_passed++))
+    else
+        echo "Test $(basename "$infile") with flag $flag and range $range FAILED"
+    fi
+done
+
+diff_files=("testingp1/input/diff/*.bpkg")
+base="testingp1/input/diff/base.bpkg"
+flag="-diff"
+passed_tests[$flag]=0
+total_tests[$flag]=0
+
+for infile in $diff_files; do
+    outfile="${infile%.bpkg}.out"
+
+    # Execute package_main with input, flag, and base package, capture the output
+    ./pkgmain "$infile" $flag "$base" > temp_output.txt
+
+    # Ensure temp_output.txt ends with a newline
+    sed -i -e '$a\' temp_output.txt
+
+    # Ensure outfile ends with a newline
+    sed -i -e '$a\' "$outfile"
+
+    # Increment the total tests counter
+    ((total_tests[$flag]++))
+    ((overall_total++))
+
+    # Compare the output to the expected output file
+    if cmp -s temp_output.txt "$outfile"; then
+        echo "Test $(basename "$infile") with flag $flag against $(basename "$base") PASSED"
+        ((passed_tests[$flag]++))
+        ((overall_passed++))
+    else
+        echo "Test $(basename "$infile") with flag $flag against $(basename "$base") FAILED"
+    fi
+done
+
 # Clean up temporary output file
 rm temp_output.txt
 
 # Print summary of passed and total tests for each flag
-for flag in "${flags[@]}" "-hashes_of"; do
+for flag in "${flags[@]}" "-hashes_of" "-range_hashes" "-diff"; do
     echo "Passed ${passed_tests[$flag]} / ${total_tests[$flag]} tests with flag $flag"
 done
 
@@ -0,0 +1,427 @@
+/*
+ ============================================================================
+ Name        : bench.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "chk/pkgchk.h"
+#include "crypt/sha256.h"
+#include "tree/merkletree.h"
+#include "tree/merkleimage.h"
+#include "net/packet.h"
+
+// Each benchmark runs for at least this long unless BENCH_MIN_MS is set
+#define BENCH_MIN_MS (250)
+// Trees larger than this are skipped unless BENCH_MEM_MB is set
+#define BENCH_MEM_MB (1024)
+#define BENCH_MIN_LOG (10)
+#define BENCH_MAX_LOG (22)
+// Generated manifests stop at this size, bpkg_load is linear in lines
+#define BENCH_LOAD_MAX_LOG (18)
+
+//
+// Allocation counting, glibc lets the program replace the malloc family
+//
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static uint64_t nallocs;
+
+void* malloc(size_t size) {
+    nallocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    nallocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    nallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * A benchmark body, runs one operation.
+ * @param arg Benchmark specific state.
+ */
+typedef void (*bench_fn)(void* arg);
+
+// Defeats dead code elimination of results
+static volatile uint64_t sink;
+static long min_ms = BENCH_MIN_MS;
+
+/**
+ * Returns the current monotonic time.
+ * @return uint64_t Nanoseconds since an arbitrary fixed point.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Runs a benchmark for at least min_ms after one warm up call, doubling
+ * the batch size so timer overhead stays negligible, and prints one JSON
+ * line with the results.
+ * @param name Name of the benchmarked operation.
+ * @param param Size parameter, reported as n.
+ * @param bytes Bytes processed per operation, 0 if not meaningful.
+ * @param fn The benchmark body.
+ * @param arg Argument passed to fn.
+ */
+static void bench_run(const char* name, uint64_t param, uint64_t bytes,
+    bench_fn fn, void* arg) {
+    fn(arg);
+
+    uint64_t iters = 0;
+    uint64_t batch = 1;
+    uint64_t allocs = nallocs;
+    uint64_t start = now_ns();
+    uint64_t elapsed = 0;
+    while (elapsed < (uint64_t)min_ms * 1000000) {
+        for (uint64_t i = 0; i < batch; i++) {
+            fn(arg);
+        }
+        iters += batch;
+        batch *= 2;
+        elapsed = now_ns() - start;
+    }
+    allocs = nallocs - allocs;
+
+    double ns_per_op = (double)elapsed / iters;
+    printf("{\"bench\":\"%s\",\"n\":%llu,\"iters\":%llu,\"ns_per_op\":%.1f,"
+        "\"mb_per_s\":%.2f,\"allocs_per_op\":%.2f}\n",
+        name, (unsigned long long)param, (unsigned long long)iters, ns_per_op,
+        bytes ? (double)bytes / (1024 * 1024) / (ns_per_op / 1e9) : 0.0,
+        (double)allocs / iters);
+    fflush(stdout);
+}
+
+/**
+ * Reports a benchmark that was not run.
+ * @param name Name of the benchmarked operation.
+ * @param param Size parameter, reported as n.
+ * @param reason Why it was skipped.
+ */
+static void bench_skip(const char* name, uint64_t param, const char* reason) {
+    printf("{\"bench\":\"%s\",\"n\":%llu,\"skipped\":\"%s\"}\n",
+        name, (unsigned long long)param, reason);
+    fflush(stdout);
+}
+
+//
+// sha256_update
+//
+
+struct sha_arg {
+    struct sha256_compute_data sha;
+    uint8_t* buf;
+    uint32_t len;
+};
+
+static void bench_sha256(void* arg) {
+    struct sha_arg* a = arg;
+    sha256_update(&a->sha, a->buf, a->len);
+    sink += a->sha.hcomps[0];
+}
+
+//
+// Interior node hashing, the generic path against the pair kernels
+//
+
+// Sibling pairs hashed per sha256_hash_pairs call
+#define BENCH_PAIRS (1024)
+
+struct pair_arg {
+    char* pairs;
+    char* out;
+};
+
+static void bench_pair_generic(void* arg) {
+    struct pair_arg* a = arg;
+    struct sha256_compute_data sha;
+    uint8_t digest[SHA256_INT_SZ];
+    sha256_compute_data_init(&sha);
+    sha256_update(&sha, a->pairs, 2 * SHA256_HEXLEN);
+    sha256_finalize(&sha, digest);
+    sha256_output_hex(&sha, a->out);
+    sink += (uint8_t)a->out[0];
+}
+
+static void bench_pair(void* arg) {
+    struct pair_arg* a = arg;
+    sha256_hash_pair(a->pairs, a->pairs + SHA256_HEXLEN, a->out);
+    sink += (uint8_t)a->out[0];
+}
+
+static void bench_pairs(void* arg) {
+    struct pair_arg* a = arg;
+    sha256_hash_pairs(a->pairs, a->out, BENCH_PAIRS);
+    sink += (uint8_t)a->out[0];
+}
+
+//
+// Merkle tree construction and subtree queries
+//
+
+/**
+ * Builds a manifest in memory with a complete tree of 2^log leaves. Hashes
+ * are unique but synthetic, nothing here checks them against data.
+ * @param log Base 2 logarithm of the number of chunks.
+ * @return struct bpkg_obj* The manifest, NULL on allocation failure.
+ */
+static struct bpkg_obj* bench_obj(int log) {
+    struct bpkg_obj* obj = calloc(1, sizeof(struct bpkg_obj));
+    if (!obj) {
+        return NULL;
+    }
+    obj->arity = BPKG_ARITY_DEFAULT;
+    obj->nchunks = 1u << log;
+    obj->nhashes = obj->nchunks - 1;
+    obj->size = obj->nchunks * 4096u;
+    snprintf(obj->ident, sizeof(obj->ident), "%064x", log);
+    snprintf(obj->filename, sizeof(obj->filename), "bench.data");
+    obj->hashes = calloc(obj->nhashes, sizeof(char*));
+    obj->chunks = calloc(obj->nchunks, sizeof(struct chunk));
+    if (!obj->hashes || !obj->chunks) {
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < obj->nhashes; i++) {
+        obj->hashes[i] = malloc(MAX_HASH_LEN + 1);
+        if (!obj->hashes[i]) {
+            bpkg_obj_destroy(obj);
+            return NULL;
+        }
+        snprintf(obj->hashes[i], MAX_HASH_LEN + 1, "f%063x", i);
+    }
+    for (uint32_t i = 0; i < obj->nchunks; i++) {
+        snprintf(obj->chunks[i].hash, MAX_HASH_LEN + 1, "%064x", i);
+        obj->chunks[i].offset = i * 4096u;
+        obj->chunks[i].size = 4096;
+    }
+    return obj;
+}
+
+struct tree_arg {
+    struct bpkg_obj* obj;
+    char* hash;
+};
+
+static void bench_tree(void* arg) {
+    struct tree_arg* a = arg;
+    struct merkle_tree* tree = create_merkle_tree(a->obj);
+    sink += tree->n_nodes;
+    free_merkle_tree(tree);
+}
+
+static void bench_subtree(void* arg) {
+    struct tree_arg* a = arg;
+    struct bpkg_query qry = bpkg_get_all_chunk_hashes_from_hash(a->obj, a->hash);
+    sink += qry.len;
+    bpkg_query_destroy(&qry);
+}
+
+struct image_arg {
+    struct merkle_image* img;
+    char* hash;
+};
+
+static void bench_image_subtree(void* arg) {
+    struct image_arg* a = arg;
+    struct bpkg_query qry = { 0 };
+    int64_t node = merkle_image_find(a->img, a->hash);
+    if (node >= 0) {
+        merkle_image_leaves(a->img, (uint32_t)node, &qry);
+    }
+    sink += qry.len;
+    bpkg_query_destroy(&qry);
+}
+
+/**
+ * Estimates the memory create_merkle_tree needs, it allocates every level
+ * at the width of the leaf level.
+ * @param log Base 2 logarithm of the number of chunks.
+ * @return uint64_t Bytes needed by the tree.
+ */
+static uint64_t tree_bytes(int log) {
+    return (uint64_t)(log + 1) * (1ULL << log) * sizeof(struct merkle_tree_node);
+}
+
+//
+// bpkg_load
+//
+
+/**
+ * Writes a manifest to a temporary file in the bpkg text format.
+ * @param obj The manifest to write.
+ * @param path Receives the path of the file.
+ * @param len Size of path.
+ * @return int 0 on success, -1 on failure.
+ */
+static int bench_write_bpkg(struct bpkg_obj* obj, char* path, size_t len) {
+    const char* dir = getenv("TMPDIR");
+    snprintf(path, len, "%s/benchXXXXXX.bpkg", dir ? dir : "/tmp");
+    int fd = mkstemps(path, 5);
+    if (fd < 0) {
+        return -1;
+    }
+    FILE* out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    fprintf(out, "ident:%s\nfilename:%s\nsize:%u\nnhashes:%u\nhashes:\n",
+        obj->ident, obj->filename, obj->size, obj->nhashes);
+    for (uint32_t i = 0; i < obj->nhashes; i++) {
+        fprintf(out, "\t%s\n", obj->hashes[i]);
+    }
+    fprintf(out, "nchunks:%u\nchunks:\n", obj->nchunks);
+    for (uint32_t i = 0; i < obj->nchunks; i++) {
+        fprintf(out, "\t%s,%u,%u\n", obj->chunks[i].hash, obj->chunks[i].offset,
+            obj->chunks[i].size);
+    }
+    if (fclose(out) != 0) {
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_load(void* arg) {
+    struct bpkg_obj* obj = bpkg_load(arg);
+    sink += obj ? obj->nchunks : 0;
+    bpkg_obj_destroy(obj);
+}
+
+//
+// Packet encoding
+//
+
+struct pkt_arg {
+    struct btide_packet pkt;
+    uint8_t wire[PACKET_SIZE];
+};
+
+static void bench_encode(void* arg) {
+    struct pkt_arg* a = arg;
+    pkt_encode(&a->pkt, a->wire);
+    sink += a->wire[PACKET_SIZE - 1];
+}
+
+static void bench_decode(void* arg) {
+    struct pkt_arg* a = arg;
+    sink += pkt_decode(a->wire, &a->pkt) + a->pkt.pl.res.data_len;
+}
+
+/**
+ * Runs every benchmark and prints one JSON object per line on stdout.
+ * BENCH_MIN_MS and BENCH_MEM_MB tune the run time and the largest tree.
+ */
+int main(void) {
+    const char* env = getenv("BENCH_MIN_MS");
+    if (env && atol(env) > 0) {
+        min_ms = atol(env);
+    }
+    uint64_t mem_limit = (uint64_t)BENCH_MEM_MB << 20;
+    env = getenv("BENCH_MEM_MB");
+    if (env && atol(env) > 0) {
+        mem_limit = (uint64_t)atol(env) << 20;
+    }
+
+    const uint32_t sizes[] = { 64, 1024, 4096, 65536, 1 << 20 };
+    struct sha_arg sha;
+    sha.buf = malloc(1 << 20);
+    if (!sha.buf) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < (1 << 20); i++) {
+        sha.buf[i] = (uint8_t)(i * 131);
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        sha256_compute_data_init(&sha.sha);
+        sha.len = sizes[i];
+        bench_run("sha256_update", sizes[i], sizes[i], bench_sha256, &sha);
+    }
+    free(sha.buf);
+
+    struct pair_arg pp;
+    pp.pairs = malloc(BENCH_PAIRS * 2 * SHA256_HEXLEN + 1);
+    pp.out = malloc(BENCH_PAIRS * SHA256_HEXLEN);
+    if (!pp.pairs || !pp.out) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < 2 * BENCH_PAIRS; i++) {
+        snprintf(pp.pairs + i * SHA256_HEXLEN, SHA256_HEXLEN + 1, "%064x", i);
+    }
+    bench_run("hash_pair_generic", 1, 2 * SHA256_HEXLEN, bench_pair_generic, &pp);
+    bench_run("sha256_hash_pair", 1, 2 * SHA256_HEXLEN, bench_pair, &pp);
+    bench_run("sha256_hash_pairs", BENCH_PAIRS, BENCH_PAIRS * 2 * SHA256_HEXLEN,
+        bench_pairs, &pp);
+    free(pp.pairs);
+    free(pp.out);
+
+    for (int log = BENCH_MIN_LOG; log <= BENCH_MAX_LOG; log += 2) {
+        uint64_t leaves = 1ULL << log;
+        if (tree_bytes(log) > mem_limit) {
+            bench_skip("create_merkle_tree", leaves, "memory");
+            bench_skip("subtree_root", leaves, "memory");
+            bench_skip("subtree_leaf_pair", leaves, "memory");
+            continue;
+        }
+        struct tree_arg ta = { bench_obj(log), NULL };
+        if (!ta.obj) {
+            bench_skip("create_merkle_tree", leaves, "memory");
+            continue;
+        }
+        bench_run("create_merkle_tree", leaves, 0, bench_tree, &ta);
+        // Whole tree below the root, and the deepest internal node
+        ta.hash = ta.obj->hashes[0];
+        bench_run("subtree_root", leaves, 0, bench_subtree, &ta);
+        ta.hash = ta.obj->hashes[ta.obj->nhashes - 1];
+        bench_run("subtree_leaf_pair", leaves, 0, bench_subtree, &ta);
+        // The same query answered from the tree's image, as later runs do
+        struct merkle_tree* tree = create_merkle_tree(ta.obj);
+        struct image_arg ia = { merkle_image_build(tree, ta.obj), ta.hash };
+        free_merkle_tree(tree);
+        if (ia.img) {
+            bench_run("image_subtree_leaf_pair", leaves, 0, bench_image_subtree, &ia);
+            merkle_image_close(ia.img);
+        }
+        bpkg_obj_destroy(ta.obj);
+    }
+
+    for (int log = BENCH_MIN_LOG; log <= BENCH_LOAD_MAX_LOG; log += 2) {
+        struct bpkg_obj* obj = bench_obj(log);
+        char path[512];
+        if (!obj || bench_write_bpkg(obj, path, sizeof(path)) != 0) {
+            bench_skip("bpkg_load", 1ULL << log, "tmpfile");
+            bpkg_obj_destroy(obj);
+            continue;
+        }
+        bpkg_obj_destroy(obj);
+        bench_run("bpkg_load", 1ULL << log, 0, bench_load, path);
+        unlink(path);
+    }
+
+    struct pkt_arg pa;
+    memset(&pa, 0, sizeof(pa));
+    pa.pkt.msg_code = PKT_MSG_RES;
+    pa.pkt.pl.res.data_len = PKT_RES_DATA_MAX;
+    memset(pa.pkt.pl.res.chunk_hash, 'a', PKT_HASH_LEN);
+    memset(pa.pkt.pl.res.identifier, 'b', PKT_IDENT_LEN);
+    bench_run("pkt_encode", 1, PACKET_SIZE, bench_encode, &pa);
+    bench_run("pkt_decode", 1, PACKET_SIZE, bench_decode, &pa);
+    return 0;
+}
@@ -5,28 +5,17 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
 #include <pthread.h>
 #include "config.h"
 #include "package.h"
-
-#define BUFFER_SIZE 5520
-
-// Structure to handle connection details
-typedef struct
-{
-	int sock;
-	struct sockaddr address;
-	int addr_len;
-} connection_t;
+#include "command.h"
+#include "peer.h"
+#include "scrub.h"
+#include "sched/pool.h"
 
 //
 // PART 2
@@ -35,239 +24,66 @@ typedef struct
 // Signal handler for SIGINT (Ctrl+C)
 void sigint_handler(int signum) {
     // Exit the program with the signal number
-    exit(signum); 
-}
-
-void * process(void * ptr)
-{
-	char * buffer;
-	int len;
-	connection_t * conn;
-	long addr = 0;
-
-	if (!ptr) pthread_exit(0);
-	conn = (connection_t *)ptr;
-
-	/* read length of message */
-	read(conn->sock, &len, sizeof(int));
-	if (len > 0)
-	{
-		addr = (long)((struct sockaddr_in *)&conn->address)->sin_addr.s_addr;
-		buffer = (char *)malloc((len+1)*sizeof(char));
-		buffer[len] = 0;
-
-		/* read message */
-		read(conn->sock, buffer, len);
-
-		/* print message */
-		printf("%d.%d.%d.%d: %s\n",
-			(int)((addr      ) & 0xff),
-			(int)((addr >>  8) & 0xff),
-			(int)((addr >> 16) & 0xff),
-			(int)((addr >> 24) & 0xff),
-			buffer);
-		free(buffer);
-	}
-
-	/* close socket and clean up */
-	close(conn->sock);
-	free(conn);
-	pthread_exit(0);
+    exit(signum);
 }
 
-
-void *cs(void *vargp) {
-    int *myid = (int *)vargp;
-    printf("Started thread cs %d\n", *myid);
-    // Appropriate return for a function used with pthreads that has nothing specific to return
-    return NULL; 
+// Arguments of a thread queueing the commands of a script file
+typedef struct {
+    struct cmd_queue *queue;
+    const char *path;
+    int quit;
+} script_t;
+
+// Arguments of the thread reading commands from stdin
+typedef struct {
+    struct cmd_queue *queue;
+    pthread_t *scriptthreads;
+    script_t *scripts;
+    int nscripts;
+} input_t;
+
+// Thread function running the event loop of a listener shard
+void *shard_thread(void *vargp) {
+    node_run((struct btide_node *)vargp);
+    return NULL;
 }
 
-// Thread function to manage server creation and incoming connections
-void *create_server(void *vargp) {
-	
-	Config *c = (Config *)vargp;
-    int server_fd;
-    struct sockaddr_in address;
-    connection_t * connection;
-    pthread_t thread;
-
-    // Create a socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-    // Set up the server address structure
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(c->port);
-
-    // Bind the socket
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+// Thread function reading a script file given on the command line
+void *script_thread(void *vargp) {
+    script_t *script = (script_t *)vargp;
+    FILE *file = fopen(script->path, "r");
+    if (!file) {
+        printf("Cannot open script %s.\n", script->path);
+        return NULL;
     }
+    script->quit = cmd_read_stream(script->queue, file);
+    fclose(file);
+    return NULL;
+}
 
-    // Listen for incoming connections
-    if (listen(server_fd, 3) < 0) {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
+// Thread function reading stdin, commands never wait on network I/O
+void *input_thread(void *vargp) {
+    input_t *input = (input_t *)vargp;
+    int quit = cmd_read_stream(input->queue, stdin);
+    for (int i = 0; i < input->nscripts; i++) {
+        pthread_join(input->scriptthreads[i], NULL);
+        quit |= input->scripts[i].quit;
     }
-
-
-    // Continuously accept incoming connections and spawn new threads to handle them
-    while (1) {
-
-        connection = (connection_t *)malloc(sizeof(connection_t));
-        socklen_t addrlen = sizeof(struct sockaddr);
-        if ((connection->sock = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0) {
-            perror("Accept failed");
-            free(connection);
-            exit(EXIT_FAILURE);
-        } else {
-			// start a new thread but do not wait for it
-			pthread_create(&thread, 0, process, (void *)connection);
-			pthread_detach(thread);
+    if (!quit) {
+        // All input consumed without a QUIT, shut down once it has run
+        struct command *cmd = cmd_parse("QUIT");
+        if (cmd) {
+            cmd_queue_push(input->queue, cmd);
         }
     }
-    	printf("SERVER\n");
+    return NULL;
 }
 
-// Client-side function to connect to peers, send and receive messages
-void start_client(PackageList *pkgList, Config *configuration) {
-
-    char input[BUFFER_SIZE];
-
-    // socket set-up
-    struct sockaddr_in serv_addr;
-    int sock = 0;
-
-    char* peers[100];
-    int peercount = 0;
-
-    while (1) {
-
-    	char *t = fgets(input, BUFFER_SIZE, stdin);
-    	if (NULL == t) {
-    		fprintf(stderr, "Error: Failed to read input\n");
-    	} 
-        char *token = strtok(input, " ");
-        char in_ip[20];
-        int in_port;
-        
-    	if (strcmp(token, "QUIT\n")==0) {
-
-            exit(0);
-
-    	} else if (strcmp(token, "CONNECT")==0) {
-            // Handling connect command to establish new connections
-            token = strtok(NULL, " ");
-            if (token == NULL) {
-                printf("Missing address and port argument\n");
-                exit(0);
-            } else {
-                token[strcspn(token, "\n")] = 0;
-            }
-
-            if (token == NULL) {
-                printf("Missing address and port argument\n");
-                exit(0);
-            }
-
-            token = strtok(token, ":");
-            strcpy(in_ip, token);
-            token = strtok(NULL, ":");
-            in_port = atoi(token);
-
-    	    // Create socket file descriptor
-    	    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    	        perror("Socket creation error");
-    	        return;
-    	    }
-
-    	    // Configure server address
-    	    serv_addr.sin_family = AF_INET;
-    	    serv_addr.sin_port = htons(in_port);
-
-    	    // Convert IPv4 and IPv6 addresses from text to binary form
-    	    if (inet_pton(AF_INET, in_ip, &serv_addr.sin_addr) <= 0) {
-    	        perror("Invalid address/ Address not supported");
-    	        return;
-    	    }
-
-    		// Connect to the server
-    	    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-    	        perror("Connection failed");
-    	        return;
-    	    }
-    	    printf("Connection established with peer\n");
-    	    peers[peercount] = in_ip;
-    	    peercount++;
-
-    	} else if (strcmp(token, "DISCONNECT")==0) {
-            // Handling disconnect command to terminate connections
-            token = strtok(NULL, " ");
-            if (token == NULL) {
-                printf("Missing address and port argument\n");
-                exit(0);
-            } else {
-                token[strcspn(token, "\n")] = 0;
-            }
-
-            if (token == NULL) {
-                printf("Missing address and port argument\n");
-                exit(0);
-            }
-
-            token = strtok(token, ":");
-            strcpy(in_ip, token);
-            token = strtok(NULL, ":");
-            in_port = atoi(token);
-            // Close the socket
-            close(sock); 
-            printf("Disconnected from peer\n");
-
-    	} else if (strcmp(token, "ADDPACKAGE") == 0) {
-            // Add a package to the list
-            token = strtok(NULL, " ");
-            token[strcspn(token, "\n")] = 0;
-            addPackage(pkgList, configuration->directory, token);
-
-        } else if (strcmp(token, "REMPACKAGE") == 0) {
-             // Remove a package from the list
-            token = strtok(NULL, " ");
-            token[strcspn(token, "\n")] = 0;
-            removePackage(pkgList, token);
-
-        } else if (strcmp(token, "PACKAGES\n")==0) {
-            // List all packages
-    		listPackages(pkgList);
-
-    	} else if (strcmp(token, "PEERS\n")==0) {
-            // List all peers
-
-            if (peercount == 0) {
-                printf("Not connected to any peers\n");
-            } else {
-    		    printf("Connected to:\n");
-    		    for (int i=0; i<peercount; i++) {
-    			    printf("%d. %s\n", peercount, peers[i]);
-    		    }
-            }
-
-    	} else if (strcmp(token, "FETCH\n")==0) {
-            // Fetch command handler
-    		printf("Fetching\n");
-    	}
-    }
-    cleanupPackages(pkgList);
-}
-
-// Main function to initialize the server and client
+// Main function to initialize the network thread and the command readers
 int main(int argc, char *argv[]) {
-    PackageList pkgList = {NULL, 0};
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <config_file>\n", argv[0]);
+    PackageList pkgList;
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <config_file> [script_file...]\n", argv[0]);
         return 1;
     }
 
@@ -285,9 +101,83 @@ int main(int argc, char *argv[]) {
         return result;
     }
 
-    pthread_t serverthread;
-    pthread_create(&serverthread, 0, create_server, (void *)&config);
-    start_client(&pkgList, &config);
-	pthread_join(serverthread, NULL);
+    // Results are reported asynchronously, keep them visible as they happen
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // Manifests already in the package directory are loaded in the background
+    struct pool* workers = pool_create(config.pool_threads);
+    static struct chunk_store store;
+    if (config.chunk_store && store_open(&store, config.directory) != 0) {
+        perror("Unable to open chunk store");
+        return 1;
+    }
+    // Without reflinks every stored chunk would be a second copy on disk
+    int sharing = config.chunk_store && store.shared;
+    if (config.chunk_store && !sharing) {
+        fprintf(stderr, "Chunk store disabled, %s does not support reflinks\n", config.directory);
+    }
+    initPackages(&pkgList, workers, sharing ? &store : NULL);
+
+    // The node watches packages becoming ready, so it exists before the scan
+    int nshards = config.listen_shards;
+    struct btide_node *nodes = calloc(nshards, sizeof(struct btide_node));
+    if (!nodes || node_init(nodes, nshards, &config, &pkgList) != 0) {
+        return 1;
+    }
+    scanPackages(&pkgList, config.directory);
+
+    // Seeded data is rehashed in the background to catch it rotting on disk
+    static struct scrubber scrubber;
+    int scrubbing = config.scrub_rate_mb > 0
+        && scrub_start(&scrubber, &pkgList, config.directory,
+            (uint64_t)config.scrub_rate_mb << 20, (uint64_t)config.scrub_pause_mb << 20) == 0;
+
+    // Every script file is an additional producer on the command queue
+    int nscripts = argc - 2;
+    pthread_t *scriptthreads = calloc(nscripts > 0 ? nscripts : 1, sizeof(pthread_t));
+    script_t *scripts = calloc(nscripts > 0 ? nscripts : 1, sizeof(script_t));
+    if (!scriptthreads || !scripts) {
+        perror("Failed to allocate script readers");
+        return 1;
+    }
+    for (int i = 0; i < nscripts; i++) {
+        scripts[i].queue = &nodes[0].commands;
+        scripts[i].path = argv[i + 2];
+        pthread_create(&scriptthreads[i], 0, script_thread, &scripts[i]);
+    }
+    // Static so the detached reader never outlives its arguments
+    static input_t input;
+    input = (input_t){ &nodes[0].commands, scriptthreads, scripts, nscripts };
+    pthread_t inputthread;
+    pthread_create(&inputthread, 0, input_thread, &input);
+    pthread_detach(inputthread);
+
+    // Commands reach shard 0, which passes on what the others must see
+    pthread_t *shardthreads = calloc(nshards, sizeof(pthread_t));
+    if (!shardthreads) {
+        perror("Failed to allocate listener shards");
+        return 1;
+    }
+    for (int i = 1; i < nshards; i++) {
+        pthread_create(&shardthreads[i], 0, shard_thread, &nodes[i]);
+    }
+
+    // This thread becomes the network thread until a QUIT is executed
+    node_run(&nodes[0]);
+    for (int i = 1; i < nshards; i++) {
+        pthread_join(shardthreads[i], NULL);
+    }
+
+    if (scrubbing) {
+        scrub_stop(&scrubber);
+    }
+    // Tasks still running report to the node, it is closed once they are done
+    pool_destroy(workers);
+    for (int i = nshards - 1; i >= 0; i--) {
+        node_close(&nodes[i]);
+    }
+    free(shardthreads);
+    free(nodes);
+    cleanupPackages(&pkgList);
     return 0;
-}
\ No newline at end of file
+}
@@ -6,8 +6,54 @@
 
 #include "chk/pkgchk.h"
 #include "tree/merkletree.h"
+#include "tree/merkleimage.h"
+#include <unistd.h>
+
+#define CHUNK_READ_SZ (65536)
+// Pending nodes of the diff walk, arity - 1 per level plus the root
+#define DIFF_STACK_MAX ((BPKG_ARITY_MAX - 1) * 32 + 1)
 // PART 1
 
+/**
+ * Reads the header lines of a manifest, from ident up to and including the
+ * "hashes:" line.
+ * @param file The manifest, at its start.
+ * @param head Receives the header fields, its arrays are left empty.
+ * @return int 0 on success, -1 if a line is missing or invalid.
+ */
+int bpkg_read_header(FILE* file, struct bpkg_obj* head) {
+    char buffer[2048];
+    // Nothing is allocated yet should a line be missing
+    memset(head, 0, sizeof(*head));
+
+    // Read the first line and store the ident value in head->ident
+    if (fgets(buffer, sizeof(buffer), file) == NULL) return -1;
+    sscanf(buffer, "ident: %1024s", head->ident);
+
+    // Read the second line and store the filename value in head->filename
+    if (fgets(buffer, sizeof(buffer), file) == NULL) return -1;
+    sscanf(buffer, "filename: %256s", head->filename);
+
+    // Read the third line and store the size value in head->size
+    if (fgets(buffer, sizeof(buffer), file) == NULL) return -1;
+    sscanf(buffer, "size: %u", &head->size);
+
+    // Read the fourth line, an arity line is only present for trees that
+    // are not binary and comes before nhashes
+    head->arity = BPKG_ARITY_DEFAULT;
+    if (fgets(buffer, sizeof(buffer), file) == NULL) return -1;
+    if (sscanf(buffer, "arity: %u", &head->arity) == 1) {
+        if (head->arity < 2 || head->arity > BPKG_ARITY_MAX
+            || (head->arity & (head->arity - 1)) != 0) return -1;
+        if (fgets(buffer, sizeof(buffer), file) == NULL) return -1;
+    }
+    sscanf(buffer, "nhashes: %u", &head->nhashes);
+
+    // The "hashes:" line
+    if (fgets(buffer, sizeof(buffer), file) == NULL) return -1;
+    return 0;
+}
+
 /**
  * Loads the package for when a value path is given.
  * @param path The path to the package file.
@@ -31,28 +77,13 @@ struct bpkg_obj* bpkg_load(const char* path) {
     }
 
     char buffer[2048];
-    // Read the first line and store the ident value in obj->ident
-    if (fgets(buffer, sizeof(buffer), file) == NULL) goto error;
-    sscanf(buffer, "ident: %1024s", obj->ident);
+    if (bpkg_read_header(file, obj) != 0) goto error;
 
-    // Read the second line and store the filename value in obj->filename
-    if (fgets(buffer, sizeof(buffer), file) == NULL) goto error;
-    sscanf(buffer, "filename: %256s", obj->filename);
-    
-    // Read the third line and store the size value in obj->size
-    if (fgets(buffer, sizeof(buffer), file) == NULL) goto error;
-    sscanf(buffer, "size: %u", &obj->size);
-
-    // Read the fourth line and store the nhashes value in obj->nhashes
-    if (fgets(buffer, sizeof(buffer), file) == NULL) goto error;
-    sscanf(buffer, "nhashes: %u", &obj->nhashes);
-    
     // Allocate memory for the array of hash pointers
     obj->hashes = calloc(obj->nhashes, sizeof(char *));  
     if (!obj->hashes) goto error;
 
     // Read and store each hash value
-    if (fgets(buffer, sizeof(buffer), file) == NULL) goto error;
     for (uint32_t i = 0; i < obj->nhashes; i++) {
         if (fgets(buffer, sizeof(buffer), file) == NULL) goto error;
 
@@ -277,6 +308,102 @@ struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg) {
 }
 
 
+/**
+ * Returns the hash of a node in the level order layout of a manifest,
+ * interior nodes come from the hashes section and leaves from the chunks.
+ * @param bpkg, constructed bpkg object
+ * @param node, level order index of the node
+ * @return the 64 character hash of the node
+ */
+static const char* bpkg_node_hash(struct bpkg_obj* bpkg, uint32_t node) {
+    return node < bpkg->nhashes ? bpkg->hashes[node]
+        : bpkg->chunks[node - bpkg->nhashes].hash;
+}
+
+/**
+ * Checks that the manifest holds a complete tree of its arity, every
+ * interior node having arity children and every chunk on the last level.
+ * @param bpkg, constructed bpkg object
+ * @return the number of levels above the chunks, -1 if the tree is not
+ * 		complete
+ */
+int bpkg_tree_height(struct bpkg_obj* bpkg) {
+    uint32_t k = bpkg->arity;
+    uint32_t n = bpkg->nchunks;
+    if (n == 0 || k < 2) {
+        return -1;
+    }
+    int height = 0;
+    for (; n > 1; n /= k, height++) {
+        if (n % k != 0) {
+            return -1;
+        }
+    }
+    // A complete tree has (nchunks - 1) / (arity - 1) interior nodes
+    return bpkg->nhashes == (bpkg->nchunks - 1) / (k - 1) ? height : -1;
+}
+
+/**
+ * Finds the run of chunks below a node of a complete tree, the node's
+ * leftmost descendant on the last level and the ones after it.
+ * @param bpkg, constructed bpkg object, only the counts are used
+ * @param node, level order index of the node
+ * @param first, receives the index of the first chunk below the node
+ * @param count, receives the number of chunks below the node
+ */
+void bpkg_subtree_span(struct bpkg_obj* bpkg, uint32_t node, uint32_t* first,
+    uint32_t* count) {
+    uint64_t leftmost = node;
+    uint64_t n = 1;
+    while (leftmost < bpkg->nhashes) {
+        leftmost = leftmost * bpkg->arity + 1;
+        n *= bpkg->arity;
+    }
+    *first = (uint32_t)(leftmost - bpkg->nhashes);
+    *count = (uint32_t)n;
+}
+
+/**
+ * Retrieves the chunks below a node of a tree that is not binary. The
+ * level order layout is indexed directly, the chunks below a node are the
+ * run that starts at its leftmost descendant.
+ * @param bpkg, constructed bpkg object
+ * @param hash, hash of the node
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved
+ */
+static struct bpkg_query subtree_chunk_hashes(struct bpkg_obj* bpkg, char* hash) {
+    struct bpkg_query qry = { 0 };
+    uint32_t total = bpkg->nhashes + bpkg->nchunks;
+    uint32_t node = 0;
+    while (node < total && strcmp(bpkg_node_hash(bpkg, node), hash) != 0) {
+        node++;
+    }
+    if (node == total || bpkg_tree_height(bpkg) < 0) {
+        printf("Node not found\n");
+        exit(1);
+    }
+
+    uint32_t first;
+    uint32_t count;
+    bpkg_subtree_span(bpkg, node, &first, &count);
+    qry.hashes = malloc((uint64_t)count * sizeof(char*));
+    if (qry.hashes == NULL) {
+        perror("Failed to allocate memory for hashes");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        qry.hashes[i] = malloc((MAX_HASH_LEN + 1) * sizeof(char));
+        if (qry.hashes[i] == NULL) {
+            perror("Failed to allocate memory for hash entry");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(qry.hashes[i], bpkg->chunks[first + i].hash);
+        qry.len++;
+    }
+    return qry;
+}
+
 /**
  * Retrieves all chunk hashes given a certain an ancestor hash (or itself)
  * Example: If the root hash was given, all chunk hashes will be outputted
@@ -290,6 +417,9 @@ struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg) {
  */
 struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, 
     char* hash) {
+        if (bpkg->arity != BPKG_ARITY_DEFAULT) {
+            return subtree_chunk_hashes(bpkg, hash);
+        }
         struct bpkg_query qry = { 0 };
         qry.len = 0;
 
@@ -332,7 +462,245 @@ struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg,
         return qry;
     }
 
+/**
+ * Retrieves all chunk hashes below the node with a hash, as
+ * bpkg_get_all_chunk_hashes_from_hash does, from the tree image kept next
+ * to the manifest. The tree is only built if there is no valid image.
+ * @param bpkg, constructed bpkg object
+ * @param path, path the manifest was loaded from
+ * @param hash, hash of the node
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved
+ */
+struct bpkg_query bpkg_get_cached_chunk_hashes_from_hash(struct bpkg_obj* bpkg,
+    const char* path, char* hash) {
+    // create_merkle_tree sizes its levels from nhashes and overruns them
+    // when nhashes is a power of two or the chunks outnumber the last level
+    uint64_t width = bpkg->nhashes > 1
+        ? (uint64_t)1 << (uint32_t)ceil(log2(bpkg->nhashes)) : 0;
+    if (bpkg->arity != BPKG_ARITY_DEFAULT || bpkg->nhashes < 2
+        || (bpkg->nhashes & (bpkg->nhashes - 1)) == 0 || bpkg->nchunks > width) {
+        return bpkg_get_all_chunk_hashes_from_hash(bpkg, hash);
+    }
+
+    struct merkle_image* img = merkle_image_load(bpkg, path);
+    if (img == NULL) {
+        puts("Unable to load tree");
+        exit(1);
+    }
+    int64_t node = merkle_image_find(img, hash);
+    if (node < 0) {
+        printf("Node not found\n");
+        merkle_image_close(img);
+        exit(1);
+    }
+    struct bpkg_query qry = { 0 };
+    if (merkle_image_leaves(img, (uint32_t)node, &qry) != 0) {
+        puts("Unable to allocate query hashes");
+        merkle_image_close(img);
+        exit(1);
+    }
+    merkle_image_close(img);
+    return qry;
+}
+
+/**
+ * Finds the minimal set of tree nodes that together cover exactly the
+ * chunks in [start, end), ordered left to right, in O(log n) from the
+ * counts of the level order layout alone.
+ * @param bpkg, constructed bpkg object, only the counts are used
+ * @param start, index of the first chunk in the range
+ * @param end, index one past the last chunk in the range
+ * @param nodes, receives up to BPKG_RANGE_MAX level order node indices
+ * @return the number of nodes, 0 if the range is empty or out of bounds or
+ * 		the tree is not complete
+ */
+int bpkg_range_nodes(struct bpkg_obj* bpkg, uint32_t start, uint32_t end,
+    uint32_t* nodes) {
+    uint32_t k = bpkg->arity;
+    if (start >= end || end > bpkg->nchunks || bpkg_tree_height(bpkg) < 0) {
+        return 0;
+    }
+
+    // At most arity - 1 nodes per side on every level
+    uint32_t right[BPKG_RANGE_MAX / 2];
+    int nleft = 0;
+    int nright = 0;
+    // Bounds are positions within a level that starts at base in level
+    // order. Nodes at unaligned positions on either end cannot be covered
+    // by a parent inside the range, take them and climb while bounds differ
+    uint32_t width = bpkg->nchunks;
+    uint32_t base = bpkg->nhashes;
+    for (uint32_t l = start, r = end; l < r; l /= k, r /= k) {
+        while (l < r && l % k != 0) {
+            nodes[nleft++] = base + l++;
+        }
+        while (l < r && r % k != 0) {
+            right[nright++] = base + --r;
+        }
+        width /= k;
+        base = width ? (width - 1) / (k - 1) : 0;
+    }
+    // Right nodes were found right to left
+    for (int i = 0; i < nright; i++) {
+        nodes[nleft + i] = right[nright - 1 - i];
+    }
+    return nleft + nright;
+}
+
+/**
+ * Retrieves the minimal set of tree nodes that together cover exactly the
+ * chunks in [start, end), ordered left to right. Works on the level order
+ * layout of the manifest in O(log n) without building the tree.
+ * @param bpkg, constructed bpkg object
+ * @param start, index of the first chunk in the range
+ * @param end, index one past the last chunk in the range
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved, none if the
+ * 		range is empty or out of bounds or the tree is not complete
+ */
+struct bpkg_query bpkg_get_range_hashes(struct bpkg_obj* bpkg, uint32_t start,
+    uint32_t end) {
+    struct bpkg_query qry = { 0 };
+    uint32_t nodes[BPKG_RANGE_MAX];
+    int n = bpkg_range_nodes(bpkg, start, end, nodes);
+    if (n == 0) {
+        return qry;
+    }
+
+    qry.hashes = malloc(n * sizeof(char*));
+    if (qry.hashes == NULL) {
+        perror("Failed to allocate memory for hashes");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        qry.hashes[i] = malloc((MAX_HASH_LEN + 1) * sizeof(char));
+        if (qry.hashes[i] == NULL) {
+            perror("Failed to allocate memory for hash entry");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(qry.hashes[i], bpkg_node_hash(bpkg, nodes[i]));
+        qry.len++;
+    }
+    return qry;
+}
 
+/**
+ * Finds the chunks that differ between two versions of a package with the
+ * same chunk geometry. Both trees are walked from the root and every
+ * subtree whose hashes match is skipped, so k changed chunks cost
+ * O(k log n) comparisons.
+ * @param from, constructed bpkg object of the old version
+ * @param to, constructed bpkg object of the new version
+ * @return diff_result, the differing chunk indices, len is -1 if the
+ * 		packages differ in size, number of chunks or arity, or a tree is not
+ * 		complete
+ */
+struct bpkg_diff bpkg_diff_chunks(struct bpkg_obj* from, struct bpkg_obj* to) {
+    struct bpkg_diff diff = { -1, NULL };
+    uint32_t k = from->arity;
+    // Equal size and chunk count give the same offsets and chunk sizes
+    if (from->nchunks != to->nchunks || from->size != to->size
+        || k != to->arity || bpkg_tree_height(from) < 0
+        || bpkg_tree_height(to) < 0) {
+        return diff;
+    }
+    diff.len = 0;
+
+    // Depth first, leftmost child on top, so chunks come out in ascending
+    // order. Each level leaves at most arity - 1 pending siblings.
+    uint32_t stack[DIFF_STACK_MAX];
+    int top = 0;
+    uint32_t cap = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        uint32_t node = stack[--top];
+        if (strncmp(bpkg_node_hash(from, node), bpkg_node_hash(to, node),
+            MAX_HASH_LEN) == 0) {
+            continue;
+        }
+        if (node < from->nhashes) {
+            for (uint32_t c = k; c >= 1; c--) {
+                stack[top++] = k * node + c;
+            }
+            continue;
+        }
+        if ((uint32_t)diff.len == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t* grown = realloc(diff.indices, cap * sizeof(uint32_t));
+            if (grown == NULL) {
+                perror("Failed to allocate memory for diff");
+                exit(EXIT_FAILURE);
+            }
+            diff.indices = grown;
+        }
+        diff.indices[diff.len++] = node - from->nhashes;
+    }
+    return diff;
+}
+
+/**
+ * Hashes a single chunk of the package data.
+ * @param bpkg, constructed bpkg object
+ * @param fd, descriptor of the data file opened for reading
+ * @param index, index of the chunk to hash
+ * @param hex, receives the 64 character digest
+ * @return 1 if the chunk could be read, 0 otherwise
+ */
+int bpkg_chunk_digest(struct bpkg_obj* bpkg, int fd, uint32_t index, char* hex) {
+    if (index >= bpkg->nchunks) {
+        return 0;
+    }
+    struct chunk* c = &bpkg->chunks[index];
+    struct sha256_compute_data sha;
+    uint8_t buffer[CHUNK_READ_SZ];
+    uint8_t digest[SHA256_INT_SZ];
+    uint64_t done = 0;
+
+    sha256_compute_data_init(&sha);
+    // Positioned reads so several chunks of one file can be checked in parallel
+    while (done < c->size) {
+        size_t want = c->size - done < CHUNK_READ_SZ ? c->size - done : CHUNK_READ_SZ;
+        ssize_t got = pread(fd, buffer, want, (off_t)c->offset + done);
+        if (got <= 0) {
+            return 0;
+        }
+        sha256_update(&sha, buffer, (uint32_t)got);
+        done += got;
+    }
+    sha256_finalize(&sha, digest);
+    sha256_output_hex(&sha, hex);
+    return 1;
+}
+
+/**
+ * Hashes chunk data held in memory, such as a chunk received from a peer.
+ * @param data, the chunk data
+ * @param size, number of bytes in data
+ * @param hex, receives the 64 character digest
+ */
+void bpkg_data_digest(const uint8_t* data, uint32_t size, char* hex) {
+    struct sha256_compute_data sha;
+    uint8_t digest[SHA256_INT_SZ];
+    sha256_compute_data_init(&sha);
+    sha256_update(&sha, (void*)data, size);
+    sha256_finalize(&sha, digest);
+    sha256_output_hex(&sha, hex);
+}
+
+/**
+ * Hashes a single chunk of the package data and compares the digest
+ * against the chunk hash recorded in the manifest.
+ * @param bpkg, constructed bpkg object
+ * @param fd, descriptor of the data file opened for reading
+ * @param index, index of the chunk to check
+ * @return 1 if the chunk is present and matches, 0 otherwise
+ */
+int bpkg_chunk_verify(struct bpkg_obj* bpkg, int fd, uint32_t index) {
+    char hex[SHA256_HEXLEN];
+    return bpkg_chunk_digest(bpkg, fd, index, hex)
+        && strncmp(hex, bpkg->chunks[index].hash, SHA256_HEXLEN) == 0;
+}
 
 
 /**
@@ -351,6 +719,17 @@ void bpkg_query_destroy(struct bpkg_query* qry) {
     }
 }
 
+/**
+ * Deallocates the result of bpkg_diff_chunks.
+ */
+void bpkg_diff_destroy(struct bpkg_diff* diff) {
+    if (diff) {
+        free(diff->indices);
+        diff->indices = NULL;
+        diff->len = 0;
+    }
+}
+
 /**
  * Deallocates memory at the end of the program,
  * make sure it has been completely deallocated
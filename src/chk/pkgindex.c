@@ -0,0 +1,601 @@
+/*
+ ============================================================================
+ Name        : pkgindex.c
+ ============================================================================
+ */
+
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "chk/pkgindex.h"
+#include "chk/sidecar.h"
+
+#define INDEX_MAGIC 0x31584449u
+#define INDEX_VERSION 2
+#define READER_BUF (8192)
+
+// On-disk header
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stride;
+    uint32_t nhashes;
+    uint32_t nchunks;
+    uint32_t reserved;
+    struct file_identity id;
+};
+
+/**
+ * Entry of the lookup table, the leading bits of a node's hash.
+ */
+struct index_key {
+    uint32_t key;
+    uint32_t node;
+};
+
+/**
+ * Reads the lines of a manifest front to back from any offset, holding
+ * only one buffer of it.
+ * - pos: file offset of buf[0].
+ * - start: first unread byte in buf.
+ * - len: bytes held in buf.
+ */
+struct line_reader {
+    int fd;
+    uint64_t pos;
+    size_t start;
+    size_t len;
+    char buf[READER_BUF];
+};
+
+/**
+ * Positions a reader at an offset.
+ * @param r The reader.
+ * @param fd The file to read.
+ * @param pos Offset of the first line.
+ */
+static void reader_init(struct line_reader* r, int fd, uint64_t pos) {
+    r->fd = fd;
+    r->pos = pos;
+    r->start = 0;
+    r->len = 0;
+}
+
+/**
+ * Returns the next line, terminated in place without its newline.
+ * @param r The reader.
+ * @return char* The line, valid until the next call, NULL at the end of the
+ *         file or if a line is longer than the buffer.
+ */
+static char* reader_next(struct line_reader* r) {
+    for (;;) {
+        char* line = r->buf + r->start;
+        char* nl = memchr(line, '\n', r->len - r->start);
+        if (nl) {
+            *nl = '\0';
+            r->start = (size_t)(nl - r->buf) + 1;
+            return line;
+        }
+
+        // Keep the partial line at the front and read after it, leaving
+        // room for a terminator
+        size_t rest = r->len - r->start;
+        memmove(r->buf, line, rest);
+        r->pos += r->start;
+        r->start = 0;
+        r->len = rest;
+        if (rest >= READER_BUF - 1) {
+            return NULL;
+        }
+        ssize_t got = pread(r->fd, r->buf + rest, READER_BUF - 1 - rest,
+            (off_t)(r->pos + rest));
+        if (got <= 0) {
+            if (rest == 0) {
+                return NULL;
+            }
+            // Last line without a newline
+            r->buf[rest] = '\0';
+            r->start = rest;
+            return r->buf;
+        }
+        r->len += (size_t)got;
+    }
+}
+
+/**
+ * Returns the leading bits of a hash, the key of the lookup table.
+ * @param hash The hash, ending at a terminator, whitespace or a comma.
+ * @return uint32_t The first eight characters read as hex digits.
+ */
+static uint32_t hash_key(const char* hash) {
+    uint32_t key = 0;
+    for (int i = 0; i < 8 && hash[i] && !isspace((unsigned char)hash[i])
+        && hash[i] != ','; i++) {
+        char c = hash[i];
+        uint32_t v = c >= '0' && c <= '9' ? (uint32_t)(c - '0')
+            : c >= 'a' && c <= 'f' ? (uint32_t)(c - 'a' + 10)
+            : (uint32_t)c & 15;
+        key = key << 4 | v;
+    }
+    return key;
+}
+
+/**
+ * Sorts lookup table entries by key, two stable counting passes over 16
+ * bits each. Entries are generated in node order, which equal keys keep.
+ * @param keys The entries.
+ * @param tmp Scratch space for n entries.
+ * @param n Number of entries.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int sort_keys(struct index_key* keys, struct index_key* tmp, uint64_t n) {
+    uint64_t* count = malloc((1 << 16) * sizeof(uint64_t));
+    if (!count) {
+        return -1;
+    }
+    struct index_key* from = keys;
+    struct index_key* to = tmp;
+    for (int shift = 0; shift < 32; shift += 16) {
+        memset(count, 0, (1 << 16) * sizeof(uint64_t));
+        for (uint64_t i = 0; i < n; i++) {
+            count[(from[i].key >> shift) & 0xffff]++;
+        }
+        uint64_t sum = 0;
+        for (uint32_t b = 0; b < (1 << 16); b++) {
+            uint64_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            to[count[(from[i].key >> shift) & 0xffff]++] = from[i];
+        }
+        struct index_key* swap = from;
+        from = to;
+        to = swap;
+    }
+    // An even number of passes leaves the result in keys
+    free(count);
+    return 0;
+}
+
+/**
+ * Returns the number of recorded offsets for a section.
+ * @param nlines Lines in the section.
+ * @return uint32_t Offsets recorded, one per BPKG_INDEX_STRIDE lines.
+ */
+static uint32_t noffs(uint32_t nlines) {
+    return (uint32_t)(((uint64_t)nlines + BPKG_INDEX_STRIDE - 1) / BPKG_INDEX_STRIDE);
+}
+
+/**
+ * Returns the size of a complete index.
+ * @param hdr The index header.
+ * @return uint64_t Bytes in the index file.
+ */
+static uint64_t index_bytes(const struct index_header* hdr) {
+    return sizeof(*hdr)
+        + ((uint64_t)noffs(hdr->nhashes) + noffs(hdr->nchunks)) * sizeof(uint64_t)
+        + ((uint64_t)hdr->nhashes + hdr->nchunks) * sizeof(struct index_key);
+}
+
+/**
+ * Returns the hash on a line of the hashes or chunks section.
+ * @param line The line.
+ * @return const char* Start of the hash, after any leading whitespace.
+ */
+static const char* line_hash(const char* line) {
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+/**
+ * Scans the sections of a manifest once and writes its index.
+ * @param fd The manifest.
+ * @param pos Offset of the first hash line.
+ * @param hdr The index header, nchunks is filled in.
+ * @param out The index file, empty.
+ * @return int 0 on success, -1 if the manifest is malformed or on a read,
+ *         write or allocation failure.
+ */
+static int index_build(int fd, uint64_t pos, struct index_header* hdr, FILE* out) {
+    struct line_reader* r = malloc(sizeof(struct line_reader));
+    uint64_t* hash_offs = malloc((noffs(hdr->nhashes) + 1) * sizeof(uint64_t));
+    uint64_t* chunk_offs = NULL;
+    struct index_key* keys = NULL;
+    struct index_key* tmp = NULL;
+    uint64_t nkeys = 0;
+    char* line;
+    int ret = -1;
+    if (!r || !hash_offs) goto done;
+    reader_init(r, fd, pos);
+
+    // The chunk count comes after the hashes, so the table grows once
+    uint64_t cap = (uint64_t)hdr->nhashes * 2 + 2;
+    keys = malloc(cap * sizeof(struct index_key));
+    if (!keys) goto done;
+    for (uint32_t j = 0; j < hdr->nhashes; j++) {
+        uint64_t off = r->pos + r->start;
+        if ((line = reader_next(r)) == NULL) goto done;
+        if (j % BPKG_INDEX_STRIDE == 0) {
+            hash_offs[j / BPKG_INDEX_STRIDE] = off;
+        }
+        keys[nkeys++] = (struct index_key){ hash_key(line_hash(line)), j };
+    }
+
+    if ((line = reader_next(r)) == NULL
+        || sscanf(line, "nchunks: %u", &hdr->nchunks) != 1
+        || reader_next(r) == NULL
+        || (uint64_t)hdr->nhashes + hdr->nchunks > UINT32_MAX) goto done;
+    chunk_offs = malloc((noffs(hdr->nchunks) + 1) * sizeof(uint64_t));
+    if (!chunk_offs) goto done;
+    if (cap < (uint64_t)hdr->nhashes + hdr->nchunks) {
+        cap = (uint64_t)hdr->nhashes + hdr->nchunks;
+        struct index_key* grown = realloc(keys, cap * sizeof(struct index_key));
+        if (!grown) goto done;
+        keys = grown;
+    }
+
+    for (uint32_t j = 0; j < hdr->nchunks; j++) {
+        uint64_t off = r->pos + r->start;
+        if ((line = reader_next(r)) == NULL) goto done;
+        if (j % BPKG_INDEX_STRIDE == 0) {
+            chunk_offs[j / BPKG_INDEX_STRIDE] = off;
+        }
+        keys[nkeys++] = (struct index_key){ hash_key(line_hash(line)), hdr->nhashes + j };
+    }
+
+    tmp = malloc((nkeys + 1) * sizeof(struct index_key));
+    if (!tmp || sort_keys(keys, tmp, nkeys) != 0) goto done;
+    if (fwrite(hdr, sizeof(*hdr), 1, out) == 1
+        && fwrite(hash_offs, sizeof(uint64_t), noffs(hdr->nhashes), out) == noffs(hdr->nhashes)
+        && fwrite(chunk_offs, sizeof(uint64_t), noffs(hdr->nchunks), out) == noffs(hdr->nchunks)
+        && fwrite(keys, sizeof(struct index_key), nkeys, out) == nkeys
+        && fflush(out) == 0) {
+        ret = 0;
+    }
+
+done:
+    free(r);
+    free(hash_offs);
+    free(chunk_offs);
+    free(keys);
+    free(tmp);
+    return ret;
+}
+
+/**
+ * Opens the index of a manifest if it was built from the manifest as it
+ * is now.
+ * @param path Path of the index.
+ * @param want The expected header, nchunks is filled in on success.
+ * @return FILE* The index, NULL if there is no valid index.
+ */
+static FILE* index_load(const char* path, struct index_header* want) {
+    FILE* index = fopen(path, "rb");
+    if (!index) {
+        return NULL;
+    }
+    struct index_header hdr;
+    struct stat st;
+    if (fread(&hdr, sizeof(hdr), 1, index) == 1 && fstat(fileno(index), &st) == 0) {
+        want->nchunks = hdr.nchunks;
+        if (memcmp(&hdr, want, sizeof(hdr)) == 0
+            && (uint64_t)st.st_size == index_bytes(&hdr)) {
+            return index;
+        }
+    }
+    fclose(index);
+    return NULL;
+}
+
+/**
+ * Builds the index of a manifest, next to it if the manifest is large and
+ * quiet, in a deleted temporary file otherwise.
+ * @param fd The manifest.
+ * @param pos Offset of the first hash line.
+ * @param path Path of the index.
+ * @param hdr The index header, nchunks is filled in.
+ * @param persist Whether to keep the index next to the manifest.
+ * @return FILE* The index, NULL on failure.
+ */
+static FILE* index_create(int fd, uint64_t pos, const char* path,
+    struct index_header* hdr, int persist) {
+    if (persist) {
+        struct sidecar sc;
+        FILE* out = sidecar_begin(&sc, path, "w+b");
+        if (out) {
+            out = sidecar_publish(&sc, index_build(fd, pos, hdr, out) == 0);
+        }
+        if (out) {
+            return out;
+        }
+    }
+    FILE* out = tmpfile();
+    if (out && index_build(fd, pos, hdr, out) != 0) {
+        fclose(out);
+        out = NULL;
+    }
+    return out;
+}
+
+/**
+ * Opens a manifest lazily, building its index if there is no valid one.
+ * @param path The path to the package file.
+ * @return struct bpkg_index* The opened manifest, NULL if it cannot be read.
+ */
+struct bpkg_index* bpkg_index_open(const char* path) {
+    struct bpkg_index* idx = calloc(1, sizeof(struct bpkg_index));
+    if (!idx) {
+        return NULL;
+    }
+    idx->file = fopen(path, "r");
+    struct file_identity id;
+    if (!idx->file || file_identity_of(fileno(idx->file), &id) != 0
+        || bpkg_read_header(idx->file, &idx->head) != 0) {
+        bpkg_index_close(idx);
+        return NULL;
+    }
+
+    struct index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = INDEX_MAGIC;
+    hdr.version = INDEX_VERSION;
+    hdr.stride = BPKG_INDEX_STRIDE;
+    hdr.nhashes = idx->head.nhashes;
+    hdr.id = id;
+
+    char idxpath[SIDECAR_PATH_LEN];
+    snprintf(idxpath, sizeof(idxpath), "%s%s", path, BPKG_INDEX_SUFFIX);
+    idx->index = index_load(idxpath, &hdr);
+    if (!idx->index) {
+        int persist = id.size >= BPKG_INDEX_PERSIST_MIN
+            && file_identity_quiet(&id, file_wall_ns());
+        idx->index = index_create(fileno(idx->file), (uint64_t)ftello(idx->file),
+            idxpath, &hdr, persist);
+    }
+    if (!idx->index) {
+        bpkg_index_close(idx);
+        return NULL;
+    }
+    idx->head.nchunks = hdr.nchunks;
+    idx->nhash_offs = noffs(hdr.nhashes);
+    idx->nchunk_offs = noffs(hdr.nchunks);
+    return idx;
+}
+
+/**
+ * Positions a reader at a line of the hashes or chunks section.
+ * @param idx The opened manifest.
+ * @param chunks 1 for the chunks section, 0 for the hashes section.
+ * @param line Index of the line within the section.
+ * @param r The reader to position.
+ * @return int 0 on success, -1 if the index or the manifest cannot be read.
+ */
+static int reader_seek(struct bpkg_index* idx, int chunks, uint32_t line,
+    struct line_reader* r) {
+    uint64_t slot = line / BPKG_INDEX_STRIDE + (chunks ? idx->nhash_offs : 0);
+    uint64_t off;
+    if (pread(fileno(idx->index), &off, sizeof(off),
+        (off_t)(sizeof(struct index_header) + slot * sizeof(uint64_t))) != sizeof(off)) {
+        return -1;
+    }
+    reader_init(r, fileno(idx->file), off);
+    for (uint32_t i = 0; i < line % BPKG_INDEX_STRIDE; i++) {
+        if (reader_next(r) == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads the hash of a node in level order, interior nodes first and then
+ * the chunks.
+ * @param idx The opened manifest.
+ * @param node Level order index of the node.
+ * @param hash Receives the hash and a terminator.
+ * @return int 0 on success, -1 if the node does not exist or cannot be read.
+ */
+int bpkg_index_node(struct bpkg_index* idx, uint32_t node, char hash[MAX_HASH_LEN + 1]) {
+    struct bpkg_obj* head = &idx->head;
+    if ((uint64_t)node >= (uint64_t)head->nhashes + head->nchunks) {
+        return -1;
+    }
+    if (node >= head->nhashes) {
+        struct chunk c;
+        if (bpkg_index_chunks(idx, node - head->nhashes, 1, &c) != 0) {
+            return -1;
+        }
+        memcpy(hash, c.hash, MAX_HASH_LEN + 1);
+        return 0;
+    }
+
+    struct line_reader r;
+    char* line;
+    if (reader_seek(idx, 0, node, &r) != 0 || (line = reader_next(&r)) == NULL) {
+        return -1;
+    }
+    hash[0] = '\0';
+    sscanf(line, "%64s", hash);
+    return 0;
+}
+
+/**
+ * Reads a run of consecutive chunks.
+ * @param idx The opened manifest.
+ * @param first Index of the first chunk.
+ * @param count Number of chunks.
+ * @param chunks Receives count chunks.
+ * @return int 0 on success, -1 if a chunk does not exist or cannot be read.
+ */
+int bpkg_index_chunks(struct bpkg_index* idx, uint32_t first, uint32_t count,
+    struct chunk* chunks) {
+    if ((uint64_t)first + count > idx->head.nchunks) {
+        return -1;
+    }
+    struct line_reader r;
+    if (count == 0) {
+        return 0;
+    }
+    if (reader_seek(idx, 1, first, &r) != 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        char* line = reader_next(&r);
+        if (line == NULL) {
+            return -1;
+        }
+        memset(&chunks[i], 0, sizeof(struct chunk));
+        sscanf(line, "%64s,%u,%u", chunks[i].hash, &chunks[i].offset,
+            &chunks[i].size);
+        chunks[i].hash[strcspn(chunks[i].hash, ",")] = '\0';
+    }
+    return 0;
+}
+
+/**
+ * Finds a node by its hash.
+ * @param idx The opened manifest.
+ * @param hash The hash to look for.
+ * @return int64_t Level order index of the first node with the hash, -1 if
+ *         there is none.
+ */
+int64_t bpkg_index_find(struct bpkg_index* idx, const char* hash) {
+    uint32_t key = hash_key(hash);
+    uint64_t nkeys = (uint64_t)idx->head.nhashes + idx->head.nchunks;
+    off_t base = (off_t)(sizeof(struct index_header)
+        + ((uint64_t)idx->nhash_offs + idx->nchunk_offs) * sizeof(uint64_t));
+    int fd = fileno(idx->index);
+    struct index_key entry;
+
+    // First entry with the key, the table is sorted by key and node
+    uint64_t lo = 0;
+    uint64_t hi = nkeys;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (pread(fd, &entry, sizeof(entry), base + (off_t)(mid * sizeof(entry)))
+            != sizeof(entry)) {
+            return -1;
+        }
+        if (entry.key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    char found[MAX_HASH_LEN + 1];
+    for (; lo < nkeys; lo++) {
+        if (pread(fd, &entry, sizeof(entry), base + (off_t)(lo * sizeof(entry)))
+            != sizeof(entry) || entry.key != key) {
+            return -1;
+        }
+        if (bpkg_index_node(idx, entry.node, found) == 0 && strcmp(found, hash) == 0) {
+            return entry.node;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Retrieves all chunk hashes below the node with a hash, reading only the
+ * chunks below it.
+ * @param idx The opened manifest.
+ * @param hash Hash of the node.
+ * @return query_result, len is -1 if no node has the hash or the tree is
+ *         not complete.
+ */
+struct bpkg_query bpkg_index_hashes_of(struct bpkg_index* idx, const char* hash) {
+    struct bpkg_query qry = { 0 };
+    int64_t node = bpkg_tree_height(&idx->head) < 0 ? -1 : bpkg_index_find(idx, hash);
+    if (node < 0) {
+        qry.len = -1;
+        return qry;
+    }
+
+    uint32_t first;
+    uint32_t count;
+    struct line_reader r;
+    bpkg_subtree_span(&idx->head, (uint32_t)node, &first, &count);
+    qry.hashes = malloc((uint64_t)count * sizeof(char*));
+    if (qry.hashes == NULL) {
+        perror("Failed to allocate memory for hashes");
+        exit(EXIT_FAILURE);
+    }
+    if (reader_seek(idx, 1, first, &r) != 0) {
+        return qry;
+    }
+    // The chunks below a node are consecutive lines, read them in one pass
+    for (uint32_t i = 0; i < count; i++) {
+        char* line = reader_next(&r);
+        if (line == NULL) {
+            break;
+        }
+        qry.hashes[i] = malloc((MAX_HASH_LEN + 1) * sizeof(char));
+        if (qry.hashes[i] == NULL) {
+            perror("Failed to allocate memory for hash entry");
+            exit(EXIT_FAILURE);
+        }
+        qry.hashes[i][0] = '\0';
+        sscanf(line, "%64s", qry.hashes[i]);
+        qry.hashes[i][strcspn(qry.hashes[i], ",")] = '\0';
+        qry.len++;
+    }
+    return qry;
+}
+
+/**
+ * Retrieves the minimal set of tree nodes that cover the chunks in
+ * [start, end), reading only those nodes.
+ * @param idx The opened manifest.
+ * @param start Index of the first chunk in the range.
+ * @param end Index one past the last chunk in the range.
+ * @return query_result, none if the range is empty or out of bounds or
+ *         the tree is not complete.
+ */
+struct bpkg_query bpkg_index_range_hashes(struct bpkg_index* idx, uint32_t start,
+    uint32_t end) {
+    struct bpkg_query qry = { 0 };
+    uint32_t nodes[BPKG_RANGE_MAX];
+    int n = bpkg_range_nodes(&idx->head, start, end, nodes);
+    if (n == 0) {
+        return qry;
+    }
+
+    qry.hashes = malloc(n * sizeof(char*));
+    if (qry.hashes == NULL) {
+        perror("Failed to allocate memory for hashes");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        qry.hashes[i] = malloc((MAX_HASH_LEN + 1) * sizeof(char));
+        if (qry.hashes[i] == NULL) {
+            perror("Failed to allocate memory for hash entry");
+            exit(EXIT_FAILURE);
+        }
+        if (bpkg_index_node(idx, nodes[i], qry.hashes[i]) != 0) {
+            free(qry.hashes[i]);
+            break;
+        }
+        qry.len++;
+    }
+    return qry;
+}
+
+/**
+ * Closes a lazily opened manifest.
+ * @param idx The opened manifest, may be NULL.
+ */
+void bpkg_index_close(struct bpkg_index* idx) {
+    if (idx) {
+        if (idx->file) {
+            fclose(idx->file);
+        }
+        if (idx->index) {
+            fclose(idx->index);
+        }
+        free(idx);
+    }
+}
@@ -0,0 +1,144 @@
+/*
+ ============================================================================
+ Name        : sidecar.c
+ ============================================================================
+ */
+
+/*
+ * Sidecars are files kept next to a manifest or data file to skip work on
+ * the next run: journals, verification caches, indexes, tree images and
+ * the scrub position. They are written in host byte order as they never
+ * leave the node, and a sidecar from another machine is simply rejected
+ * by its header check. Each one is written to a temporary file and
+ * renamed into place, so a crash leaves either the old sidecar or the new
+ * one and never a torn file.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "chk/sidecar.h"
+
+/**
+ * Copies the identity fields of a stat result.
+ * @param st The stat result.
+ * @param id Receives the identity.
+ */
+static void identity_from(const struct stat* st, struct file_identity* id) {
+    memset(id, 0, sizeof(*id));
+    id->dev = (uint64_t)st->st_dev;
+    id->ino = (uint64_t)st->st_ino;
+    id->size = (uint64_t)st->st_size;
+    id->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    id->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+}
+
+/**
+ * Reads the identity of an open file.
+ * @param fd The file.
+ * @param id Receives the identity.
+ * @return int 0 on success, -1 if the file cannot be examined.
+ */
+int file_identity_of(int fd, struct file_identity* id) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    identity_from(&st, id);
+    return 0;
+}
+
+/**
+ * Reads the identity of a file by its path.
+ * @param path Path of the file.
+ * @param id Receives the identity.
+ * @return int 0 on success, -1 if the file cannot be examined.
+ */
+int file_identity_at(const char* path, struct file_identity* id) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    identity_from(&st, id);
+    return 0;
+}
+
+/**
+ * Returns the wall clock time, comparable with file modification times.
+ * @return int64_t Nanoseconds since the epoch.
+ */
+int64_t file_wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Checks whether a file was quiet when its identity was read, so that a
+ * later write is certain to change its identity.
+ * @param id The identity.
+ * @param examined_ns Wall clock time at which it was read.
+ * @return int 1 if the file is quiet, 0 if a sidecar of it must not be kept.
+ */
+int file_identity_quiet(const struct file_identity* id, int64_t examined_ns) {
+    // A write in the same clock tick as the one before it leaves mtime as
+    // it was, so only files that were quiet when examined are trusted.
+    // Later writes move mtime past the examination and change the identity.
+    int64_t age = examined_ns - (id->mtime_sec * 1000000000LL + id->mtime_nsec);
+    return age >= SIDECAR_RACY_NS;
+}
+
+/**
+ * Starts writing a sidecar, in a temporary file next to its final path.
+ * @param sc The sidecar.
+ * @param path Path the sidecar is published at.
+ * @param mode fopen mode, "wb" or "w+b" to read it back after publishing.
+ * @return FILE* The file to write, NULL on failure.
+ */
+FILE* sidecar_begin(struct sidecar* sc, const char* path, const char* mode) {
+    snprintf(sc->path, sizeof(sc->path), "%s", path);
+    snprintf(sc->tmppath, sizeof(sc->tmppath), "%s.tmp", sc->path);
+    sc->file = fopen(sc->tmppath, mode);
+    return sc->file;
+}
+
+/**
+ * Publishes a sidecar if it was written completely, leaving it open.
+ * On failure the temporary file is closed and removed.
+ * @param sc The sidecar.
+ * @param ok Whether every write succeeded.
+ * @return FILE* The published file, NULL on failure.
+ */
+FILE* sidecar_publish(struct sidecar* sc, int ok) {
+    FILE* file = sc->file;
+    sc->file = NULL;
+    if (!file) {
+        return NULL;
+    }
+    if (!ok || fflush(file) != 0 || rename(sc->tmppath, sc->path) != 0) {
+        fclose(file);
+        remove(sc->tmppath);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Closes and publishes a sidecar if it was written completely, removing
+ * the temporary file otherwise.
+ * @param sc The sidecar.
+ * @param ok Whether every write succeeded.
+ * @return int 0 on success, -1 on failure.
+ */
+int sidecar_commit(struct sidecar* sc, int ok) {
+    FILE* file = sc->file;
+    sc->file = NULL;
+    if (!file) {
+        return -1;
+    }
+    if (fclose(file) != 0 || !ok || rename(sc->tmppath, sc->path) != 0) {
+        remove(sc->tmppath);
+        return -1;
+    }
+    return 0;
+}
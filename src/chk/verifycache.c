@@ -0,0 +1,192 @@
+/*
+ ============================================================================
+ Name        : verifycache.c
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include "chk/verifycache.h"
+
+#define VCACHE_MAGIC 0x31435642u
+#define VCACHE_VERSION 1
+
+// On-disk header
+struct vcache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nchunks;
+    uint32_t reserved;
+    struct file_identity id;
+};
+
+/**
+ * Converts a hex digest to binary.
+ * @param hex The 64 character digest.
+ * @param bin Receives VCACHE_DIGEST_LEN bytes.
+ * @return int 0 on success, -1 if hex is not a digest.
+ */
+static int hex_to_bin(const char* hex, uint8_t* bin) {
+    for (int i = 0; i < VCACHE_DIGEST_LEN; i++) {
+        unsigned v;
+        if (sscanf(hex + 2 * i, "%2x", &v) != 1) {
+            return -1;
+        }
+        bin[i] = (uint8_t)v;
+    }
+    return 0;
+}
+
+/**
+ * Loads the cache of a data file. If there is no valid cache for the file
+ * as it is now, the cache starts empty.
+ * @param vc The cache to initialise.
+ * @param datapath Path of the data file.
+ * @param fd The data file, opened for reading.
+ * @param nchunks Number of chunks in the package.
+ * @return int 0 on success, -1 if the file cannot be examined or on
+ * 		allocation failure.
+ */
+int vcache_load(struct verify_cache* vc, const char* datapath, int fd, uint32_t nchunks) {
+    memset(vc, 0, sizeof(*vc));
+    vc->nchunks = nchunks;
+    vc->known = calloc((nchunks + 7) / 8, 1);
+    vc->digests = malloc((size_t)nchunks * VCACHE_DIGEST_LEN);
+    if (!vc->known || !vc->digests || file_identity_of(fd, &vc->id) != 0) {
+        free(vc->known);
+        free(vc->digests);
+        return -1;
+    }
+    vc->examined_ns = file_wall_ns();
+    pthread_mutex_init(&vc->lock, NULL);
+
+    char path[SIDECAR_PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s", datapath, VCACHE_SUFFIX);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+    struct vcache_header want = { VCACHE_MAGIC, VCACHE_VERSION, nchunks, 0, vc->id };
+    struct vcache_header hdr;
+    size_t len = (nchunks + 7) / 8;
+    int ok = fread(&hdr, sizeof(hdr), 1, file) == 1
+        && memcmp(&hdr, &want, sizeof(hdr)) == 0
+        && fread(vc->known, 1, len, file) == len
+        && fread(vc->digests, VCACHE_DIGEST_LEN, nchunks, file) == nchunks;
+    fclose(file);
+    if (!ok) {
+        memset(vc->known, 0, len);
+    }
+    return 0;
+}
+
+/**
+ * Checks a chunk against the manifest, hashing it only if the cache has
+ * no digest for it, and records the digest of a hashed chunk.
+ * @param vc The cache.
+ * @param bpkg, constructed bpkg object
+ * @param fd, descriptor of the data file opened for reading
+ * @param index, index of the chunk to check
+ * @param hashed, set to 1 if the chunk had to be hashed, may be NULL
+ * @return 1 if the chunk is present and matches, 0 otherwise
+ */
+int vcache_verify(struct verify_cache* vc, struct bpkg_obj* bpkg, int fd,
+    uint32_t index, int* hashed) {
+    uint8_t want[VCACHE_DIGEST_LEN];
+    uint8_t have[VCACHE_DIGEST_LEN];
+    if (hashed) {
+        *hashed = 0;
+    }
+    if (index >= bpkg->nchunks || index >= vc->nchunks
+        || hex_to_bin(bpkg->chunks[index].hash, want) != 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&vc->lock);
+    int known = (vc->known[index / 8] >> (index % 8)) & 1;
+    if (known) {
+        memcpy(have, vc->digests[index], VCACHE_DIGEST_LEN);
+    }
+    pthread_mutex_unlock(&vc->lock);
+    if (known) {
+        return memcmp(have, want, VCACHE_DIGEST_LEN) == 0;
+    }
+
+    char hex[MAX_HASH_LEN];
+    if (hashed) {
+        *hashed = 1;
+    }
+    if (!bpkg_chunk_digest(bpkg, fd, index, hex) || hex_to_bin(hex, have) != 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&vc->lock);
+    memcpy(vc->digests[index], have, VCACHE_DIGEST_LEN);
+    vc->known[index / 8] |= (uint8_t)(1u << (index % 8));
+    vc->dirty = 1;
+    pthread_mutex_unlock(&vc->lock);
+    return memcmp(have, want, VCACHE_DIGEST_LEN) == 0;
+}
+
+/**
+ * Writes the cache next to the data file if digests were added. Nothing
+ * is written if the file changed since the cache was loaded.
+ * @param vc The cache.
+ * @param datapath Path of the data file.
+ * @return int 0 on success or if there was nothing to write, -1 otherwise.
+ */
+int vcache_save(struct verify_cache* vc, const char* datapath) {
+    if (!vc->dirty) {
+        return 0;
+    }
+    struct file_identity now;
+    if (file_identity_at(datapath, &now) != 0
+        || memcmp(&now, &vc->id, sizeof(now)) != 0) {
+        return -1;
+    }
+
+    // Digests of a file that was still being written are not kept
+    if (!file_identity_quiet(&vc->id, vc->examined_ns)) {
+        return 0;
+    }
+
+    char path[SIDECAR_PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s", datapath, VCACHE_SUFFIX);
+    struct sidecar sc;
+    FILE* file = sidecar_begin(&sc, path, "wb");
+    if (!file) {
+        return -1;
+    }
+    struct vcache_header hdr = { VCACHE_MAGIC, VCACHE_VERSION, vc->nchunks, 0, vc->id };
+    size_t len = (vc->nchunks + 7) / 8;
+    pthread_mutex_lock(&vc->lock);
+    int ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1
+        && fwrite(vc->known, 1, len, file) == len
+        && fwrite(vc->digests, VCACHE_DIGEST_LEN, vc->nchunks, file) == vc->nchunks;
+    pthread_mutex_unlock(&vc->lock);
+    if (sidecar_commit(&sc, ok) != 0) {
+        return -1;
+    }
+    vc->dirty = 0;
+    return 0;
+}
+
+/**
+ * Deletes the cache of a data file, for when chunks are found to have
+ * changed without a change to the file's identity.
+ * @param datapath Path of the data file.
+ */
+void vcache_discard(const char* datapath) {
+    char path[SIDECAR_PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s", datapath, VCACHE_SUFFIX);
+    remove(path);
+}
+
+/**
+ * Frees the memory of a cache.
+ * @param vc The cache.
+ */
+void vcache_free(struct verify_cache* vc) {
+    free(vc->known);
+    free(vc->digests);
+    pthread_mutex_destroy(&vc->lock);
+    memset(vc, 0, sizeof(*vc));
+}
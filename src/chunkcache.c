@@ -0,0 +1,515 @@
+/*
+ ============================================================================
+ Name        : chunkcache.c
+ ============================================================================
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "chunkcache.h"
+#include "metrics.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_INITIAL_BUCKETS 64
+// Share of a shard given to the admission window, in percent
+#define CACHE_WINDOW_PERCENT 1
+// Largest chunk cached, as a fraction of a shard
+#define CACHE_MAX_ENTRY_DIV 4
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+// Chunk size assumed when sizing the frequency sketch
+#define SKETCH_CHUNK_GUESS (16 * 1024)
+#define SKETCH_MIN_WIDTH 256
+#define SKETCH_MAX_WIDTH 65536
+
+/**
+ * Cached chunk. Entries are in their shard's hash chain and in either the
+ * window list or the main ring.
+ * - referenced: CLOCK bit, set on a hit in the main ring.
+ */
+struct cache_entry {
+    uint64_t serial;
+    uint32_t index;
+    struct chunk_buf* buf;
+    struct cache_entry* hnext;
+    struct cache_entry* prev;
+    struct cache_entry* next;
+    int in_main;
+    int referenced;
+};
+
+/**
+ * Independently locked part of the cache.
+ * - window: circular LRU list, window is the least recently used entry.
+ * - hand: circular CLOCK ring of the main area, hand is the next entry
+ *   considered for eviction.
+ * - sketch: count-min sketch of access frequencies, halved every
+ *   sample accesses so old popularity fades.
+ */
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry** buckets;
+    size_t nbuckets;
+    size_t count;
+    struct cache_entry* window;
+    struct cache_entry* hand;
+    size_t window_bytes;
+    size_t window_cap;
+    size_t main_bytes;
+    size_t main_cap;
+    uint8_t* sketch;
+    size_t sketch_width;
+    uint32_t additions;
+    uint32_t sample;
+};
+
+struct chunk_cache {
+    size_t max_entry;
+    struct cache_shard shards[CACHE_SHARDS];
+};
+
+/**
+ * Allocates a buffer holding one reference.
+ * @param len Number of data bytes.
+ * @return struct chunk_buf* The buffer, or NULL on allocation failure.
+ */
+struct chunk_buf* chunk_buf_alloc(uint32_t len) {
+    struct chunk_buf* buf = malloc(sizeof(struct chunk_buf) + len);
+    if (buf) {
+        atomic_init(&buf->refs, 1);
+        buf->len = len;
+    }
+    return buf;
+}
+
+/**
+ * Takes an additional reference to a buffer.
+ * @param buf The buffer.
+ */
+void chunk_buf_retain(struct chunk_buf* buf) {
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * Drops a reference to a buffer, freeing it with the last reference.
+ * @param buf The buffer, may be NULL.
+ */
+void chunk_buf_release(struct chunk_buf* buf) {
+    if (buf && atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+        free(buf);
+    }
+}
+
+/**
+ * Mixes a cache key into a well distributed hash.
+ * @param serial Serial number of the package.
+ * @param index Index of the chunk.
+ * @return uint64_t The hash.
+ */
+static uint64_t key_hash(uint64_t serial, uint32_t index) {
+    uint64_t h = serial * 0x9e3779b97f4a7c15ULL ^ index;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Returns the counter of a key in one row of the sketch. The low bits of
+ * the hash select the shard, so rows use multiply-shift on the rest.
+ * @param shard The shard.
+ * @param h Hash of the key.
+ * @param r The row.
+ * @return size_t Index of the counter in the sketch.
+ */
+static size_t sketch_slot(struct cache_shard* shard, uint64_t h, int r) {
+    static const uint64_t seeds[SKETCH_ROWS] = {
+        0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL,
+        0x94d049bb133111ebULL, 0xd6e8feb86659fd93ULL,
+    };
+    size_t i = (size_t)(((h >> 4) * seeds[r]) >> 48) & (shard->sketch_width - 1);
+    return (size_t)r * shard->sketch_width + i;
+}
+
+/**
+ * Returns the estimated access frequency of a key, the smallest of its
+ * counters.
+ * @param shard The shard.
+ * @param h Hash of the key.
+ * @return int The estimate.
+ */
+static int sketch_freq(struct cache_shard* shard, uint64_t h) {
+    int freq = SKETCH_MAX;
+    for (int r = 0; r < SKETCH_ROWS; r++) {
+        uint8_t v = shard->sketch[sketch_slot(shard, h, r)];
+        if (v < freq) {
+            freq = v;
+        }
+    }
+    return freq;
+}
+
+/**
+ * Records an access to a key, halving every counter once sample accesses
+ * have been recorded.
+ * @param shard The shard.
+ * @param h Hash of the key.
+ */
+static void sketch_add(struct cache_shard* shard, uint64_t h) {
+    for (int r = 0; r < SKETCH_ROWS; r++) {
+        uint8_t* v = &shard->sketch[sketch_slot(shard, h, r)];
+        if (*v < SKETCH_MAX) {
+            (*v)++;
+        }
+    }
+    if (++shard->additions >= shard->sample) {
+        for (size_t i = 0; i < SKETCH_ROWS * shard->sketch_width; i++) {
+            shard->sketch[i] >>= 1;
+        }
+        shard->additions /= 2;
+    }
+}
+
+/**
+ * Appends an entry to a circular list, just before its head.
+ * @param head The list, the head stays the same unless the list was empty.
+ * @param e The entry.
+ */
+static void ring_push(struct cache_entry** head, struct cache_entry* e) {
+    if (!*head) {
+        e->prev = e;
+        e->next = e;
+        *head = e;
+        return;
+    }
+    e->next = *head;
+    e->prev = (*head)->prev;
+    e->prev->next = e;
+    (*head)->prev = e;
+}
+
+/**
+ * Removes an entry from a circular list, moving the head past it.
+ * @param head The list.
+ * @param e The entry.
+ */
+static void ring_unlink(struct cache_entry** head, struct cache_entry* e) {
+    if (e->next == e) {
+        *head = NULL;
+        return;
+    }
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    if (*head == e) {
+        *head = e->next;
+    }
+}
+
+/**
+ * Finds the hash chain link pointing at a key's entry, or the end of the
+ * chain if it is not cached.
+ * @param shard The shard.
+ * @param h Hash of the key.
+ * @param serial Serial number of the package.
+ * @param index Index of the chunk.
+ * @return struct cache_entry** The link.
+ */
+static struct cache_entry** chain_find(struct cache_shard* shard, uint64_t h,
+    uint64_t serial, uint32_t index) {
+    struct cache_entry** link = &shard->buckets[(h >> 4) & (shard->nbuckets - 1)];
+    while (*link && ((*link)->serial != serial || (*link)->index != index)) {
+        link = &(*link)->hnext;
+    }
+    return link;
+}
+
+/**
+ * Doubles the hash table of a shard once it holds more entries than
+ * buckets. The table keeps its size if the allocation fails.
+ * @param shard The shard.
+ */
+static void chain_grow(struct cache_shard* shard) {
+    if (shard->count < shard->nbuckets) {
+        return;
+    }
+    size_t nbuckets = shard->nbuckets * 2;
+    struct cache_entry** buckets = calloc(nbuckets, sizeof(struct cache_entry*));
+    if (!buckets) {
+        return;
+    }
+    for (size_t b = 0; b < shard->nbuckets; b++) {
+        struct cache_entry* e = shard->buckets[b];
+        while (e) {
+            struct cache_entry* next = e->hnext;
+            size_t nb = (key_hash(e->serial, e->index) >> 4) & (nbuckets - 1);
+            e->hnext = buckets[nb];
+            buckets[nb] = e;
+            e = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+/**
+ * Removes an entry from the hash chain and frees it, the caller has
+ * already taken it off its list.
+ * @param shard The shard.
+ * @param e The entry.
+ */
+static void entry_free(struct cache_shard* shard, struct cache_entry* e) {
+    struct cache_entry** link = chain_find(shard, key_hash(e->serial, e->index),
+        e->serial, e->index);
+    *link = e->hnext;
+    shard->count--;
+    chunk_buf_release(e->buf);
+    free(e);
+}
+
+/**
+ * Picks the main area's eviction victim, giving every referenced entry
+ * another round.
+ * @param shard The shard, with a non-empty main ring.
+ * @return struct cache_entry* The victim, still in the ring.
+ */
+static struct cache_entry* clock_victim(struct cache_shard* shard) {
+    while (shard->hand->referenced) {
+        shard->hand->referenced = 0;
+        shard->hand = shard->hand->next;
+    }
+    return shard->hand;
+}
+
+/**
+ * Decides the fate of an entry leaving the window. It moves into the main
+ * area if there is room or if it is more popular than every victim that
+ * has to make way, otherwise it is dropped.
+ * @param shard The shard.
+ * @param cand The entry, already off the window list.
+ */
+static void admit(struct cache_shard* shard, struct cache_entry* cand) {
+    size_t len = cand->buf->len;
+    int freq = sketch_freq(shard, key_hash(cand->serial, cand->index));
+    while (shard->main_bytes + len > shard->main_cap) {
+        if (!shard->hand) {
+            entry_free(shard, cand);
+            return;
+        }
+        struct cache_entry* victim = clock_victim(shard);
+        if (freq <= sketch_freq(shard, key_hash(victim->serial, victim->index))) {
+            entry_free(shard, cand);
+            return;
+        }
+        ring_unlink(&shard->hand, victim);
+        shard->main_bytes -= victim->buf->len;
+        entry_free(shard, victim);
+    }
+    cand->in_main = 1;
+    cand->referenced = 0;
+    ring_push(&shard->hand, cand);
+    shard->main_bytes += len;
+}
+
+/**
+ * Returns the shard owning a key.
+ * @param cache The cache.
+ * @param h Hash of the key.
+ * @return struct cache_shard* The shard.
+ */
+static struct cache_shard* shard_of(struct chunk_cache* cache, uint64_t h) {
+    return &cache->shards[h & (CACHE_SHARDS - 1)];
+}
+
+/**
+ * Creates a cache of chunk data bounded to a number of bytes. The cache is
+ * split into independently locked shards, each using W-TinyLFU: new chunks
+ * enter a small LRU window and only move into the CLOCK managed main area
+ * if they have been requested more often than the chunk they would evict.
+ * @param capacity Upper bound on the bytes of cached chunk data.
+ * @return struct chunk_cache* The cache, or NULL on allocation failure.
+ */
+struct chunk_cache* cache_create(size_t capacity) {
+    struct chunk_cache* cache = calloc(1, sizeof(struct chunk_cache));
+    if (!cache) {
+        return NULL;
+    }
+    size_t per_shard = capacity / CACHE_SHARDS;
+    cache->max_entry = per_shard / CACHE_MAX_ENTRY_DIV;
+
+    size_t width = SKETCH_MIN_WIDTH;
+    while (width < SKETCH_MAX_WIDTH && width * SKETCH_CHUNK_GUESS < per_shard) {
+        width *= 2;
+    }
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        struct cache_shard* shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->nbuckets = CACHE_INITIAL_BUCKETS;
+        shard->buckets = calloc(shard->nbuckets, sizeof(struct cache_entry*));
+        shard->sketch = calloc(SKETCH_ROWS * width, 1);
+        shard->sketch_width = width;
+        shard->sample = (uint32_t)(width * 8);
+        shard->window_cap = per_shard * CACHE_WINDOW_PERCENT / 100;
+        shard->main_cap = per_shard - shard->window_cap;
+        if (!shard->buckets || !shard->sketch) {
+            cache_destroy(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+/**
+ * Looks up a chunk and records the access for admission decisions.
+ * @param cache The cache.
+ * @param serial Serial number of the package owning the chunk.
+ * @param index Index of the chunk.
+ * @return struct chunk_buf* A new reference to the data, or NULL on a miss.
+ */
+struct chunk_buf* cache_get(struct chunk_cache* cache, uint64_t serial, uint32_t index) {
+    uint64_t h = key_hash(serial, index);
+    struct cache_shard* shard = shard_of(cache, h);
+    struct chunk_buf* buf = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    sketch_add(shard, h);
+    struct cache_entry* e = *chain_find(shard, h, serial, index);
+    if (e) {
+        if (e->in_main) {
+            e->referenced = 1;
+        } else {
+            // Most recently used entries sit at the end of the window
+            ring_unlink(&shard->window, e);
+            ring_push(&shard->window, e);
+        }
+        buf = e->buf;
+        chunk_buf_retain(buf);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    metrics_add(buf ? MC_CACHE_HITS : MC_CACHE_MISSES, 1);
+    return buf;
+}
+
+/**
+ * Offers a chunk to the cache, which takes its own reference if the chunk
+ * is admitted. Chunks too large for a shard are never cached.
+ * @param cache The cache.
+ * @param serial Serial number of the package owning the chunk.
+ * @param index Index of the chunk.
+ * @param buf The complete chunk data.
+ */
+void cache_put(struct chunk_cache* cache, uint64_t serial, uint32_t index,
+    struct chunk_buf* buf) {
+    if (buf->len > cache->max_entry) {
+        return;
+    }
+    uint64_t h = key_hash(serial, index);
+    struct cache_shard* shard = shard_of(cache, h);
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry** link = chain_find(shard, h, serial, index);
+    struct cache_entry* e = *link ? NULL : calloc(1, sizeof(struct cache_entry));
+    if (!e) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    e->serial = serial;
+    e->index = index;
+    e->buf = buf;
+    chunk_buf_retain(buf);
+    *link = e;
+    shard->count++;
+    ring_push(&shard->window, e);
+    shard->window_bytes += buf->len;
+
+    // Entries pushed out of the window compete for the main area
+    while (shard->window_bytes > shard->window_cap) {
+        struct cache_entry* cand = shard->window;
+        ring_unlink(&shard->window, cand);
+        shard->window_bytes -= cand->buf->len;
+        admit(shard, cand);
+    }
+    chain_grow(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Drops a chunk from the cache, for when its data is found to be bad.
+ * Buffers already handed out stay valid.
+ * @param cache The cache.
+ * @param serial Serial number of the package owning the chunk.
+ * @param index Index of the chunk.
+ */
+void cache_invalidate(struct chunk_cache* cache, uint64_t serial, uint32_t index) {
+    uint64_t h = key_hash(serial, index);
+    struct cache_shard* shard = shard_of(cache, h);
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry* e = *chain_find(shard, h, serial, index);
+    if (e) {
+        if (e->in_main) {
+            ring_unlink(&shard->hand, e);
+            shard->main_bytes -= e->buf->len;
+        } else {
+            ring_unlink(&shard->window, e);
+            shard->window_bytes -= e->buf->len;
+        }
+        entry_free(shard, e);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Returns the size of the largest chunk the cache accepts.
+ * @param cache The cache.
+ * @return size_t The limit in bytes.
+ */
+size_t cache_entry_limit(struct chunk_cache* cache) {
+    return cache->max_entry;
+}
+
+/**
+ * Returns the bytes of chunk data currently held.
+ * @param cache The cache.
+ * @return size_t Bytes held over all shards.
+ */
+size_t cache_size(struct chunk_cache* cache) {
+    size_t total = 0;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        struct cache_shard* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        total += shard->window_bytes + shard->main_bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return total;
+}
+
+/**
+ * Frees a cache, buffers still referenced elsewhere stay valid.
+ * @param cache The cache, may be NULL.
+ */
+void cache_destroy(struct chunk_cache* cache) {
+    if (!cache) {
+        return;
+    }
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        struct cache_shard* shard = &cache->shards[s];
+        for (size_t b = 0; shard->buckets && b < shard->nbuckets; b++) {
+            struct cache_entry* e = shard->buckets[b];
+            while (e) {
+                struct cache_entry* next = e->hnext;
+                chunk_buf_release(e->buf);
+                free(e);
+                e = next;
+            }
+        }
+        free(shard->buckets);
+        free(shard->sketch);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
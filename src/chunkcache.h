@@ -0,0 +1,104 @@
+/*
+ ============================================================================
+ Name        : chunkcache.h
+ ============================================================================
+ */
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * Reference counted chunk data. The reader that fills it, the cache and
+ * every queued RES packet hold a reference, the data is freed with the
+ * last one and never copied in between.
+ */
+struct chunk_buf {
+    atomic_int refs;
+    uint32_t len;
+    uint8_t data[];
+};
+
+struct chunk_cache;
+
+/**
+ * Allocates a buffer holding one reference.
+ * @param len Number of data bytes.
+ * @return struct chunk_buf* The buffer, or NULL on allocation failure.
+ */
+struct chunk_buf* chunk_buf_alloc(uint32_t len);
+
+/**
+ * Takes an additional reference to a buffer.
+ * @param buf The buffer.
+ */
+void chunk_buf_retain(struct chunk_buf* buf);
+
+/**
+ * Drops a reference to a buffer, freeing it with the last reference.
+ * @param buf The buffer, may be NULL.
+ */
+void chunk_buf_release(struct chunk_buf* buf);
+
+/**
+ * Creates a cache of chunk data bounded to a number of bytes. The cache is
+ * split into independently locked shards, each using W-TinyLFU: new chunks
+ * enter a small LRU window and only move into the CLOCK managed main area
+ * if they have been requested more often than the chunk they would evict.
+ * @param capacity Upper bound on the bytes of cached chunk data.
+ * @return struct chunk_cache* The cache, or NULL on allocation failure.
+ */
+struct chunk_cache* cache_create(size_t capacity);
+
+/**
+ * Looks up a chunk and records the access for admission decisions.
+ * @param cache The cache.
+ * @param serial Serial number of the package owning the chunk.
+ * @param index Index of the chunk.
+ * @return struct chunk_buf* A new reference to the data, or NULL on a miss.
+ */
+struct chunk_buf* cache_get(struct chunk_cache* cache, uint64_t serial, uint32_t index);
+
+/**
+ * Offers a chunk to the cache, which takes its own reference if the chunk
+ * is admitted. Chunks too large for a shard are never cached.
+ * @param cache The cache.
+ * @param serial Serial number of the package owning the chunk.
+ * @param index Index of the chunk.
+ * @param buf The complete chunk data.
+ */
+void cache_put(struct chunk_cache* cache, uint64_t serial, uint32_t index,
+    struct chunk_buf* buf);
+
+/**
+ * Drops a chunk from the cache, for when its data is found to be bad.
+ * Buffers already handed out stay valid.
+ * @param cache The cache.
+ * @param serial Serial number of the package owning the chunk.
+ * @param index Index of the chunk.
+ */
+void cache_invalidate(struct chunk_cache* cache, uint64_t serial, uint32_t index);
+
+/**
+ * Returns the size of the largest chunk the cache accepts.
+ * @param cache The cache.
+ * @return size_t The limit in bytes.
+ */
+size_t cache_entry_limit(struct chunk_cache* cache);
+
+/**
+ * Returns the bytes of chunk data currently held.
+ * @param cache The cache.
+ * @return size_t Bytes held over all shards.
+ */
+size_t cache_size(struct chunk_cache* cache);
+
+/**
+ * Frees a cache, buffers still referenced elsewhere stay valid.
+ * @param cache The cache, may be NULL.
+ */
+void cache_destroy(struct chunk_cache* cache);
+
+#endif // CHUNKCACHE_H
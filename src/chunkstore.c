@@ -0,0 +1,290 @@
+/*
+ ============================================================================
+ Name        : chunkstore.c
+ ============================================================================
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "chunkstore.h"
+#include "chk/pkgchk.h"
+
+// Buffer used when the kernel cannot copy between the two files
+#define STORE_COPY_BLOCK (64 * 1024)
+
+/**
+ * Builds the path of a chunk in the store. Hashes come from manifests, so
+ * anything but lowercase hex is refused rather than used in a path.
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ * @param path Receives the path, STORE_PATH_LEN bytes.
+ * @return int 0 on success, -1 if the hash is malformed.
+ */
+static int store_path(struct chunk_store* store, const char* hash, char* path) {
+    for (int i = 0; i < MAX_HASH_LEN; i++) {
+        if (!((hash[i] >= '0' && hash[i] <= '9') || (hash[i] >= 'a' && hash[i] <= 'f'))) {
+            return -1;
+        }
+    }
+    snprintf(path, STORE_PATH_LEN, "%s/%.2s/%.*s", store->root, hash,
+        MAX_HASH_LEN, hash);
+    return 0;
+}
+
+/**
+ * Copies a byte range between two files, inside the kernel when possible.
+ * @param in Source file.
+ * @param in_off Offset in the source.
+ * @param out Destination file.
+ * @param out_off Offset in the destination.
+ * @param len Number of bytes to copy.
+ * @return int 0 on success, -1 on a read or write error.
+ */
+static int copy_range(int in, uint64_t in_off, int out, uint64_t out_off, uint32_t len) {
+    loff_t src = (loff_t)in_off;
+    loff_t dst = (loff_t)out_off;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, &src, out, &dst, left, 0);
+        if (n > 0) {
+            left -= (size_t)n;
+            continue;
+        }
+        if (n == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL
+            && errno != EOPNOTSUPP)) {
+            return -1;
+        }
+        break;
+    }
+    if (left == 0) {
+        return 0;
+    }
+
+    // Not supported between these files, copy the rest through a buffer
+    uint8_t* buf = malloc(STORE_COPY_BLOCK);
+    if (!buf) {
+        return -1;
+    }
+    while (left > 0) {
+        size_t want = left < STORE_COPY_BLOCK ? left : STORE_COPY_BLOCK;
+        ssize_t got = pread(in, buf, want, src);
+        if (got <= 0 || pwrite(out, buf, (size_t)got, dst) != got) {
+            free(buf);
+            return -1;
+        }
+        src += got;
+        dst += got;
+        left -= (size_t)got;
+    }
+    free(buf);
+    return 0;
+}
+
+/**
+ * Shares a byte range of one file with another, the destination then
+ * refers to the source's extents. Offsets must be aligned to the file
+ * system block, the length too unless the range ends the source.
+ * @param in Source file.
+ * @param in_off Offset in the source.
+ * @param out Destination file.
+ * @param out_off Offset in the destination.
+ * @param len Number of bytes to share.
+ * @return int 0 on success, -1 if the range cannot be cloned.
+ */
+static int clone_range(int in, uint64_t in_off, int out, uint64_t out_off, uint32_t len) {
+    struct file_clone_range range = {
+        .src_fd = in,
+        .src_offset = in_off,
+        .src_length = len,
+        .dest_offset = out_off,
+    };
+    return ioctl(out, FICLONERANGE, &range) == 0 ? 0 : -1;
+}
+
+/**
+ * Checks whether the store's file system supports reflinks by cloning a
+ * block between two scratch files.
+ * @param store The store.
+ * @return int 1 if extents can be shared, 0 otherwise.
+ */
+static int store_probe(struct chunk_store* store) {
+    char a[STORE_PATH_LEN];
+    char b[STORE_PATH_LEN];
+    snprintf(a, sizeof(a), "%s/probe.%d.a.tmp", store->root, (int)getpid());
+    snprintf(b, sizeof(b), "%s/probe.%d.b.tmp", store->root, (int)getpid());
+    int in = open(a, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    int out = open(b, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    uint8_t block[4096];
+    memset(block, 0, sizeof(block));
+    struct stat st;
+    int ok = in >= 0 && out >= 0
+        && pwrite(in, block, sizeof(block), 0) == (ssize_t)sizeof(block)
+        && clone_range(in, 0, out, 0, sizeof(block)) == 0;
+    store->block = ok && fstat(in, &st) == 0 && st.st_blksize > 0
+        ? (uint32_t)st.st_blksize : sizeof(block);
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    unlink(a);
+    unlink(b);
+    return ok;
+}
+
+/**
+ * Checks whether a chunk's range can be cloned, FICLONERANGE rejects
+ * ranges that do not start on a block or end mid-block short of the end
+ * of the source file.
+ * @param store The store.
+ * @param fd Data file holding the chunk.
+ * @param offset Offset of the chunk in the data file.
+ * @param size Size of the chunk.
+ * @return int 1 if the range is aligned, 0 otherwise.
+ */
+static int store_aligned(struct chunk_store* store, int fd, uint64_t offset,
+    uint32_t size) {
+    struct stat st;
+    if (offset % store->block != 0) {
+        return 0;
+    }
+    return size % store->block == 0
+        || (fstat(fd, &st) == 0 && offset + size == (uint64_t)st.st_size);
+}
+
+/**
+ * Opens the store of a package directory, creating it if needed, and
+ * checks whether its file system can share extents.
+ *
+ * @param store The store to initialise.
+ * @param directory The package directory.
+ * @return int 0 on success, -1 if the store directory cannot be created.
+ */
+int store_open(struct chunk_store* store, const char* directory) {
+    snprintf(store->root, sizeof(store->root), "%s/%s", directory, STORE_DIR);
+    atomic_init(&store->seq, 0);
+    if (mkdir(store->root, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    store->shared = store_probe(store);
+    return 0;
+}
+
+/**
+ * Checks whether the store holds a chunk.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ * @return int 1 if the chunk is held, 0 otherwise.
+ */
+int store_has(struct chunk_store* store, const char* hash) {
+    char path[STORE_PATH_LEN];
+    return store_path(store, hash, path) == 0 && access(path, F_OK) == 0;
+}
+
+/**
+ * Adds a verified chunk from a data file to the store as a reflink of its
+ * extents. A chunk that is already held is left as it is, so every hash is
+ * stored once, and one that cannot be cloned is skipped. Only chunks whose
+ * range is aligned to the store's block can be cloned, which the chunk
+ * size of the manifest decides.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ * @param fd Data file holding the chunk, opened for reading.
+ * @param offset Offset of the chunk in the data file.
+ * @param size Size of the chunk.
+ * @return int 0 if the store holds the chunk afterwards, 1 if it was
+ *     skipped for an unaligned range, -1 otherwise.
+ */
+int store_put(struct chunk_store* store, const char* hash, int fd,
+    uint64_t offset, uint32_t size) {
+    char path[STORE_PATH_LEN];
+    char tmppath[STORE_PATH_LEN + 32];
+    if (!store->shared || store_path(store, hash, path) != 0) {
+        return -1;
+    }
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+    if (!store_aligned(store, fd, offset, size)) {
+        return 1;
+    }
+
+    // Fan-out directory named by the first two hash characters
+    char* slash = strrchr(path, '/');
+    *slash = '\0';
+    int made = mkdir(path, 0700) == 0 || errno == EEXIST;
+    *slash = '/';
+    if (!made) {
+        return -1;
+    }
+
+    // Writers racing on one hash each fill their own file, the renames
+    // replace identical content
+    snprintf(tmppath, sizeof(tmppath), "%s.%d.%u.tmp", path, (int)getpid(),
+        atomic_fetch_add(&store->seq, 1));
+    int out = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        return -1;
+    }
+    // A plain copy would double the disk space of the chunk, skip it instead
+    int ok = clone_range(fd, offset, out, 0, size) == 0;
+    if (close(out) != 0 || !ok || rename(tmppath, path) != 0) {
+        remove(tmppath);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copies a chunk from the store into a data file, as a reflink when the
+ * offsets allow it. The caller verifies the copy, the store is not trusted
+ * over the manifest.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ * @param fd Data file to write, opened for writing.
+ * @param offset Offset of the chunk in the data file.
+ * @param size Size of the chunk.
+ * @return int 0 if the chunk was copied, -1 if it is not held or cannot be read.
+ */
+int store_get(struct chunk_store* store, const char* hash, int fd,
+    uint64_t offset, uint32_t size) {
+    char path[STORE_PATH_LEN];
+    if (store_path(store, hash, path) != 0) {
+        return -1;
+    }
+    int in = open(path, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    struct stat st;
+    int ok = fstat(in, &st) == 0 && (uint64_t)st.st_size == size
+        && (clone_range(in, 0, fd, offset, size) == 0
+            || copy_range(in, 0, fd, offset, size) == 0);
+    close(in);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Removes a chunk from the store, for a copy that failed verification.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ */
+void store_drop(struct chunk_store* store, const char* hash) {
+    char path[STORE_PATH_LEN];
+    if (store_path(store, hash, path) == 0) {
+        unlink(path);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ ============================================================================
+ Name        : chunkstore.h
+ ============================================================================
+ */
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define STORE_DIR ".chunks"
+#define STORE_ROOT_LEN 1024
+// Root, two fan-out characters and the hash with separators
+#define STORE_PATH_LEN (STORE_ROOT_LEN + 80)
+
+/**
+ * Content addressed chunk store shared by every package of a node. Each
+ * verified chunk is kept once under STORE_DIR in the package directory,
+ * named by its hash and fanned out over directories named by the first
+ * two hash characters. Chunks enter the store as reflinks of the package
+ * data files (FICLONERANGE), so the store shares their extents instead of
+ * holding a second copy. A chunk that cannot be cloned is not stored.
+ * - seq: numbers the temporary files of concurrent writers.
+ * - shared: set by store_open if the file system supports reflinks, the
+ *   store is of no use otherwise.
+ * - block: file system block size, cloned ranges must start on a block
+ *   and span whole blocks unless they end the data file.
+ */
+struct chunk_store {
+    char root[STORE_ROOT_LEN];
+    atomic_uint seq;
+    int shared;
+    uint32_t block;
+};
+
+/**
+ * Opens the store of a package directory, creating it if needed, and
+ * checks whether its file system can share extents.
+ *
+ * @param store The store to initialise.
+ * @param directory The package directory.
+ * @return int 0 on success, -1 if the store directory cannot be created.
+ */
+int store_open(struct chunk_store* store, const char* directory);
+
+/**
+ * Checks whether the store holds a chunk.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ * @return int 1 if the chunk is held, 0 otherwise.
+ */
+int store_has(struct chunk_store* store, const char* hash);
+
+/**
+ * Adds a verified chunk from a data file to the store as a reflink of its
+ * extents. A chunk that is already held is left as it is, so every hash is
+ * stored once, and one that cannot be cloned is skipped. Only chunks whose
+ * range is aligned to the store's block can be cloned, which the chunk
+ * size of the manifest decides.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ * @param fd Data file holding the chunk, opened for reading.
+ * @param offset Offset of the chunk in the data file.
+ * @param size Size of the chunk.
+ * @return int 0 if the store holds the chunk afterwards, 1 if it was
+ *     skipped for an unaligned range, -1 otherwise.
+ */
+int store_put(struct chunk_store* store, const char* hash, int fd,
+    uint64_t offset, uint32_t size);
+
+/**
+ * Removes a chunk from the store, for a copy that failed verification.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ */
+void store_drop(struct chunk_store* store, const char* hash);
+
+/**
+ * Copies a chunk from the store into a data file, as a reflink when the
+ * offsets allow it. The caller verifies the copy, the store is not trusted
+ * over the manifest.
+ *
+ * @param store The store.
+ * @param hash The 64 character chunk hash.
+ * @param fd Data file to write, opened for writing.
+ * @param offset Offset of the chunk in the data file.
+ * @param size Size of the chunk.
+ * @return int 0 if the chunk was copied, -1 if it is not held or cannot be read.
+ */
+int store_get(struct chunk_store* store, const char* hash, int fd,
+    uint64_t offset, uint32_t size);
+
+#endif // CHUNKSTORE_H
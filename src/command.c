@@ -0,0 +1,273 @@
+/*
+ ============================================================================
+ Name        : command.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "command.h"
+#include "metrics.h"
+
+#define CMD_LINE_LEN 5520
+// Limit on SCRIPT files including other scripts
+#define CMD_SCRIPT_DEPTH 8
+
+/**
+ * Initialises an empty queue.
+ * @param q The queue to initialise.
+ * @return int 0 on success, -1 if the wake pipe cannot be created.
+ */
+int cmd_queue_init(struct cmd_queue* q) {
+    if (pipe(q->wake_fds) != 0) {
+        return -1;
+    }
+    fcntl(q->wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(q->wake_fds[1], F_SETFL, O_NONBLOCK);
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+    atomic_init(&q->signalled, 0);
+    return 0;
+}
+
+/**
+ * Returns the descriptor the consumer polls for readability.
+ * @param q The queue.
+ * @return int The descriptor.
+ */
+int cmd_queue_fd(struct cmd_queue* q) {
+    return q->wake_fds[0];
+}
+
+/**
+ * Links a node at the head of the queue without signalling the consumer.
+ * @param q The queue.
+ * @param cmd The node to link.
+ */
+static void cmd_queue_link(struct cmd_queue* q, struct command* cmd) {
+    atomic_store_explicit(&cmd->next, NULL, memory_order_relaxed);
+    struct command* prev = atomic_exchange_explicit(&q->head, cmd,
+        memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, cmd, memory_order_release);
+}
+
+/**
+ * Appends a command, called from any thread. The queue takes ownership.
+ * @param q The queue.
+ * @param cmd The command to append.
+ */
+void cmd_queue_push(struct cmd_queue* q, struct command* cmd) {
+    metrics_add(MC_CMDS_QUEUED, 1);
+    cmd_queue_link(q, cmd);
+    // Only the first push after the consumer last drained writes to the pipe
+    if (atomic_exchange(&q->signalled, 1) == 0) {
+        char byte = 1;
+        if (write(q->wake_fds[1], &byte, 1) < 0) {
+            // Pipe already full, the consumer is awake anyway
+        }
+    }
+}
+
+/**
+ * Consumes the wake signal, consumer only, once per wake up before the
+ * queue is drained with cmd_queue_pop. Pushes from then on signal again.
+ * @param q The queue.
+ */
+void cmd_queue_drain(struct cmd_queue* q) {
+    char drain[64];
+    while (read(q->wake_fds[0], drain, sizeof(drain)) > 0) {
+    }
+    atomic_store(&q->signalled, 0);
+}
+
+/**
+ * Removes the oldest command, consumer only.
+ * @param q The queue.
+ * @return struct command* The command, NULL if the queue is empty.
+ */
+struct command* cmd_queue_pop(struct cmd_queue* q) {
+    struct command* tail = q->tail;
+    struct command* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub) {
+        if (!next) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        metrics_add(MC_CMDS_RUN, 1);
+        return tail;
+    }
+    // A producer is between its exchange and link, it signals once linked
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+    cmd_queue_link(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        metrics_add(MC_CMDS_RUN, 1);
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * Parses an ip:port argument into a command.
+ * @param token The argument.
+ * @param cmd The command to fill.
+ * @return int 0 on success, -1 if the argument is malformed.
+ */
+static int cmd_parse_addr(char* token, struct command* cmd) {
+    char* colon = token ? strrchr(token, ':') : NULL;
+    if (!colon || colon == token || (size_t)(colon - token) >= CMD_ADDR_LEN) {
+        return -1;
+    }
+    long port = strtol(colon + 1, NULL, 10);
+    if (port < 1 || port > 65535) {
+        return -1;
+    }
+    memcpy(cmd->ip, token, colon - token);
+    cmd->ip[colon - token] = '\0';
+    cmd->port = (uint16_t)port;
+    return 0;
+}
+
+/**
+ * Parses one input line into a command. Usage errors are reported on
+ * stdout and produce no command.
+ * @param line The input line, may include the trailing newline.
+ * @return struct command* The parsed command, NULL if nothing to run.
+ */
+struct command* cmd_parse(const char* line) {
+    char input[CMD_LINE_LEN];
+    char* save = NULL;
+    snprintf(input, sizeof(input), "%s", line);
+    input[strcspn(input, "\r\n")] = '\0';
+
+    char* token = strtok_r(input, " ", &save);
+    if (!token) {
+        return NULL;
+    }
+
+    struct command* cmd = calloc(1, sizeof(struct command));
+    if (!cmd) {
+        puts("Failed to allocate command");
+        return NULL;
+    }
+
+    if (strcmp(token, "QUIT") == 0) {
+        cmd->type = CMD_QUIT;
+    } else if (strcmp(token, "CONNECT") == 0 || strcmp(token, "DISCONNECT") == 0) {
+        cmd->type = strcmp(token, "CONNECT") == 0 ? CMD_CONNECT : CMD_DISCONNECT;
+        if (cmd_parse_addr(strtok_r(NULL, " ", &save), cmd) != 0) {
+            puts("Missing address and port argument");
+            goto invalid;
+        }
+    } else if (strcmp(token, "ADDPACKAGE") == 0 || strcmp(token, "REMPACKAGE") == 0) {
+        cmd->type = strcmp(token, "ADDPACKAGE") == 0 ? CMD_ADDPACKAGE : CMD_REMPACKAGE;
+        token = strtok_r(NULL, " ", &save);
+        if (!token) {
+            puts(cmd->type == CMD_ADDPACKAGE ? "Missing file argument."
+                : "Missing identifier argument, please specify whole 1024 character or at least 20 characters.");
+            goto invalid;
+        }
+        snprintf(cmd->arg, sizeof(cmd->arg), "%s", token);
+    } else if (strcmp(token, "PACKAGES") == 0) {
+        cmd->type = CMD_PACKAGES;
+    } else if (strcmp(token, "PEERS") == 0) {
+        cmd->type = CMD_PEERS;
+    } else if (strcmp(token, "STATS") == 0) {
+        cmd->type = CMD_STATS;
+    } else if (strcmp(token, "FETCH") == 0) {
+        cmd->type = CMD_FETCH;
+        char* addr = strtok_r(NULL, " ", &save);
+        char* ident = strtok_r(NULL, " ", &save);
+        char* hash = strtok_r(NULL, " ", &save);
+        char* offset = strtok_r(NULL, " ", &save);
+        if (addr && !ident && !strchr(addr, ':')) {
+            // FETCH <identifier> downloads the whole package from any peer
+            snprintf(cmd->arg, sizeof(cmd->arg), "%s", addr);
+            return cmd;
+        }
+        if (!hash) {
+            puts("Missing arguments from command");
+            goto invalid;
+        }
+        if (cmd_parse_addr(addr, cmd) != 0) {
+            puts("Missing address and port argument");
+            goto invalid;
+        }
+        snprintf(cmd->arg, sizeof(cmd->arg), "%s", ident);
+        snprintf(cmd->hash, sizeof(cmd->hash), "%s", hash);
+        if (offset) {
+            cmd->offset = (uint32_t)strtoul(offset, NULL, 10);
+            cmd->has_offset = 1;
+        }
+    } else {
+        puts("Invalid Input");
+        goto invalid;
+    }
+    return cmd;
+
+invalid:
+    free(cmd);
+    return NULL;
+}
+
+/**
+ * Reads a stream at a given SCRIPT nesting depth.
+ * @param q The queue.
+ * @param in The stream to read.
+ * @param depth Number of enclosing scripts.
+ * @return int 1 if a QUIT command was queued, 0 otherwise.
+ */
+static int cmd_read_depth(struct cmd_queue* q, FILE* in, int depth) {
+    char line[CMD_LINE_LEN];
+
+    while (fgets(line, sizeof(line), in)) {
+        char path[CMD_LINE_LEN];
+        if (sscanf(line, "SCRIPT %5519s", path) == 1) {
+            // Commands of the script are queued in place of the SCRIPT line
+            FILE* script = depth < CMD_SCRIPT_DEPTH ? fopen(path, "r") : NULL;
+            if (!script) {
+                printf("Cannot open script %s.\n", path);
+                continue;
+            }
+            int quit = cmd_read_depth(q, script, depth + 1);
+            fclose(script);
+            if (quit) {
+                return 1;
+            }
+            continue;
+        }
+
+        struct command* cmd = cmd_parse(line);
+        if (!cmd) {
+            continue;
+        }
+        int quit = cmd->type == CMD_QUIT;
+        cmd_queue_push(q, cmd);
+        if (quit) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parses every line of a stream and queues the resulting commands. A
+ * SCRIPT <file> line queues the commands of that file in its place.
+ * @param q The queue.
+ * @param in The stream to read.
+ * @return int 1 if a QUIT command was queued, 0 otherwise.
+ */
+int cmd_read_stream(struct cmd_queue* q, FILE* in) {
+    return cmd_read_depth(q, in, 0);
+}
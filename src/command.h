@@ -0,0 +1,132 @@
+/*
+ ============================================================================
+ Name        : command.h
+ ============================================================================
+ */
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "chk/pkgchk.h"
+
+#define CMD_ADDR_LEN 64
+
+enum cmd_type {
+    CMD_QUIT,
+    CMD_CONNECT,
+    CMD_DISCONNECT,
+    CMD_ADDPACKAGE,
+    CMD_REMPACKAGE,
+    CMD_PACKAGES,
+    CMD_PEERS,
+    CMD_STATS,
+    CMD_FETCH,
+    // Pushed by background tasks, never parsed and never held behind an
+    // ADDPACKAGE, so they stay last: a chunk of a package passed or failed
+    // verification, or a package became ready
+    CMD_VERIFIED,
+    CMD_REJECTED,
+    CMD_READY,
+    // Pushed by a pool task once the data for a peer's REQ has been read
+    CMD_SERVED,
+    // Pushed once the package of an ADDPACKAGE is loaded or refused
+    CMD_ADDED,
+};
+
+/**
+ * A parsed command, queued by a reader thread and executed by the
+ * network thread.
+ * - ip, port: peer address for CONNECT, DISCONNECT and FETCH, ip is empty
+ *   for a FETCH of a whole package.
+ * - arg: filename for ADDPACKAGE, identifier for REMPACKAGE, FETCH and
+ *   the commands pushed by background tasks.
+ * - hash, offset: chunk selected by FETCH, has_offset set if given. The
+ *   offset is the chunk index for VERIFIED and REJECTED, and the number of
+ *   peers listed so far for a PEERS passed between listener shards.
+ * - serial: the package a command pushed by a background task is about,
+ *   an identifier may name a newer package by the time it is handled.
+ * - forwarded: set on copies passed from one listener shard to another.
+ * - data: result of the task pushing a SERVED, owned by the command.
+ */
+struct command {
+    _Atomic(struct command*) next;
+    enum cmd_type type;
+    char ip[CMD_ADDR_LEN];
+    uint16_t port;
+    char arg[MAX_IDENT_LEN + 1];
+    char hash[MAX_HASH_LEN + 1];
+    uint32_t offset;
+    int has_offset;
+    uint64_t serial;
+    int forwarded;
+    void* data;
+};
+
+/**
+ * Lock-free multi-producer single-consumer queue of commands.
+ * Any thread may push, only the network thread pops. The consumer sleeps
+ * in poll() on wake_fd, which producers signal after pushing.
+ */
+struct cmd_queue {
+    _Atomic(struct command*) head;
+    struct command* tail;
+    struct command stub;
+    atomic_int signalled;
+    int wake_fds[2];
+};
+
+/**
+ * Initialises an empty queue.
+ * @param q The queue to initialise.
+ * @return int 0 on success, -1 if the wake pipe cannot be created.
+ */
+int cmd_queue_init(struct cmd_queue* q);
+
+/**
+ * Returns the descriptor the consumer polls for readability.
+ * @param q The queue.
+ * @return int The descriptor.
+ */
+int cmd_queue_fd(struct cmd_queue* q);
+
+/**
+ * Appends a command, called from any thread. The queue takes ownership.
+ * @param q The queue.
+ * @param cmd The command to append.
+ */
+void cmd_queue_push(struct cmd_queue* q, struct command* cmd);
+
+/**
+ * Consumes the wake signal, consumer only, once per wake up before the
+ * queue is drained with cmd_queue_pop. Pushes from then on signal again.
+ * @param q The queue.
+ */
+void cmd_queue_drain(struct cmd_queue* q);
+
+/**
+ * Removes the oldest command, consumer only.
+ * @param q The queue.
+ * @return struct command* The command, NULL if the queue is empty.
+ */
+struct command* cmd_queue_pop(struct cmd_queue* q);
+
+/**
+ * Parses one input line into a command. Usage errors are reported on
+ * stdout and produce no command.
+ * @param line The input line, may include the trailing newline.
+ * @return struct command* The parsed command, NULL if nothing to run.
+ */
+struct command* cmd_parse(const char* line);
+
+/**
+ * Parses every line of a stream and queues the resulting commands. A
+ * SCRIPT <file> line queues the commands of that file in its place.
+ * @param q The queue.
+ * @param in The stream to read.
+ * @return int 1 if a QUIT command was queued, 0 otherwise.
+ */
+int cmd_read_stream(struct cmd_queue* q, FILE* in);
+
+#endif // COMMAND_H
@@ -13,6 +13,24 @@
 #define MAX_PATH_LENGTH 256
 #include "config.h"
 
+/**
+ * Parses a bandwidth limit in KiB per second.
+ *
+ * @param value The configuration value.
+ * @param rate Receives the parsed limit.
+ * @return int Returns 0 on success, or 6 if the value is not a valid limit.
+ */
+static int parse_rate(const char *value, uint32_t *rate) {
+    char *end;
+    long long val = strtoll(value, &end, 10);
+    if (end == value || *end != '\0' || val < 0 || val > 4194304) {
+        // Invalid rate value
+        return 6;
+    }
+    *rate = (uint32_t)val;
+    return 0;
+}
+
 /**
  * Ensures that a directory exists at the specified path.
  * If the directory does not exist, it attempts to create it.
@@ -40,7 +58,11 @@ int ensure_directory(const char *dir_path) {
 
 /**
  * Parses a configuration file to extract configuration settings.
- * The configuration settings include directory path, maximum peers, and port number.
+ * The configuration settings include directory path, maximum peers, port number
+ * and the optional global and per-peer upload and download rate limits,
+ * metrics dump file, chunk store switch, chunk cache size, worker count,
+ * scrubbing rates, the durability and queue size of chunk writes and the
+ * number of listener shards.
  * 
  * @param filename Path to the configuration file.
  * @param config Pointer to the Config structure to store the parsed data.
@@ -53,6 +75,14 @@ int parse_config(const char *filename, Config *config) {
         // File opening failed
         return 1; 
     }
+    // Keys that are not present keep their defaults
+    memset(config, 0, sizeof(*config));
+    config->metrics_interval = 10;
+    config->scrub_pause_mb = 1;
+    config->write_sync = 1;
+    config->write_batch_ms = 10;
+    config->write_queue_mb = 64;
+    config->listen_shards = 1;
 
     // Buffer to store lines read from the file
     char line[1024];
@@ -80,6 +110,108 @@ int parse_config(const char *filename, Config *config) {
                     return 5; 
                 }
                 config->port = (uint16_t)port_val;
+            } else if (strcmp(key, "upload_rate") == 0
+                || strcmp(key, "download_rate") == 0
+                || strcmp(key, "peer_upload_rate") == 0
+                || strcmp(key, "peer_download_rate") == 0) {
+                // Parse a bandwidth limit and validate
+                uint32_t *rate = strcmp(key, "upload_rate") == 0 ? &config->upload_rate
+                    : strcmp(key, "download_rate") == 0 ? &config->download_rate
+                    : strcmp(key, "peer_upload_rate") == 0 ? &config->peer_upload_rate
+                    : &config->peer_download_rate;
+                int err = parse_rate(value, rate);
+                if (err != 0) {
+                    fclose(file);
+                    return err;
+                }
+            } else if (strcmp(key, "metrics_file") == 0) {
+                snprintf(config->metrics_file, sizeof(config->metrics_file), "%s", value);
+            } else if (strcmp(key, "metrics_interval") == 0) {
+                // Parse the dump interval in seconds and validate
+                config->metrics_interval = atoi(value);
+                if (config->metrics_interval < 1 || config->metrics_interval > 86400) {
+                    fclose(file);
+                    // Invalid metrics_interval value
+                    return 7;
+                }
+            } else if (strcmp(key, "chunk_store") == 0) {
+                // Parse the chunk store switch and validate
+                if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                    fclose(file);
+                    // Invalid chunk_store value
+                    return 8;
+                }
+                config->chunk_store = value[0] == '1';
+            } else if (strcmp(key, "chunk_cache_mb") == 0) {
+                // Parse the chunk cache size and validate
+                char *end;
+                long long mb = strtoll(value, &end, 10);
+                if (end == value || *end != '\0' || mb < 0 || mb > 1048576) {
+                    fclose(file);
+                    // Invalid chunk_cache_mb value
+                    return 9;
+                }
+                config->chunk_cache_mb = (uint32_t)mb;
+            } else if (strcmp(key, "pool_threads") == 0) {
+                // Parse the worker count and validate
+                char *end;
+                long threads = strtol(value, &end, 10);
+                if (end == value || *end != '\0' || threads < 0 || threads > 1024) {
+                    fclose(file);
+                    // Invalid pool_threads value
+                    return 10;
+                }
+                config->pool_threads = (int)threads;
+            } else if (strcmp(key, "scrub_rate_mb") == 0
+                || strcmp(key, "scrub_pause_mb") == 0) {
+                // Parse a scrubbing rate and validate
+                int scrub_rate = strcmp(key, "scrub_rate_mb") == 0;
+                char *end;
+                long long mb = strtoll(value, &end, 10);
+                if (end == value || *end != '\0' || mb < 0 || mb > 65536) {
+                    fclose(file);
+                    // Invalid scrub_rate_mb (11) or scrub_pause_mb (12) value
+                    return scrub_rate ? 11 : 12;
+                }
+                *(scrub_rate ? &config->scrub_rate_mb : &config->scrub_pause_mb) = (uint32_t)mb;
+            } else if (strcmp(key, "write_sync") == 0) {
+                // Parse the write durability switch and validate
+                if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                    fclose(file);
+                    // Invalid write_sync value
+                    return 13;
+                }
+                config->write_sync = value[0] == '1';
+            } else if (strcmp(key, "write_batch_ms") == 0) {
+                // Parse the write batching delay and validate
+                char *end;
+                long ms = strtol(value, &end, 10);
+                if (end == value || *end != '\0' || ms < 0 || ms > 10000) {
+                    fclose(file);
+                    // Invalid write_batch_ms value
+                    return 15;
+                }
+                config->write_batch_ms = (int)ms;
+            } else if (strcmp(key, "write_queue_mb") == 0) {
+                // Parse the write queue size and validate
+                char *end;
+                long long mb = strtoll(value, &end, 10);
+                if (end == value || *end != '\0' || mb < 1 || mb > 65536) {
+                    fclose(file);
+                    // Invalid write_queue_mb value
+                    return 14;
+                }
+                config->write_queue_mb = (uint32_t)mb;
+            } else if (strcmp(key, "listen_shards") == 0) {
+                // Parse the listener thread count and validate
+                char *end;
+                long shards = strtol(value, &end, 10);
+                if (end == value || *end != '\0' || shards < 1 || shards > 64) {
+                    fclose(file);
+                    // Invalid listen_shards value
+                    return 16;
+                }
+                config->listen_shards = (int)shards;
             }
         }
     }
@@ -12,6 +12,35 @@ typedef struct {
     char directory[256];
     int max_peers;
     uint16_t port;
+    // Bandwidth limits in KiB per second, 0 for unlimited
+    uint32_t upload_rate;
+    uint32_t download_rate;
+    uint32_t peer_upload_rate;
+    uint32_t peer_download_rate;
+    // Metrics are dumped to metrics_file every metrics_interval seconds
+    char metrics_file[256];
+    int metrics_interval;
+    // Keep verified chunks in a content addressed store shared by packages,
+    // as reflinks of the data files, disabled where those are unsupported
+    int chunk_store;
+    // Memory for caching served chunks in MiB, 0 disables the cache
+    uint32_t chunk_cache_mb;
+    // Workers shared by loading, verification and tree building, 0 for
+    // one per online processor
+    int pool_threads;
+    // Background rehashing of seeded chunks in MiB per second, 0 disables
+    // it, paused while uploads exceed scrub_pause_mb MiB per second
+    uint32_t scrub_rate_mb;
+    uint32_t scrub_pause_mb;
+    // Received chunks are written in batches gathered for write_batch_ms and
+    // flushed with fdatasync before they are recorded unless write_sync is
+    // 0, reading from peers stops while write_queue_mb MiB of them wait
+    int write_sync;
+    int write_batch_ms;
+    uint32_t write_queue_mb;
+    // Event loop threads sharing the port through SO_REUSEPORT, each
+    // accepting its share of the incoming peers
+    int listen_shards;
 } Config;
 
 /**
@@ -25,7 +54,11 @@ int ensure_directory(const char *dir_path);
 
 /**
  * Parses a configuration file to extract configuration settings.
- * The configuration settings include directory path, maximum peers, and port number.
+ * The configuration settings include directory path, maximum peers, port number
+ * and the optional global and per-peer upload and download rate limits,
+ * metrics dump file, chunk store switch, chunk cache size, worker count,
+ * scrubbing rates, the durability and queue size of chunk writes and the
+ * number of listener shards.
  * 
  * @param filename Path to the configuration file.
  * @param config Pointer to the Config structure to store the parsed data.
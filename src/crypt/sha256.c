@@ -222,3 +222,269 @@ void sha256_output_hex(struct sha256_compute_data* data,
 	sha256_output(data, hash);
 	bin_to_hex(hash, 32, hexbuf);
 }
+
+//
+// Interior Merkle nodes hash the hex digests of their children, 64 bytes
+// each. The message is a whole number of blocks and the padding block that
+// follows depends only on the number of children, so its schedule is
+// computed once and the length bookkeeping of sha256_update and
+// sha256_finalize is skipped.
+//
+
+#define PAIR_LANES (4)
+
+//Padding block of a 128 byte message: 0x80, zeros, then the length of 1024
+//bits. Holds k[i] + w[i] of its expanded schedule.
+static const uint32_t pair_pad_kw[SHA256K] = {
+    0xc28a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf574,
+    0x649b69c1, 0xf23e4787, 0x0fe1edc6, 0x240ca2dc,
+    0x4fe9346f, 0x4b1e84aa, 0x61b9431e, 0x36f9b39a,
+    0xfa465156, 0xb85a8e77, 0xb01d681d, 0x5e59c7ea,
+    0x2faa3291, 0x07e2a6fb, 0x1f515a8e, 0x6f915f0a,
+    0x5fb4221d, 0x612cc90a, 0x35c3e883, 0xa925d9d4,
+    0x8b82d1b9, 0x92848088, 0x9a5b7704, 0x034ba272,
+    0x9f594686, 0x6f480592, 0xe49bee62, 0xc1cf12eb,
+    0x3ef55e11, 0x1f0f59a3, 0x327a0634, 0xbfa4d9bc,
+    0x770df572, 0x9b9fbf40, 0xc21be9e9, 0xf5001d69,
+    0x840ec6da, 0x8a337f83, 0xb737625a, 0xe9b9ecd0,
+    0xfe5d6d40, 0xa52dab8d, 0xee944592, 0x5f2d004a,
+    0x3bc8cb2e, 0x36d964a4, 0x5eb10caf, 0x6289d971
+};
+
+static const uint32_t pair_iv[SHA256_INT_SZ] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t load_be32(const uint8_t* p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+		| (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+/**
+ * Expands a block into its schedule with the round constants added.
+ * @param block The 64 byte block.
+ * @param kw Receives k[i] + w[i] for every round.
+ */
+static void pair_schedule(const uint8_t* block, uint32_t kw[SHA256K]) {
+	uint32_t w[SHA256K];
+	for (uint32_t i = 0; i < 16; i++) {
+		w[i] = load_be32(block + 4 * i);
+	}
+	for (uint32_t i = 16; i < SHA256K; i++) {
+		uint32_t s0 = rotate_r(w[i-15], 7) ^ rotate_r(w[i-15], 18)
+			^ (w[i-15] >> 3);
+		uint32_t s1 = rotate_r(w[i-2], 17) ^ rotate_r(w[i-2], 19)
+			^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	for (uint32_t i = 0; i < SHA256K; i++) {
+		kw[i] = k[i] + w[i];
+	}
+}
+
+/**
+ * Runs the compression rounds over a schedule and adds the result to the
+ * state.
+ * @param hs The state.
+ * @param kw Schedule with the round constants added.
+ */
+static void pair_rounds(uint32_t hs[SHA256_INT_SZ], const uint32_t kw[SHA256K]) {
+	uint32_t a = hs[0], b = hs[1], c = hs[2], d = hs[3];
+	uint32_t e = hs[4], f = hs[5], g = hs[6], h = hs[7];
+	for (uint32_t i = 0; i < SHA256K; i++) {
+		uint32_t t1 = h + (rotate_r(e, 6) ^ rotate_r(e, 11) ^ rotate_r(e, 25))
+			+ ((e & f) ^ (~e & g)) + kw[i];
+		uint32_t t2 = (rotate_r(a, 2) ^ rotate_r(a, 13) ^ rotate_r(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	hs[0] += a; hs[1] += b; hs[2] += c; hs[3] += d;
+	hs[4] += e; hs[5] += f; hs[6] += g; hs[7] += h;
+}
+
+/**
+ * Writes a finished state as 64 hex characters.
+ * @param hs The state.
+ * @param out Receives the digest, not terminated.
+ */
+static void pair_output_hex(const uint32_t hs[SHA256_INT_SZ], char* out) {
+	uint8_t hash[32];
+	for (uint32_t i = 0; i < SHA256_INT_SZ; i++) {
+		hash[i*4] = hs[i] >> 24;
+		hash[i*4 + 1] = hs[i] >> 16;
+		hash[i*4 + 2] = hs[i] >> 8;
+		hash[i*4 + 3] = hs[i];
+	}
+	bin_to_hex(hash, 32, out);
+}
+
+/**
+ * Builds the schedule of the padding block that follows a message of whole
+ * blocks, taken from the table for the common two block message.
+ * @param nblocks Number of blocks in the message.
+ * @param kw Receives k[i] + w[i] of the padding block.
+ */
+static void pad_schedule(uint32_t nblocks, uint32_t kw[SHA256K]) {
+	if (nblocks == 2) {
+		memcpy(kw, pair_pad_kw, sizeof(pair_pad_kw));
+		return;
+	}
+	uint8_t block[SHA256_CHUNK_SZ] = { 0x80 };
+	uint64_t size = (uint64_t) nblocks * SHA256_CHUNK_SZ * 8;
+	for (int32_t i = 8; i > 0; --i) {
+		block[55+i] = size & 255;
+		size >>= 8;
+	}
+	pair_schedule(block, kw);
+}
+
+void sha256_hash_pair(const char* left, const char* right, char* out) {
+	uint32_t hs[SHA256_INT_SZ];
+	uint32_t kw[SHA256K];
+	memcpy(hs, pair_iv, sizeof(hs));
+	pair_schedule((const uint8_t*) left, kw);
+	pair_rounds(hs, kw);
+	pair_schedule((const uint8_t*) right, kw);
+	pair_rounds(hs, kw);
+	pair_rounds(hs, pair_pad_kw);
+	pair_output_hex(hs, out);
+}
+
+void sha256_hash_digests(const char* digests, uint32_t count, char* out) {
+	uint32_t hs[SHA256_INT_SZ];
+	uint32_t kw[SHA256K];
+	memcpy(hs, pair_iv, sizeof(hs));
+	for (uint32_t b = 0; b < count; b++) {
+		pair_schedule((const uint8_t*) digests + b * SHA256_CHUNK_SZ, kw);
+		pair_rounds(hs, kw);
+	}
+	pad_schedule(count, kw);
+	pair_rounds(hs, kw);
+	pair_output_hex(hs, out);
+}
+
+/**
+ * Expands one block of each lane, lanes are stored side by side so every
+ * step is the same operation over all of them.
+ * @param blocks First block, the block of lane l is at blocks + l * stride.
+ * @param stride Distance between the blocks of neighbouring lanes.
+ * @param kw Receives k[i] + w[i] of every lane.
+ */
+static void pairs_schedule(const uint8_t* blocks, size_t stride,
+		uint32_t kw[SHA256K][PAIR_LANES]) {
+	for (uint32_t i = 0; i < 16; i++) {
+		for (uint32_t l = 0; l < PAIR_LANES; l++) {
+			kw[i][l] = load_be32(blocks + l * stride + 4 * i);
+		}
+	}
+	for (uint32_t i = 16; i < SHA256K; i++) {
+		for (uint32_t l = 0; l < PAIR_LANES; l++) {
+			uint32_t s0 = rotate_r(kw[i-15][l], 7)
+				^ rotate_r(kw[i-15][l], 18) ^ (kw[i-15][l] >> 3);
+			uint32_t s1 = rotate_r(kw[i-2][l], 17)
+				^ rotate_r(kw[i-2][l], 19) ^ (kw[i-2][l] >> 10);
+			kw[i][l] = kw[i-16][l] + s0 + kw[i-7][l] + s1;
+		}
+	}
+	for (uint32_t i = 0; i < SHA256K; i++) {
+		for (uint32_t l = 0; l < PAIR_LANES; l++) {
+			kw[i][l] += k[i];
+		}
+	}
+}
+
+/**
+ * Runs the compression rounds of every lane and adds the results to their
+ * states.
+ * @param hs The states, word i of lane l at hs[i][l].
+ * @param kw Schedules with the round constants added.
+ */
+static void pairs_rounds(uint32_t hs[SHA256_INT_SZ][PAIR_LANES],
+		const uint32_t kw[SHA256K][PAIR_LANES]) {
+	uint32_t a[PAIR_LANES], b[PAIR_LANES], c[PAIR_LANES], d[PAIR_LANES];
+	uint32_t e[PAIR_LANES], f[PAIR_LANES], g[PAIR_LANES], h[PAIR_LANES];
+	for (uint32_t l = 0; l < PAIR_LANES; l++) {
+		a[l] = hs[0][l]; b[l] = hs[1][l]; c[l] = hs[2][l]; d[l] = hs[3][l];
+		e[l] = hs[4][l]; f[l] = hs[5][l]; g[l] = hs[6][l]; h[l] = hs[7][l];
+	}
+	for (uint32_t i = 0; i < SHA256K; i++) {
+		for (uint32_t l = 0; l < PAIR_LANES; l++) {
+			uint32_t t1 = h[l] + (rotate_r(e[l], 6) ^ rotate_r(e[l], 11)
+				^ rotate_r(e[l], 25)) + ((e[l] & f[l]) ^ (~e[l] & g[l]))
+				+ kw[i][l];
+			uint32_t t2 = (rotate_r(a[l], 2) ^ rotate_r(a[l], 13)
+				^ rotate_r(a[l], 22))
+				+ ((a[l] & b[l]) ^ (a[l] & c[l]) ^ (b[l] & c[l]));
+			h[l] = g[l];
+			g[l] = f[l];
+			f[l] = e[l];
+			e[l] = d[l] + t1;
+			d[l] = c[l];
+			c[l] = b[l];
+			b[l] = a[l];
+			a[l] = t1 + t2;
+		}
+	}
+	for (uint32_t l = 0; l < PAIR_LANES; l++) {
+		hs[0][l] += a[l]; hs[1][l] += b[l]; hs[2][l] += c[l]; hs[3][l] += d[l];
+		hs[4][l] += e[l]; hs[5][l] += f[l]; hs[6][l] += g[l]; hs[7][l] += h[l];
+	}
+}
+
+void sha256_hash_digest_groups(const char* digests, uint32_t width, char* out,
+		uint32_t n) {
+	uint32_t hs[SHA256_INT_SZ][PAIR_LANES];
+	uint32_t kw[SHA256K][PAIR_LANES];
+	uint32_t pad[SHA256K][PAIR_LANES];
+	uint32_t pad_kw[SHA256K];
+	const size_t stride = (size_t) width * SHA256_CHUNK_SZ;
+
+	pad_schedule(width, pad_kw);
+	for (uint32_t i = 0; i < SHA256K; i++) {
+		for (uint32_t l = 0; l < PAIR_LANES; l++) {
+			pad[i][l] = pad_kw[i];
+		}
+	}
+
+	uint32_t i = 0;
+	for (; i + PAIR_LANES <= n; i += PAIR_LANES) {
+		const uint8_t* in = (const uint8_t*) digests + i * stride;
+		for (uint32_t w = 0; w < SHA256_INT_SZ; w++) {
+			for (uint32_t l = 0; l < PAIR_LANES; l++) {
+				hs[w][l] = pair_iv[w];
+			}
+		}
+		for (uint32_t b = 0; b < width; b++) {
+			pairs_schedule(in + b * SHA256_CHUNK_SZ, stride, kw);
+			pairs_rounds(hs, (const uint32_t (*)[PAIR_LANES]) kw);
+		}
+		pairs_rounds(hs, (const uint32_t (*)[PAIR_LANES]) pad);
+
+		for (uint32_t l = 0; l < PAIR_LANES; l++) {
+			uint32_t lane[SHA256_INT_SZ];
+			for (uint32_t w = 0; w < SHA256_INT_SZ; w++) {
+				lane[w] = hs[w][l];
+			}
+			pair_output_hex(lane, out + (size_t)(i + l) * SHA256_CHUNK_SZ);
+		}
+	}
+
+	for (; i < n; i++) {
+		sha256_hash_digests(digests + i * stride, width, out + (size_t) i * SHA256_CHUNK_SZ);
+	}
+}
+
+void sha256_hash_pairs(const char* pairs, char* out, uint32_t n) {
+	sha256_hash_digest_groups(pairs, 2, out, n);
+}
@@ -0,0 +1,103 @@
+/*
+ ============================================================================
+ Name        : journal.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "journal.h"
+#include "chk/sidecar.h"
+
+#define JOURNAL_MAGIC 0x334a5442u
+
+// On-disk header
+struct journal_header {
+    uint32_t magic;
+    uint32_t nchunks;
+    struct file_identity data;
+    // The manifest the bitmap was recorded for, zero padded
+    char ident[MAX_IDENT_LEN + 1];
+    char root[MAX_HASH_LEN + 1];
+};
+
+/**
+ * Fills in the header a journal of a package must have.
+ * @param datapath Path of the package data file.
+ * @param obj The package manifest.
+ * @param hdr Receives the header.
+ * @return int 0 on success, -1 if the data file cannot be examined.
+ */
+static int journal_header_for(const char* datapath, const struct bpkg_obj* obj,
+    struct journal_header* hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->nchunks = obj->nchunks;
+    memcpy(hdr->ident, obj->ident, strnlen(obj->ident, MAX_IDENT_LEN));
+    // A single chunk is its own root
+    const char* root = obj->nhashes > 0 ? obj->hashes[0]
+        : obj->nchunks > 0 ? obj->chunks[0].hash : "";
+    memcpy(hdr->root, root, strnlen(root, MAX_HASH_LEN));
+    return file_identity_at(datapath, &hdr->data);
+}
+
+/**
+ * Loads the chunk completion bitmap recorded for a data file.
+ * The journal is only trusted if it was recorded for the same manifest and
+ * the data file still has the identity it had when the journal was written.
+ *
+ * @param datapath Path of the package data file.
+ * @param obj The package manifest.
+ * @param bitmap Receives one bit per chunk, (nchunks + 7) / 8 bytes.
+ * @return int 0 if a valid journal was loaded, -1 otherwise.
+ */
+int journal_load(const char* datapath, const struct bpkg_obj* obj, uint8_t* bitmap) {
+    struct journal_header want;
+    struct journal_header hdr;
+    char path[SIDECAR_PATH_LEN];
+
+    if (journal_header_for(datapath, obj, &want) != 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s%s", datapath, JOURNAL_SUFFIX);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    size_t len = (obj->nchunks + 7) / 8;
+    int ok = fread(&hdr, sizeof(hdr), 1, file) == 1
+        && memcmp(&hdr, &want, sizeof(hdr)) == 0
+        && fread(bitmap, 1, len, file) == len;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Records the chunk completion bitmap of a data file alongside it.
+ *
+ * @param datapath Path of the package data file.
+ * @param obj The package manifest.
+ * @param bitmap One bit per chunk, (nchunks + 7) / 8 bytes.
+ * @return int 0 on success, -1 if the journal could not be written.
+ */
+int journal_save(const char* datapath, const struct bpkg_obj* obj, const uint8_t* bitmap) {
+    struct journal_header hdr;
+    char path[SIDECAR_PATH_LEN];
+
+    if (journal_header_for(datapath, obj, &hdr) != 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s%s", datapath, JOURNAL_SUFFIX);
+
+    struct sidecar sc;
+    FILE* file = sidecar_begin(&sc, path, "wb");
+    if (!file) {
+        return -1;
+    }
+    size_t len = (obj->nchunks + 7) / 8;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1
+        && fwrite(bitmap, 1, len, file) == len;
+    return sidecar_commit(&sc, ok);
+}
@@ -0,0 +1,38 @@
+/*
+ ============================================================================
+ Name        : journal.h
+ ============================================================================
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "chk/pkgchk.h"
+
+#define JOURNAL_SUFFIX ".journal"
+
+/**
+ * Loads the chunk completion bitmap recorded for a data file.
+ * The journal is only trusted if it was recorded for the same manifest and
+ * the data file still has the identity it had when the journal was written.
+ * Manifests sharing a data file share its journal, each rejects the
+ * bitmap recorded by another and verifies the data file instead.
+ *
+ * @param datapath Path of the package data file.
+ * @param obj The package manifest.
+ * @param bitmap Receives one bit per chunk, (nchunks + 7) / 8 bytes.
+ * @return int 0 if a valid journal was loaded, -1 otherwise.
+ */
+int journal_load(const char* datapath, const struct bpkg_obj* obj, uint8_t* bitmap);
+
+/**
+ * Records the chunk completion bitmap of a data file alongside it.
+ *
+ * @param datapath Path of the package data file.
+ * @param obj The package manifest.
+ * @param bitmap One bit per chunk, (nchunks + 7) / 8 bytes.
+ * @return int 0 on success, -1 if the journal could not be written.
+ */
+int journal_save(const char* datapath, const struct bpkg_obj* obj, const uint8_t* bitmap);
+
+#endif // JOURNAL_H
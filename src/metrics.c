@@ -0,0 +1,285 @@
+/*
+ ============================================================================
+ Name        : metrics.c
+ ============================================================================
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "ratelimit.h"
+#include "net/packet.h"
+
+// Histogram buckets are log-linear: each power of two is split into
+// 2^HIST_SUB_BITS buckets, keeping the relative error under 12.5%
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/**
+ * Counters of one thread. Only the owning thread writes them, so updates
+ * are plain relaxed load/store pairs, readers sum every shard.
+ */
+struct metrics_shard {
+    _Atomic uint64_t counters[MC_COUNT];
+    _Atomic uint64_t pkts[2][256];
+    _Atomic uint64_t hist[MH_COUNT][HIST_BUCKETS];
+    _Atomic uint64_t hist_max[MH_COUNT];
+    struct metrics_shard* next;
+};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard* shards;
+static uint64_t start_ns;
+static _Thread_local struct metrics_shard* local;
+
+static const char* hist_names[MH_COUNT] = { "req_res", "verify", "download", "tail" };
+static const char* counter_names[MC_COUNT] = {
+    "bytes_in", "bytes_out", "chunks_verified", "chunks_failed",
+    "hash_bytes", "hash_ns", "commands_queued", "commands_run",
+    "store_hits", "store_bytes", "store_skipped", "cache_hits",
+    "cache_misses", "verify_cached", "scrub_bytes", "scrub_failed",
+    "endgame_requests", "endgame_waste", "write_bytes", "write_calls",
+    "write_syncs",
+};
+
+/**
+ * Returns the calling thread's shard, registering it on first use.
+ * Shards outlive their threads so totals never go backwards.
+ * @return struct metrics_shard* The shard, NULL if allocation failed.
+ */
+static struct metrics_shard* shard_get(void) {
+    if (local) {
+        return local;
+    }
+    struct metrics_shard* s = calloc(1, sizeof(struct metrics_shard));
+    if (!s) {
+        return NULL;
+    }
+    pthread_mutex_lock(&shards_lock);
+    if (!shards) {
+        start_ns = tb_now_ns();
+    }
+    s->next = shards;
+    shards = s;
+    pthread_mutex_unlock(&shards_lock);
+    local = s;
+    return s;
+}
+
+/**
+ * Adds to a counter owned by the calling thread.
+ * @param c The counter.
+ * @param n Amount to add.
+ */
+static inline void bump(_Atomic uint64_t* c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+/**
+ * Maps a value to its histogram bucket.
+ * @param v The value.
+ * @return int Index of the bucket.
+ */
+static int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB
+        + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * Returns the smallest value falling in a histogram bucket.
+ * @param b Index of the bucket.
+ * @return uint64_t The bucket's lower bound.
+ */
+static uint64_t hist_value(int b) {
+    if (b < HIST_SUB) {
+        return (uint64_t)b;
+    }
+    int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/**
+ * Adds to a counter of the calling thread.
+ * @param c The counter.
+ * @param n Amount to add.
+ */
+void metrics_add(enum metric_counter c, uint64_t n) {
+    struct metrics_shard* s = shard_get();
+    if (s) {
+        bump(&s->counters[c], n);
+    }
+}
+
+/**
+ * Counts a packet sent or received by the calling thread.
+ * @param out 1 for a sent packet, 0 for a received one.
+ * @param msg_code The packet's message code.
+ */
+void metrics_packet(int out, uint16_t msg_code) {
+    struct metrics_shard* s = shard_get();
+    if (s) {
+        bump(&s->pkts[out ? 1 : 0][msg_code & 0xff], 1);
+    }
+}
+
+/**
+ * Records a latency sample in a histogram of the calling thread.
+ * @param h The histogram.
+ * @param ns The latency in nanoseconds.
+ */
+void metrics_record(enum metric_hist h, uint64_t ns) {
+    struct metrics_shard* s = shard_get();
+    if (!s) {
+        return;
+    }
+    bump(&s->hist[h][hist_bucket(ns)], 1);
+    if (ns > atomic_load_explicit(&s->hist_max[h], memory_order_relaxed)) {
+        atomic_store_explicit(&s->hist_max[h], ns, memory_order_relaxed);
+    }
+}
+
+/**
+ * Records the outcome of verifying a chunk.
+ * @param ok 1 if the chunk matched its hash.
+ * @param bytes Size of the chunk.
+ * @param ns Time spent verifying it.
+ */
+void metrics_verify(int ok, uint64_t bytes, uint64_t ns) {
+    metrics_add(ok ? MC_CHUNKS_VERIFIED : MC_CHUNKS_FAILED, 1);
+    metrics_add(MC_HASH_BYTES, bytes);
+    metrics_add(MC_HASH_NS, ns);
+    metrics_record(MH_VERIFY, ns);
+}
+
+/**
+ * Returns the current value of a counter summed over all threads.
+ * @param c The counter.
+ * @return uint64_t The aggregated value.
+ */
+uint64_t metrics_get(enum metric_counter c) {
+    uint64_t total = 0;
+    pthread_mutex_lock(&shards_lock);
+    for (struct metrics_shard* s = shards; s; s = s->next) {
+        total += atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shards_lock);
+    return total;
+}
+
+/**
+ * Returns the name of a message code.
+ * @param code The message code.
+ * @return const char* Its name, NULL for unknown codes.
+ */
+static const char* msg_name(int code) {
+    switch (code) {
+    case PKT_MSG_ACK: return "ACK";
+    case PKT_MSG_ACP: return "ACP";
+    case PKT_MSG_DSN: return "DSN";
+    case PKT_MSG_REQ: return "REQ";
+    case PKT_MSG_RES: return "RES";
+    case PKT_MSG_PNG: return "PNG";
+    case PKT_MSG_POG: return "POG";
+    case PKT_MSG_PRF: return "PRF";
+    case PKT_MSG_BMP: return "BMP";
+    case PKT_MSG_HAV: return "HAV";
+    case PKT_MSG_CCL: return "CCL";
+    default: return NULL;
+    }
+}
+
+/**
+ * Writes the aggregated counters and histograms as `key value` lines.
+ * Latencies are reported in microseconds.
+ * @param out Destination stream.
+ */
+void metrics_write(FILE* out) {
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t counters[MC_COUNT] = { 0 };
+    uint64_t pkts[2][256] = { { 0 } };
+
+    pthread_mutex_lock(&shards_lock);
+    for (struct metrics_shard* s = shards; s; s = s->next) {
+        for (int c = 0; c < MC_COUNT; c++) {
+            counters[c] += atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+        }
+        for (int d = 0; d < 2; d++) {
+            for (int m = 0; m < 256; m++) {
+                pkts[d][m] += atomic_load_explicit(&s->pkts[d][m], memory_order_relaxed);
+            }
+        }
+    }
+    uint64_t now = tb_now_ns();
+    fprintf(out, "uptime_s %.3f\n", shards ? (double)(now - start_ns) / 1e9 : 0.0);
+    pthread_mutex_unlock(&shards_lock);
+
+    for (int c = 0; c < MC_COUNT; c++) {
+        fprintf(out, "%s %llu\n", counter_names[c], (unsigned long long)counters[c]);
+    }
+    double secs = (double)counters[MC_HASH_NS] / 1e9;
+    fprintf(out, "hash_mb_per_s %.1f\n",
+        secs > 0 ? (double)counters[MC_HASH_BYTES] / (1024 * 1024) / secs : 0.0);
+    for (int d = 0; d < 2; d++) {
+        for (int m = 0; m < 256; m++) {
+            if (pkts[d][m] == 0) {
+                continue;
+            }
+            const char* name = msg_name(m);
+            if (name) {
+                fprintf(out, "packets_%s.%s %llu\n", d ? "out" : "in", name,
+                    (unsigned long long)pkts[d][m]);
+            } else {
+                fprintf(out, "packets_%s.0x%02x %llu\n", d ? "out" : "in", m,
+                    (unsigned long long)pkts[d][m]);
+            }
+        }
+    }
+
+    for (int h = 0; h < MH_COUNT; h++) {
+        uint64_t count = 0;
+        uint64_t max = 0;
+        pthread_mutex_lock(&shards_lock);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] = 0;
+        }
+        for (struct metrics_shard* s = shards; s; s = s->next) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                hist[b] += atomic_load_explicit(&s->hist[h][b], memory_order_relaxed);
+            }
+            uint64_t m = atomic_load_explicit(&s->hist_max[h], memory_order_relaxed);
+            max = m > max ? m : max;
+        }
+        pthread_mutex_unlock(&shards_lock);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            count += hist[b];
+        }
+
+        // Percentiles report the lower bound of the bucket they fall in
+        const double pcts[] = { 50, 90, 99, 99.9 };
+        const char* labels[] = { "p50", "p90", "p99", "p999" };
+        fprintf(out, "latency_%s.count %llu\n", hist_names[h], (unsigned long long)count);
+        for (int p = 0; p < 4 && count > 0; p++) {
+            uint64_t rank = (uint64_t)((double)count * pcts[p] / 100.0 + 0.5);
+            rank = rank < 1 ? 1 : rank;
+            uint64_t seen = 0;
+            int b = 0;
+            for (; b < HIST_BUCKETS - 1; b++) {
+                seen += hist[b];
+                if (seen >= rank) {
+                    break;
+                }
+            }
+            fprintf(out, "latency_%s.%s_us %.1f\n", hist_names[h], labels[p],
+                (double)hist_value(b) / 1000);
+        }
+        if (count > 0) {
+            fprintf(out, "latency_%s.max_us %.1f\n", hist_names[h], (double)max / 1000);
+        }
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ ============================================================================
+ Name        : metrics.h
+ ============================================================================
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters aggregated over all threads
+enum metric_counter {
+    MC_BYTES_IN,
+    MC_BYTES_OUT,
+    MC_CHUNKS_VERIFIED,
+    MC_CHUNKS_FAILED,
+    // Bytes hashed and time spent hashing them, for throughput
+    MC_HASH_BYTES,
+    MC_HASH_NS,
+    // Commands pushed and executed, the difference is the queue depth
+    MC_CMDS_QUEUED,
+    MC_CMDS_RUN,
+    // Chunks and bytes filled from the chunk store instead of the network,
+    // and verified chunks left out of it for ranges that cannot be cloned
+    MC_STORE_HITS,
+    MC_STORE_BYTES,
+    MC_STORE_SKIPPED,
+    // Lookups of served chunks in the chunk cache
+    MC_CACHE_HITS,
+    MC_CACHE_MISSES,
+    // Chunks whose cached digest spared rehashing them
+    MC_VERIFY_CACHED,
+    // Bytes rehashed by the scrubber and chunks it found corrupted
+    MC_SCRUB_BYTES,
+    MC_SCRUB_FAILED,
+    // Duplicate endgame requests, and the bytes still received for
+    // requests that were cancelled after another peer answered
+    MC_ENDGAME_REQS,
+    MC_ENDGAME_WASTE,
+    // Bytes written by the chunk writer, in how many pwritev calls, and
+    // the fdatasync calls of its batches
+    MC_WRITE_BYTES,
+    MC_WRITE_CALLS,
+    MC_WRITE_SYNCS,
+    MC_COUNT,
+};
+
+// Latency histograms
+enum metric_hist {
+    // FETCH request sent until the chunk has been received and verified
+    MH_REQ_RES,
+    // Hashing and comparing a single chunk
+    MH_VERIFY,
+    // FETCH of a whole package until every chunk is present
+    MH_DOWNLOAD,
+    // Last missing chunk of a package requested until the package is complete
+    MH_TAIL,
+    MH_COUNT,
+};
+
+/**
+ * Adds to a counter of the calling thread.
+ * @param c The counter.
+ * @param n Amount to add.
+ */
+void metrics_add(enum metric_counter c, uint64_t n);
+
+/**
+ * Counts a packet sent or received by the calling thread.
+ * @param out 1 for a sent packet, 0 for a received one.
+ * @param msg_code The packet's message code.
+ */
+void metrics_packet(int out, uint16_t msg_code);
+
+/**
+ * Records a latency sample in a histogram of the calling thread.
+ * @param h The histogram.
+ * @param ns The latency in nanoseconds.
+ */
+void metrics_record(enum metric_hist h, uint64_t ns);
+
+/**
+ * Records the outcome of verifying a chunk.
+ * @param ok 1 if the chunk matched its hash.
+ * @param bytes Size of the chunk.
+ * @param ns Time spent verifying it.
+ */
+void metrics_verify(int ok, uint64_t bytes, uint64_t ns);
+
+/**
+ * Returns the current value of a counter summed over all threads.
+ * @param c The counter.
+ * @return uint64_t The aggregated value.
+ */
+uint64_t metrics_get(enum metric_counter c);
+
+/**
+ * Writes the aggregated counters and histograms as `key value` lines.
+ * @param out Destination stream.
+ */
+void metrics_write(FILE* out);
+
+#endif // METRICS_H
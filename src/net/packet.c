@@ -0,0 +1,218 @@
+/*
+ ============================================================================
+ Name        : packet.c
+ ============================================================================
+ */
+#include <string.h>
+#include <stdint.h>
+#include "net/packet.h"
+
+// Offsets of the structured payload fields on the wire
+#define PKT_HDR_SZ (4)
+#define REQ_OFF_OFFSET (0)
+#define REQ_OFF_LEN (4)
+#define REQ_OFF_HASH (8)
+#define REQ_OFF_IDENT (REQ_OFF_HASH + PKT_HASH_LEN)
+#define RES_OFF_OFFSET (0)
+#define RES_OFF_DATA (PKT_RES_DATA_POS - PKT_HDR_SZ)
+#define RES_OFF_LEN (RES_OFF_DATA + PKT_RES_DATA_MAX)
+#define RES_OFF_HASH (RES_OFF_LEN + 2)
+#define RES_OFF_IDENT (RES_OFF_HASH + PKT_HASH_LEN)
+#define PRF_OFF_OFFSET (0)
+#define PRF_OFF_INDEX (4)
+#define PRF_OFF_NLEAVES (8)
+#define PRF_OFF_LEN (12)
+#define PRF_OFF_HASH (14)
+#define PRF_OFF_IDENT (PRF_OFF_HASH + PKT_HASH_LEN)
+#define PRF_OFF_SIBLINGS (PRF_OFF_IDENT + PKT_IDENT_LEN)
+#define BMP_OFF_NCHUNKS (0)
+#define BMP_OFF_FIRST (4)
+#define BMP_OFF_LEN (8)
+#define BMP_OFF_FLAGS (10)
+#define BMP_OFF_IDENT (12)
+#define BMP_OFF_BITS (BMP_OFF_IDENT + PKT_IDENT_LEN)
+#define HAV_OFF_COUNT (0)
+#define HAV_OFF_IDENT (4)
+#define HAV_OFF_INDICES (HAV_OFF_IDENT + PKT_IDENT_LEN)
+_Static_assert(BMP_OFF_BITS + PKT_BMP_MAX <= PAYLOAD_MAX,
+    "BMP bits overflow the payload");
+_Static_assert(HAV_OFF_INDICES + PKT_HAV_MAX * 4 <= PAYLOAD_MAX,
+    "HAV indices overflow the payload");
+_Static_assert(PRF_OFF_SIBLINGS + PKT_PROOF_MAX * PKT_HASH_LEN <= PAYLOAD_MAX,
+    "PRF siblings overflow the payload");
+
+/**
+ * Writes a 16 bit value in network byte order.
+ * @param p Destination.
+ * @param v Value to write.
+ */
+static void put16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+/**
+ * Writes a 32 bit value in network byte order.
+ * @param p Destination.
+ * @param v Value to write.
+ */
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/**
+ * Reads a 16 bit value in network byte order.
+ * @param p Source.
+ * @return uint16_t The value.
+ */
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/**
+ * Reads a 32 bit value in network byte order.
+ * @param p Source.
+ * @return uint32_t The value.
+ */
+static uint32_t get32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+        | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/**
+ * Serialises a packet into its fixed size wire format. Integer fields are
+ * written in network byte order at fixed offsets so the layout does not
+ * depend on structure padding.
+ * @param pkt The packet to encode.
+ * @param out Buffer receiving PACKET_SIZE bytes.
+ */
+void pkt_encode(const struct btide_packet* pkt, uint8_t out[PACKET_SIZE]) {
+    uint8_t* pl = out + PKT_HDR_SZ;
+
+    put16(out, pkt->msg_code);
+    put16(out + 2, pkt->error);
+
+    switch (pkt->msg_code) {
+    case PKT_MSG_REQ:
+    case PKT_MSG_CCL:
+        memset(pl, 0, PAYLOAD_MAX);
+        put32(pl + REQ_OFF_OFFSET, pkt->pl.req.file_offset);
+        put32(pl + REQ_OFF_LEN, pkt->pl.req.data_len);
+        memcpy(pl + REQ_OFF_HASH, pkt->pl.req.chunk_hash, PKT_HASH_LEN);
+        memcpy(pl + REQ_OFF_IDENT, pkt->pl.req.identifier, PKT_IDENT_LEN);
+        break;
+    case PKT_MSG_RES:
+        put32(pl + RES_OFF_OFFSET, pkt->pl.res.file_offset);
+        memcpy(pl + RES_OFF_DATA, pkt->pl.res.data, PKT_RES_DATA_MAX);
+        put16(pl + RES_OFF_LEN, pkt->pl.res.data_len);
+        memcpy(pl + RES_OFF_HASH, pkt->pl.res.chunk_hash, PKT_HASH_LEN);
+        memcpy(pl + RES_OFF_IDENT, pkt->pl.res.identifier, PKT_IDENT_LEN);
+        break;
+    case PKT_MSG_PRF:
+        memset(pl, 0, PAYLOAD_MAX);
+        put32(pl + PRF_OFF_OFFSET, pkt->pl.prf.file_offset);
+        put32(pl + PRF_OFF_INDEX, pkt->pl.prf.chunk_index);
+        put32(pl + PRF_OFF_NLEAVES, pkt->pl.prf.nleaves);
+        put16(pl + PRF_OFF_LEN, pkt->pl.prf.len);
+        memcpy(pl + PRF_OFF_HASH, pkt->pl.prf.chunk_hash, PKT_HASH_LEN);
+        memcpy(pl + PRF_OFF_IDENT, pkt->pl.prf.identifier, PKT_IDENT_LEN);
+        memcpy(pl + PRF_OFF_SIBLINGS, pkt->pl.prf.siblings,
+            (size_t)(pkt->pl.prf.len <= PKT_PROOF_MAX ? pkt->pl.prf.len : 0) * PKT_HASH_LEN);
+        break;
+    case PKT_MSG_BMP:
+        memset(pl, 0, PAYLOAD_MAX);
+        put32(pl + BMP_OFF_NCHUNKS, pkt->pl.bmp.nchunks);
+        put32(pl + BMP_OFF_FIRST, pkt->pl.bmp.first);
+        put16(pl + BMP_OFF_LEN, pkt->pl.bmp.len);
+        pl[BMP_OFF_FLAGS] = pkt->pl.bmp.flags;
+        memcpy(pl + BMP_OFF_IDENT, pkt->pl.bmp.identifier, PKT_IDENT_LEN);
+        memcpy(pl + BMP_OFF_BITS, pkt->pl.bmp.bits,
+            pkt->pl.bmp.len <= PKT_BMP_MAX ? pkt->pl.bmp.len : 0);
+        break;
+    case PKT_MSG_HAV:
+        memset(pl, 0, PAYLOAD_MAX);
+        put16(pl + HAV_OFF_COUNT, pkt->pl.hav.count);
+        memcpy(pl + HAV_OFF_IDENT, pkt->pl.hav.identifier, PKT_IDENT_LEN);
+        for (uint16_t i = 0; i < pkt->pl.hav.count && i < PKT_HAV_MAX; i++) {
+            put32(pl + HAV_OFF_INDICES + 4 * i, pkt->pl.hav.indices[i]);
+        }
+        break;
+    default:
+        memcpy(pl, pkt->pl.data, PAYLOAD_MAX);
+        break;
+    }
+}
+
+/**
+ * Parses a packet from its fixed size wire format.
+ * @param in Buffer holding PACKET_SIZE bytes.
+ * @param pkt The packet to fill.
+ * @return int 0 on success, -1 if the packet is malformed.
+ */
+int pkt_decode(const uint8_t in[PACKET_SIZE], struct btide_packet* pkt) {
+    const uint8_t* pl = in + PKT_HDR_SZ;
+
+    pkt->msg_code = get16(in);
+    pkt->error = get16(in + 2);
+
+    switch (pkt->msg_code) {
+    case PKT_MSG_REQ:
+    case PKT_MSG_CCL:
+        pkt->pl.req.file_offset = get32(pl + REQ_OFF_OFFSET);
+        pkt->pl.req.data_len = get32(pl + REQ_OFF_LEN);
+        memcpy(pkt->pl.req.chunk_hash, pl + REQ_OFF_HASH, PKT_HASH_LEN);
+        memcpy(pkt->pl.req.identifier, pl + REQ_OFF_IDENT, PKT_IDENT_LEN);
+        break;
+    case PKT_MSG_RES:
+        pkt->pl.res.file_offset = get32(pl + RES_OFF_OFFSET);
+        pkt->pl.res.data_len = get16(pl + RES_OFF_LEN);
+        if (pkt->pl.res.data_len > PKT_RES_DATA_MAX) {
+            return -1;
+        }
+        memcpy(pkt->pl.res.data, pl + RES_OFF_DATA, pkt->pl.res.data_len);
+        memcpy(pkt->pl.res.chunk_hash, pl + RES_OFF_HASH, PKT_HASH_LEN);
+        memcpy(pkt->pl.res.identifier, pl + RES_OFF_IDENT, PKT_IDENT_LEN);
+        break;
+    case PKT_MSG_PRF:
+        pkt->pl.prf.file_offset = get32(pl + PRF_OFF_OFFSET);
+        pkt->pl.prf.chunk_index = get32(pl + PRF_OFF_INDEX);
+        pkt->pl.prf.nleaves = get32(pl + PRF_OFF_NLEAVES);
+        pkt->pl.prf.len = get16(pl + PRF_OFF_LEN);
+        if (pkt->pl.prf.len > PKT_PROOF_MAX) {
+            return -1;
+        }
+        memcpy(pkt->pl.prf.chunk_hash, pl + PRF_OFF_HASH, PKT_HASH_LEN);
+        memcpy(pkt->pl.prf.identifier, pl + PRF_OFF_IDENT, PKT_IDENT_LEN);
+        memcpy(pkt->pl.prf.siblings, pl + PRF_OFF_SIBLINGS,
+            (size_t)pkt->pl.prf.len * PKT_HASH_LEN);
+        break;
+    case PKT_MSG_BMP:
+        pkt->pl.bmp.nchunks = get32(pl + BMP_OFF_NCHUNKS);
+        pkt->pl.bmp.first = get32(pl + BMP_OFF_FIRST);
+        pkt->pl.bmp.len = get16(pl + BMP_OFF_LEN);
+        pkt->pl.bmp.flags = pl[BMP_OFF_FLAGS];
+        if (pkt->pl.bmp.len > PKT_BMP_MAX) {
+            return -1;
+        }
+        memcpy(pkt->pl.bmp.identifier, pl + BMP_OFF_IDENT, PKT_IDENT_LEN);
+        memcpy(pkt->pl.bmp.bits, pl + BMP_OFF_BITS, pkt->pl.bmp.len);
+        break;
+    case PKT_MSG_HAV:
+        pkt->pl.hav.count = get16(pl + HAV_OFF_COUNT);
+        if (pkt->pl.hav.count > PKT_HAV_MAX) {
+            return -1;
+        }
+        memcpy(pkt->pl.hav.identifier, pl + HAV_OFF_IDENT, PKT_IDENT_LEN);
+        for (uint16_t i = 0; i < pkt->pl.hav.count; i++) {
+            pkt->pl.hav.indices[i] = get32(pl + HAV_OFF_INDICES + 4 * i);
+        }
+        break;
+    default:
+        memcpy(pkt->pl.data, pl, PAYLOAD_MAX);
+        break;
+    }
+    return 0;
+}
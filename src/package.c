@@ -6,79 +6,798 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "chk/pkgchk.h"
+#include "chk/verifycache.h"
 #include "package.h"
+#include "journal.h"
+#include "rcu.h"
+#include "metrics.h"
+#include "ratelimit.h"
+
+#define PKG_INITIAL_BUCKETS 64
+// Chunks checked by one task of a package verification
+#define VERIFY_GRAIN 64
+
+// Source of Package serial numbers, never reused
+static atomic_uint_fast64_t next_serial = 1;
 
 /**
- * Adds a package to the package list by reading package details from a file.
- *
- * @param pkgList Pointer to the list of packages.
- * @param directory The directory where the package files are located.
- * @param filename The filename of the package to be added.
+ * Hashes the identifier prefix used to select a bucket. Only the first
+ * PKG_PREFIX_LEN characters contribute so that any valid prefix of an
+ * identifier hashes to the same bucket as the identifier itself.
+ * @param ident The identifier or identifier prefix.
+ * @return uint64_t FNV-1a hash of the prefix.
  */
-void addPackage(PackageList *pkgList, char *directory, char* filename) {
-    // Construct the full path to the package file
-    char fullpath[1025];
-    strcpy(fullpath, directory);
-    strcat(fullpath, "/");
-    strcat(fullpath, filename);
+static uint64_t prefix_hash(const char* ident) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < PKG_PREFIX_LEN && ident[i] != '\0'; i++) {
+        h ^= (unsigned char)ident[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-    // Ensure the fullpath is not NULL
-    if (fullpath == NULL) {
-        puts("Missing file argument.");
-        return;
+/**
+ * Allocates an empty hash table.
+ * @param nbuckets Number of buckets, must be a power of two.
+ * @return struct pkg_table* The table, or NULL on allocation failure.
+ */
+static struct pkg_table* table_create(size_t nbuckets) {
+    struct pkg_table* table = calloc(1, sizeof(struct pkg_table) +
+        nbuckets * sizeof(_Atomic(struct pkg_node*)));
+    if (!table) {
+        return NULL;
     }
+    table->nbuckets = nbuckets;
+    return table;
+}
 
-    // Open the file to read package details
-    FILE* file = fopen(fullpath, "r");
-    if (!file) {
-        printf("Cannot open file %s.\n", fullpath);
+/**
+ * Links a package into a table. Writers only, the node becomes visible to
+ * readers once the bucket head has been published.
+ * @param table The table to insert into.
+ * @param pkg The package to insert.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int table_insert(struct pkg_table* table, Package* pkg) {
+    struct pkg_node* node = malloc(sizeof(struct pkg_node));
+    if (!node) {
+        return -1;
+    }
+    size_t b = prefix_hash(pkg->identifier) & (table->nbuckets - 1);
+    node->pkg = pkg;
+    atomic_store_explicit(&node->next,
+        atomic_load_explicit(&table->buckets[b], memory_order_relaxed),
+        memory_order_relaxed);
+    atomic_store_explicit(&table->buckets[b], node, memory_order_release);
+    return 0;
+}
+
+/**
+ * Frees a table and its chain nodes, but not the packages they reference.
+ * @param table The table to free.
+ */
+static void table_free(struct pkg_table* table) {
+    for (size_t b = 0; b < table->nbuckets; b++) {
+        struct pkg_node* node = atomic_load(&table->buckets[b]);
+        while (node) {
+            struct pkg_node* next = atomic_load(&node->next);
+            free(node);
+            node = next;
+        }
+    }
+    free(table);
+}
+
+/**
+ * Doubles the number of buckets once the load factor exceeds one. A new
+ * table is built on the side and published, the old one is released after
+ * a grace period. Caller must hold write_lock.
+ * @param pkgList Pointer to the list of packages.
+ */
+static void table_grow(PackageList *pkgList) {
+    struct pkg_table* old = atomic_load(&pkgList->table);
+    if ((size_t)atomic_load(&pkgList->count) < old->nbuckets) {
         return;
-    }   
-    
-    char buffer[2048];
-    char identifier[1025]; 
-    char nameoffile[257];
-    // Read the first line and store the ident value in obj->ident
-    if (fgets(buffer, sizeof(buffer), file) == NULL) {
-        printf("Unable to read filename from file %s.\n", filename);
-        fclose(file);
+    }
+
+    struct pkg_table* table = table_create(old->nbuckets * 2);
+    if (!table) {
+        // Keep the current table, lookups stay correct with longer chains
         return;
-    } else {
-        sscanf(buffer, "ident: %1024s", identifier);
     }
+    for (Package* p = atomic_load(&pkgList->head); p; p = atomic_load(&p->next)) {
+        if (table_insert(table, p) != 0) {
+            table_free(table);
+            return;
+        }
+    }
+
+    atomic_store_explicit(&pkgList->table, table, memory_order_release);
+    rcu_synchronize();
+    table_free(old);
+}
+
+/**
+ * Initialises an empty package list.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pool Workers used to load and verify packages, or NULL to do the
+ *             work on the calling thread.
+ * @param store Chunk store shared by the packages, or NULL to disable it.
+ */
+void initPackages(PackageList *pkgList, struct pool* pool, struct chunk_store* store) {
+    struct pkg_table* table = table_create(PKG_INITIAL_BUCKETS);
+    if (!table) {
+        perror("Failed to allocate package table");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&pkgList->table, table);
+    atomic_init(&pkgList->head, NULL);
+    pkgList->tail = NULL;
+    atomic_init(&pkgList->count, 0);
+    pthread_mutex_init(&pkgList->write_lock, NULL);
+    pkgList->pool = pool;
+    pkgList->store = store;
+    pkgList->on_ready = NULL;
+    pkgList->on_ready_arg = NULL;
+    pkgList->on_demoted = NULL;
+    pkgList->on_demoted_arg = NULL;
+}
+
+/**
+ * Registers a function called whenever a package becomes ready, on the
+ * thread that established its completion state. Must be called before
+ * packages are scanned or added.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param fn The function, NULL to stop notifications.
+ * @param arg Argument passed to fn.
+ */
+void watchPackages(PackageList *pkgList, void (*fn)(void* arg, Package* pkg), void* arg) {
+    pkgList->on_ready = fn;
+    pkgList->on_ready_arg = arg;
+}
+
+/**
+ * Registers a function called whenever a verified chunk is found bad and
+ * demoted with demoteChunk, so copies of its data kept elsewhere can be
+ * dropped. Must be called before packages are scanned or added.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param fn The function, NULL to stop notifications.
+ * @param arg Argument passed to fn.
+ */
+void watchDemotions(PackageList *pkgList,
+    void (*fn)(void* arg, Package* pkg, uint32_t index), void* arg) {
+    pkgList->on_demoted = fn;
+    pkgList->on_demoted_arg = arg;
+}
+
+/**
+ * Publishes the completion state of a package so its chunks may be served.
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package.
+ */
+static void readyPackage(PackageList *pkgList, Package* pkg) {
+    atomic_store_explicit(&pkg->state, PKG_READY, memory_order_release);
+    if (pkgList->on_ready) {
+        pkgList->on_ready(pkgList->on_ready_arg, pkg);
+    }
+}
+
+/**
+ * Looks up a package by its identifier or an identifier prefix of at least
+ * PKG_PREFIX_LEN characters. Must be called between rcu_read_lock and
+ * rcu_read_unlock, the returned package stays valid until the unlock.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param ident The identifier or identifier prefix to search for.
+ * @param nmatches Set to the number of packages sharing the prefix, may be NULL.
+ * @return Package* The package if exactly one matches, otherwise NULL.
+ */
+Package* findPackage(PackageList *pkgList, const char* ident, int* nmatches) {
+    struct pkg_table* table = atomic_load_explicit(&pkgList->table,
+        memory_order_acquire);
+    // The registry has been cleaned up
+    if (!table) {
+        if (nmatches) {
+            *nmatches = 0;
+        }
+        return NULL;
+    }
+    size_t len = strlen(ident);
+    size_t b = prefix_hash(ident) & (table->nbuckets - 1);
+    Package* match = NULL;
+    int count = 0;
+
+    // Several identifiers may share a bucket or even the whole prefix, so
+    // every candidate is compared on the full length that was given
+    struct pkg_node* node = atomic_load_explicit(&table->buckets[b],
+        memory_order_acquire);
+    for (; node; node = atomic_load_explicit(&node->next, memory_order_acquire)) {
+        if (strncmp(node->pkg->identifier, ident, len) == 0) {
+            match = node->pkg;
+            count++;
+        }
+    }
+
+    if (nmatches) {
+        *nmatches = count;
+    }
+    return count == 1 ? match : NULL;
+}
+
+/**
+ * Records a chunk as present and verified on disk.
+ *
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk was not marked before, 0 otherwise.
+ */
+int markChunk(Package* pkg, uint32_t index) {
+    uint64_t bit = 1ULL << (index % 64);
+    uint64_t old = atomic_fetch_or(&pkg->chunk_map[index / 64], bit);
+    if (old & bit) {
+        return 0;
+    }
+    atomic_fetch_add(&pkg->ncomplete, 1);
+    return 1;
+}
+
+/**
+ * Records a chunk as missing, for example after it failed verification.
+ *
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk was marked before, 0 otherwise.
+ */
+int clearChunk(Package* pkg, uint32_t index) {
+    uint64_t bit = 1ULL << (index % 64);
+    uint64_t old = atomic_fetch_and(&pkg->chunk_map[index / 64], ~bit);
+    if (!(old & bit)) {
+        return 0;
+    }
+    atomic_fetch_sub(&pkg->ncomplete, 1);
+    return 1;
+}
+
+/**
+ * Records a verified chunk as missing after its data was found bad, and
+ * tells the function registered with watchDemotions.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk was marked before, 0 otherwise.
+ */
+int demoteChunk(PackageList *pkgList, Package* pkg, uint32_t index) {
+    if (!clearChunk(pkg, index)) {
+        return 0;
+    }
+    if (pkgList->on_demoted) {
+        pkgList->on_demoted(pkgList->on_demoted_arg, pkg, index);
+    }
+    return 1;
+}
+
+/**
+ * Checks whether a chunk is present and verified on disk.
+ *
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk is marked, 0 otherwise.
+ */
+int hasChunk(Package* pkg, uint32_t index) {
+    return (atomic_load(&pkg->chunk_map[index / 64]) >> (index % 64)) & 1;
+}
+
+/**
+ * Opens the data file of a package for writing, creating it at its full
+ * size so chunks can land anywhere.
+ *
+ * @param pkg The package.
+ * @return int The descriptor, or -1 if the file cannot be opened or sized.
+ */
+int openPackageData(Package* pkg) {
+    struct stat st;
+    int fd = open(pkg->filename, O_RDWR | O_CREAT, 0644);
+    if (fd >= 0 && (fstat(fd, &st) != 0
+        || (st.st_size < pkg->obj->size && ftruncate(fd, pkg->obj->size) != 0))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Adds a verified chunk of a package to the chunk store, if there is one.
+ * Chunks the store cannot clone for their alignment are counted in STATS.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package owning the chunk.
+ * @param fd Data file of the package, opened for reading.
+ * @param index Index of the chunk.
+ */
+void storeChunk(PackageList *pkgList, Package* pkg, int fd, uint32_t index) {
+    if (pkgList->store) {
+        struct chunk* c = &pkg->obj->chunks[index];
+        if (store_put(pkgList->store, c->hash, fd, c->offset, c->size) == 1) {
+            metrics_add(MC_STORE_SKIPPED, 1);
+        }
+    }
+}
+
+/**
+ * Fills a missing chunk of a package from the chunk store without going to
+ * the network. The copy is verified against the manifest before it is
+ * marked, a store entry that cannot provide it intact is dropped so the
+ * chunk is fetched from a peer next time.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package owning the chunk.
+ * @param fd Data file of the package, opened for reading and writing.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk is now present and verified, 0 otherwise.
+ */
+int restoreChunk(PackageList *pkgList, Package* pkg, int fd, uint32_t index) {
+    struct chunk* c = &pkg->obj->chunks[index];
+    if (!pkgList->store) {
+        return 0;
+    }
+    if (store_get(pkgList->store, c->hash, fd, c->offset, c->size) != 0
+        || !bpkg_chunk_verify(pkg->obj, fd, index)) {
+        store_drop(pkgList->store, c->hash);
+        return 0;
+    }
+    markChunk(pkg, index);
+    metrics_add(MC_STORE_HITS, 1);
+    metrics_add(MC_STORE_BYTES, c->size);
+    return 1;
+}
+
+/**
+ * Persists the completion bitmap of a package in its journal.
+ *
+ * @param pkg The package to record.
+ * @return int 0 on success, -1 if the journal could not be written.
+ */
+int savePackageState(Package* pkg) {
+    uint32_t nchunks = pkg->obj->nchunks;
+    uint8_t* bitmap = calloc((nchunks + 7) / 8, 1);
+    if (!bitmap) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < nchunks; i++) {
+        if (hasChunk(pkg, i)) {
+            bitmap[i / 8] |= (uint8_t)(1u << (i % 8));
+        }
+    }
+    // Chunks completing on several workers save at once, one writer at a time
+    pthread_mutex_lock(&pkg->journal_lock);
+    int result = journal_save(pkg->filename, pkg->obj, bitmap);
+    pthread_mutex_unlock(&pkg->journal_lock);
+    free(bitmap);
+    return result;
+}
+
+/**
+ * Takes an additional reference to a package so it outlives removal
+ * from the registry. Must be called while the package is known to be live.
+ *
+ * @param pkg The package to retain.
+ */
+void retainPackage(Package* pkg) {
+    atomic_fetch_add(&pkg->refs, 1);
+}
 
-    // Read the second line and store the filename value in obj->filename
-    if (fgets(buffer, sizeof(buffer), file) == NULL) {
-        printf("Unable to read identifier from file %s.\n", filename);
-        fclose(file);
+/**
+ * Drops a reference to a package, freeing it with the last reference.
+ *
+ * @param pkg The package to release.
+ */
+void releasePackage(Package* pkg) {
+    if (atomic_fetch_sub(&pkg->refs, 1) != 1) {
         return;
+    }
+    bpkg_obj_destroy(pkg->obj);
+    pthread_mutex_destroy(&pkg->journal_lock);
+    free(pkg->chunk_map);
+    free(pkg);
+}
+
+/**
+ * Parses a manifest into a new, unregistered package holding one reference.
+ * @param directory The directory where the package files are located.
+ * @param filename The filename of the manifest.
+ * @return Package* The package, or NULL if the manifest cannot be loaded.
+ */
+static Package* loadPackage(const char* directory, const char* filename) {
+    char fullpath[PKG_PATH_LEN];
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, filename);
+
+    struct bpkg_obj* obj = bpkg_load(fullpath);
+    if (!obj) {
+        return NULL;
+    }
+
+    Package* pkg = calloc(1, sizeof(Package));
+    if (pkg) {
+        pkg->chunk_map = calloc((obj->nchunks + 63) / 64, sizeof(uint64_t));
+    }
+    if (!pkg || !pkg->chunk_map) {
+        free(pkg);
+        bpkg_obj_destroy(obj);
+        return NULL;
+    }
+    pkg->obj = obj;
+    pkg->serial = atomic_fetch_add(&next_serial, 1);
+    strcpy(pkg->identifier, obj->ident);
+    snprintf(pkg->filename, sizeof(pkg->filename), "%s/%s", directory, obj->filename);
+    atomic_init(&pkg->ncomplete, 0);
+    atomic_init(&pkg->state, PKG_VERIFYING);
+    atomic_init(&pkg->refs, 1);
+    pthread_mutex_init(&pkg->journal_lock, NULL);
+    return pkg;
+}
+
+/**
+ * Publishes a package in the registry, which takes over its reference.
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package to register.
+ * @return int 0 on success, 1 if the identifier is already managed,
+ *         -1 on allocation failure.
+ */
+static int registerPackage(PackageList *pkgList, Package* pkg) {
+    pthread_mutex_lock(&pkgList->write_lock);
+
+    // Reject a second copy of an identifier that is already managed
+    struct pkg_table* table = atomic_load(&pkgList->table);
+    size_t b = prefix_hash(pkg->identifier) & (table->nbuckets - 1);
+    for (struct pkg_node* n = atomic_load(&table->buckets[b]); n;
+        n = atomic_load(&n->next)) {
+        if (strcmp(n->pkg->identifier, pkg->identifier) == 0) {
+            pthread_mutex_unlock(&pkgList->write_lock);
+            return 1;
+        }
+    }
+
+    if (table_insert(table, pkg) != 0) {
+        pthread_mutex_unlock(&pkgList->write_lock);
+        return -1;
+    }
+
+    // Append to the insertion ordered list, publishing the link last
+    pkg->prev = pkgList->tail;
+    if (pkgList->tail) {
+        atomic_store_explicit(&pkgList->tail->next, pkg, memory_order_release);
     } else {
-        sscanf(buffer, "filename: %256s", nameoffile);
+        atomic_store_explicit(&pkgList->head, pkg, memory_order_release);
     }
+    pkgList->tail = pkg;
+    atomic_fetch_add(&pkgList->count, 1);
 
-    fclose(file);
+    table_grow(pkgList);
+    pthread_mutex_unlock(&pkgList->write_lock);
+    return 0;
+}
 
-    // Buffer to hold up to 32 characters + null terminator
-    char trimmedIdentifier[33];  
-    strncpy(trimmedIdentifier, identifier, 32);
-    // Ensure null termination
-    trimmedIdentifier[32] = '\0';  
+// Package handed to a background task, holding a reference taken for it
+struct package_job {
+    PackageList* pkgList;
+    Package* pkg;
+};
 
-    pkgList->packages = realloc(pkgList->packages, (pkgList->count + 1) * sizeof(Package));
-    if (!pkgList->packages) {
-        puts("Failed to allocate memory for packages");
+/**
+ * Exchanges chunks between a package and the chunk store once its
+ * completion state is known. Verified chunks are added to the store and
+ * missing chunks that another package already provided are filled from it.
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package.
+ * @return int Number of chunks filled from the store.
+ */
+static int syncStore(PackageList *pkgList, Package* pkg) {
+    struct bpkg_obj* obj = pkg->obj;
+    int fd = open(pkg->filename, O_RDONLY);
+    int wfd = -1;
+    int restored = 0;
+    for (uint32_t i = 0; i < obj->nchunks; i++) {
+        if (hasChunk(pkg, i)) {
+            storeChunk(pkgList, pkg, fd, i);
+            continue;
+        }
+        if (!store_has(pkgList->store, obj->chunks[i].hash)) {
+            continue;
+        }
+        // Only create the data file once there is something to put in it
+        if (wfd < 0 && (wfd = openPackageData(pkg)) < 0) {
+            break;
+        }
+        restored += restoreChunk(pkgList, pkg, wfd, i);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (wfd >= 0) {
+        close(wfd);
+    }
+    return restored;
+}
+
+/**
+ * Chunks of one package being verified by a parallel for.
+ */
+struct verify_range {
+    Package* pkg;
+    struct verify_cache* vc;
+    int fd;
+};
+
+/**
+ * Parallel for body checking a run of chunks against the manifest.
+ * @param arg The struct verify_range.
+ * @param first Index of the first chunk.
+ * @param last One past the index of the last chunk.
+ */
+static void verify_chunks(void* arg, uint64_t first, uint64_t last) {
+    struct verify_range* r = arg;
+    struct bpkg_obj* obj = r->pkg->obj;
+    for (uint32_t i = (uint32_t)first; i < last; i++) {
+        int hashed;
+        uint64_t start = tb_now_ns();
+        int ok = vcache_verify(r->vc, obj, r->fd, i, &hashed);
+        if (hashed) {
+            metrics_verify(ok, obj->chunks[i].size, tb_now_ns() - start);
+        } else {
+            metrics_add(ok ? MC_CHUNKS_VERIFIED : MC_CHUNKS_FAILED, 1);
+            metrics_add(MC_VERIFY_CACHED, 1);
+        }
+        if (ok) {
+            markChunk(r->pkg, i);
+        }
+    }
+}
+
+/**
+ * Background task checking every chunk of a package's data file against
+ * the manifest, then recording the result in the journal. The chunks are
+ * spread over the pool, which this task helps with while it waits.
+ * @param arg The struct package_job, freed when done.
+ */
+static void verify_task(void* arg) {
+    struct package_job* job = arg;
+    Package* pkg = job->pkg;
+    struct bpkg_obj* obj = pkg->obj;
+
+    // Digests from an earlier run are reused while the file is unchanged
+    struct verify_cache vc;
+    int fd = open(pkg->filename, O_RDONLY);
+    if (fd >= 0 && vcache_load(&vc, pkg->filename, fd, obj->nchunks) == 0) {
+        struct verify_range range = { pkg, &vc, fd };
+        pool_parallel_for(job->pkgList->pool, 0, obj->nchunks, VERIFY_GRAIN,
+            verify_chunks, &range);
+        vcache_save(&vc, pkg->filename);
+        vcache_free(&vc);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    int restored = job->pkgList->store ? syncStore(job->pkgList, pkg) : 0;
+    if (fd >= 0 || restored > 0) {
+        savePackageState(pkg);
+    }
+
+    readyPackage(job->pkgList, pkg);
+    releasePackage(pkg);
+    free(job);
+}
+
+/**
+ * Background task exchanging chunks with the store for a package whose
+ * state came from its journal.
+ * @param arg The struct package_job, freed when done.
+ */
+static void store_task(void* arg) {
+    struct package_job* job = arg;
+    if (syncStore(job->pkgList, job->pkg) > 0) {
+        savePackageState(job->pkg);
+    }
+    releasePackage(job->pkg);
+    free(job);
+}
+
+/**
+ * Runs a task for a package on the pool, or on the calling thread if
+ * there is no pool or the job cannot be queued.
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package, retained for the task.
+ * @param task verify_task or store_task.
+ */
+static void runPackageTask(PackageList *pkgList, Package* pkg, void (*task)(void*)) {
+    struct package_job* job = malloc(sizeof(struct package_job));
+    if (!job) {
+        perror("Failed to allocate package task");
+        exit(EXIT_FAILURE);
+    }
+    job->pkgList = pkgList;
+    job->pkg = pkg;
+    retainPackage(pkg);
+    if (!pkgList->pool || pool_submit(pkgList->pool, task, job) != 0) {
+        task(job);
+    }
+}
+
+/**
+ * Establishes the completion state of a freshly registered package from
+ * its journal, or schedules a background verification if there is none.
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The registered package.
+ */
+static void establishPackage(PackageList *pkgList, Package* pkg) {
+    uint32_t nchunks = pkg->obj->nchunks;
+    uint8_t* bitmap = calloc((nchunks + 7) / 8, 1);
+    if (bitmap && journal_load(pkg->filename, pkg->obj, bitmap) == 0) {
+        for (uint32_t i = 0; i < nchunks; i++) {
+            if (bitmap[i / 8] & (1u << (i % 8))) {
+                markChunk(pkg, i);
+            }
+        }
+        free(bitmap);
+        readyPackage(pkgList, pkg);
+        if (pkgList->store) {
+            runPackageTask(pkgList, pkg, store_task);
+        }
         return;
     }
+    free(bitmap);
+    runPackageTask(pkgList, pkg, verify_task);
+}
 
-    char fullname[1025];
-    strcpy(fullname, directory);
-    strcat(fullname, "/");
-    strcat(fullname, nameoffile);
+// Manifest to load on the pool, report is set for ADDPACKAGE, whose
+// outcome is printed, and clear for the startup scan. The directory is the
+// configured one, which outlives the pool. done, if set, is called last.
+struct scan_job {
+    PackageList* pkgList;
+    const char* directory;
+    char filename[MAX_FILENAME_LEN + 1];
+    int report;
+    void (*done)(void* arg);
+    void* done_arg;
+};
+
+/**
+ * Worker task loading one manifest found by scanPackages or given to
+ * addPackage.
+ * @param arg The scan_job describing the manifest, freed by the task.
+ */
+static void scan_task(void* arg) {
+    struct scan_job* job = arg;
+
+    // Ensure the manifest can be opened before parsing it
+    char fullpath[PKG_PATH_LEN];
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", job->directory, job->filename);
+    Package* pkg = NULL;
+    int result;
+    if (job->report && access(fullpath, R_OK) != 0) {
+        printf("Cannot open file %s.\n", fullpath);
+    } else if (!(pkg = loadPackage(job->directory, job->filename))) {
+        if (job->report) {
+            printf("Unable to load package %s.\n", job->filename);
+        } else {
+            fprintf(stderr, "Unable to load package %s.\n", job->filename);
+        }
+    } else if ((result = registerPackage(job->pkgList, pkg)) != 0) {
+        releasePackage(pkg);
+        if (job->report) {
+            puts(result > 0 ? "Package is already managed" : "Failed to allocate memory for packages");
+        }
+    } else {
+        establishPackage(job->pkgList, pkg);
+    }
+    if (job->done) {
+        job->done(job->done_arg);
+    }
+    free(job);
+}
 
-    strcpy(pkgList->packages[pkgList->count].identifier, trimmedIdentifier);
-    strcpy(pkgList->packages[pkgList->count].filename, fullname);
-    pkgList->count++;
+/**
+ * Queues a manifest for scan_task on the pool, or loads it on the calling
+ * thread if there is no pool or the job cannot be queued.
+ * @param pkgList Pointer to the list of packages.
+ * @param directory The directory where the package files are located,
+ *        valid until the pool is destroyed.
+ * @param filename The filename of the manifest.
+ * @param report 1 to print the outcome of the load.
+ * @param done Called once the manifest is handled, may be NULL.
+ * @param arg Argument passed to done.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int queueScan(PackageList *pkgList, const char *directory, const char *filename,
+    int report, void (*done)(void* arg), void* arg) {
+    struct scan_job* job = malloc(sizeof(struct scan_job));
+    if (!job) {
+        return -1;
+    }
+    job->pkgList = pkgList;
+    job->directory = directory;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    job->report = report;
+    job->done = done;
+    job->done_arg = arg;
+    if (!pkgList->pool || pool_submit(pkgList->pool, scan_task, job) != 0) {
+        scan_task(job);
+    }
+    return 0;
+}
+
+/**
+ * Queues every .bpkg manifest in a directory for loading on the worker
+ * pool. Packages with a valid journal are served as soon as they are
+ * registered, the others are verified in the background first.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param directory The directory to scan.
+ * @return int Number of manifests queued, or -1 if the directory cannot be read.
+ */
+int scanPackages(PackageList *pkgList, const char *directory) {
+    DIR* dir = opendir(directory);
+    if (!dir) {
+        return -1;
+    }
+
+    int queued = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= strlen(".bpkg") || len > MAX_FILENAME_LEN
+            || strcmp(entry->d_name + len - strlen(".bpkg"), ".bpkg") != 0) {
+            continue;
+        }
+
+        if (queueScan(pkgList, directory, entry->d_name, 0, NULL, NULL) != 0) {
+            break;
+        }
+        queued++;
+    }
+    closedir(dir);
+    return queued;
+}
+
+/**
+ * Adds a package to the package list by reading package details from a file.
+ * The manifest is parsed on the worker pool, which prints any failure once
+ * it is known, so the caller never waits for the file.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param directory The directory where the package files are located.
+ * @param filename The filename of the package to be added.
+ * @param done Called once the outcome is printed and the package is
+ *        registered, on the thread that loaded it, may be NULL.
+ * @param arg Argument passed to done.
+ * @return int 1 if the load was queued and done will be called, 0 if the
+ *         outcome was printed at once.
+ */
+int addPackage(PackageList *pkgList, char *directory, char* filename,
+    void (*done)(void* arg), void* arg) {
+    // Ensure a filename was given
+    if (filename == NULL) {
+        puts("Missing file argument.");
+        return 0;
+    }
+    if (strlen(filename) > MAX_FILENAME_LEN) {
+        printf("Unable to load package %s.\n", filename);
+        return 0;
+    }
+    if (queueScan(pkgList, directory, filename, 1, done, arg) != 0) {
+        puts("Failed to allocate memory for packages");
+        return 0;
+    }
+    return 1;
 }
 
 /**
@@ -88,44 +807,57 @@ void addPackage(PackageList *pkgList, char *directory, char* filename) {
  * @param ident The identifier of the package to remove.
  */
 void removePackage(PackageList *pkgList, char* ident) {
-    if (!ident) {
+    if (!ident || strlen(ident) < PKG_PREFIX_LEN) {
         puts("Missing identifier argument, please specify whole 1024 character or at least 20 characters.");
         return;
     }
 
-    // Loop through all packages in the list to find the matching identifier
-    for (int i = 0; i < pkgList->count; i++) {
-        if (strncmp(pkgList->packages[i].identifier, ident, 20) == 0) {
-            // printf("Removing package with identifier: %.*s\n", 20, pkgList->packages[i].identifier);
+    pthread_mutex_lock(&pkgList->write_lock);
 
-            // Reduce the package count first
-            pkgList->count--;
-
-            // If not the last item, shift the rest of the elements left
-            if (i < pkgList->count) {
-                memmove(&pkgList->packages[i], &pkgList->packages[i + 1], (pkgList->count - i) * sizeof(Package));
-            }
+    int nmatches = 0;
+    Package* pkg = findPackage(pkgList, ident, &nmatches);
+    if (!pkg) {
+        pthread_mutex_unlock(&pkgList->write_lock);
+        if (nmatches > 1) {
+            puts("Identifier provided matches multiple packages, please specify more characters");
+        } else {
+            puts("Identifier provided does not match managed packages");
+        }
+        return;
+    }
 
-            // Attempt to reduce the array size by reallocating
-            if (pkgList->count > 0) {
-                Package* temp = realloc(pkgList->packages, pkgList->count * sizeof(Package));
-                if (temp) {
-                    pkgList->packages = temp; 
-                } else {
-                    puts("Memory reallocation failed, potential memory waste.");
-                }
-            } else {
-                // If no packages are left, free the array
-                free(pkgList->packages);
-                pkgList->packages = NULL;
-            }
+    // Unlink the chain node, readers already on it can still move past it
+    struct pkg_table* table = atomic_load(&pkgList->table);
+    size_t b = prefix_hash(pkg->identifier) & (table->nbuckets - 1);
+    _Atomic(struct pkg_node*)* link = &table->buckets[b];
+    struct pkg_node* node = atomic_load(link);
+    while (node->pkg != pkg) {
+        link = &node->next;
+        node = atomic_load(link);
+    }
+    atomic_store_explicit(link, atomic_load(&node->next), memory_order_release);
 
-            puts("Package has been removed");
-            return;
-        }
+    // Unlink from the insertion ordered list
+    Package* next = atomic_load(&pkg->next);
+    if (pkg->prev) {
+        atomic_store_explicit(&pkg->prev->next, next, memory_order_release);
+    } else {
+        atomic_store_explicit(&pkgList->head, next, memory_order_release);
+    }
+    if (next) {
+        next->prev = pkg->prev;
+    } else {
+        pkgList->tail = pkg->prev;
     }
+    atomic_fetch_sub(&pkgList->count, 1);
 
-    printf("Identifier provided does not match managed packages");
+    // Wait for readers that may still reference the package
+    rcu_synchronize();
+    pthread_mutex_unlock(&pkgList->write_lock);
+
+    free(node);
+    releasePackage(pkg);
+    puts("Package has been removed");
 }
 
 /**
@@ -134,23 +866,51 @@ void removePackage(PackageList *pkgList, char* ident) {
  * @param pkgList Pointer to the list of packages.
  */
 void listPackages(PackageList *pkgList) {
-    if (pkgList->count == 0) {
+    rcu_read_lock();
+    Package* pkg = atomic_load_explicit(&pkgList->head, memory_order_acquire);
+    if (!pkg) {
+        rcu_read_unlock();
         puts("No packages managed");
         return;
     }
 
-    for (int i = 0; i < pkgList->count; i++) {
-        printf("%d. %s, %s : %s\n", i + 1, pkgList->packages[i].identifier, pkgList->packages[i].filename, "INCOMPLETE");  
+    for (int i = 1; pkg; i++) {
+        // Cached count, so listing never touches the data files
+        uint32_t nchunks = pkg->obj->nchunks;
+        uint32_t done = atomic_load_explicit(&pkg->ncomplete, memory_order_relaxed);
+        double percent = nchunks ? 100.0 * done / nchunks : 100.0;
+        printf("%d. %.*s, %s : %s %.1f%%\n", i, PKG_DISPLAY_LEN, pkg->identifier,
+            pkg->filename, done == nchunks ? "COMPLETE" : "INCOMPLETE", percent);
+        pkg = atomic_load_explicit(&pkg->next, memory_order_acquire);
     }
+    rcu_read_unlock();
 }
 
 /**
- * Cleans up the memory used by the package list.
+ * Cleans up the memory used by the package list. The list must be
+ * initialised again before it is reused. Lookups made afterwards find
+ * nothing, but no reader may still be inside findPackage or hold a
+ * package from it when the list is cleaned up.
  *
  * @param pkgList Pointer to the list of packages.
  */
 void cleanupPackages(PackageList *pkgList) {
-    free(pkgList->packages);
-    pkgList->packages = NULL;
-    pkgList->count = 0;
+    pthread_mutex_lock(&pkgList->write_lock);
+    struct pkg_table* table = atomic_load(&pkgList->table);
+    Package* pkg = atomic_load(&pkgList->head);
+
+    atomic_store(&pkgList->head, NULL);
+    atomic_store(&pkgList->table, NULL);
+    pkgList->tail = NULL;
+    atomic_store(&pkgList->count, 0);
+    rcu_synchronize();
+    pthread_mutex_unlock(&pkgList->write_lock);
+    pthread_mutex_destroy(&pkgList->write_lock);
+
+    table_free(table);
+    while (pkg) {
+        Package* next = atomic_load(&pkg->next);
+        releasePackage(pkg);
+        pkg = next;
+    }
 }
@@ -7,24 +7,147 @@
 #ifndef PACKAGE_H
 #define PACKAGE_H
 
-typedef struct {
-    char identifier[33];  
-    char filename[256];   
+#include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "chk/pkgchk.h"
+#include "sched/pool.h"
+#include "chunkstore.h"
+
+// Number of identifier characters that must be given to select a package
+#define PKG_PREFIX_LEN 20
+// Number of identifier characters shown when listing packages
+#define PKG_DISPLAY_LEN 32
+#define PKG_PATH_LEN 1025
+
+enum pkg_state {
+    // Manifest loaded, data file still being verified in the background
+    PKG_VERIFYING,
+    // Completion state established, chunks may be served
+    PKG_READY,
+};
+
+typedef struct Package {
+    char identifier[MAX_IDENT_LEN + 1];
+    char filename[PKG_PATH_LEN];
+    struct bpkg_obj* obj;
+    // Unique for the lifetime of the process, names the package in caches
+    uint64_t serial;
+    // One bit per chunk, set once the chunk has been verified on disk
+    _Atomic uint64_t* chunk_map;
+    // Number of bits set in chunk_map, kept in step with every update
+    atomic_uint ncomplete;
+    atomic_int state;
+    // References held by the registry and by background tasks
+    atomic_int refs;
+    // Serialises writes of the journal
+    pthread_mutex_t journal_lock;
+    // Next package in insertion order, read without locks
+    _Atomic(struct Package*) next;
+    // Previous package in insertion order, only used by writers
+    struct Package* prev;
 } Package;
 
+/**
+ * Hash chain node, one per registered package. Chains are keyed by the
+ * first PKG_PREFIX_LEN characters of the identifier so that every valid
+ * prefix lookup lands in the same bucket.
+ */
+struct pkg_node {
+    _Atomic(struct pkg_node*) next;
+    Package* pkg;
+};
+
+struct pkg_table {
+    size_t nbuckets;
+    _Atomic(struct pkg_node*) buckets[];
+};
+
+/**
+ * Registry of managed packages.
+ * Lookups and listing run inside an rcu read-side critical section and
+ * never take a lock, adding and removing packages is serialized by
+ * write_lock and frees memory only after a grace period.
+ */
 typedef struct {
-    Package* packages;  // Dynamic array of packages
-    int count;          // Number of packages
+    _Atomic(struct pkg_table*) table;
+    // Insertion ordered list of packages
+    _Atomic(Package*) head;
+    Package* tail;
+    atomic_int count;
+    pthread_mutex_t write_lock;
+    // Workers used for loading and verification, may be NULL
+    struct pool* pool;
+    // Chunks shared between packages, NULL when the store is disabled
+    struct chunk_store* store;
+    // Called by the thread that makes a package ready, may be NULL
+    void (*on_ready)(void* arg, Package* pkg);
+    void* on_ready_arg;
+    // Called by the thread that finds a verified chunk bad, may be NULL
+    void (*on_demoted)(void* arg, Package* pkg, uint32_t index);
+    void* on_demoted_arg;
 } PackageList;
 
+/**
+ * Initialises an empty package list.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pool Workers used to load and verify packages, or NULL to do the
+ *             work on the calling thread.
+ * @param store Chunk store shared by the packages, or NULL to disable it.
+ */
+void initPackages(PackageList *pkgList, struct pool* pool, struct chunk_store* store);
+
+/**
+ * Registers a function called whenever a package becomes ready, on the
+ * thread that established its completion state. Must be called before
+ * packages are scanned or added.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param fn The function, NULL to stop notifications.
+ * @param arg Argument passed to fn.
+ */
+void watchPackages(PackageList *pkgList, void (*fn)(void* arg, Package* pkg), void* arg);
+
+/**
+ * Registers a function called whenever a verified chunk is found bad and
+ * demoted with demoteChunk, so copies of its data kept elsewhere can be
+ * dropped. Must be called before packages are scanned or added.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param fn The function, NULL to stop notifications.
+ * @param arg Argument passed to fn.
+ */
+void watchDemotions(PackageList *pkgList,
+    void (*fn)(void* arg, Package* pkg, uint32_t index), void* arg);
+
+/**
+ * Queues every .bpkg manifest in a directory for loading on the worker
+ * pool. Packages with a valid journal are served as soon as they are
+ * registered, the others are verified in the background first.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param directory The directory to scan.
+ * @return int Number of manifests queued, or -1 if the directory cannot be read.
+ */
+int scanPackages(PackageList *pkgList, const char *directory);
+
 /**
  * Adds a package to the package list by reading package details from a file.
+ * The manifest is parsed on the worker pool, which prints any failure once
+ * it is known, so the caller never waits for the file.
  *
  * @param pkgList Pointer to the list of packages.
  * @param directory The directory where the package files are located.
  * @param filename The filename of the package to be added.
+ * @param done Called once the outcome is printed and the package is
+ *        registered, on the thread that loaded it, may be NULL.
+ * @param arg Argument passed to done.
+ * @return int 1 if the load was queued and done will be called, 0 if the
+ *         outcome was printed at once.
  */
-void addPackage(PackageList *pkgList, char *directory, char* filename);
+int addPackage(PackageList *pkgList, char *directory, char* filename,
+    void (*done)(void* arg), void* arg);
 
 /**
  * Removes a package from the list based on its identifier.
@@ -34,6 +157,112 @@ void addPackage(PackageList *pkgList, char *directory, char* filename);
  */
 void removePackage(PackageList *pkgList, char* ident);
 
+/**
+ * Looks up a package by its identifier or an identifier prefix of at least
+ * PKG_PREFIX_LEN characters. Must be called between rcu_read_lock and
+ * rcu_read_unlock, the returned package stays valid until the unlock.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param ident The identifier or identifier prefix to search for.
+ * @param nmatches Set to the number of packages sharing the prefix, may be NULL.
+ * @return Package* The package if exactly one matches, otherwise NULL.
+ */
+Package* findPackage(PackageList *pkgList, const char* ident, int* nmatches);
+
+/**
+ * Records a chunk as present and verified on disk.
+ *
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk was not marked before, 0 otherwise.
+ */
+int markChunk(Package* pkg, uint32_t index);
+
+/**
+ * Records a chunk as missing, for example after it failed verification.
+ *
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk was marked before, 0 otherwise.
+ */
+int clearChunk(Package* pkg, uint32_t index);
+
+/**
+ * Records a verified chunk as missing after its data was found bad, and
+ * tells the function registered with watchDemotions.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk was marked before, 0 otherwise.
+ */
+int demoteChunk(PackageList *pkgList, Package* pkg, uint32_t index);
+
+/**
+ * Checks whether a chunk is present and verified on disk.
+ *
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk is marked, 0 otherwise.
+ */
+int hasChunk(Package* pkg, uint32_t index);
+
+/**
+ * Opens the data file of a package for writing, creating it at its full
+ * size so chunks can land anywhere.
+ *
+ * @param pkg The package.
+ * @return int The descriptor, or -1 if the file cannot be opened or sized.
+ */
+int openPackageData(Package* pkg);
+
+/**
+ * Adds a verified chunk of a package to the chunk store, if there is one.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package owning the chunk.
+ * @param fd Data file of the package, opened for reading.
+ * @param index Index of the chunk.
+ */
+void storeChunk(PackageList *pkgList, Package* pkg, int fd, uint32_t index);
+
+/**
+ * Fills a missing chunk of a package from the chunk store without going to
+ * the network. The copy is verified against the manifest before it is
+ * marked, a store entry that cannot provide it intact is dropped so the
+ * chunk is fetched from a peer next time.
+ *
+ * @param pkgList Pointer to the list of packages.
+ * @param pkg The package owning the chunk.
+ * @param fd Data file of the package, opened for reading and writing.
+ * @param index Index of the chunk.
+ * @return int 1 if the chunk is now present and verified, 0 otherwise.
+ */
+int restoreChunk(PackageList *pkgList, Package* pkg, int fd, uint32_t index);
+
+/**
+ * Persists the completion bitmap of a package in its journal.
+ *
+ * @param pkg The package to record.
+ * @return int 0 on success, -1 if the journal could not be written.
+ */
+int savePackageState(Package* pkg);
+
+/**
+ * Takes an additional reference to a package so it outlives removal
+ * from the registry. Must be called while the package is known to be live.
+ *
+ * @param pkg The package to retain.
+ */
+void retainPackage(Package* pkg);
+
+/**
+ * Drops a reference to a package, freeing it with the last reference.
+ *
+ * @param pkg The package to release.
+ */
+void releasePackage(Package* pkg);
+
 /**
  * Lists all packages managed in the package list.
  *
@@ -42,10 +271,13 @@ void removePackage(PackageList *pkgList, char* ident);
 void listPackages(PackageList *pkgList);
 
 /**
- * Cleans up the memory used by the package list.
+ * Cleans up the memory used by the package list. The list must be
+ * initialised again before it is reused. Lookups made afterwards find
+ * nothing, but no reader may still be inside findPackage or hold a
+ * package from it when the list is cleaned up.
  *
  * @param pkgList Pointer to the list of packages.
  */
 void cleanupPackages(PackageList *pkgList);
 
-#endif // PACKAGE_H
\ No newline at end of file
+#endif // PACKAGE_H
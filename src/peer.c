@@ -0,0 +1,2404 @@
+/*
+ ============================================================================
+ Name        : peer.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "peer.h"
+#include "rcu.h"
+#include "metrics.h"
+#include "sched/pool.h"
+#include "tree/merkletree.h"
+
+// Bytes of chunks requested from a peer at once by package downloads
+#define DOWNLOAD_PIPELINE (4u << 20)
+// Chunks still in flight below which a package download enters endgame
+#define ENDGAME_CHUNKS 16
+// Peers a chunk is requested from at once during endgame
+#define ENDGAME_COPIES 3
+// Disk reads in flight for the REQs of one peer before it is no longer read
+#define PEER_READS_MAX 32
+
+/**
+ * Switches a descriptor to non-blocking mode.
+ * @param fd The descriptor.
+ * @return int 0 on success, -1 on failure.
+ */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Allocates a peer for a connected or connecting socket.
+ * @param node The node the peer belongs to.
+ * @param fd The socket.
+ * @param ip Address of the remote node.
+ * @param port Port of the remote node.
+ * @param outbound 1 if the connection was initiated locally.
+ * @return struct peer* The peer, NULL on allocation failure.
+ */
+static struct peer* peer_add(struct btide_node* node, int fd, const char* ip,
+    uint16_t port, int outbound) {
+    struct peer* peer = calloc(1, sizeof(struct peer));
+    if (!peer) {
+        return NULL;
+    }
+    peer->fd = fd;
+    snprintf(peer->ip, sizeof(peer->ip), "%s", ip);
+    peer->port = port;
+    peer->outbound = outbound;
+    peer->state = outbound ? PEER_CONNECTING : PEER_HANDSHAKE;
+    peer->id = ++node->peer_ids;
+    tb_init(&peer->up, (uint64_t)node->config->peer_upload_rate * 1024);
+    tb_init(&peer->down, (uint64_t)node->config->peer_download_rate * 1024);
+    peer->next = node->peers;
+    node->peers = peer;
+    node->npeers++;
+    return peer;
+}
+
+/**
+ * Finds a peer by address.
+ * @param node The node.
+ * @param ip Address of the remote node.
+ * @param port Port of the remote node.
+ * @return struct peer* The peer, NULL if not connected.
+ */
+static struct peer* peer_find(struct btide_node* node, const char* ip, uint16_t port) {
+    for (struct peer* p = node->peers; p; p = p->next) {
+        if (!p->closing && p->port == port && strcmp(p->ip, ip) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Frees a download that is no longer listed, releasing its package
+ * reference.
+ * @param f The download.
+ */
+static void fetch_free(struct fetch* f) {
+    free(f->data);
+    releasePackage(f->pkg);
+    free(f);
+}
+
+/**
+ * Removes a download from the node's list without freeing it.
+ * @param node The node.
+ * @param f The download to unlink.
+ */
+static void fetch_unlink(struct btide_node* node, struct fetch* f) {
+    struct fetch** link = &node->fetches;
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link = f->next;
+    f->peer->inflight -= f->pkg->obj->chunks[f->index].size;
+}
+
+/**
+ * Finds the download of a whole package.
+ * @param node The node.
+ * @param pkg The package.
+ * @return struct download* The download, NULL if the package is not being
+ *         fetched as a whole.
+ */
+static struct download* download_find(struct btide_node* node, Package* pkg) {
+    for (struct download* d = node->downloads; d; d = d->next) {
+        if (d->pkg == pkg) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds a download of a chunk.
+ * @param node The node.
+ * @param pkg The package.
+ * @param index Index of the chunk.
+ * @param peer The peer the chunk is requested from, NULL for any peer.
+ * @return struct fetch* The download, NULL if the chunk is not requested.
+ */
+static struct fetch* fetch_find(struct btide_node* node, Package* pkg, uint32_t index,
+    struct peer* peer) {
+    for (struct fetch* f = node->fetches; f; f = f->next) {
+        if (f->pkg == pkg && f->index == index && (!peer || f->peer == peer)) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Abandons a download, releasing its package reference. A chunk of a
+ * whole package download is requested again later, unless an endgame
+ * duplicate of it is still in flight.
+ * @param node The node.
+ * @param f The download to remove.
+ */
+static void fetch_remove(struct btide_node* node, struct fetch* f) {
+    fetch_unlink(node, f);
+    struct download* d = download_find(node, f->pkg);
+    if (d && !fetch_find(node, f->pkg, f->index, NULL)) {
+        picker_abort(&d->picker, f->index);
+        node->reschedule = 1;
+    }
+    fetch_free(f);
+}
+
+/**
+ * Finds the availability of a package at a peer.
+ * @param peer The peer.
+ * @param pkg The package.
+ * @return struct peer_have* The availability, NULL if none was exchanged.
+ */
+static struct peer_have* have_find(struct peer* peer, Package* pkg) {
+    for (struct peer_have* h = peer->haves; h; h = h->next) {
+        if (h->pkg == pkg) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds or creates the availability of a package at a peer, a new one
+ * holds no chunks.
+ * @param peer The peer.
+ * @param pkg The package, retained by a new availability.
+ * @return struct peer_have* The availability, NULL on allocation failure.
+ */
+static struct peer_have* have_get(struct peer* peer, Package* pkg) {
+    struct peer_have* h = have_find(peer, pkg);
+    if (h) {
+        return h;
+    }
+    h = calloc(1, sizeof(struct peer_have));
+    if (!h || !(h->bits = calloc((pkg->obj->nchunks + 63) / 64 + 1, sizeof(uint64_t)))) {
+        free(h);
+        return NULL;
+    }
+    retainPackage(pkg);
+    h->pkg = pkg;
+    h->next = peer->haves;
+    peer->haves = h;
+    return h;
+}
+
+/**
+ * Records a chunk as held by a peer and counts it for the download of its
+ * package.
+ * @param node The node.
+ * @param h Availability of the package at the peer.
+ * @param index Index of the chunk.
+ */
+static void have_set(struct btide_node* node, struct peer_have* h, uint32_t index) {
+    uint64_t bit = 1ULL << (index % 64);
+    if (h->bits[index / 64] & bit) {
+        return;
+    }
+    h->bits[index / 64] |= bit;
+    h->nbits++;
+    struct download* d = download_find(node, h->pkg);
+    if (d) {
+        picker_add(&d->picker, index);
+        node->reschedule = 1;
+    }
+}
+
+/**
+ * Records a chunk as no longer held by a peer.
+ * @param node The node.
+ * @param h Availability of the package at the peer.
+ * @param index Index of the chunk.
+ */
+static void have_clear(struct btide_node* node, struct peer_have* h, uint32_t index) {
+    uint64_t bit = 1ULL << (index % 64);
+    if (!(h->bits[index / 64] & bit)) {
+        return;
+    }
+    h->bits[index / 64] &= ~bit;
+    h->nbits--;
+    struct download* d = download_find(node, h->pkg);
+    if (d) {
+        picker_remove(&d->picker, index);
+    }
+}
+
+/**
+ * Frees an availability, uncounting its chunks from the download of its
+ * package.
+ * @param node The node.
+ * @param h The availability, already unlinked from its peer.
+ */
+static void have_free(struct btide_node* node, struct peer_have* h) {
+    struct download* d = download_find(node, h->pkg);
+    for (uint32_t i = 0; d && h->nbits && i < h->pkg->obj->nchunks; i++) {
+        if (h->bits[i / 64] >> (i % 64) & 1) {
+            picker_remove(&d->picker, i);
+        }
+    }
+    releasePackage(h->pkg);
+    free(h->bits);
+    free(h);
+}
+
+/**
+ * Marks a peer for removal. The socket is closed and the peer freed once
+ * the current poll round has been processed.
+ * @param node The node.
+ * @param peer The peer to close.
+ */
+static void peer_close(struct btide_node* node, struct peer* peer) {
+    if (peer->closing) {
+        return;
+    }
+    peer->closing = 1;
+
+    // Downloads from this peer can no longer complete
+    struct fetch* f = node->fetches;
+    while (f) {
+        struct fetch* next = f->next;
+        if (f->peer == peer) {
+            fetch_remove(node, f);
+        }
+        f = next;
+    }
+    // Its chunks no longer count towards availability
+    while (peer->haves) {
+        struct peer_have* h = peer->haves;
+        peer->haves = h->next;
+        have_free(node, h);
+    }
+}
+
+/**
+ * Frees every peer marked for removal.
+ * @param node The node.
+ */
+static void peer_sweep(struct btide_node* node) {
+    struct peer** link = &node->peers;
+    while (*link) {
+        struct peer* peer = *link;
+        if (!peer->closing) {
+            link = &peer->next;
+            continue;
+        }
+        *link = peer->next;
+        node->npeers--;
+        close(peer->fd);
+        while (peer->sq_head) {
+            struct pkt_buf* b = peer->sq_head;
+            peer->sq_head = b->next;
+            chunk_buf_release(b->ref);
+            free(b);
+        }
+        free(peer);
+    }
+}
+
+/**
+ * Writes part of a queued packet. A packet referencing chunk data is
+ * gathered from its header, the referenced bytes and the rest of the
+ * encoded packet.
+ * @param fd The socket.
+ * @param b The packet.
+ * @param off Bytes of the packet already sent.
+ * @return ssize_t Bytes written, or -1 with errno set.
+ */
+static ssize_t pkt_buf_send(int fd, const struct pkt_buf* b, size_t off) {
+    if (!b->ref) {
+        return send(fd, b->data + off, PACKET_SIZE - off, MSG_NOSIGNAL);
+    }
+    const uint8_t* base[3] = { b->data, b->ref->data + b->ref_off,
+        b->data + PKT_RES_DATA_POS + b->ref_len };
+    size_t len[3] = { PKT_RES_DATA_POS, b->ref_len,
+        PACKET_SIZE - PKT_RES_DATA_POS - b->ref_len };
+    struct iovec iov[3];
+    int n = 0;
+    for (int i = 0; i < 3; i++) {
+        if (off >= len[i]) {
+            off -= len[i];
+            continue;
+        }
+        iov[n].iov_base = (void*)(base[i] + off);
+        iov[n].iov_len = len[i] - off;
+        off = 0;
+        n++;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * Writes the packet at the head of a peer's send queue, charging the
+ * bytes written to the peer's and the node's upload buckets.
+ * @param node The node.
+ * @param peer The peer to send to.
+ * @return int 1 if a whole packet has been sent, 0 otherwise.
+ */
+static int peer_send_one(struct btide_node* node, struct peer* peer) {
+    struct pkt_buf* b = peer->sq_head;
+    while (peer->sq_off < PACKET_SIZE) {
+        ssize_t n = pkt_buf_send(peer->fd, b, peer->sq_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                peer->blocked = 1;
+            } else {
+                peer_close(node, peer);
+            }
+            return 0;
+        }
+        peer->sq_off += n;
+        peer->bytes_out += n;
+        metrics_add(MC_BYTES_OUT, n);
+        tb_consume(&peer->up, n);
+        tb_consume(node->up, n);
+    }
+
+    peer->sq_head = b->next;
+    if (!peer->sq_head) {
+        peer->sq_tail = NULL;
+    }
+    peer->sq_off = 0;
+    peer->sq_len--;
+    chunk_buf_release(b->ref);
+    free(b);
+    return 1;
+}
+
+/**
+ * Shares upload capacity between peers with queued packets. Peers take
+ * turns sending one packet each, starting from a rotating position, until
+ * every queue is empty, blocked or out of tokens. Throttled peers are
+ * picked up again by the event loop once their buckets refill.
+ * @param node The node.
+ */
+static void node_pump(struct btide_node* node) {
+    if ((size_t)node->npeers > node->sendable_cap) {
+        size_t cap = (size_t)node->npeers * 2;
+        struct peer** list = realloc(node->sendable, cap * sizeof(struct peer*));
+        if (!list) {
+            return;
+        }
+        node->sendable = list;
+        node->sendable_cap = cap;
+    }
+
+    size_t n = 0;
+    for (struct peer* p = node->peers; p; p = p->next) {
+        if (p->sq_head && !p->blocked && !p->closing && p->state != PEER_CONNECTING) {
+            node->sendable[n++] = p;
+        }
+    }
+
+    uint64_t now = tb_now_ns();
+    size_t start = n ? node->rr++ % n : 0;
+    int progress = 1;
+    while (progress && tb_ready(node->up, now)) {
+        progress = 0;
+        for (size_t i = 0; i < n; i++) {
+            struct peer* p = node->sendable[(start + i) % n];
+            if (!p->sq_head || p->blocked || p->closing || !tb_ready(&p->up, now)) {
+                continue;
+            }
+            if (!tb_ready(node->up, now)) {
+                break;
+            }
+            progress |= peer_send_one(node, p);
+        }
+    }
+}
+
+/**
+ * Queues a packet for a peer, it is sent by node_pump. A RES may take its
+ * data from a chunk buffer, which stays referenced until it has been sent.
+ * @param node The node.
+ * @param peer The destination.
+ * @param pkt The packet to send.
+ * @param ref Chunk data of a RES, NULL if the data is in pkt.
+ * @param ref_off Position of the RES data in ref.
+ * @return struct pkt_buf* The queued packet, NULL if the peer was closed
+ *         for lack of memory.
+ */
+static struct pkt_buf* peer_send_data(struct btide_node* node, struct peer* peer,
+    const struct btide_packet* pkt, struct chunk_buf* ref, uint32_t ref_off) {
+    struct pkt_buf* b = malloc(sizeof(struct pkt_buf));
+    if (!b) {
+        peer_close(node, peer);
+        return NULL;
+    }
+    pkt_encode(pkt, b->data);
+    metrics_packet(1, pkt->msg_code);
+    b->ref = ref;
+    b->ref_off = ref_off;
+    b->ref_len = ref ? pkt->pl.res.data_len : 0;
+    if (ref) {
+        chunk_buf_retain(ref);
+    }
+    b->serial = 0;
+    b->next = NULL;
+    if (peer->sq_tail) {
+        peer->sq_tail->next = b;
+    } else {
+        peer->sq_head = b;
+    }
+    peer->sq_tail = b;
+    peer->sq_len++;
+    return b;
+}
+
+/**
+ * Records which chunk a queued RES carries, so a CCL can find it.
+ * @param b The queued packet, NULL if it could not be queued.
+ * @param serial Serial of the package.
+ * @param index Index of the chunk.
+ * @param offset File offset of the data in the packet.
+ */
+static void pkt_buf_tag(struct pkt_buf* b, uint64_t serial, uint32_t index, uint32_t offset) {
+    if (b) {
+        b->serial = serial;
+        b->chunk = index;
+        b->offset = offset;
+    }
+}
+
+/**
+ * Queues a packet for a peer, it is sent by node_pump.
+ * @param node The node.
+ * @param peer The destination.
+ * @param pkt The packet to send.
+ */
+static void peer_send(struct btide_node* node, struct peer* peer,
+    const struct btide_packet* pkt) {
+    peer_send_data(node, peer, pkt, NULL, 0);
+}
+
+/**
+ * Sends a packet that carries no payload.
+ * @param node The node.
+ * @param peer The destination.
+ * @param msg_code The message type.
+ */
+static void peer_send_code(struct btide_node* node, struct peer* peer, uint16_t msg_code) {
+    struct btide_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.msg_code = msg_code;
+    peer_send(node, peer, &pkt);
+}
+
+/**
+ * Sends the chunks of a package held locally, as a single packet if the
+ * package is complete or split over as many packets as needed otherwise.
+ * @param node The node.
+ * @param peer The destination.
+ * @param pkg The package, ready.
+ * @param flags PKT_BMP_REPLY to ask for the peer's bitmap in return.
+ */
+static void peer_send_bitmap(struct btide_node* node, struct peer* peer,
+    Package* pkg, uint8_t flags) {
+    struct peer_have* h = have_get(peer, pkg);
+    if (!h) {
+        return;
+    }
+    h->sent = 1;
+
+    uint32_t nchunks = pkg->obj->nchunks;
+    int complete = atomic_load_explicit(&pkg->ncomplete, memory_order_relaxed) == nchunks;
+    struct btide_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.msg_code = PKT_MSG_BMP;
+    pkt.pl.bmp.nchunks = nchunks;
+    pkt.pl.bmp.flags = flags | (complete ? PKT_BMP_COMPLETE : 0);
+    memcpy(pkt.pl.bmp.identifier, pkg->identifier, PKT_IDENT_LEN);
+    if (complete) {
+        peer_send(node, peer, &pkt);
+        return;
+    }
+    uint32_t first = 0;
+    do {
+        uint32_t n = nchunks - first;
+        if (n > PKT_BMP_MAX * 8) {
+            n = PKT_BMP_MAX * 8;
+        }
+        memset(pkt.pl.bmp.bits, 0, sizeof(pkt.pl.bmp.bits));
+        for (uint32_t i = 0; i < n; i++) {
+            if (hasChunk(pkg, first + i)) {
+                pkt.pl.bmp.bits[i / 8] |= (uint8_t)(1u << (i % 8));
+            }
+        }
+        pkt.pl.bmp.first = first;
+        pkt.pl.bmp.len = (uint16_t)((n + 7) / 8);
+        peer_send(node, peer, &pkt);
+        // Only the first packet asks for a reply
+        pkt.pl.bmp.flags &= ~PKT_BMP_REPLY;
+        first += n;
+    } while (first < nchunks);
+}
+
+/**
+ * Sends the bitmap of every ready package to a peer that just completed
+ * its handshake.
+ * @param node The node.
+ * @param peer The peer.
+ */
+static void peer_greet(struct btide_node* node, struct peer* peer) {
+    rcu_read_lock();
+    Package* pkg = atomic_load_explicit(&node->packages->head, memory_order_acquire);
+    for (; pkg; pkg = atomic_load_explicit(&pkg->next, memory_order_acquire)) {
+        if (atomic_load_explicit(&pkg->state, memory_order_acquire) == PKG_READY) {
+            peer_send_bitmap(node, peer, pkg, 0);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Finds the chunk starting at or containing an offset, chunks are stored
+ * in file order.
+ * @param obj The package manifest.
+ * @param offset Offset within the data file.
+ * @return int64_t Index of the chunk, -1 if the offset is out of range.
+ */
+static int64_t chunk_at(struct bpkg_obj* obj, uint32_t offset) {
+    int64_t lo = 0;
+    int64_t hi = (int64_t)obj->nchunks - 1;
+    while (lo <= hi) {
+        int64_t mid = (lo + hi) / 2;
+        struct chunk* c = &obj->chunks[mid];
+        if (offset < c->offset) {
+            hi = mid - 1;
+        } else if (offset >= c->offset + c->size) {
+            lo = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Reads a whole chunk into a new buffer.
+ * @param fd The data file.
+ * @param offset Offset of the chunk.
+ * @param size Size of the chunk.
+ * @return struct chunk_buf* The chunk, or NULL if it cannot be read.
+ */
+static struct chunk_buf* read_chunk(int fd, uint32_t offset, uint32_t size) {
+    struct chunk_buf* buf = chunk_buf_alloc(size);
+    uint32_t done = 0;
+    while (buf && done < size) {
+        ssize_t got = pread(fd, buf->data + done, size - done, (off_t)offset + done);
+        if (got <= 0) {
+            chunk_buf_release(buf);
+            return NULL;
+        }
+        done += got;
+    }
+    return buf;
+}
+
+/**
+ * Chunk data read for a REQ on the pool, handed back to the network thread
+ * of the shard owning the requesting peer by a SERVED command.
+ * - cmd: the SERVED command, allocated up front so the answer always
+ *   arrives and the peer's count of reads in flight is settled.
+ * - peer_id: the requesting peer, which may be gone by then.
+ * - pkg, index: the chunk, the package is retained by the job.
+ * - buf, base: the data read and the data file offset of its first byte,
+ *   buf is NULL if the read failed.
+ */
+struct serve_job {
+    struct command* cmd;
+    struct cmd_queue* commands;
+    struct chunk_cache* cache;
+    uint64_t peer_id;
+    struct btide_req req;
+    Package* pkg;
+    uint32_t index;
+    struct chunk_buf* buf;
+    uint32_t base;
+};
+
+/**
+ * Answers a REQ with the requested range split over RES packets, every RES
+ * referencing data already read, or with a single RES with the error flag.
+ * @param node The node.
+ * @param peer The requesting peer.
+ * @param req The request.
+ * @param buf Data holding the range, NULL to answer with an error.
+ * @param base Data file offset of the first byte of buf.
+ * @param serial Serial number of the package, tags the RES for CCL.
+ * @param index Index of the chunk.
+ */
+static void res_send(struct btide_node* node, struct peer* peer,
+    const struct btide_req* req, struct chunk_buf* buf, uint32_t base,
+    uint64_t serial, uint32_t index) {
+    struct btide_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.msg_code = PKT_MSG_RES;
+    memcpy(pkt.pl.res.chunk_hash, req->chunk_hash, PKT_HASH_LEN);
+    memcpy(pkt.pl.res.identifier, req->identifier, PKT_IDENT_LEN);
+    pkt.pl.res.file_offset = req->file_offset;
+    if (!buf) {
+        pkt.error = 1;
+        peer_send(node, peer, &pkt);
+        return;
+    }
+    // Every RES references the data, it is never copied
+    uint32_t done = 0;
+    while (done < req->data_len && !peer->closing) {
+        uint32_t len = req->data_len - done;
+        if (len > PKT_RES_DATA_MAX) {
+            len = PKT_RES_DATA_MAX;
+        }
+        pkt.pl.res.file_offset = req->file_offset + done;
+        pkt.pl.res.data_len = (uint16_t)len;
+        pkt_buf_tag(peer_send_data(node, peer, &pkt, buf,
+            req->file_offset - base + done), serial, index, pkt.pl.res.file_offset);
+        done += len;
+    }
+}
+
+/**
+ * Pool task reading the data for a REQ that missed the chunk cache. With a
+ * cache the whole chunk is read and offered to it, otherwise only the
+ * requested range.
+ * @param arg The struct serve_job, handed to the network thread when done.
+ */
+static void serve_task(void* arg) {
+    struct serve_job* job = arg;
+    Package* pkg = job->pkg;
+    const struct chunk* c = &pkg->obj->chunks[job->index];
+    int fd = open(pkg->filename, O_RDONLY);
+    if (fd >= 0) {
+        if (job->cache && c->size <= cache_entry_limit(job->cache)) {
+            job->base = c->offset;
+            job->buf = read_chunk(fd, c->offset, c->size);
+            if (job->buf) {
+                cache_put(job->cache, pkg->serial, job->index, job->buf);
+                // A chunk demoted while it was read may have been
+                // invalidated before it was cached
+                if (!hasChunk(pkg, job->index)) {
+                    cache_invalidate(job->cache, pkg->serial, job->index);
+                }
+            }
+        } else {
+            job->base = job->req.file_offset;
+            job->buf = read_chunk(fd, job->req.file_offset, job->req.data_len);
+        }
+        close(fd);
+    }
+    cmd_queue_push(job->commands, job->cmd);
+}
+
+/**
+ * Frees a serve job and what it holds.
+ * @param job The job.
+ */
+static void serve_job_free(struct serve_job* job) {
+    chunk_buf_release(job->buf);
+    releasePackage(job->pkg);
+    free(job);
+}
+
+/**
+ * Answers a REQ. A chunk in the cache is answered at once, otherwise the
+ * data is read on the pool so the network thread never waits on the disk,
+ * and the answer is sent once the read completes.
+ * @param node The node.
+ * @param peer The requesting peer.
+ * @param req The request.
+ */
+static void handle_req(struct btide_node* node, struct peer* peer,
+    const struct btide_req* req) {
+    char ident[PKT_IDENT_LEN + 1];
+    memcpy(ident, req->identifier, PKT_IDENT_LEN);
+    ident[PKT_IDENT_LEN] = '\0';
+
+    struct chunk_buf* buf = NULL;
+    Package* held = NULL;
+    uint32_t base = 0;
+    uint64_t serial = 0;
+    int64_t i = -1;
+    rcu_read_lock();
+    Package* pkg = findPackage(node->packages, ident, NULL);
+    if (pkg && atomic_load_explicit(&pkg->state, memory_order_acquire) == PKG_READY) {
+        i = chunk_at(pkg->obj, req->file_offset);
+        // Serve only verified chunks and never past the end of the chunk
+        if (i >= 0 && hasChunk(pkg, (uint32_t)i)
+            && strncmp(pkg->obj->chunks[i].hash, req->chunk_hash, PKT_HASH_LEN) == 0
+            && req->data_len <= pkg->obj->chunks[i].offset
+                + pkg->obj->chunks[i].size - req->file_offset) {
+            base = pkg->obj->chunks[i].offset;
+            serial = pkg->serial;
+            buf = node->cache ? cache_get(node->cache, serial, (uint32_t)i) : NULL;
+            if (!buf) {
+                held = pkg;
+                retainPackage(held);
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    if (!held) {
+        res_send(node, peer, req, buf, base, serial, (uint32_t)i);
+        chunk_buf_release(buf);
+        return;
+    }
+    struct serve_job* job = calloc(1, sizeof(struct serve_job));
+    struct command* cmd = job ? calloc(1, sizeof(struct command)) : NULL;
+    if (!cmd) {
+        free(job);
+        releasePackage(held);
+        res_send(node, peer, req, NULL, 0, serial, (uint32_t)i);
+        return;
+    }
+    cmd->type = CMD_SERVED;
+    cmd->data = job;
+    job->cmd = cmd;
+    job->commands = &node->commands;
+    job->cache = node->cache;
+    job->peer_id = peer->id;
+    job->req = *req;
+    job->pkg = held;
+    job->index = (uint32_t)i;
+    peer->reading++;
+    struct pool* pool = node->packages->pool;
+    if (!pool || pool_submit(pool, serve_task, job) != 0) {
+        serve_task(job);
+    }
+}
+
+/**
+ * Sends the answer to a REQ once its data has been read on the pool.
+ * @param node The node.
+ * @param job The completed struct serve_job, freed here.
+ */
+static void node_served(struct btide_node* node, struct serve_job* job) {
+    struct peer* peer = node->peers;
+    while (peer && peer->id != job->peer_id) {
+        peer = peer->next;
+    }
+    if (peer) {
+        peer->reading--;
+        if (!peer->closing) {
+            res_send(node, peer, &job->req, job->buf, job->base, job->pkg->serial,
+                job->index);
+        }
+    }
+    serve_job_free(job);
+}
+
+/**
+ * Withdraws a request: the RES packets for the range still waiting in the
+ * peer's send queue are dropped. A packet partly written stays, the rest of
+ * it must follow on the stream.
+ * @param node The node.
+ * @param peer The cancelling peer.
+ * @param req The cancelled range.
+ */
+static void handle_ccl(struct btide_node* node, struct peer* peer,
+    const struct btide_req* req) {
+    char ident[PKT_IDENT_LEN + 1];
+    memcpy(ident, req->identifier, PKT_IDENT_LEN);
+    ident[PKT_IDENT_LEN] = '\0';
+
+    uint64_t serial = 0;
+    int64_t i = -1;
+    rcu_read_lock();
+    Package* pkg = findPackage(node->packages, ident, NULL);
+    if (pkg) {
+        i = chunk_at(pkg->obj, req->file_offset);
+        if (i >= 0 && strncmp(pkg->obj->chunks[i].hash, req->chunk_hash, PKT_HASH_LEN) == 0) {
+            serial = pkg->serial;
+        }
+    }
+    rcu_read_unlock();
+    if (!serial) {
+        return;
+    }
+
+    struct pkt_buf* prev = peer->sq_off ? peer->sq_head : NULL;
+    struct pkt_buf** link = prev ? &prev->next : &peer->sq_head;
+    while (*link) {
+        struct pkt_buf* b = *link;
+        if (b->serial != serial || b->chunk != (uint32_t)i || b->offset < req->file_offset
+            || b->offset - req->file_offset >= req->data_len) {
+            prev = b;
+            link = &b->next;
+            continue;
+        }
+        *link = b->next;
+        peer->sq_len--;
+        chunk_buf_release(b->ref);
+        free(b);
+    }
+    peer->sq_tail = prev;
+}
+
+/**
+ * Completed download handed to the pool for verification.
+ */
+struct fetch_job {
+    struct chunk_writer* writer;
+    struct cmd_queue* commands;
+    struct fetch* f;
+};
+
+/**
+ * Tells the network thread, from any thread, that a chunk passed or failed
+ * verification.
+ * @param commands The node's command queue.
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @param ok 1 if the chunk is now present.
+ */
+static void notify_verified(struct cmd_queue* commands, Package* pkg, uint32_t index, int ok) {
+    struct command* cmd = calloc(1, sizeof(struct command));
+    if (!cmd) {
+        return;
+    }
+    cmd->type = ok ? CMD_VERIFIED : CMD_REJECTED;
+    memcpy(cmd->arg, pkg->identifier, sizeof(cmd->arg));
+    cmd->serial = pkg->serial;
+    cmd->offset = index;
+    cmd->has_offset = 1;
+    cmd_queue_push(commands, cmd);
+}
+
+/**
+ * Pool task verifying a completed download against the manifest. A good
+ * chunk goes to the writer, which reports it once it is on disk.
+ * @param arg The struct fetch_job, freed with its download when done.
+ */
+static void fetch_verify_task(void* arg) {
+    struct fetch_job* job = arg;
+    struct fetch* f = job->f;
+    struct chunk* c = &f->pkg->obj->chunks[f->index];
+    uint64_t start = tb_now_ns();
+    char hex[SHA256_HEXLEN];
+    bpkg_data_digest(f->data, c->size, hex);
+    int ok = strncmp(hex, c->hash, SHA256_HEXLEN) == 0;
+    uint64_t end = tb_now_ns();
+    metrics_verify(ok, c->size, end - start);
+    metrics_record(MH_REQ_RES, end - f->sent_ns);
+    if (!ok) {
+        printf("Chunk %.16s failed verification\n", c->hash);
+        notify_verified(job->commands, f->pkg, f->index, 0);
+    } else if (writer_put(job->writer, f->pkg, f->index, f->data) == 0) {
+        f->data = NULL;
+    } else {
+        notify_verified(job->commands, f->pkg, f->index, 0);
+    }
+    fetch_free(f);
+    free(job);
+}
+
+/**
+ * Called by the writer once a verified chunk is on disk and marked, or
+ * could not be written.
+ * @param arg The node.
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @param ok 1 if the chunk is now present.
+ */
+static void node_written(void* arg, Package* pkg, uint32_t index, int ok) {
+    struct btide_node* node = arg;
+    notify_verified(&node->commands, pkg, index, ok);
+}
+
+// Chunk filled from the chunk store on the pool, holding a reference to pkg
+struct restore_job {
+    PackageList* packages;
+    struct cmd_queue* commands;
+    Package* pkg;
+    uint32_t index;
+    int fd;
+};
+
+/**
+ * Pool task copying a chunk another package already holds out of the
+ * chunk store and verifying it, reported like a download so the peers of
+ * every shard hear of it.
+ * @param arg The struct restore_job, freed when done.
+ */
+static void fetch_restore_task(void* arg) {
+    struct restore_job* job = arg;
+    Package* pkg = job->pkg;
+    int ok = restoreChunk(job->packages, pkg, job->fd, job->index);
+    close(job->fd);
+    if (ok) {
+        printf("Chunk %.16s found in the chunk store\n", pkg->obj->chunks[job->index].hash);
+        savePackageState(pkg);
+    }
+    notify_verified(job->commands, pkg, job->index, ok);
+    releasePackage(pkg);
+    free(job);
+}
+
+/**
+ * Drops a download whose chunk arrived from another peer, telling the peer
+ * to stop sending it.
+ * @param node The node.
+ * @param f The download to cancel.
+ */
+static void fetch_cancel(struct btide_node* node, struct fetch* f) {
+    struct chunk* c = &f->pkg->obj->chunks[f->index];
+    struct peer* peer = f->peer;
+    fetch_unlink(node, f);
+    if (!peer->closing) {
+        struct btide_packet pkt;
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.msg_code = PKT_MSG_CCL;
+        pkt.pl.req.file_offset = c->offset;
+        pkt.pl.req.data_len = c->size;
+        memcpy(pkt.pl.req.chunk_hash, c->hash, PKT_HASH_LEN);
+        memcpy(pkt.pl.req.identifier, f->pkg->identifier, PKT_IDENT_LEN);
+        peer_send(node, peer, &pkt);
+    }
+    fetch_free(f);
+}
+
+/**
+ * Stores the data of a RES in the download it belongs to and queues the
+ * chunk for verification once all of it has arrived. The first copy of a
+ * chunk requested from several peers wins, the others are cancelled.
+ * @param node The node.
+ * @param peer The responding peer.
+ * @param pkt The response packet.
+ */
+static void handle_res(struct btide_node* node, struct peer* peer,
+    const struct btide_packet* pkt) {
+    const struct btide_res* res = &pkt->pl.res;
+    struct fetch* f = node->fetches;
+    for (; f; f = f->next) {
+        struct chunk* c = &f->pkg->obj->chunks[f->index];
+        if (f->peer == peer && strncmp(c->hash, res->chunk_hash, PKT_HASH_LEN) == 0
+            && strncmp(f->pkg->identifier, res->identifier, PKT_IDENT_LEN) == 0
+            && res->file_offset >= c->offset
+            && res->file_offset + res->data_len <= c->offset + c->size) {
+            break;
+        }
+    }
+    if (!f) {
+        // Mostly data of a cancelled request that was already on its way
+        metrics_add(MC_ENDGAME_WASTE, res->data_len);
+        return;
+    }
+
+    struct chunk* c = &f->pkg->obj->chunks[f->index];
+    if (pkt->error) {
+        printf("Unable to fetch chunk %.16s, peer does not have it\n", c->hash);
+        struct peer_have* h = have_find(peer, f->pkg);
+        if (h) {
+            have_clear(node, h, f->index);
+        }
+        fetch_remove(node, f);
+        return;
+    }
+    // Chunks are written whole once verified, duplicates never share bytes
+    memcpy(f->data + (res->file_offset - c->offset), res->data, res->data_len);
+    f->received += res->data_len;
+    if (f->received < c->size) {
+        return;
+    }
+    // Hashing runs on the pool, the download leaves the list so later
+    // packets and disconnects no longer see it
+    fetch_unlink(node, f);
+    struct fetch* o;
+    while ((o = fetch_find(node, f->pkg, f->index, NULL))) {
+        fetch_cancel(node, o);
+    }
+    struct fetch_job* job = malloc(sizeof(struct fetch_job));
+    if (job) {
+        job->writer = &node->writer;
+        job->commands = &node->commands;
+        job->f = f;
+    }
+    if (!job || !node->packages->pool
+        || pool_submit(node->packages->pool, fetch_verify_task, job) != 0) {
+        if (job) {
+            fetch_verify_task(job);
+        } else {
+            fetch_free(f);
+        }
+    }
+}
+
+/**
+ * Answers a proof request for a chunk of a managed package. The proof
+ * only depends on the manifest, so it is served even while the data is
+ * still incomplete.
+ * @param node The node.
+ * @param peer The requesting peer.
+ * @param prf The request.
+ */
+static void handle_prf_req(struct btide_node* node, struct peer* peer,
+    const struct btide_prf* prf) {
+    char ident[PKT_IDENT_LEN + 1];
+    memcpy(ident, prf->identifier, PKT_IDENT_LEN);
+    ident[PKT_IDENT_LEN] = '\0';
+
+    struct btide_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.msg_code = PKT_MSG_PRF;
+    pkt.pl.prf.file_offset = prf->file_offset;
+    memcpy(pkt.pl.prf.chunk_hash, prf->chunk_hash, PKT_HASH_LEN);
+    memcpy(pkt.pl.prf.identifier, prf->identifier, PKT_IDENT_LEN);
+    pkt.error = 1;
+
+    struct merkle_proof proof;
+    rcu_read_lock();
+    Package* pkg = findPackage(node->packages, ident, NULL);
+    int64_t i = pkg ? chunk_at(pkg->obj, prf->file_offset) : -1;
+    // A requester lacking the chunk's hash asks by offset alone
+    if (i >= 0 && (prf->chunk_hash[0] == '\0'
+            || strncmp(pkg->obj->chunks[i].hash, prf->chunk_hash, PKT_HASH_LEN) == 0)
+        && merkle_get_proof(pkg->obj, (uint32_t)i, &proof) == 0
+        && proof.len <= PKT_PROOF_MAX) {
+        pkt.error = 0;
+        pkt.pl.prf.chunk_index = proof.index;
+        pkt.pl.prf.nleaves = proof.nleaves;
+        pkt.pl.prf.len = (uint16_t)proof.len;
+        memcpy(pkt.pl.prf.siblings, proof.siblings, (size_t)proof.len * PKT_HASH_LEN);
+    }
+    rcu_read_unlock();
+    peer_send(node, peer, &pkt);
+}
+
+/**
+ * Looks up the package named by a BMP or HAV.
+ * @param node The node.
+ * @param identifier The identifier field of the packet.
+ * @return Package* The package, retained, NULL if it is not managed.
+ */
+static Package* packet_package(struct btide_node* node, const char* identifier) {
+    char ident[PKT_IDENT_LEN + 1];
+    memcpy(ident, identifier, PKT_IDENT_LEN);
+    ident[PKT_IDENT_LEN] = '\0';
+    rcu_read_lock();
+    Package* pkg = findPackage(node->packages, ident, NULL);
+    if (pkg && strcmp(pkg->identifier, ident) == 0) {
+        retainPackage(pkg);
+    } else {
+        pkg = NULL;
+    }
+    rcu_read_unlock();
+    return pkg;
+}
+
+/**
+ * Records the chunks a peer holds from its bitmap, and answers with ours
+ * if it has not been sent or the peer asks for it.
+ * @param node The node.
+ * @param peer The sending peer.
+ * @param bmp The bitmap.
+ */
+static void handle_bmp(struct btide_node* node, struct peer* peer,
+    const struct btide_bmp* bmp) {
+    Package* pkg = packet_package(node, bmp->identifier);
+    if (!pkg) {
+        return;
+    }
+    // A bitmap only means something against the same manifest
+    uint32_t nchunks = pkg->obj->nchunks;
+    struct peer_have* h = bmp->nchunks == nchunks ? have_get(peer, pkg) : NULL;
+    if (h) {
+        if (bmp->flags & PKT_BMP_COMPLETE) {
+            for (uint32_t i = 0; i < nchunks; i++) {
+                have_set(node, h, i);
+            }
+        }
+        for (uint32_t i = 0; i < (uint32_t)bmp->len * 8 && bmp->first < nchunks
+            && i < nchunks - bmp->first; i++) {
+            if (bmp->bits[i / 8] >> (i % 8) & 1) {
+                have_set(node, h, bmp->first + i);
+            }
+        }
+        if (atomic_load_explicit(&pkg->state, memory_order_acquire) == PKG_READY
+            && (!h->sent || ((bmp->flags & PKT_BMP_REPLY) && bmp->first == 0))) {
+            peer_send_bitmap(node, peer, pkg, 0);
+        }
+    }
+    releasePackage(pkg);
+}
+
+/**
+ * Records chunks a peer has verified since its bitmap.
+ * @param node The node.
+ * @param peer The sending peer.
+ * @param hav The announcement.
+ */
+static void handle_hav(struct btide_node* node, struct peer* peer,
+    const struct btide_hav* hav) {
+    Package* pkg = packet_package(node, hav->identifier);
+    if (!pkg) {
+        return;
+    }
+    struct peer_have* h = have_get(peer, pkg);
+    for (uint16_t i = 0; h && i < hav->count; i++) {
+        if (hav->indices[i] < pkg->obj->nchunks) {
+            have_set(node, h, hav->indices[i]);
+        }
+    }
+    releasePackage(pkg);
+}
+
+/**
+ * Dispatches a complete packet received from a peer.
+ * @param node The node.
+ * @param peer The sending peer.
+ * @param pkt The packet.
+ */
+static void handle_packet(struct btide_node* node, struct peer* peer,
+    const struct btide_packet* pkt) {
+    switch (pkt->msg_code) {
+    case PKT_MSG_ACP:
+        // The accepting side greets us, complete the handshake
+        if (peer->outbound && peer->state == PEER_HANDSHAKE) {
+            peer_send_code(node, peer, PKT_MSG_ACK);
+            peer->state = PEER_ESTABLISHED;
+            puts("Connection established with peer");
+            peer_greet(node, peer);
+        }
+        break;
+    case PKT_MSG_ACK:
+        if (!peer->outbound && peer->state == PEER_HANDSHAKE) {
+            peer->state = PEER_ESTABLISHED;
+            peer_greet(node, peer);
+        }
+        break;
+    case PKT_MSG_DSN:
+        peer_close(node, peer);
+        break;
+    case PKT_MSG_PNG:
+        peer_send_code(node, peer, PKT_MSG_POG);
+        break;
+    case PKT_MSG_POG:
+        break;
+    case PKT_MSG_REQ:
+        if (peer->state == PEER_ESTABLISHED) {
+            handle_req(node, peer, &pkt->pl.req);
+        }
+        break;
+    case PKT_MSG_RES:
+        handle_res(node, peer, pkt);
+        break;
+    case PKT_MSG_PRF:
+        if (peer->state != PEER_ESTABLISHED) {
+            break;
+        }
+        // Proofs are served to peers verifying against the root alone,
+        // our manifests carry every chunk hash so none are asked for
+        if (pkt->pl.prf.nleaves == 0) {
+            handle_prf_req(node, peer, &pkt->pl.prf);
+        }
+        break;
+    case PKT_MSG_BMP:
+        if (peer->state == PEER_ESTABLISHED) {
+            handle_bmp(node, peer, &pkt->pl.bmp);
+        }
+        break;
+    case PKT_MSG_HAV:
+        if (peer->state == PEER_ESTABLISHED) {
+            handle_hav(node, peer, &pkt->pl.hav);
+        }
+        break;
+    case PKT_MSG_CCL:
+        if (peer->state == PEER_ESTABLISHED) {
+            handle_ccl(node, peer, &pkt->pl.req);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Reads and handles every complete packet available on a peer's socket.
+ * @param node The node.
+ * @param peer The peer to read from.
+ */
+static void peer_read(struct btide_node* node, struct peer* peer) {
+    uint64_t now = tb_now_ns();
+    // Stop reading once over the download limit, TCP pushes back on the sender
+    while (!peer->closing && tb_ready(&peer->down, now) && tb_ready(node->down, now)) {
+        ssize_t n = recv(peer->fd, peer->rbuf + peer->rlen, PACKET_SIZE - peer->rlen, 0);
+        if (n == 0) {
+            peer_close(node, peer);
+            return;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                peer_close(node, peer);
+            }
+            return;
+        }
+        peer->rlen += n;
+        peer->bytes_in += n;
+        metrics_add(MC_BYTES_IN, n);
+        tb_consume(&peer->down, n);
+        tb_consume(node->down, n);
+        if (peer->rlen < PACKET_SIZE) {
+            continue;
+        }
+        peer->rlen = 0;
+
+        struct btide_packet pkt;
+        if (pkt_decode(peer->rbuf, &pkt) != 0) {
+            peer_close(node, peer);
+            return;
+        }
+        metrics_packet(0, pkt.msg_code);
+        handle_packet(node, peer, &pkt);
+    }
+}
+
+/**
+ * Completes a non-blocking connect once the socket becomes writable.
+ * @param node The node.
+ * @param peer The connecting peer.
+ */
+static void peer_connected(struct btide_node* node, struct peer* peer) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        puts("Unable to connect to request peer");
+        peer_close(node, peer);
+        return;
+    }
+    // Wait for the accepting side to send ACP
+    peer->state = PEER_HANDSHAKE;
+}
+
+/**
+ * Accepts every pending inbound connection.
+ * @param node The node.
+ */
+static void accept_peers(struct btide_node* node) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = accept(node->listen_fd, (struct sockaddr*)&addr, &addrlen);
+        if (fd < 0) {
+            return;
+        }
+        if (node->npeers >= node->max_peers || set_nonblocking(fd) != 0) {
+            close(fd);
+            continue;
+        }
+
+        char ip[PEER_ADDR_LEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        struct peer* peer = peer_add(node, fd, ip, ntohs(addr.sin_port), 0);
+        if (!peer) {
+            close(fd);
+            continue;
+        }
+        peer_send_code(node, peer, PKT_MSG_ACP);
+    }
+}
+
+/**
+ * Queues a copy of a command for another listener shard.
+ * @param node The current shard.
+ * @param cmd The command.
+ * @param shard Index of the destination shard.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int node_pass(struct btide_node* node, const struct command* cmd, int shard) {
+    struct command* copy = malloc(sizeof(struct command));
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, cmd, sizeof(struct command));
+    copy->forwarded = 1;
+    cmd_queue_push(&node->shards[shard].commands, copy);
+    return 0;
+}
+
+/**
+ * Passes a command naming a peer on to the next listener shard, the peer
+ * may be connected there.
+ * @param node The current shard.
+ * @param cmd The command.
+ * @return int 1 if the next shard takes the command over, 0 if this is
+ *         the last shard.
+ */
+static int node_forward(struct btide_node* node, const struct command* cmd) {
+    return node->shard + 1 < node->nshards && node_pass(node, cmd, node->shard + 1) == 0;
+}
+
+/**
+ * Hands a command to every other listener shard, for events all of their
+ * peers need to hear about.
+ * @param node The current shard.
+ * @param cmd The command.
+ */
+static void node_broadcast(struct btide_node* node, const struct command* cmd) {
+    for (int i = 0; i < node->nshards; i++) {
+        if (i != node->shard) {
+            node_pass(node, cmd, i);
+        }
+    }
+}
+
+/**
+ * CONNECT: starts a non-blocking connection to a peer.
+ * @param node The node.
+ * @param cmd The command.
+ */
+static void cmd_connect(struct btide_node* node, struct command* cmd) {
+    if (peer_find(node, cmd->ip, cmd->port)) {
+        puts("Already connected to peer");
+        return;
+    }
+    if (node->npeers >= node->max_peers) {
+        puts("Unable to connect to request peer, peer limit reached");
+        return;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cmd->port);
+    if (inet_pton(AF_INET, cmd->ip, &addr.sin_addr) <= 0) {
+        puts("Invalid address/ Address not supported");
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || set_nonblocking(fd) != 0) {
+        perror("Socket creation error");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    // Completion is reported by the event loop, the command returns at once
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        puts("Unable to connect to request peer");
+        close(fd);
+        return;
+    }
+    if (!peer_add(node, fd, cmd->ip, cmd->port, 1)) {
+        close(fd);
+    }
+}
+
+/**
+ * DISCONNECT: notifies a peer and drops the connection.
+ * @param node The node.
+ * @param cmd The command.
+ */
+static void cmd_disconnect(struct btide_node* node, struct command* cmd) {
+    struct peer* peer = peer_find(node, cmd->ip, cmd->port);
+    if (!peer) {
+        if (!node_forward(node, cmd)) {
+            puts("Unknown peer, not connected");
+        }
+        return;
+    }
+    if (peer->state == PEER_ESTABLISHED) {
+        peer_send_code(node, peer, PKT_MSG_DSN);
+    }
+    peer_close(node, peer);
+    puts("Disconnected from peer");
+}
+
+/**
+ * PEERS: lists established peers and pings them, the listing continues
+ * with the peers of the next listener shard.
+ * @param node The node.
+ * @param cmd The command.
+ */
+static void cmd_peers(struct btide_node* node, struct command* cmd) {
+    int count = cmd->forwarded ? (int)cmd->offset : 0;
+    for (struct peer* p = node->peers; p; p = p->next) {
+        if (p->closing || p->state != PEER_ESTABLISHED) {
+            continue;
+        }
+        if (count++ == 0) {
+            printf("Connected to:\n");
+        }
+        printf("%d. %s\n", count, p->ip);
+        peer_send_code(node, p, PKT_MSG_PNG);
+    }
+    cmd->offset = (uint32_t)count;
+    if (!node_forward(node, cmd) && count == 0) {
+        printf("Not connected to any peers\n");
+    }
+}
+
+/**
+ * Queues a chunk announcement for the peers the package was exchanged
+ * with, sent in batches at the end of the loop iteration.
+ * @param node The node.
+ * @param pkg The package, retained until the announcement is sent.
+ * @param index Index of the chunk.
+ */
+static void node_have(struct btide_node* node, Package* pkg, uint32_t index) {
+    if (node->nhaves == node->haves_cap) {
+        size_t cap = node->haves_cap ? node->haves_cap * 2 : 64;
+        struct have_event* haves = realloc(node->haves, cap * sizeof(struct have_event));
+        if (!haves) {
+            return;
+        }
+        node->haves = haves;
+        node->haves_cap = cap;
+    }
+    retainPackage(pkg);
+    node->haves[node->nhaves].pkg = pkg;
+    node->haves[node->nhaves].index = index;
+    node->nhaves++;
+}
+
+/**
+ * Sends the queued chunk announcements, consecutive chunks of a package
+ * sharing HAV packets.
+ * @param node The node.
+ */
+static void node_announce(struct btide_node* node) {
+    if (!node->nhaves) {
+        return;
+    }
+    struct btide_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.msg_code = PKT_MSG_HAV;
+    for (struct peer* p = node->peers; p; p = p->next) {
+        if (p->closing || p->state != PEER_ESTABLISHED) {
+            continue;
+        }
+        for (size_t i = 0; i < node->nhaves;) {
+            Package* pkg = node->haves[i].pkg;
+            struct peer_have* h = have_find(p, pkg);
+            size_t end = i;
+            pkt.pl.hav.count = 0;
+            while (end < node->nhaves && node->haves[end].pkg == pkg
+                && pkt.pl.hav.count < PKT_HAV_MAX) {
+                pkt.pl.hav.indices[pkt.pl.hav.count++] = node->haves[end++].index;
+            }
+            // Peers that never got a bitmap of the package learn it from
+            // one, and peers holding the whole package need no updates
+            if (h && h->sent && h->nbits < pkg->obj->nchunks) {
+                memcpy(pkt.pl.hav.identifier, pkg->identifier, PKT_IDENT_LEN);
+                peer_send(node, p, &pkt);
+            }
+            i = end;
+        }
+    }
+    for (size_t i = 0; i < node->nhaves; i++) {
+        releasePackage(node->haves[i].pkg);
+    }
+    node->nhaves = 0;
+}
+
+/**
+ * Frees a whole package download.
+ * @param node The node.
+ * @param d The download to remove.
+ */
+static void download_remove(struct btide_node* node, struct download* d) {
+    struct download** link = &node->downloads;
+    while (*link != d) {
+        link = &(*link)->next;
+    }
+    *link = d->next;
+    picker_free(&d->picker);
+    releasePackage(d->pkg);
+    free(d);
+}
+
+/**
+ * Ends a whole package download once every chunk is present, recording
+ * how long it took.
+ * @param node The node.
+ * @param d The download.
+ */
+static void download_check(struct btide_node* node, struct download* d) {
+    if (d->picker.nwanted == 0 && d->picker.nactive == 0) {
+        uint64_t now = tb_now_ns();
+        metrics_record(MH_DOWNLOAD, now - d->start_ns);
+        if (d->tail_ns) {
+            metrics_record(MH_TAIL, now - d->tail_ns);
+        }
+        printf("Package %.*s fetched\n", PKG_DISPLAY_LEN, d->pkg->identifier);
+        download_remove(node, d);
+    }
+}
+
+/**
+ * Records the outcome of verifying a downloaded chunk: a good chunk is
+ * announced to peers and leaves its download, a bad one is requested again.
+ * @param node The node.
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @param ok 1 if the chunk is now present.
+ */
+static void node_verified(struct btide_node* node, Package* pkg, uint32_t index, int ok) {
+    struct download* d = download_find(node, pkg);
+    if (ok) {
+        node_have(node, pkg, index);
+    }
+    if (!d) {
+        return;
+    }
+    if (ok) {
+        picker_done(&d->picker, index);
+    } else {
+        picker_abort(&d->picker, index);
+    }
+    // Scheduling requests a replacement, or ends a completed download
+    node->reschedule = 1;
+}
+
+/**
+ * Fills a chunk from the chunk store on the pool if another package
+ * already holds the same content.
+ * @param node The node.
+ * @param pkg The package, retained again for the restore.
+ * @param index Index of the chunk.
+ * @return int 1 if the restore was queued, 0 if the store does not hold
+ *         the chunk, -1 if the data file cannot be opened.
+ */
+static int fetch_restore(struct btide_node* node, Package* pkg, uint32_t index) {
+    PackageList* packages = node->packages;
+    if (!packages->store || !store_has(packages->store, pkg->obj->chunks[index].hash)) {
+        return 0;
+    }
+    struct restore_job* job = malloc(sizeof(struct restore_job));
+    int fd = job ? openPackageData(pkg) : -1;
+    if (fd < 0) {
+        perror("Unable to open package data");
+        free(job);
+        return -1;
+    }
+    retainPackage(pkg);
+    job->packages = packages;
+    job->commands = &node->commands;
+    job->pkg = pkg;
+    job->index = index;
+    job->fd = fd;
+    if (!packages->pool || pool_submit(packages->pool, fetch_restore_task, job) != 0) {
+        fetch_restore_task(job);
+    }
+    return 1;
+}
+
+/**
+ * Requests a chunk of a package from a peer. The chunk is filled from the
+ * chunk store instead if another package already holds the same content,
+ * its result is then reported like a download's.
+ * @param node The node.
+ * @param peer The peer, established.
+ * @param pkg The package, retained again for the download.
+ * @param index Index of the chunk.
+ * @return int 0 if the chunk was requested, 1 if it is being restored from
+ *         the store, -1 on failure.
+ */
+static int fetch_start(struct btide_node* node, struct peer* peer, Package* pkg,
+    uint32_t index) {
+    struct bpkg_obj* obj = pkg->obj;
+    int restoring = fetch_restore(node, pkg, index);
+    if (restoring != 0) {
+        return restoring;
+    }
+    struct fetch* f = calloc(1, sizeof(struct fetch));
+    if (!f) {
+        perror("Unable to allocate download");
+        return -1;
+    }
+    f->data = malloc(obj->chunks[index].size ? obj->chunks[index].size : 1);
+    if (!f->data) {
+        perror("Unable to allocate chunk buffer");
+        free(f);
+        return -1;
+    }
+    retainPackage(pkg);
+    f->pkg = pkg;
+    f->index = index;
+    f->peer = peer;
+    f->sent_ns = tb_now_ns();
+    f->next = node->fetches;
+    node->fetches = f;
+    peer->inflight += obj->chunks[index].size;
+
+    struct chunk* c = &obj->chunks[index];
+    struct btide_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.msg_code = PKT_MSG_REQ;
+    pkt.pl.req.file_offset = c->offset;
+    pkt.pl.req.data_len = c->size;
+    memcpy(pkt.pl.req.chunk_hash, c->hash, PKT_HASH_LEN);
+    memcpy(pkt.pl.req.identifier, pkg->identifier, PKT_IDENT_LEN);
+    peer_send(node, peer, &pkt);
+    return 0;
+}
+
+/**
+ * Counts the peers a chunk is requested from.
+ * @param node The node.
+ * @param pkg The package.
+ * @param index Index of the chunk.
+ * @return uint32_t Number of downloads of the chunk.
+ */
+static uint32_t fetch_copies(struct btide_node* node, Package* pkg, uint32_t index) {
+    uint32_t n = 0;
+    for (struct fetch* f = node->fetches; f; f = f->next) {
+        n += f->pkg == pkg && f->index == index;
+    }
+    return n;
+}
+
+/**
+ * Requests the chunks still in flight of a download in endgame from other
+ * peers holding them, up to ENDGAME_COPIES requests per chunk. Peers keep
+ * their pipeline limit, so a slow peer holding one of the last chunks is
+ * raced by the others instead of waited for.
+ * @param node The node.
+ * @param d The download, with no chunk left unrequested.
+ */
+static void download_endgame(struct btide_node* node, struct download* d) {
+    for (struct peer* p = node->peers; p; p = p->next) {
+        struct peer_have* h = p->closing || p->state != PEER_ESTABLISHED
+            ? NULL : have_find(p, d->pkg);
+        // Requests are added at the head of the list, f is never one of them
+        for (struct fetch* f = node->fetches; h && f && !p->closing
+            && p->inflight < DOWNLOAD_PIPELINE; f = f->next) {
+            uint32_t i = f->index;
+            if (f->pkg != d->pkg || !(h->bits[i / 64] >> (i % 64) & 1)
+                || fetch_find(node, d->pkg, i, p)
+                || fetch_copies(node, d->pkg, i) >= ENDGAME_COPIES) {
+                continue;
+            }
+            if (fetch_start(node, p, d->pkg, i) == 0) {
+                metrics_add(MC_ENDGAME_REQS, 1);
+            }
+        }
+    }
+}
+
+/**
+ * Keeps every peer busy with the rarest chunks it holds of the packages
+ * being downloaded, up to DOWNLOAD_PIPELINE bytes in flight per peer.
+ * Downloads down to their last ENDGAME_CHUNKS chunks in flight enter
+ * endgame. Runs only after availability or the chunks in flight changed.
+ * @param node The node.
+ */
+static void node_schedule(struct btide_node* node) {
+    // Requests wait for the writer to drain, like reads
+    if (!node->reschedule || writer_full(&node->writer)) {
+        return;
+    }
+    node->reschedule = 0;
+    struct download* d = node->downloads;
+    while (d) {
+        struct download* next = d->next;
+        for (struct peer* p = node->peers; p && d->picker.nwanted; p = p->next) {
+            struct peer_have* h = p->closing || p->state != PEER_ESTABLISHED
+                ? NULL : have_find(p, d->pkg);
+            while (h && !p->closing && h->nbits && p->inflight < DOWNLOAD_PIPELINE) {
+                uint32_t i = picker_pick(&d->picker, h->bits);
+                if (i == PICKER_NONE) {
+                    break;
+                }
+                picker_start(&d->picker, i);
+                if (hasChunk(d->pkg, i)) {
+                    picker_done(&d->picker, i);
+                    continue;
+                }
+                int started = fetch_start(node, p, d->pkg, i);
+                if (started < 0) {
+                    picker_abort(&d->picker, i);
+                    break;
+                }
+            }
+        }
+        if (!d->picker.nwanted && d->picker.nactive) {
+            if (!d->tail_ns) {
+                d->tail_ns = tb_now_ns();
+            }
+            if (d->picker.nactive <= ENDGAME_CHUNKS) {
+                download_endgame(node, d);
+            }
+        }
+        download_check(node, d);
+        d = next;
+    }
+}
+
+/**
+ * FETCH <identifier>: downloads every missing chunk of a package from the
+ * connected peers holding it, rarest first.
+ * @param node The node.
+ * @param cmd The command.
+ */
+static void cmd_fetch_package(struct btide_node* node, struct command* cmd) {
+    rcu_read_lock();
+    Package* pkg = findPackage(node->packages, cmd->arg, NULL);
+    if (pkg) {
+        retainPackage(pkg);
+    }
+    rcu_read_unlock();
+    if (!pkg) {
+        puts("Unable to request package, package is not managed");
+        return;
+    }
+    if (atomic_load_explicit(&pkg->state, memory_order_acquire) != PKG_READY) {
+        puts("Unable to request package, package is still being verified");
+        releasePackage(pkg);
+        return;
+    }
+    if (download_find(node, pkg)) {
+        releasePackage(pkg);
+        return;
+    }
+
+    struct download* d = calloc(1, sizeof(struct download));
+    if (!d || picker_init(&d->picker, pkg->obj->nchunks, pkg->serial ^ tb_now_ns()) != 0) {
+        perror("Unable to start download");
+        free(d);
+        releasePackage(pkg);
+        return;
+    }
+    d->pkg = pkg;
+    d->start_ns = tb_now_ns();
+    for (uint32_t i = 0; i < pkg->obj->nchunks; i++) {
+        if (hasChunk(pkg, i)) {
+            picker_done(&d->picker, i);
+        }
+    }
+    // Chunks already being fetched by FETCH commands are not requested twice
+    for (struct fetch* f = node->fetches; f; f = f->next) {
+        if (f->pkg == pkg) {
+            picker_start(&d->picker, f->index);
+        }
+    }
+    for (struct peer* p = node->peers; p; p = p->next) {
+        struct peer_have* h = p->closing ? NULL : have_find(p, pkg);
+        for (uint32_t i = 0; h && h->nbits && i < pkg->obj->nchunks; i++) {
+            if (h->bits[i / 64] >> (i % 64) & 1) {
+                picker_add(&d->picker, i);
+            }
+        }
+    }
+    d->next = node->downloads;
+    node->downloads = d;
+    node->reschedule = 1;
+}
+
+/**
+ * FETCH: requests a chunk of a managed package from a connected peer.
+ * @param node The node.
+ * @param cmd The command.
+ */
+static void cmd_fetch(struct btide_node* node, struct command* cmd) {
+    if (cmd->ip[0] == '\0') {
+        cmd_fetch_package(node, cmd);
+        return;
+    }
+    struct peer* peer = peer_find(node, cmd->ip, cmd->port);
+    if (!peer && node_forward(node, cmd)) {
+        return;
+    }
+    if (!peer || peer->state != PEER_ESTABLISHED) {
+        puts("Unable to request chunk, peer not in list");
+        return;
+    }
+
+    rcu_read_lock();
+    Package* pkg = findPackage(node->packages, cmd->arg, NULL);
+    if (pkg) {
+        retainPackage(pkg);
+    }
+    rcu_read_unlock();
+    if (!pkg) {
+        puts("Unable to request chunk, package is not managed");
+        return;
+    }
+
+    // The offset disambiguates chunks that share a hash
+    struct bpkg_obj* obj = pkg->obj;
+    int64_t index = -1;
+    for (uint32_t i = 0; i < obj->nchunks && index < 0; i++) {
+        if (strncmp(obj->chunks[i].hash, cmd->hash, MAX_HASH_LEN) == 0
+            && (!cmd->has_offset || obj->chunks[i].offset == cmd->offset)) {
+            index = i;
+        }
+    }
+    if (index < 0) {
+        puts("Unable to request chunk, chunk hash does not belong to package");
+    } else if (!hasChunk(pkg, (uint32_t)index)
+        && fetch_start(node, peer, pkg, (uint32_t)index) == 0) {
+        struct download* d = download_find(node, pkg);
+        if (d) {
+            picker_start(&d->picker, (uint32_t)index);
+        }
+    }
+    releasePackage(pkg);
+}
+
+/**
+ * Handles a command pushed by a background task.
+ * @param node The node.
+ * @param cmd The command.
+ */
+static void node_event(struct btide_node* node, struct command* cmd) {
+    rcu_read_lock();
+    Package* pkg = findPackage(node->packages, cmd->arg, NULL);
+    // The package was removed, and possibly added again, since the event
+    // was pushed
+    if (pkg && pkg->serial != cmd->serial) {
+        pkg = NULL;
+    }
+    if (pkg) {
+        retainPackage(pkg);
+    }
+    rcu_read_unlock();
+    if (!pkg) {
+        return;
+    }
+    if (cmd->type == CMD_READY) {
+        // Peers that connected earlier learn the package now
+        for (struct peer* p = node->peers; p; p = p->next) {
+            if (!p->closing && p->state == PEER_ESTABLISHED) {
+                peer_send_bitmap(node, p, pkg, PKT_BMP_REPLY);
+            }
+        }
+    } else if (cmd->offset < pkg->obj->nchunks) {
+        node_verified(node, pkg, cmd->offset, cmd->type == CMD_VERIFIED);
+        // The other shards announce the chunk to their own peers
+        if (cmd->type == CMD_VERIFIED && !cmd->forwarded) {
+            node_broadcast(node, cmd);
+        }
+    }
+    releasePackage(pkg);
+}
+
+/**
+ * Package registry hook, tells the network thread of every shard a
+ * package became ready.
+ * @param arg Shard 0 of the node.
+ * @param pkg The package.
+ */
+static void node_package_ready(void* arg, Package* pkg) {
+    struct btide_node* node = arg;
+    for (int i = 0; i < node->nshards; i++) {
+        struct command* cmd = calloc(1, sizeof(struct command));
+        if (!cmd) {
+            return;
+        }
+        cmd->type = CMD_READY;
+        memcpy(cmd->arg, pkg->identifier, sizeof(cmd->arg));
+        cmd->serial = pkg->serial;
+        cmd_queue_push(&node->shards[i].commands, cmd);
+    }
+}
+
+/**
+ * Package registry hook, drops a chunk found bad from the chunk cache
+ * shared by the shards, so it is read from disk again once restored.
+ * @param arg Shard 0 of the node.
+ * @param pkg The package.
+ * @param index Index of the chunk.
+ */
+static void node_chunk_demoted(void* arg, Package* pkg, uint32_t index) {
+    struct btide_node* node = arg;
+    if (node->cache) {
+        cache_invalidate(node->cache, pkg->serial, index);
+    }
+}
+
+/**
+ * Drops the downloads and peer availability of packages that are no
+ * longer managed.
+ * @param node The node.
+ */
+static void node_prune(struct btide_node* node) {
+    rcu_read_lock();
+    struct download* d = node->downloads;
+    while (d) {
+        struct download* next = d->next;
+        if (findPackage(node->packages, d->pkg->identifier, NULL) != d->pkg) {
+            download_remove(node, d);
+        }
+        d = next;
+    }
+    for (struct peer* p = node->peers; p; p = p->next) {
+        struct peer_have** link = &p->haves;
+        while (*link) {
+            struct peer_have* h = *link;
+            if (findPackage(node->packages, h->pkg->identifier, NULL) == h->pkg) {
+                link = &h->next;
+                continue;
+            }
+            *link = h->next;
+            have_free(node, h);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Writes the global metrics followed by queue depths and per-peer traffic.
+ * Only shard 0 writes the global part, the queue depths of each listener
+ * shard are prefixed with shard.<index>. when there are several.
+ * @param node The node.
+ * @param out Destination stream.
+ */
+static void node_stats(struct btide_node* node, FILE* out) {
+    if (node->shard == 0) {
+        metrics_write(out);
+        uint64_t queued = metrics_get(MC_CMDS_QUEUED);
+        uint64_t run = metrics_get(MC_CMDS_RUN);
+        fprintf(out, "queue.commands %llu\n",
+            (unsigned long long)(queued > run ? queued - run : 0));
+        fprintf(out, "queue.tasks %d\n", pool_pending(node->packages->pool));
+        if (node->cache) {
+            fprintf(out, "cache.bytes %zu\n", cache_size(node->cache));
+        }
+    }
+
+    size_t fetches = 0;
+    for (struct fetch* f = node->fetches; f; f = f->next) {
+        fetches++;
+    }
+    char prefix[32] = "";
+    if (node->nshards > 1) {
+        snprintf(prefix, sizeof(prefix), "shard.%d.", node->shard);
+    }
+    fprintf(out, "%squeue.fetches %zu\n", prefix, fetches);
+    fprintf(out, "%squeue.write_bytes %zu\n", prefix, atomic_load(&node->writer.queued));
+    fprintf(out, "%speers %d\n", prefix, node->npeers);
+    for (struct peer* p = node->peers; p; p = p->next) {
+        if (p->closing) {
+            continue;
+        }
+        fprintf(out, "peer.%s:%u.bytes_in %llu\n", p->ip, p->port,
+            (unsigned long long)p->bytes_in);
+        fprintf(out, "peer.%s:%u.bytes_out %llu\n", p->ip, p->port,
+            (unsigned long long)p->bytes_out);
+        fprintf(out, "peer.%s:%u.send_queue %zu\n", p->ip, p->port, p->sq_len);
+    }
+}
+
+/**
+ * Rewrites the metrics file, through a temporary file so readers never
+ * see a partial dump.
+ * @param node The node.
+ */
+static void node_dump_stats(struct btide_node* node) {
+    char tmp[sizeof(node->config->metrics_file) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", node->config->metrics_file);
+    FILE* out = fopen(tmp, "w");
+    if (!out) {
+        return;
+    }
+    node_stats(node, out);
+    if (fclose(out) != 0 || rename(tmp, node->config->metrics_file) != 0) {
+        unlink(tmp);
+    }
+}
+
+/**
+ * Tells the network thread, from the thread that loaded it, that the
+ * package of an ADDPACKAGE is registered or was refused.
+ * @param arg The node that executed the ADDPACKAGE.
+ */
+static void node_package_added(void* arg) {
+    struct btide_node* node = arg;
+    struct command* cmd = calloc(1, sizeof(struct command));
+    if (!cmd) {
+        // Nothing else would ever release the held commands
+        perror("Failed to allocate command");
+        exit(EXIT_FAILURE);
+    }
+    cmd->type = CMD_ADDED;
+    cmd_queue_push(&node->commands, cmd);
+}
+
+/**
+ * Holds a command read after an ADDPACKAGE that is still being loaded, so
+ * that it only runs once the package is registered or refused. Commands
+ * pushed by background tasks are never held.
+ * @param node The node.
+ * @param cmd The command, owned by the node if it is held.
+ * @return int 1 if the command was held.
+ */
+static int node_hold(struct btide_node* node, struct command* cmd) {
+    if (!node->adding || cmd->type >= CMD_VERIFIED) {
+        return 0;
+    }
+    atomic_store_explicit(&cmd->next, NULL, memory_order_relaxed);
+    if (node->held_tail) {
+        atomic_store_explicit(&node->held_tail->next, cmd, memory_order_relaxed);
+    } else {
+        node->held = cmd;
+    }
+    node->held_tail = cmd;
+    return 1;
+}
+
+/**
+ * Takes the oldest held command once no ADDPACKAGE is being loaded.
+ * @param node The node.
+ * @return struct command* The command, NULL if none may run yet.
+ */
+static struct command* node_unhold(struct btide_node* node) {
+    struct command* cmd = node->adding ? NULL : node->held;
+    if (cmd) {
+        node->held = atomic_load_explicit(&cmd->next, memory_order_relaxed);
+        if (!node->held) {
+            node->held_tail = NULL;
+        }
+    }
+    return cmd;
+}
+
+/**
+ * Executes one queued command on the network thread.
+ * @param node The node.
+ * @param cmd The command.
+ */
+static void node_execute(struct btide_node* node, struct command* cmd) {
+    switch (cmd->type) {
+    case CMD_QUIT:
+        // Passed down the shards like PEERS, so it never overtakes one
+        node_forward(node, cmd);
+        node->running = 0;
+        break;
+    case CMD_CONNECT:
+        cmd_connect(node, cmd);
+        break;
+    case CMD_DISCONNECT:
+        cmd_disconnect(node, cmd);
+        break;
+    case CMD_ADDPACKAGE:
+        node->adding = addPackage(node->packages, node->config->directory, cmd->arg,
+            node_package_added, node);
+        break;
+    case CMD_REMPACKAGE:
+        // Every shard drops the state it keeps about the package
+        if (!cmd->forwarded) {
+            removePackage(node->packages, cmd->arg);
+            node_broadcast(node, cmd);
+        }
+        node_prune(node);
+        break;
+    case CMD_PACKAGES:
+        listPackages(node->packages);
+        break;
+    case CMD_PEERS:
+        cmd_peers(node, cmd);
+        break;
+    case CMD_STATS:
+        node_stats(node, stdout);
+        node_forward(node, cmd);
+        break;
+    case CMD_FETCH:
+        cmd_fetch(node, cmd);
+        break;
+    case CMD_VERIFIED:
+    case CMD_REJECTED:
+    case CMD_READY:
+        node_event(node, cmd);
+        break;
+    case CMD_SERVED:
+        node_served(node, cmd->data);
+        break;
+    case CMD_ADDED:
+        // The commands held behind it run next, see node_run
+        node->adding = 0;
+        break;
+    }
+}
+
+/**
+ * Prepares one listener shard and opens its listening socket.
+ * @param nodes All shards, the chunk cache of the first is shared.
+ * @param count Number of shards.
+ * @param shard Index of the shard to initialise.
+ * @param config Parsed configuration.
+ * @param packages Registry of managed packages.
+ * @return int 0 on success, -1 on failure.
+ */
+static int node_init_shard(struct btide_node* nodes, int count, int shard,
+    Config* config, PackageList* packages) {
+    struct btide_node* node = &nodes[shard];
+    memset(node, 0, sizeof(*node));
+    node->config = config;
+    node->packages = packages;
+    node->shards = nodes;
+    node->nshards = count;
+    node->shard = shard;
+    node->max_peers = (config->max_peers + count - 1) / count;
+    node->running = 1;
+    // The global limits are the buckets of shard 0, charged by every shard
+    if (shard == 0) {
+        tb_init(&node->up_limit, (uint64_t)config->upload_rate * 1024);
+        tb_init(&node->down_limit, (uint64_t)config->download_rate * 1024);
+        if (count > 1) {
+            pthread_mutex_init(&node->limit_lock, NULL);
+            tb_share(&node->up_limit, &node->limit_lock);
+            tb_share(&node->down_limit, &node->limit_lock);
+        }
+    }
+    node->up = &nodes[0].up_limit;
+    node->down = &nodes[0].down_limit;
+    if (shard > 0) {
+        node->cache = nodes[0].cache;
+    } else if (config->chunk_cache_mb > 0) {
+        node->cache = cache_create((size_t)config->chunk_cache_mb << 20);
+        if (!node->cache) {
+            perror("Failed to create chunk cache");
+            return -1;
+        }
+    }
+
+    if (cmd_queue_init(&node->commands) != 0) {
+        perror("Failed to create command queue");
+        return -1;
+    }
+    if (writer_start(&node->writer, packages, config->write_sync,
+        (uint64_t)config->write_batch_ms * 1000000ULL, (size_t)config->write_queue_mb << 20,
+        node_written, node) != 0) {
+        perror("Failed to start chunk writer");
+        return -1;
+    }
+
+    node->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (node->listen_fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(node->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // The kernel spreads incoming connections over the shards' sockets
+    if (count > 1 && setsockopt(node->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("Failed to share listening port");
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(config->port);
+    if (bind(node->listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("Bind failed");
+        return -1;
+    }
+    if (listen(node->listen_fd, node->max_peers) < 0 || set_nonblocking(node->listen_fd) != 0) {
+        perror("Listen failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Prepares the listener shards and opens their listening sockets.
+ * @param nodes Array of count nodes to initialise.
+ * @param count Number of shards, at least 1.
+ * @param config Parsed configuration.
+ * @param packages Registry of managed packages.
+ * @return int 0 on success, -1 on failure.
+ */
+int node_init(struct btide_node* nodes, int count, Config* config, PackageList* packages) {
+    for (int i = 0; i < count; i++) {
+        if (node_init_shard(nodes, count, i, config, packages) != 0) {
+            return -1;
+        }
+    }
+    watchPackages(packages, node_package_ready, &nodes[0]);
+    watchDemotions(packages, node_chunk_demoted, &nodes[0]);
+    return 0;
+}
+
+/**
+ * Event loop of the network thread. Accepts peers, exchanges packets and
+ * executes queued commands until a QUIT command is received.
+ * @param node The node to run.
+ */
+void node_run(struct btide_node* node) {
+    struct pollfd* fds = NULL;
+    struct peer** polled = NULL;
+    size_t cap = 0;
+
+    while (node->running) {
+        size_t n = 2 + (size_t)node->npeers;
+        if (n > cap) {
+            cap = n * 2;
+            fds = realloc(fds, cap * sizeof(struct pollfd));
+            polled = realloc(polled, cap * sizeof(struct peer*));
+            if (!fds || !polled) {
+                perror("Failed to allocate poll set");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        fds[0].fd = cmd_queue_fd(&node->commands);
+        fds[0].events = POLLIN;
+        fds[1].fd = node->listen_fd;
+        fds[1].events = POLLIN;
+        n = 2;
+
+        // Throttled peers are not polled, instead the timeout wakes the
+        // loop when the first of their buckets has refilled. Nothing is read
+        // while the writer is full, the chunks it writes wake the loop, nor
+        // from a peer waiting on many reads, which wake it as they complete
+        uint64_t now = tb_now_ns();
+        uint64_t wait = UINT64_MAX;
+        int full = writer_full(&node->writer);
+        for (struct peer* p = node->peers; p; p = p->next) {
+            fds[n].fd = p->fd;
+            fds[n].events = 0;
+            if (p->state == PEER_CONNECTING || (p->sq_head && p->blocked)) {
+                fds[n].events |= POLLOUT;
+            } else if (p->sq_head) {
+                uint64_t w = tb_wait_ns(&p->up, now);
+                uint64_t g = tb_wait_ns(node->up, now);
+                w = w > g ? w : g;
+                wait = w < wait ? w : wait;
+            }
+            uint64_t r = tb_wait_ns(&p->down, now);
+            uint64_t g = tb_wait_ns(node->down, now);
+            r = r > g ? r : g;
+            if (r == 0 && !full && p->reading < PEER_READS_MAX) {
+                fds[n].events |= POLLIN;
+            } else if (r != 0) {
+                wait = r < wait ? r : wait;
+            }
+            polled[n] = p;
+            n++;
+        }
+        if (node->shard == 0 && node->config->metrics_file[0] != '\0') {
+            if (now >= node->next_dump_ns) {
+                node_dump_stats(node);
+                node->next_dump_ns = now + (uint64_t)node->config->metrics_interval * 1000000000ULL;
+            }
+            uint64_t d = node->next_dump_ns - now;
+            wait = d < wait ? d : wait;
+        }
+        int timeout = wait == UINT64_MAX ? -1 : (int)((wait + 999999) / 1000000);
+
+        if (poll(fds, n, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            break;
+        }
+
+        for (size_t i = 2; i < n; i++) {
+            struct peer* p = polled[i];
+            short ev = fds[i].revents;
+            if (!ev || p->closing) {
+                continue;
+            }
+            if (p->state == PEER_CONNECTING) {
+                if (ev & (POLLOUT | POLLERR | POLLHUP)) {
+                    peer_connected(node, p);
+                }
+                continue;
+            }
+            if (ev & (POLLIN | POLLHUP | POLLERR)) {
+                peer_read(node, p);
+            }
+            if ((ev & POLLOUT) && !p->closing) {
+                p->blocked = 0;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_peers(node);
+        }
+        // Commands run after network events so control never waits on I/O
+        if (fds[0].revents & POLLIN) {
+            cmd_queue_drain(&node->commands);
+        }
+        struct command* cmd;
+        while (node->running && (cmd = cmd_queue_pop(&node->commands)) != NULL) {
+            if (node_hold(node, cmd)) {
+                continue;
+            }
+            node_execute(node, cmd);
+            free(cmd);
+            // Commands held behind a finished ADDPACKAGE go before newer ones
+            while (node->running && (cmd = node_unhold(node)) != NULL) {
+                node_execute(node, cmd);
+                free(cmd);
+            }
+        }
+        node_schedule(node);
+        node_announce(node);
+        node_pump(node);
+        peer_sweep(node);
+    }
+    free(fds);
+    free(polled);
+}
+
+/**
+ * Disconnects all peers and releases the node's resources.
+ * @param node The node to close.
+ */
+void node_close(struct btide_node* node) {
+    // Chunks still queued are written, their notifications are dropped below
+    writer_stop(&node->writer);
+    for (struct peer* p = node->peers; p; p = p->next) {
+        peer_close(node, p);
+    }
+    peer_sweep(node);
+    while (node->downloads) {
+        download_remove(node, node->downloads);
+    }
+    for (size_t i = 0; i < node->nhaves; i++) {
+        releasePackage(node->haves[i].pkg);
+    }
+    free(node->haves);
+    close(node->listen_fd);
+    free(node->sendable);
+    if (node->shard == 0 && node->config->metrics_file[0] != '\0') {
+        node_dump_stats(node);
+    }
+
+    struct command* cmd;
+    while ((cmd = cmd_queue_pop(&node->commands)) != NULL) {
+        if (cmd->type == CMD_SERVED) {
+            serve_job_free(cmd->data);
+        }
+        free(cmd);
+    }
+    node->adding = 0;
+    while ((cmd = node_unhold(node)) != NULL) {
+        free(cmd);
+    }
+    close(node->commands.wake_fds[0]);
+    close(node->commands.wake_fds[1]);
+    // The other shards share the cache and limits of shard 0, closed last
+    if (node->shard == 0) {
+        cache_destroy(node->cache);
+        if (node->nshards > 1) {
+            pthread_mutex_destroy(&node->limit_lock);
+        }
+    }
+}
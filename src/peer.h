@@ -0,0 +1,224 @@
+/*
+ ============================================================================
+ Name        : peer.h
+ ============================================================================
+ */
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "net/packet.h"
+#include "config.h"
+#include "package.h"
+#include "command.h"
+#include "ratelimit.h"
+#include "chunkcache.h"
+#include "picker.h"
+#include "writer.h"
+
+#define PEER_ADDR_LEN 64
+
+enum peer_state {
+    // Outbound connect() still in progress
+    PEER_CONNECTING,
+    // Connected, waiting for ACP or ACK
+    PEER_HANDSHAKE,
+    PEER_ESTABLISHED,
+};
+
+/**
+ * Encoded packet waiting in a peer's send queue. A RES built from cached
+ * chunk data keeps a reference to it instead of a copy, its data bytes
+ * are sent straight from ref at ref_off. A RES carrying chunk data also
+ * records the serial of its package, the chunk index and its file offset
+ * so a CCL can withdraw it, serial is 0 for every other packet.
+ */
+struct pkt_buf {
+    struct pkt_buf* next;
+    struct chunk_buf* ref;
+    uint32_t ref_off;
+    uint16_t ref_len;
+    uint64_t serial;
+    uint32_t chunk;
+    uint32_t offset;
+    uint8_t data[PACKET_SIZE];
+};
+
+/**
+ * Chunks of one package held by a peer, learnt from its BMP and HAV
+ * packets. sent is set once our own bitmap of the package went out.
+ * - bits: one bit per chunk of the local manifest.
+ * - nbits: number of bits set.
+ */
+struct peer_have {
+    Package* pkg;
+    uint64_t* bits;
+    uint32_t nbits;
+    int sent;
+    struct peer_have* next;
+};
+
+/**
+ * Connection to another btide node. Owned by the network thread.
+ * - rbuf, rlen: partially received packet.
+ * - sq_head, sq_tail, sq_off: encoded packets still to be sent, sq_off
+ *   bytes of the head packet have already been written.
+ * - up, down: per-peer bandwidth limits, nested inside the node's limits.
+ * - blocked: the socket buffer is full, wait for POLLOUT before sending.
+ * - bytes_in, bytes_out, sq_len: traffic totals and send queue depth.
+ * - haves: availability of the packages exchanged with the peer.
+ * - inflight: bytes of chunks requested from the peer and not yet received.
+ * - id: unique within the shard, names the peer to tasks outliving it.
+ * - reading: disk reads in flight on the pool for the peer's requests.
+ */
+struct peer {
+    int fd;
+    char ip[PEER_ADDR_LEN];
+    uint16_t port;
+    enum peer_state state;
+    int outbound;
+    int closing;
+    uint8_t rbuf[PACKET_SIZE];
+    size_t rlen;
+    struct pkt_buf* sq_head;
+    struct pkt_buf* sq_tail;
+    size_t sq_off;
+    struct token_bucket up;
+    struct token_bucket down;
+    int blocked;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    size_t sq_len;
+    struct peer_have* haves;
+    uint64_t inflight;
+    uint64_t id;
+    uint32_t reading;
+    struct peer* next;
+};
+
+/**
+ * Chunk being downloaded in response to a FETCH command, sent_ns is when
+ * the REQ was queued. The chunk is gathered in data and only written once
+ * verified.
+ */
+struct fetch {
+    Package* pkg;
+    uint32_t index;
+    struct peer* peer;
+    uint8_t* data;
+    uint32_t received;
+    uint64_t sent_ns;
+    struct fetch* next;
+};
+
+/**
+ * Package being downloaded by a FETCH naming only its identifier. Missing
+ * chunks are requested from every peer holding them, rarest first. Once
+ * every missing chunk has been requested and few remain, the download is
+ * in endgame: the remaining chunks are also requested from other peers and
+ * the requests still pending when one copy arrives are cancelled.
+ * - start_ns: when the FETCH was executed.
+ * - tail_ns: when the last missing chunk was requested, 0 before.
+ */
+struct download {
+    Package* pkg;
+    struct picker picker;
+    uint64_t start_ns;
+    uint64_t tail_ns;
+    struct download* next;
+};
+
+/**
+ * Chunk verified locally and not yet announced to peers in a HAV.
+ */
+struct have_event {
+    Package* pkg;
+    uint32_t index;
+};
+
+/**
+ * State of the local node, owned by the network thread. Other threads
+ * only interact with it by pushing onto commands. A node may be split into
+ * listener shards, each with its own network thread, listening socket and
+ * peers. Shard 0 executes the commands read from input, owns outbound
+ * peers and package downloads, and passes commands naming other peers on.
+ * - shards, nshards, shard: every shard of the node and the index of this
+ *   one.
+ * - max_peers: this shard's share of config->max_peers.
+ * - up, down: global bandwidth limits shared by all peers, the up_limit
+ *   and down_limit of shard 0, guarded by its limit_lock when sharded.
+ * - sendable, rr: scratch list and rotation used to share upload
+ *   capacity fairly between peers.
+ * - next_dump_ns: when the metrics file is due to be rewritten.
+ * - cache: recently served chunks shared by the shards, NULL when disabled.
+ * - downloads: packages fetched rarest first, rescheduled when reschedule
+ *   is set by a change of availability or of the chunks in flight.
+ * - haves: chunks to announce at the end of the current loop iteration.
+ * - writer: writes verified chunks, peers are not read while it is full.
+ * - peer_ids: last id given to a peer of this shard.
+ * - adding, held: an ADDPACKAGE is being loaded on the pool, the commands
+ *   read after it wait in held, in order, until it is done.
+ */
+struct btide_node {
+    Config* config;
+    PackageList* packages;
+    struct btide_node* shards;
+    int nshards;
+    int shard;
+    int max_peers;
+    struct cmd_queue commands;
+    int listen_fd;
+    struct peer* peers;
+    int npeers;
+    struct fetch* fetches;
+    struct token_bucket* up;
+    struct token_bucket* down;
+    struct token_bucket up_limit;
+    struct token_bucket down_limit;
+    pthread_mutex_t limit_lock;
+    struct peer** sendable;
+    size_t sendable_cap;
+    unsigned rr;
+    uint64_t next_dump_ns;
+    struct chunk_cache* cache;
+    struct download* downloads;
+    int reschedule;
+    struct have_event* haves;
+    size_t nhaves;
+    size_t haves_cap;
+    struct chunk_writer writer;
+    uint64_t peer_ids;
+    int adding;
+    struct command* held;
+    struct command* held_tail;
+    int running;
+};
+
+/**
+ * Prepares the listener shards of a node and opens their listening
+ * sockets. With several shards every socket is bound to the configured
+ * port with SO_REUSEPORT, so the kernel spreads incoming peers over them.
+ * @param nodes The shards to initialise.
+ * @param count Number of shards, at least 1.
+ * @param config Parsed configuration.
+ * @param packages Registry of managed packages.
+ * @return int 0 on success, -1 on failure.
+ */
+int node_init(struct btide_node* nodes, int count, Config* config, PackageList* packages);
+
+/**
+ * Event loop of the network thread of a shard. Accepts peers, exchanges
+ * packets and executes queued commands until a QUIT command is received.
+ * @param node The shard to run.
+ */
+void node_run(struct btide_node* node);
+
+/**
+ * Disconnects all peers and releases the shard's resources, shard 0 last
+ * as the others share its chunk cache and bandwidth limits.
+ * @param node The shard to close.
+ */
+void node_close(struct btide_node* node);
+
+#endif // PEER_H
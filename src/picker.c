@@ -0,0 +1,290 @@
+/*
+ ============================================================================
+ Name        : picker.c
+ ============================================================================
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "picker.h"
+
+#define PICKER_INITIAL_BUCKETS 8
+
+/**
+ * Returns the next value of the picker's xorshift generator.
+ * @param p The picker.
+ * @return uint64_t A pseudo random value.
+ */
+static uint64_t picker_rand(struct picker* p) {
+    p->rng ^= p->rng << 13;
+    p->rng ^= p->rng >> 7;
+    p->rng ^= p->rng << 17;
+    return p->rng;
+}
+
+/**
+ * Sets or clears the wanted bit of a chunk.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ * @param on 1 if the chunk is wanted.
+ */
+static void wanted_set(struct picker* p, uint32_t index, int on) {
+    uint64_t bit = 1ULL << (index % 64);
+    if (on) {
+        p->wanted[index / 64] |= bit;
+    } else {
+        p->wanted[index / 64] &= ~bit;
+    }
+}
+
+/**
+ * Adds a chunk to the bucket of its availability, at a random end.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+static void bucket_link(struct picker* p, uint32_t index) {
+    uint32_t c = p->count[index];
+    if (p->heads[c] == PICKER_NONE) {
+        p->prev[index] = p->next[index] = PICKER_NONE;
+        p->heads[c] = p->tails[c] = index;
+    } else if (picker_rand(p) & 1) {
+        p->prev[index] = PICKER_NONE;
+        p->next[index] = p->heads[c];
+        p->prev[p->heads[c]] = index;
+        p->heads[c] = index;
+    } else {
+        p->next[index] = PICKER_NONE;
+        p->prev[index] = p->tails[c];
+        p->next[p->tails[c]] = index;
+        p->tails[c] = index;
+    }
+    if (c > 0 && c < p->min) {
+        p->min = c;
+    }
+}
+
+/**
+ * Removes a chunk from the bucket of its availability.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+static void bucket_unlink(struct picker* p, uint32_t index) {
+    uint32_t c = p->count[index];
+    if (p->prev[index] != PICKER_NONE) {
+        p->next[p->prev[index]] = p->next[index];
+    } else {
+        p->heads[c] = p->next[index];
+    }
+    if (p->next[index] != PICKER_NONE) {
+        p->prev[p->next[index]] = p->prev[index];
+    } else {
+        p->tails[c] = p->prev[index];
+    }
+}
+
+/**
+ * Initialises a picker with every chunk wanted and unavailable.
+ * @param p The picker.
+ * @param nchunks Number of chunks of the package.
+ * @param seed Seed for the choice between equally rare chunks.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int picker_init(struct picker* p, uint32_t nchunks, uint64_t seed) {
+    memset(p, 0, sizeof(*p));
+    p->nchunks = nchunks;
+    p->nbuckets = PICKER_INITIAL_BUCKETS;
+    p->min = p->nbuckets;
+    p->rng = seed | 1;
+    p->count = calloc(nchunks ? nchunks : 1, sizeof(uint32_t));
+    p->prev = malloc((nchunks ? nchunks : 1) * sizeof(uint32_t));
+    p->next = malloc((nchunks ? nchunks : 1) * sizeof(uint32_t));
+    p->state = calloc(nchunks ? nchunks : 1, 1);
+    p->wanted = calloc(nchunks / 64 + 1, sizeof(uint64_t));
+    p->heads = malloc(p->nbuckets * sizeof(uint32_t));
+    p->tails = malloc(p->nbuckets * sizeof(uint32_t));
+    if (!p->count || !p->prev || !p->next || !p->state || !p->wanted
+        || !p->heads || !p->tails) {
+        picker_free(p);
+        return -1;
+    }
+    for (uint32_t c = 0; c < p->nbuckets; c++) {
+        p->heads[c] = p->tails[c] = PICKER_NONE;
+    }
+    for (uint32_t i = 0; i < nchunks; i++) {
+        p->state[i] = PICK_WANTED;
+        wanted_set(p, i, 1);
+        bucket_link(p, i);
+    }
+    p->nwanted = nchunks;
+    return 0;
+}
+
+/**
+ * Frees the memory of a picker.
+ * @param p The picker.
+ */
+void picker_free(struct picker* p) {
+    free(p->count);
+    free(p->prev);
+    free(p->next);
+    free(p->state);
+    free(p->wanted);
+    free(p->heads);
+    free(p->tails);
+    memset(p, 0, sizeof(*p));
+}
+
+/**
+ * Records one more peer holding a chunk.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int picker_add(struct picker* p, uint32_t index) {
+    if (p->count[index] + 1 >= p->nbuckets) {
+        uint32_t n = p->nbuckets * 2;
+        uint32_t* heads = realloc(p->heads, n * sizeof(uint32_t));
+        if (heads) {
+            p->heads = heads;
+        }
+        uint32_t* tails = heads ? realloc(p->tails, n * sizeof(uint32_t)) : NULL;
+        if (!tails) {
+            return -1;
+        }
+        p->tails = tails;
+        for (uint32_t c = p->nbuckets; c < n; c++) {
+            p->heads[c] = p->tails[c] = PICKER_NONE;
+        }
+        if (p->min == p->nbuckets) {
+            p->min = n;
+        }
+        p->nbuckets = n;
+    }
+    int wanted = p->state[index] == PICK_WANTED;
+    if (wanted) {
+        bucket_unlink(p, index);
+    }
+    p->count[index]++;
+    if (wanted) {
+        bucket_link(p, index);
+    }
+    return 0;
+}
+
+/**
+ * Records one peer less holding a chunk.
+ * @param p The picker.
+ * @param index Index of the chunk, its availability must be above 0.
+ */
+void picker_remove(struct picker* p, uint32_t index) {
+    int wanted = p->state[index] == PICK_WANTED;
+    if (wanted) {
+        bucket_unlink(p, index);
+    }
+    p->count[index]--;
+    if (wanted) {
+        bucket_link(p, index);
+    }
+}
+
+/**
+ * Takes a wanted chunk out of selection once it has been requested.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+void picker_start(struct picker* p, uint32_t index) {
+    if (p->state[index] != PICK_WANTED) {
+        return;
+    }
+    bucket_unlink(p, index);
+    wanted_set(p, index, 0);
+    p->state[index] = PICK_ACTIVE;
+    p->nwanted--;
+    p->nactive++;
+}
+
+/**
+ * Puts a requested chunk back into selection, for example after its
+ * download failed.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+void picker_abort(struct picker* p, uint32_t index) {
+    if (p->state[index] != PICK_ACTIVE) {
+        return;
+    }
+    p->state[index] = PICK_WANTED;
+    wanted_set(p, index, 1);
+    bucket_link(p, index);
+    p->nactive--;
+    p->nwanted++;
+}
+
+/**
+ * Records a chunk as present, it is never selected again.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+void picker_done(struct picker* p, uint32_t index) {
+    if (p->state[index] == PICK_WANTED) {
+        bucket_unlink(p, index);
+        wanted_set(p, index, 0);
+        p->nwanted--;
+    } else if (p->state[index] == PICK_ACTIVE) {
+        p->nactive--;
+    }
+    p->state[index] = PICK_DONE;
+}
+
+/**
+ * Selects the rarest wanted chunk a peer holds. Buckets are searched from
+ * the rarest, skipping chunks the peer does not have. A peer holding none
+ * of the rarest chunks would make that walk visit every wanted chunk, so
+ * after PICKER_SCAN_MAX entries the peer's bitmap is intersected with the
+ * wanted chunks a word at a time instead. A pick costs
+ * O(PICKER_SCAN_MAX + nchunks / 64 + k), k being the wanted chunks the peer
+ * holds, and returns early on a chunk in the lowest non-empty bucket.
+ * @param p The picker.
+ * @param bits Chunks held by the peer, one bit per chunk.
+ * @return uint32_t Index of the chunk, PICKER_NONE if the peer holds no
+ *         wanted chunk.
+ */
+uint32_t picker_pick(struct picker* p, const uint64_t* bits) {
+    // Buckets emptied since min was lowered are skipped for good
+    while (p->min < p->nbuckets && p->heads[p->min] == PICKER_NONE) {
+        p->min++;
+    }
+    uint32_t budget = PICKER_SCAN_MAX;
+    for (uint32_t c = p->min; c < p->nbuckets; c++) {
+        for (uint32_t i = p->heads[c]; i != PICKER_NONE; i = p->next[i]) {
+            if (bits[i / 64] >> (i % 64) & 1) {
+                return i;
+            }
+            if (--budget == 0) {
+                goto scan;
+            }
+        }
+    }
+    return PICKER_NONE;
+
+scan:;
+    uint32_t best = PICKER_NONE;
+    uint32_t nwords = (p->nchunks + 63) / 64;
+    for (uint32_t w = 0; w < nwords; w++) {
+        uint64_t held = bits[w] & p->wanted[w];
+        while (held) {
+            uint32_t i = w * 64 + (uint32_t)__builtin_ctzll(held);
+            held &= held - 1;
+            // Chunks nobody is known to hold are never picked
+            uint32_t c = p->count[i];
+            if (c == 0 || (best != PICKER_NONE && c >= p->count[best])) {
+                continue;
+            }
+            best = i;
+            if (c == p->min) {
+                return best;
+            }
+        }
+    }
+    return best;
+}
@@ -0,0 +1,124 @@
+/*
+ ============================================================================
+ Name        : picker.h
+ ============================================================================
+ */
+#ifndef PICKER_H
+#define PICKER_H
+
+#include <stdint.h>
+
+// Index standing for no chunk
+#define PICKER_NONE UINT32_MAX
+// Bucket entries a pick examines before it scans the peer's bitmap instead
+#define PICKER_SCAN_MAX 64
+
+enum pick_state {
+    // Missing and not requested, listed in the bucket of its availability
+    PICK_WANTED,
+    // Requested from a peer, no longer listed
+    PICK_ACTIVE,
+    // Present locally, never listed again
+    PICK_DONE,
+};
+
+/**
+ * Rarest first selection of the chunks a download still needs. The
+ * availability of a chunk is the number of peers known to hold it. Every
+ * wanted chunk is linked into the bucket of its availability, so a change
+ * of availability moves it in O(1) and the rarest wanted chunk is the head
+ * of the lowest non-empty bucket. Chunks nobody has stay in bucket 0 and
+ * are never picked.
+ * - count: availability of every chunk, kept whatever its state.
+ * - wanted: one bit per chunk in the PICK_WANTED state.
+ * - prev, next: links of the chunk within its bucket.
+ * - heads, tails: ends of every bucket, nbuckets grows with availability.
+ * - min: lowest bucket above 0 that may be non-empty.
+ * - nwanted, nactive: chunks in each state.
+ * - rng: picks the end of a bucket chunks are added to, so peers starting
+ *   from the same counts spread over different chunks.
+ */
+struct picker {
+    uint32_t nchunks;
+    uint32_t* count;
+    uint32_t* prev;
+    uint32_t* next;
+    uint8_t* state;
+    uint64_t* wanted;
+    uint32_t* heads;
+    uint32_t* tails;
+    uint32_t nbuckets;
+    uint32_t min;
+    uint32_t nwanted;
+    uint32_t nactive;
+    uint64_t rng;
+};
+
+/**
+ * Initialises a picker with every chunk wanted and unavailable.
+ * @param p The picker.
+ * @param nchunks Number of chunks of the package.
+ * @param seed Seed for the choice between equally rare chunks.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int picker_init(struct picker* p, uint32_t nchunks, uint64_t seed);
+
+/**
+ * Frees the memory of a picker.
+ * @param p The picker.
+ */
+void picker_free(struct picker* p);
+
+/**
+ * Records one more peer holding a chunk.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int picker_add(struct picker* p, uint32_t index);
+
+/**
+ * Records one peer less holding a chunk.
+ * @param p The picker.
+ * @param index Index of the chunk, its availability must be above 0.
+ */
+void picker_remove(struct picker* p, uint32_t index);
+
+/**
+ * Takes a wanted chunk out of selection once it has been requested.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+void picker_start(struct picker* p, uint32_t index);
+
+/**
+ * Puts a requested chunk back into selection, for example after its
+ * download failed.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+void picker_abort(struct picker* p, uint32_t index);
+
+/**
+ * Records a chunk as present, it is never selected again.
+ * @param p The picker.
+ * @param index Index of the chunk.
+ */
+void picker_done(struct picker* p, uint32_t index);
+
+/**
+ * Selects the rarest wanted chunk a peer holds. Buckets are searched from
+ * the rarest, skipping chunks the peer does not have. A peer holding none
+ * of the rarest chunks would make that walk visit every wanted chunk, so
+ * after PICKER_SCAN_MAX entries the peer's bitmap is intersected with the
+ * wanted chunks a word at a time instead. A pick costs
+ * O(PICKER_SCAN_MAX + nchunks / 64 + k), k being the wanted chunks the peer
+ * holds, and returns early on a chunk in the lowest non-empty bucket.
+ * @param p The picker.
+ * @param bits Chunks held by the peer, one bit per chunk.
+ * @return uint32_t Index of the chunk, PICKER_NONE if the peer holds no
+ *         wanted chunk.
+ */
+uint32_t picker_pick(struct picker* p, const uint64_t* bits);
+
+#endif // PICKER_H
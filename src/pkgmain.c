@@ -10,10 +10,49 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <errno.h>
+#include <stdint.h>
 #include "tree/merkletree.h"
+#include "chk/pkgindex.h"
 
 #define SHA256_HEX_LEN (65)
 
+/**
+ * Parses a chunk index of -range_hashes.
+ * @param arg The argument.
+ * @param out Receives the index.
+ * @return int 0 on success, -1 if the argument is not a chunk index.
+ */
+static int parse_chunk_index(const char* arg, uint32_t* out) {
+	char* end;
+	errno = 0;
+	unsigned long value = strtoul(arg, &end, 10);
+	if(end == arg || *end != '\0' || arg[0] == '-' || errno != 0 || value > UINT32_MAX) {
+		return -1;
+	}
+	*out = (uint32_t)value;
+	return 0;
+}
+
+/**
+ * Checks the chunk range of -range_hashes against the package, exiting
+ * with an error if it is empty or out of bounds.
+ * @param argv The array of arguments.
+ * @param nchunks Number of chunks in the package.
+ * @param start Receives the index of the first chunk.
+ * @param end Receives the index one past the last chunk.
+ */
+static void range_args(char** argv, uint32_t nchunks, uint32_t* start, uint32_t* end) {
+	if(parse_chunk_index(argv[3], start) != 0 || parse_chunk_index(argv[4], end) != 0) {
+		puts("Invalid chunk range");
+		exit(1);
+	}
+	if(*start >= *end || *end > nchunks) {
+		puts("Chunk range out of bounds");
+		exit(1);
+	}
+}
+
 /**
  * Function to select the argument provided in the command line.
  * @param argc The number of arguments.
@@ -52,6 +91,20 @@ int arg_select(int argc, char** argv, int* asel, char* harg) {
 	if(strcmp(cursor, "-file_check") == 0) {
 		*asel = 5;
 	}
+	if(strcmp(cursor, "-range_hashes") == 0) {
+		if(argc < 5) {
+			puts("chunk range not provided");
+			exit(1);
+		}
+		*asel = 6;
+	}
+	if(strcmp(cursor, "-diff") == 0) {
+		if(argc < 4) {
+			puts("bpkg to compare against not provided");
+			exit(1);
+		}
+		*asel = 7;
+	}
 	return *asel;
 }
 
@@ -69,6 +122,44 @@ void bpkg_print_hashes(struct bpkg_query* qry) {
     }
 }
 
+/**
+ * Answers the queries that touch part of the tree from a lazily opened
+ * manifest, reading only the lines they need instead of the whole file.
+ * Trees that are not complete are left to bpkg_load.
+ * @param argselect The selected query.
+ * @param argv The array of arguments.
+ * @param hash The hash argument of -hashes_of.
+ * @return int 1 if the query was answered, 0 otherwise.
+ */
+static int lazy_query(int argselect, char** argv, char* hash) {
+	if(argselect != 4 && argselect != 6) {
+		return 0;
+	}
+	struct bpkg_index* idx = bpkg_index_open(argv[1]);
+	if(!idx || bpkg_tree_height(&idx->head) < 0) {
+		bpkg_index_close(idx);
+		return 0;
+	}
+
+	struct bpkg_query qry = { 0 };
+	if(argselect == 4) {
+		qry = bpkg_index_hashes_of(idx, hash);
+		if(qry.len < 0) {
+			printf("Node not found\n");
+			bpkg_index_close(idx);
+			exit(1);
+		}
+	} else {
+		uint32_t start, end;
+		range_args(argv, idx->head.nchunks, &start, &end);
+		qry = bpkg_index_range_hashes(idx, start, end);
+	}
+	bpkg_print_hashes(&qry);
+	bpkg_query_destroy(&qry);
+	bpkg_index_close(idx);
+	return 1;
+}
+
 /**
  * The main function to handle different operations based on command line arguments.
  * @param argc The number of arguments.
@@ -82,6 +173,9 @@ int main(int argc, char** argv) {
 
 
 	if(arg_select(argc, argv, &argselect, hash)) {
+		if(lazy_query(argselect, argv, hash)) {
+			return 0;
+		}
 		struct bpkg_query qry = { 0 };
 		struct bpkg_obj* obj = bpkg_load(argv[1]);
 		
@@ -100,12 +194,38 @@ int main(int argc, char** argv) {
 			qry = bpkg_get_min_completed_hashes(obj);
 			bpkg_print_hashes(&qry);
 		} else if(argselect == 4) {
-			qry = bpkg_get_all_chunk_hashes_from_hash(obj, 
-					hash);
+			qry = bpkg_get_cached_chunk_hashes_from_hash(obj,
+					argv[1], hash);
 			bpkg_print_hashes(&qry);
 		} else if(argselect == 5) {
 			qry = bpkg_file_check(obj);
 			bpkg_print_hashes(&qry);
+		} else if(argselect == 6) {
+			uint32_t start, end;
+			range_args(argv, obj->nchunks, &start, &end);
+			qry = bpkg_get_range_hashes(obj, start, end);
+			if(qry.len == 0) {
+				puts("Chunk range not available, tree is not complete");
+				bpkg_obj_destroy(obj);
+				exit(1);
+			}
+			bpkg_print_hashes(&qry);
+		} else if(argselect == 7) {
+			struct bpkg_obj* base = bpkg_load(argv[3]);
+			if(!base) {
+				puts("Unable to load pkg");
+				bpkg_obj_destroy(obj);
+				exit(1);
+			}
+			struct bpkg_diff diff = bpkg_diff_chunks(base, obj);
+			if(diff.len < 0) {
+				puts("Packages have different chunk layouts");
+			}
+			for(int i = 0; i < diff.len; i++) {
+				printf("%u\n", diff.indices[i]);
+			}
+			bpkg_diff_destroy(&diff);
+			bpkg_obj_destroy(base);
 		} else {
 			puts("Argument is invalid");
 			return 1;
@@ -0,0 +1,335 @@
+/*
+ ============================================================================
+ Name        : pkgmake.c
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "crypt/sha256.h"
+#include "tree/merklebuild.h"
+#include "sched/pool.h"
+
+#define DEFAULT_NCHUNKS (16)
+// Size of every read, large enough to stream from disk at full speed
+#define READ_BLOCK (4 << 20)
+// Contiguous bytes handed to a single hashing task
+#define TASK_BYTES (32 << 20)
+#define OUT_BUFFER (1 << 20)
+#define IDENT_PARTS (MAX_IDENT_LEN / SHA256_HEXLEN)
+
+/**
+ * Chunk layout of the input: every chunk has base bytes and the first
+ * extra chunks one byte more, under nhashes interior nodes of arity
+ * children each.
+ */
+struct layout {
+    uint64_t size;
+    uint32_t arity;
+    uint32_t nchunks;
+    uint32_t nhashes;
+    uint64_t base;
+    uint32_t extra;
+};
+
+/**
+ * Run of consecutive chunks hashed by one task, reading their bytes
+ * sequentially.
+ */
+struct hash_job {
+    const struct layout* lay;
+    int fd;
+    merkle_hex* leaves;
+    uint32_t first;
+    uint32_t last;
+    atomic_int* failed;
+};
+
+/**
+ * Returns the offset of a chunk.
+ * @param lay The layout.
+ * @param i Index of the chunk.
+ * @return uint64_t Offset of the chunk in the input.
+ */
+static uint64_t chunk_offset(const struct layout* lay, uint32_t i) {
+    return (uint64_t)i * lay->base + (i < lay->extra ? i : lay->extra);
+}
+
+/**
+ * Returns the size of a chunk.
+ * @param lay The layout.
+ * @param i Index of the chunk.
+ * @return uint64_t Size of the chunk.
+ */
+static uint64_t chunk_size(const struct layout* lay, uint32_t i) {
+    return lay->base + (i < lay->extra ? 1 : 0);
+}
+
+/**
+ * Pool task hashing a run of chunks. The run is read front to back in
+ * READ_BLOCK reads and each block is fed to the chunks it covers.
+ * @param arg The struct hash_job, freed when done.
+ */
+static void hash_task(void* arg) {
+    struct hash_job* job = arg;
+    const struct layout* lay = job->lay;
+    uint8_t* buf = malloc(READ_BLOCK);
+    if (!buf) {
+        atomic_store(job->failed, 1);
+        free(job);
+        return;
+    }
+
+    struct sha256_compute_data sha;
+    uint8_t digest[SHA256_INT_SZ];
+    uint32_t cur = job->first;
+    uint64_t left = chunk_size(lay, cur);
+    uint64_t pos = chunk_offset(lay, job->first);
+    uint64_t end = chunk_offset(lay, job->last);
+    sha256_compute_data_init(&sha);
+
+    while (cur < job->last) {
+        ssize_t got = 0;
+        if (pos < end) {
+            size_t want = end - pos < READ_BLOCK ? end - pos : READ_BLOCK;
+            got = pread(job->fd, buf, want, (off_t)pos);
+            if (got <= 0) {
+                atomic_store(job->failed, 1);
+                break;
+            }
+            pos += got;
+        }
+
+        // Feed the block to the chunks it covers, empty chunks need no data
+        size_t used = 0;
+        while (cur < job->last && (used < (size_t)got || left == 0)) {
+            size_t take = (size_t)got - used < left ? (size_t)got - used : left;
+            sha256_update(&sha, buf + used, (uint32_t)take);
+            used += take;
+            left -= take;
+            if (left == 0) {
+                sha256_finalize(&sha, digest);
+                sha256_output_hex(&sha, job->leaves[cur]);
+                if (++cur < job->last) {
+                    left = chunk_size(lay, cur);
+                    sha256_compute_data_init(&sha);
+                }
+            }
+        }
+    }
+    free(buf);
+    free(job);
+}
+
+/**
+ * Hashes every chunk into the leaves, in runs of about TASK_BYTES spread
+ * over the pool's workers.
+ * @param lay The layout.
+ * @param fd The input, opened for reading.
+ * @param leaves Receives the chunk hashes.
+ * @param pool The workers.
+ * @return int 0 on success, -1 if the input could not be read.
+ */
+static int hash_chunks(const struct layout* lay, int fd, merkle_hex* leaves,
+    struct pool* pool) {
+    atomic_int failed = 0;
+    struct pool_group group;
+    pool_group_init(&group);
+    uint32_t first = 0;
+    while (first < lay->nchunks) {
+        uint32_t last = first + 1;
+        while (last < lay->nchunks
+            && chunk_offset(lay, last + 1) - chunk_offset(lay, first) <= TASK_BYTES) {
+            last++;
+        }
+        struct hash_job* job = malloc(sizeof(struct hash_job));
+        if (!job) {
+            failed = 1;
+            break;
+        }
+        *job = (struct hash_job){ lay, fd, leaves, first, last, &failed };
+        if (pool_group_submit(pool, &group, hash_task, job) != 0) {
+            free(job);
+            failed = 1;
+            break;
+        }
+        first = last;
+    }
+    pool_group_wait(pool, &group);
+    return atomic_load(&failed) ? -1 : 0;
+}
+
+/**
+ * Derives the 1024 character identifier from the root hash and filename,
+ * so rebuilding identical content gives the same package.
+ * @param root The root hash.
+ * @param filename The filename recorded in the manifest.
+ * @param ident Receives MAX_IDENT_LEN characters and a terminator.
+ */
+static void make_ident(const char* root, const char* filename, char* ident) {
+    for (int i = 0; i < IDENT_PARTS; i++) {
+        struct sha256_compute_data sha;
+        uint8_t digest[SHA256_INT_SZ];
+        uint8_t part = (uint8_t)i;
+        sha256_compute_data_init(&sha);
+        sha256_update(&sha, (void*)root, SHA256_HEXLEN);
+        sha256_update(&sha, (void*)filename, (uint32_t)strlen(filename));
+        sha256_update(&sha, &part, 1);
+        sha256_finalize(&sha, digest);
+        sha256_output_hex(&sha, ident + i * SHA256_HEXLEN);
+    }
+    ident[MAX_IDENT_LEN] = '\0';
+}
+
+/**
+ * Writes the manifest in one pass over the tree.
+ * @param out Destination stream.
+ * @param filename The filename recorded in the manifest.
+ * @param lay The layout.
+ * @param nodes The complete tree.
+ * @return int 0 on success, -1 on a write error.
+ */
+static int emit_bpkg(FILE* out, const char* filename, const struct layout* lay,
+    merkle_hex* nodes) {
+    char ident[MAX_IDENT_LEN + 1];
+    uint32_t nhashes = lay->nhashes;
+    make_ident(nodes[0], filename, ident);
+
+    fprintf(out, "ident:%s\nfilename:%s\nsize:%u\n", ident, filename,
+        (uint32_t)lay->size);
+    // Binary manifests keep the original format
+    if (lay->arity != BPKG_ARITY_DEFAULT) {
+        fprintf(out, "arity:%u\n", lay->arity);
+    }
+    fprintf(out, "nhashes:%u\nhashes:\n", nhashes);
+    for (uint32_t i = 0; i < nhashes; i++) {
+        fprintf(out, "\t%.64s\n", nodes[i]);
+    }
+    fprintf(out, "nchunks:%u\nchunks:\n", lay->nchunks);
+    for (uint32_t i = 0; i < lay->nchunks; i++) {
+        fprintf(out, "\t%.64s,%u,%u\n", nodes[nhashes + i],
+            (uint32_t)chunk_offset(lay, i), (uint32_t)chunk_size(lay, i));
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+/**
+ * Prints the usage message.
+ */
+static void usage(void) {
+    puts("Usage: \npkgmake <file>\n\n--chunksz <chunk size>\n--nchunks <number of chunks>\n"
+        "--output <filename>\n--threads <number of hashing threads>\n"
+        "--arity <children per node, 2, 4 or 8>\n\n"
+        "Example: pkgmake somedatafile.dat --nchunks 32 --output somedatafile.bpkg");
+}
+
+/**
+ * Builds a .bpkg manifest for a data file. The number of chunks is rounded
+ * down to a power of the arity, from --nchunks or the size divided by
+ * --chunksz.
+ * Without --output the manifest is written to stdout.
+ */
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    const char* input = argv[1];
+    const char* output = NULL;
+    uint64_t nchunks = DEFAULT_NCHUNKS;
+    uint64_t chunksz = 0;
+    int nthreads = 0;
+    uint32_t arity = BPKG_ARITY_DEFAULT;
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        if (strcmp(argv[i], "--nchunks") == 0) {
+            nchunks = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--chunksz") == 0) {
+            chunksz = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            nthreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--arity") == 0) {
+            arity = (uint32_t)atoi(argv[++i]);
+            if (arity != 2 && arity != 4 && arity != 8) {
+                usage();
+                return 1;
+            }
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    int fd = open(input, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Unable to open file: %s\n", input);
+        return 1;
+    }
+    // Sizes and offsets are 32 bit in the manifest and on the wire
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+        printf("File too large for a package: %s\n", input);
+        close(fd);
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct layout lay;
+    lay.size = (uint64_t)st.st_size;
+    if (chunksz > 0) {
+        nchunks = lay.size / chunksz;
+    }
+    // Largest power of the arity not above the request and the file size
+    uint64_t limit = nchunks < lay.size ? nchunks : lay.size;
+    lay.arity = arity;
+    lay.nchunks = 1;
+    while ((uint64_t)lay.nchunks * arity <= limit
+        && (uint64_t)lay.nchunks * arity <= (1u << 31)) {
+        lay.nchunks *= arity;
+    }
+    lay.nhashes = (lay.nchunks - 1) / (arity - 1);
+    lay.base = lay.size / lay.nchunks;
+    lay.extra = (uint32_t)(lay.size % lay.nchunks);
+
+    merkle_hex* nodes = malloc(((size_t)lay.nhashes + lay.nchunks) * sizeof(merkle_hex));
+    struct pool* pool = pool_create(nthreads);
+    if (!nodes || !pool) {
+        perror("Unable to allocate builder");
+        return 1;
+    }
+
+    if (hash_chunks(&lay, fd, nodes + lay.nhashes, pool) != 0) {
+        printf("Unable to read file: %s\n", input);
+        return 1;
+    }
+    close(fd);
+    merkle_build_levels(nodes, lay.nchunks, lay.arity, pool);
+    pool_destroy(pool);
+
+    FILE* out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        printf("Unable to open file: %s\n", output);
+        free(nodes);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, OUT_BUFFER);
+    int err = emit_bpkg(out, input, &lay, nodes);
+    if ((output ? fclose(out) : fflush(out)) != 0 || err) {
+        perror("Unable to write package");
+        free(nodes);
+        return 1;
+    }
+    free(nodes);
+    return 0;
+}
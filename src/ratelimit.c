@@ -0,0 +1,123 @@
+/*
+ ============================================================================
+ Name        : ratelimit.c
+ ============================================================================
+ */
+#include <time.h>
+#include "ratelimit.h"
+#include "net/packet.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+/**
+ * Returns the current monotonic time.
+ * @return uint64_t Nanoseconds since an arbitrary fixed point.
+ */
+uint64_t tb_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Initialises a full bucket.
+ * @param tb The bucket.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void tb_init(struct token_bucket* tb, uint64_t rate) {
+    tb->rate = rate;
+    // Allow a quarter second of traffic, but at least a couple of packets
+    tb->burst = (double)rate / 4;
+    if (tb->burst < 2 * PACKET_SIZE) {
+        tb->burst = 2 * PACKET_SIZE;
+    }
+    tb->tokens = tb->burst;
+    tb->last_ns = tb_now_ns();
+    tb->lock = NULL;
+}
+
+/**
+ * Lets several threads charge the bucket, every operation takes lock.
+ * @param tb A bucket initialised by tb_init.
+ * @param lock An initialised mutex outliving the bucket.
+ */
+void tb_share(struct token_bucket* tb, pthread_mutex_t* lock) {
+    tb->lock = lock;
+}
+
+/**
+ * Adds the tokens accumulated since the last refill.
+ * @param tb The bucket.
+ * @param now_ns Current time from tb_now_ns.
+ */
+static void tb_refill(struct token_bucket* tb, uint64_t now_ns) {
+    if (now_ns <= tb->last_ns) {
+        return;
+    }
+    tb->tokens += (double)(now_ns - tb->last_ns) * tb->rate / NS_PER_SEC;
+    if (tb->tokens > tb->burst) {
+        tb->tokens = tb->burst;
+    }
+    tb->last_ns = now_ns;
+}
+
+/**
+ * Checks whether a transfer may start now.
+ * @param tb The bucket.
+ * @param now_ns Current time from tb_now_ns.
+ * @return int 1 if the balance is positive or the bucket is unlimited.
+ */
+int tb_ready(struct token_bucket* tb, uint64_t now_ns) {
+    if (tb->rate == 0) {
+        return 1;
+    }
+    if (tb->lock) {
+        pthread_mutex_lock(tb->lock);
+    }
+    tb_refill(tb, now_ns);
+    int ready = tb->tokens > 0;
+    if (tb->lock) {
+        pthread_mutex_unlock(tb->lock);
+    }
+    return ready;
+}
+
+/**
+ * Charges transferred bytes to the bucket.
+ * @param tb The bucket.
+ * @param bytes Number of bytes transferred.
+ */
+void tb_consume(struct token_bucket* tb, size_t bytes) {
+    if (tb->rate == 0) {
+        return;
+    }
+    if (tb->lock) {
+        pthread_mutex_lock(tb->lock);
+    }
+    tb->tokens -= (double)bytes;
+    if (tb->lock) {
+        pthread_mutex_unlock(tb->lock);
+    }
+}
+
+/**
+ * Returns how long until tb_ready will succeed.
+ * @param tb The bucket.
+ * @param now_ns Current time from tb_now_ns.
+ * @return uint64_t Nanoseconds to wait, 0 if ready now.
+ */
+uint64_t tb_wait_ns(struct token_bucket* tb, uint64_t now_ns) {
+    if (tb->rate == 0) {
+        return 0;
+    }
+    if (tb->lock) {
+        pthread_mutex_lock(tb->lock);
+    }
+    tb_refill(tb, now_ns);
+    // Wait until the balance is back above zero
+    uint64_t wait = tb->tokens > 0 ? 0 : (uint64_t)((-tb->tokens + 1) * NS_PER_SEC / tb->rate);
+    if (tb->lock) {
+        pthread_mutex_unlock(tb->lock);
+    }
+    return wait;
+}
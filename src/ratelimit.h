@@ -0,0 +1,71 @@
+/*
+ ============================================================================
+ Name        : ratelimit.h
+ ============================================================================
+ */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Token bucket limiting a byte rate. Tokens refill continuously up to the
+ * burst size. Transfers are allowed while the balance is positive and may
+ * overdraw it, the debt delays the next transfer instead.
+ * A rate of 0 disables the limit. A bucket charged from several threads
+ * is guarded by lock, NULL when a single thread owns it.
+ */
+struct token_bucket {
+    uint64_t rate;
+    double burst;
+    double tokens;
+    uint64_t last_ns;
+    pthread_mutex_t* lock;
+};
+
+/**
+ * Returns the current monotonic time.
+ * @return uint64_t Nanoseconds since an arbitrary fixed point.
+ */
+uint64_t tb_now_ns(void);
+
+/**
+ * Initialises a full bucket.
+ * @param tb The bucket.
+ * @param rate Bytes per second, 0 for unlimited.
+ */
+void tb_init(struct token_bucket* tb, uint64_t rate);
+
+/**
+ * Lets several threads charge the bucket, every operation takes lock.
+ * @param tb A bucket initialised by tb_init.
+ * @param lock An initialised mutex outliving the bucket.
+ */
+void tb_share(struct token_bucket* tb, pthread_mutex_t* lock);
+
+/**
+ * Checks whether a transfer may start now.
+ * @param tb The bucket.
+ * @param now_ns Current time from tb_now_ns.
+ * @return int 1 if the balance is positive or the bucket is unlimited.
+ */
+int tb_ready(struct token_bucket* tb, uint64_t now_ns);
+
+/**
+ * Charges transferred bytes to the bucket.
+ * @param tb The bucket.
+ * @param bytes Number of bytes transferred.
+ */
+void tb_consume(struct token_bucket* tb, size_t bytes);
+
+/**
+ * Returns how long until tb_ready will succeed.
+ * @param tb The bucket.
+ * @param now_ns Current time from tb_now_ns.
+ * @return uint64_t Nanoseconds to wait, 0 if ready now.
+ */
+uint64_t tb_wait_ns(struct token_bucket* tb, uint64_t now_ns);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,124 @@
+/*
+ ============================================================================
+ Name        : rcu.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "rcu.h"
+
+// Per-thread reader record, linked into a global list that is only ever
+// appended to. Records of exited threads are recycled.
+struct rcu_reader {
+    // Epoch observed on entry, 0 when the thread is outside a read section
+    _Atomic uint64_t epoch;
+    atomic_int in_use;
+    struct rcu_reader* next;
+};
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(struct rcu_reader*) readers = NULL;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local struct rcu_reader* self = NULL;
+static _Thread_local int nesting = 0;
+
+/**
+ * Releases the reader record of an exiting thread so it can be reused.
+ * @param arg The reader record owned by the thread.
+ */
+static void rcu_reader_release(void* arg) {
+    struct rcu_reader* r = arg;
+    atomic_store(&r->epoch, 0);
+    atomic_store(&r->in_use, 0);
+}
+
+/**
+ * Creates the thread-specific key used to release records on thread exit.
+ */
+static void rcu_key_init(void) {
+    pthread_key_create(&reader_key, rcu_reader_release);
+}
+
+/**
+ * Returns the reader record of the calling thread, claiming a free record
+ * or appending a new one on first use.
+ * @return struct rcu_reader* The record of the calling thread.
+ */
+static struct rcu_reader* rcu_self(void) {
+    if (self) {
+        return self;
+    }
+    pthread_once(&reader_key_once, rcu_key_init);
+
+    // Try to recycle the record of a thread that has exited
+    for (struct rcu_reader* r = atomic_load(&readers); r; r = r->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, 1)) {
+            self = r;
+            pthread_setspecific(reader_key, r);
+            return r;
+        }
+    }
+
+    struct rcu_reader* r = calloc(1, sizeof(struct rcu_reader));
+    if (!r) {
+        perror("Failed to allocate rcu reader");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&r->in_use, 1);
+    // Push onto the reader list, records are never removed
+    struct rcu_reader* head = atomic_load(&readers);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak(&readers, &head, r));
+
+    self = r;
+    pthread_setspecific(reader_key, r);
+    return r;
+}
+
+/**
+ * Enters a read-side critical section. Sections may be nested.
+ * The calling thread is registered on first use.
+ */
+void rcu_read_lock(void) {
+    struct rcu_reader* r = rcu_self();
+    if (nesting++ == 0) {
+        atomic_store(&r->epoch, atomic_load(&global_epoch));
+        // Order the announcement before any read of shared pointers
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+/**
+ * Leaves a read-side critical section entered with rcu_read_lock.
+ */
+void rcu_read_unlock(void) {
+    if (--nesting == 0) {
+        atomic_store_explicit(&self->epoch, 0, memory_order_release);
+    }
+}
+
+/**
+ * Waits for all read-side critical sections that started before the call
+ * to finish. Must not be called from inside a read-side critical section.
+ */
+void rcu_synchronize(void) {
+    // Order the writer's unlinking stores before scanning the readers
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t target = atomic_fetch_add(&global_epoch, 1) + 1;
+
+    for (struct rcu_reader* r = atomic_load(&readers); r; r = r->next) {
+        uint64_t seen;
+        // A reader that announced an older epoch may still hold references
+        while ((seen = atomic_load(&r->epoch)) != 0 && seen < target) {
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ ============================================================================
+ Name        : rcu.h
+ ============================================================================
+ */
+#ifndef RCU_H
+#define RCU_H
+
+/**
+ * Epoch based read-copy-update used by the shared btide data structures.
+ * Readers bracket their accesses with rcu_read_lock/rcu_read_unlock and
+ * never block. Writers publish new pointers with release stores, unlink
+ * old objects and call rcu_synchronize before freeing them, which waits
+ * until every reader that could still hold a reference has left its
+ * read-side critical section.
+ */
+
+/**
+ * Enters a read-side critical section. Sections may be nested.
+ * The calling thread is registered on first use.
+ */
+void rcu_read_lock(void);
+
+/**
+ * Leaves a read-side critical section entered with rcu_read_lock.
+ */
+void rcu_read_unlock(void);
+
+/**
+ * Waits for all read-side critical sections that started before the call
+ * to finish. Must not be called from inside a read-side critical section.
+ */
+void rcu_synchronize(void);
+
+#endif // RCU_H
@@ -0,0 +1,565 @@
+/*
+ ============================================================================
+ Name        : pool.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sched/pool.h"
+
+// Slots of a worker's deque before it first grows
+#define DEQUE_INITIAL (256)
+// Sub-ranges per worker when pool_parallel_for picks the grain
+#define PARALLEL_SPLIT (4)
+
+struct pool_task {
+    pool_task_fn fn;
+    void* arg;
+    struct pool_group* group;
+    struct pool_task* next;
+};
+
+/**
+ * Circular buffer of a deque. Replaced buffers stay allocated until the
+ * pool is destroyed, as a thief may still be reading from them.
+ */
+struct deque_array {
+    int64_t size;
+    struct deque_array* retired;
+    _Atomic(struct pool_task*) slots[];
+};
+
+/**
+ * Chase-Lev work-stealing deque. Only the owning worker pushes and takes
+ * at the bottom, any thread steals at the top.
+ */
+struct deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(struct deque_array*) array;
+};
+
+struct worker {
+    struct pool* pool;
+    struct deque deque;
+    pthread_t thread;
+    unsigned seed;
+};
+
+struct pool {
+    struct worker* workers;
+    // Workers with a deque, and those of them whose thread is running
+    int nthreads;
+    int nrunning;
+    // Tasks submitted from outside the pool, in submission order
+    struct pool_task* head;
+    struct pool_task* tail;
+    atomic_int nshared;
+    pthread_mutex_t inject_lock;
+    // Tasks in a deque or the shared queue
+    atomic_int queued;
+    // Tasks queued or running
+    atomic_int pending;
+    // Threads sleeping on work, workers and group joiners
+    atomic_int sleepers;
+    atomic_int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+};
+
+// Worker running on this thread, NULL outside of every pool
+static _Thread_local struct worker* self;
+
+/**
+ * Initialises an empty deque.
+ * @param d The deque.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int deque_init(struct deque* d) {
+    struct deque_array* a = malloc(sizeof(struct deque_array)
+        + DEQUE_INITIAL * sizeof(struct pool_task*));
+    if (!a) {
+        return -1;
+    }
+    a->size = DEQUE_INITIAL;
+    a->retired = NULL;
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, a);
+    return 0;
+}
+
+/**
+ * Frees a deque's buffer and every buffer it replaced.
+ * @param d The deque, no longer used by any thread.
+ */
+static void deque_free(struct deque* d) {
+    struct deque_array* a = atomic_load(&d->array);
+    while (a) {
+        struct deque_array* next = a->retired;
+        free(a);
+        a = next;
+    }
+}
+
+/**
+ * Pushes a task at the bottom, owner only.
+ * @param d The deque.
+ * @param task The task.
+ * @return int 0 on success, -1 if a full deque could not grow.
+ */
+static int deque_push(struct deque* d, struct pool_task* task) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    struct deque_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (b - t > a->size - 1) {
+        struct deque_array* grown = malloc(sizeof(struct deque_array)
+            + 2 * a->size * sizeof(struct pool_task*));
+        if (!grown) {
+            return -1;
+        }
+        grown->size = 2 * a->size;
+        grown->retired = a;
+        for (int64_t i = t; i < b; i++) {
+            atomic_store_explicit(&grown->slots[i & (grown->size - 1)],
+                atomic_load_explicit(&a->slots[i & (a->size - 1)], memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        atomic_store_explicit(&d->array, grown, memory_order_release);
+        a = grown;
+    }
+    atomic_store_explicit(&a->slots[b & (a->size - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Takes the newest task from the bottom, owner only.
+ * @param d The deque.
+ * @return struct pool_task* The task, NULL if the deque is empty or a
+ *         thief took the last task.
+ */
+static struct pool_task* deque_take(struct deque* d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    struct deque_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    struct pool_task* task = atomic_load_explicit(&a->slots[b & (a->size - 1)],
+        memory_order_relaxed);
+    if (t == b) {
+        // Last task, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * Steals the oldest task from the top, any thread.
+ * @param d The deque.
+ * @return struct pool_task* The task, NULL if the deque is empty or
+ *         another thread took the task first.
+ */
+static struct pool_task* deque_steal(struct deque* d) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    struct deque_array* a = atomic_load_explicit(&d->array, memory_order_acquire);
+    struct pool_task* task = atomic_load_explicit(&a->slots[t & (a->size - 1)],
+        memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+        memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+/**
+ * Finds a task to run: the newest of the worker's own deque, else the
+ * oldest of another worker's, else the oldest submitted from outside.
+ * @param pool The pool.
+ * @param me The calling worker, NULL for a thread outside the pool.
+ * @return struct pool_task* The task, NULL if none was found.
+ */
+static struct pool_task* pool_find(struct pool* pool, struct worker* me) {
+    struct pool_task* task = me ? deque_take(&me->deque) : NULL;
+    if (!task && pool->nthreads > (me ? 1 : 0)) {
+        unsigned start = me ? (me->seed = me->seed * 1103515245u + 12345u) >> 16 : 0;
+        for (int i = 0; i < pool->nthreads && !task; i++) {
+            struct worker* w = &pool->workers[(start + (unsigned)i) % (unsigned)pool->nthreads];
+            if (w != me) {
+                task = deque_steal(&w->deque);
+            }
+        }
+    }
+    if (!task && atomic_load(&pool->nshared) > 0) {
+        pthread_mutex_lock(&pool->inject_lock);
+        task = pool->head;
+        if (task) {
+            pool->head = task->next;
+            if (!pool->head) {
+                pool->tail = NULL;
+            }
+            atomic_fetch_sub(&pool->nshared, 1);
+        }
+        pthread_mutex_unlock(&pool->inject_lock);
+    }
+    if (task) {
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return task;
+}
+
+/**
+ * Runs a task and signals its group and the pool if they became idle.
+ * @param pool The pool.
+ * @param task The task, freed.
+ */
+static void pool_run(struct pool* pool, struct pool_task* task) {
+    struct pool_group* group = task->group;
+    task->fn(task->arg);
+    free(task);
+
+    // The joiner may free the group as soon as pending reaches zero
+    if (group && atomic_fetch_sub(&group->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Worker loop, runs tasks until the pool is stopped and drained.
+ * @param arg The worker.
+ * @return NULL
+ */
+static void* pool_worker(void* arg) {
+    struct worker* me = arg;
+    struct pool* pool = me->pool;
+    self = me;
+
+    while (1) {
+        struct pool_task* task = pool_find(pool, me);
+        if (task) {
+            pool_run(pool, task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stopping)) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        int done = atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (done) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the default number of workers, one per online processor.
+ * @return int The number of workers to use when none is configured.
+ */
+int pool_default_size(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/**
+ * Creates a pool and starts its worker threads.
+ * @param nthreads Number of workers, pool_default_size() if less than 1.
+ * @return struct pool* The pool, or NULL if it could not be created.
+ */
+struct pool* pool_create(int nthreads) {
+    if (nthreads < 1) {
+        nthreads = pool_default_size();
+    }
+
+    struct pool* pool = calloc(1, sizeof(struct pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->workers = calloc(nthreads, sizeof(struct worker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->inject_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    // Deques are ready before any worker may steal from them
+    int ndeques = 0;
+    while (ndeques < nthreads && deque_init(&pool->workers[ndeques].deque) == 0) {
+        pool->workers[ndeques].pool = pool;
+        pool->workers[ndeques].seed = (unsigned)ndeques * 2654435761u + 1;
+        ndeques++;
+    }
+    // Deques of workers that fail to start stay empty, stealing from them
+    // finds nothing
+    pool->nthreads = ndeques;
+    for (int i = 0; i < ndeques; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_worker,
+            &pool->workers[i]) != 0) {
+            perror("Failed to start pool worker");
+            break;
+        }
+        pool->nrunning++;
+    }
+    if (pool->nrunning == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+ * Returns the number of workers of a pool.
+ * @param pool The pool, may be NULL.
+ * @return int The number of workers, 0 for no pool.
+ */
+int pool_size(struct pool* pool) {
+    return pool ? pool->nrunning : 0;
+}
+
+/**
+ * Queues a task on the calling worker's deque, or on the shared queue
+ * when called from outside the pool.
+ * @param pool The pool to submit to.
+ * @param group The group the task joins, may be NULL.
+ * @param fn The function to run.
+ * @param arg Argument passed to fn.
+ * @return int 0 on success, -1 if the task could not be queued.
+ */
+static int pool_push(struct pool* pool, struct pool_group* group,
+    pool_task_fn fn, void* arg) {
+    struct pool_task* task = malloc(sizeof(struct pool_task));
+    if (!task) {
+        return -1;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->group = group;
+    task->next = NULL;
+
+    if (group) {
+        atomic_fetch_add(&group->pending, 1);
+    }
+    atomic_fetch_add(&pool->pending, 1);
+    // Counted first so a thread finding it never takes queued below zero
+    atomic_fetch_add(&pool->queued, 1);
+    struct worker* me = self && self->pool == pool ? self : NULL;
+    if (!me || deque_push(&me->deque, task) != 0) {
+        pthread_mutex_lock(&pool->inject_lock);
+        if (pool->tail) {
+            pool->tail->next = task;
+        } else {
+            pool->head = task;
+        }
+        pool->tail = task;
+        atomic_fetch_add(&pool->nshared, 1);
+        pthread_mutex_unlock(&pool->inject_lock);
+    }
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 0;
+}
+
+/**
+ * Queues a task for execution on one of the workers.
+ * @param pool The pool to submit to.
+ * @param fn The function to run.
+ * @param arg Argument passed to fn.
+ * @return int 0 on success, -1 if the task could not be queued.
+ */
+int pool_submit(struct pool* pool, pool_task_fn fn, void* arg) {
+    return pool_push(pool, NULL, fn, arg);
+}
+
+/**
+ * Blocks until every submitted task, including tasks submitted by other
+ * tasks while waiting, has finished. Must not be called from a task, join
+ * a group instead.
+ * @param pool The pool to wait on.
+ */
+void pool_wait(struct pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Returns the number of tasks queued or running.
+ * @param pool The pool.
+ * @return int The number of unfinished tasks.
+ */
+int pool_pending(struct pool* pool) {
+    return atomic_load(&pool->pending);
+}
+
+/**
+ * Initialises an empty task group.
+ * @param group The group.
+ */
+void pool_group_init(struct pool_group* group) {
+    atomic_init(&group->pending, 0);
+}
+
+/**
+ * Queues a task belonging to a group.
+ * @param pool The pool to submit to.
+ * @param group The group the task joins.
+ * @param fn The function to run.
+ * @param arg Argument passed to fn.
+ * @return int 0 on success, -1 if the task could not be queued.
+ */
+int pool_group_submit(struct pool* pool, struct pool_group* group,
+    pool_task_fn fn, void* arg) {
+    return pool_push(pool, group, fn, arg);
+}
+
+/**
+ * Blocks until every task of a group has finished, running queued tasks
+ * of the pool meanwhile, so tasks may join groups of their own.
+ * @param pool The pool the tasks were submitted to.
+ * @param group The group to join.
+ */
+void pool_group_wait(struct pool* pool, struct pool_group* group) {
+    struct worker* me = self && self->pool == pool ? self : NULL;
+    while (atomic_load(&group->pending) > 0) {
+        struct pool_task* task = pool_find(pool, me);
+        if (task) {
+            pool_run(pool, task);
+            continue;
+        }
+        // The group's last tasks are running elsewhere
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&group->pending) > 0 && atomic_load(&pool->queued) == 0) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Sub-range handed to a task by pool_parallel_for.
+ */
+struct range_task {
+    pool_range_fn fn;
+    void* arg;
+    uint64_t begin;
+    uint64_t end;
+};
+
+/**
+ * Pool task running one sub-range.
+ * @param arg The struct range_task, owned by pool_parallel_for.
+ */
+static void range_task_run(void* arg) {
+    struct range_task* r = arg;
+    r->fn(r->arg, r->begin, r->end);
+}
+
+/**
+ * Runs fn over [begin, end) split into sub-ranges of about grain indices,
+ * spread over the pool and the calling thread, and returns once all of
+ * them are done. May be called from a task.
+ * @param pool The pool, NULL to run the whole range on the calling thread.
+ * @param begin First index.
+ * @param end One past the last index.
+ * @param grain Indices per sub-range, 0 to pick one from the pool size.
+ * @param fn The function to run on each sub-range.
+ * @param arg Argument passed to fn.
+ */
+void pool_parallel_for(struct pool* pool, uint64_t begin, uint64_t end,
+    uint64_t grain, pool_range_fn fn, void* arg) {
+    if (end <= begin) {
+        return;
+    }
+    uint64_t n = end - begin;
+    if (grain == 0) {
+        uint64_t parts = (uint64_t)pool_size(pool) * PARALLEL_SPLIT;
+        grain = parts ? (n + parts - 1) / parts : n;
+    }
+    uint64_t nranges = (n + grain - 1) / grain;
+    struct range_task* ranges = pool && nranges > 1
+        ? malloc(nranges * sizeof(struct range_task)) : NULL;
+    if (!ranges) {
+        fn(arg, begin, end);
+        return;
+    }
+
+    struct pool_group group;
+    pool_group_init(&group);
+    for (uint64_t i = 0; i < nranges; i++) {
+        uint64_t lo = begin + i * grain;
+        ranges[i] = (struct range_task){ fn, arg, lo, n - i * grain > grain ? lo + grain : end };
+    }
+    // The calling thread takes the first range itself
+    for (uint64_t i = 1; i < nranges; i++) {
+        if (pool_group_submit(pool, &group, range_task_run, &ranges[i]) != 0) {
+            range_task_run(&ranges[i]);
+        }
+    }
+    range_task_run(&ranges[0]);
+    pool_group_wait(pool, &group);
+    free(ranges);
+}
+
+/**
+ * Finishes all queued tasks, stops the workers and frees the pool.
+ * @param pool The pool to destroy.
+ */
+void pool_destroy(struct pool* pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, 1);
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nrunning; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool->nthreads; i++) {
+        deque_free(&pool->workers[i].deque);
+    }
+    pthread_mutex_destroy(&pool->inject_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->workers);
+    free(pool);
+}
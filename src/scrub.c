@@ -0,0 +1,360 @@
+/*
+ ============================================================================
+ Name        : scrub.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "scrub.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "chk/verifycache.h"
+#include "chk/sidecar.h"
+
+#define SCRUB_MAGIC 0x31524353u
+// Nice value of the scrubbing thread
+#define SCRUB_NICE 19
+// ioprio_set arguments selecting the idle I/O class for the calling thread
+#define SCRUB_IOPRIO_WHO_PROCESS 1
+#define SCRUB_IOPRIO_IDLE (3 << 13)
+// Interval between samples of the upload rate, and the wait while it is high
+#define SCRUB_LOAD_NS (250000000ULL)
+// Interval between saves of the position in the cycle
+#define SCRUB_SAVE_NS (10000000000ULL)
+// Wait before starting the next cycle
+#define SCRUB_IDLE_NS (1000000000ULL)
+
+// On-disk position
+struct scrub_progress {
+    uint32_t magic;
+    // Next chunk of the package being scrubbed
+    uint32_t chunk;
+    // Completed cycles over all packages
+    uint64_t cycle;
+    // Package being scrubbed, empty at the start of a cycle
+    char ident[MAX_IDENT_LEN + 1];
+};
+
+// Upload rate observed by the scrubbing thread
+struct scrub_load {
+    uint64_t last_ns;
+    uint64_t last_bytes;
+    int busy;
+};
+
+/**
+ * Loads the position recorded by an earlier run.
+ * @param path Path of the progress file.
+ * @param pos Receives the position, the start of a cycle if there is none.
+ */
+static void scrub_load(const char* path, struct scrub_progress* pos) {
+    FILE* file = fopen(path, "rb");
+    int ok = file && fread(pos, sizeof(*pos), 1, file) == 1
+        && pos->magic == SCRUB_MAGIC
+        && memchr(pos->ident, '\0', sizeof(pos->ident)) != NULL;
+    if (file) {
+        fclose(file);
+    }
+    if (!ok) {
+        memset(pos, 0, sizeof(*pos));
+        pos->magic = SCRUB_MAGIC;
+    }
+}
+
+/**
+ * Records the position in the cycle.
+ * @param path Path of the progress file.
+ * @param pos The position.
+ * @return int 0 on success, -1 if the file could not be written.
+ */
+static int scrub_save(const char* path, const struct scrub_progress* pos) {
+    struct sidecar sc;
+    FILE* file = sidecar_begin(&sc, path, "wb");
+    if (!file) {
+        return -1;
+    }
+    int ok = fwrite(pos, sizeof(*pos), 1, file) == 1;
+    return sidecar_commit(&sc, ok);
+}
+
+/**
+ * Moves the calling thread to the lowest CPU and I/O priority, so that
+ * scrubbing only uses what serving leaves idle. Failures are ignored.
+ */
+static void scrub_lower_priority(void) {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), SCRUB_NICE);
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, SCRUB_IOPRIO_WHO_PROCESS, 0, SCRUB_IOPRIO_IDLE);
+#endif
+}
+
+/**
+ * Waits until a timeout passes or the scrubber is stopped.
+ * @param s The scrubber.
+ * @param ns Nanoseconds to wait.
+ * @return int 1 if the scrubber is stopping, 0 otherwise.
+ */
+static int scrub_sleep(struct scrubber* s, uint64_t ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t nsec = (uint64_t)ts.tv_nsec + ns;
+    ts.tv_sec += (time_t)(nsec / 1000000000ULL);
+    ts.tv_nsec = (long)(nsec % 1000000000ULL);
+
+    pthread_mutex_lock(&s->lock);
+    if (!atomic_load(&s->stop)) {
+        pthread_cond_timedwait(&s->wake, &s->lock, &ts);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return atomic_load(&s->stop);
+}
+
+/**
+ * Checks whether the node is serving more than the pause threshold,
+ * sampling the bytes sent by all threads every SCRUB_LOAD_NS.
+ * @param s The scrubber.
+ * @param load The last sample.
+ * @param now Current time from tb_now_ns.
+ * @return int 1 if scrubbing should wait.
+ */
+static int scrub_busy(struct scrubber* s, struct scrub_load* load, uint64_t now) {
+    if (!s->pause_rate) {
+        return 0;
+    }
+    if (now - load->last_ns >= SCRUB_LOAD_NS) {
+        uint64_t bytes = metrics_get(MC_BYTES_OUT);
+        double rate = (double)(bytes - load->last_bytes) * 1e9
+            / (double)(now - load->last_ns);
+        load->busy = rate > (double)s->pause_rate;
+        load->last_ns = now;
+        load->last_bytes = bytes;
+    }
+    return load->busy;
+}
+
+/**
+ * Waits until the token bucket allows a read and serving is below the
+ * pause threshold.
+ * @param s The scrubber.
+ * @param load The last upload rate sample.
+ * @return int 1 if the scrubber is stopping, 0 when the read may start.
+ */
+static int scrub_wait(struct scrubber* s, struct scrub_load* load) {
+    while (!atomic_load(&s->stop)) {
+        uint64_t now = tb_now_ns();
+        uint64_t wait = scrub_busy(s, load, now) ? SCRUB_LOAD_NS
+            : tb_wait_ns(&s->rate, now);
+        if (!wait) {
+            return 0;
+        }
+        scrub_sleep(s, wait);
+    }
+    return 1;
+}
+
+/**
+ * Handles a chunk that no longer matches its hash: it is cleared so it is
+ * fetched again, restored from the chunk store if a good copy is there,
+ * and the journal is updated at once so a restart does not trust it.
+ * @param s The scrubber.
+ * @param pkg The package owning the chunk.
+ * @param index Index of the chunk.
+ * @param wfd Data file opened for writing, opened on first use.
+ */
+static void scrub_failed(struct scrubber* s, Package* pkg, uint32_t index, int* wfd) {
+    // Served copies of the chunk, such as the chunk cache's, are dropped
+    if (!demoteChunk(s->packages, pkg, index)) {
+        return;
+    }
+    metrics_add(MC_SCRUB_FAILED, 1);
+    printf("Chunk %.16s of %.*s failed scrub\n", pkg->obj->chunks[index].hash,
+        PKG_DISPLAY_LEN, pkg->identifier);
+
+    // The file identity did not change, cached digests would vouch for it
+    vcache_discard(pkg->filename);
+    if (s->packages->store && store_has(s->packages->store, pkg->obj->chunks[index].hash)
+        && (*wfd >= 0 || (*wfd = openPackageData(pkg)) >= 0)) {
+        restoreChunk(s->packages, pkg, *wfd, index);
+    }
+    savePackageState(pkg);
+}
+
+/**
+ * Rehashes the chunks of a package present on disk, from the position in
+ * the cycle onwards.
+ * @param s The scrubber.
+ * @param pkg The package, retained by the caller.
+ * @param pos The position, advanced as chunks are scrubbed.
+ * @param load The last upload rate sample.
+ * @param saved_ns Time the position was last saved.
+ */
+static void scrub_package(struct scrubber* s, Package* pkg, struct scrub_progress* pos,
+    struct scrub_load* load, uint64_t* saved_ns) {
+    struct bpkg_obj* obj = pkg->obj;
+    // A data file that is gone fails every chunk still marked
+    int fd = open(pkg->filename, O_RDONLY);
+    int wfd = -1;
+    while (pos->chunk < obj->nchunks) {
+        uint32_t i = pos->chunk;
+        if (hasChunk(pkg, i)) {
+            if (scrub_wait(s, load)) {
+                break;
+            }
+            if (!bpkg_chunk_verify(obj, fd, i)) {
+                scrub_failed(s, pkg, i, &wfd);
+            }
+            tb_consume(&s->rate, obj->chunks[i].size);
+            metrics_add(MC_SCRUB_BYTES, obj->chunks[i].size);
+        }
+        pos->chunk = i + 1;
+
+        uint64_t now = tb_now_ns();
+        if (now - *saved_ns >= SCRUB_SAVE_NS) {
+            scrub_save(s->path, pos);
+            *saved_ns = now;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (wfd >= 0) {
+        close(wfd);
+    }
+}
+
+/**
+ * Returns the package to scrub next, retained for the caller.
+ * @param list Registry of managed packages.
+ * @param ident Identifier of the package of the current position, empty
+ *        at the start of a cycle.
+ * @param advance 0 to return that package, 1 to return the one after it.
+ * @return Package* The package, the first one if the named package is
+ *         gone, NULL at the end of the cycle.
+ */
+static Package* scrub_next(PackageList* list, const char* ident, int advance) {
+    rcu_read_lock();
+    Package* head = atomic_load_explicit(&list->head, memory_order_acquire);
+    Package* pkg = head;
+    if (ident[0]) {
+        while (pkg && strcmp(pkg->identifier, ident) != 0) {
+            pkg = atomic_load_explicit(&pkg->next, memory_order_acquire);
+        }
+        if (!pkg) {
+            pkg = head;
+        } else if (advance) {
+            pkg = atomic_load_explicit(&pkg->next, memory_order_acquire);
+        }
+    }
+    if (pkg) {
+        retainPackage(pkg);
+    }
+    rcu_read_unlock();
+    return pkg;
+}
+
+/**
+ * Scrubbing thread, cycles over the packages until stopped.
+ * @param arg The struct scrubber.
+ * @return void* NULL.
+ */
+static void* scrub_thread(void* arg) {
+    struct scrubber* s = arg;
+    scrub_lower_priority();
+
+    // Let the packages found at startup load and verify first, so the
+    // package of a loaded position is not taken for removed
+    while (s->packages->pool && pool_pending(s->packages->pool) > 0) {
+        if (scrub_sleep(s, SCRUB_LOAD_NS)) {
+            return NULL;
+        }
+    }
+
+    struct scrub_progress pos;
+    scrub_load(s->path, &pos);
+    struct scrub_load load = { tb_now_ns(), metrics_get(MC_BYTES_OUT), 0 };
+    uint64_t saved_ns = tb_now_ns();
+    // The package of a loaded position is resumed rather than skipped
+    int advance = 0;
+
+    while (!atomic_load(&s->stop)) {
+        Package* pkg = scrub_next(s->packages, pos.ident, advance);
+        if (!pkg) {
+            if (pos.ident[0]) {
+                pos.cycle++;
+                pos.ident[0] = '\0';
+                pos.chunk = 0;
+                scrub_save(s->path, &pos);
+                saved_ns = tb_now_ns();
+            }
+            advance = 0;
+            scrub_sleep(s, SCRUB_IDLE_NS);
+            continue;
+        }
+        if (strcmp(pkg->identifier, pos.ident) != 0) {
+            strcpy(pos.ident, pkg->identifier);
+            pos.chunk = 0;
+        }
+        // Packages still being verified are done at their next turn
+        if (atomic_load_explicit(&pkg->state, memory_order_acquire) == PKG_READY) {
+            scrub_package(s, pkg, &pos, &load, &saved_ns);
+        }
+        releasePackage(pkg);
+        advance = 1;
+    }
+    scrub_save(s->path, &pos);
+    return NULL;
+}
+
+/**
+ * Starts scrubbing the packages of a list.
+ * @param s The scrubber to initialise.
+ * @param packages Registry of managed packages.
+ * @param directory The package directory, holding the progress file.
+ * @param rate Bytes read per second, must not be 0.
+ * @param pause_rate Upload rate in bytes per second that pauses
+ *        scrubbing, 0 to never pause.
+ * @return int 0 on success, -1 if the thread could not be started.
+ */
+int scrub_start(struct scrubber* s, PackageList* packages, const char* directory,
+    uint64_t rate, uint64_t pause_rate) {
+    s->packages = packages;
+    snprintf(s->path, sizeof(s->path), "%s/%s", directory, SCRUB_FILE);
+    tb_init(&s->rate, rate);
+    s->pause_rate = pause_rate;
+    atomic_init(&s->stop, 0);
+    pthread_mutex_init(&s->lock, NULL);
+
+    // Timeouts are measured on the clock the token buckets use
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&s->thread, NULL, scrub_thread, s) != 0) {
+        pthread_cond_destroy(&s->wake);
+        pthread_mutex_destroy(&s->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Records the position in the cycle and stops the scrubbing thread.
+ * @param s A scrubber started by scrub_start.
+ */
+void scrub_stop(struct scrubber* s) {
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->stop, 1);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+}
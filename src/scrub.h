@@ -0,0 +1,59 @@
+/*
+ ============================================================================
+ Name        : scrub.h
+ ============================================================================
+ */
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "package.h"
+#include "ratelimit.h"
+
+#define SCRUB_FILE ".scrub"
+
+/**
+ * Low priority thread rehashing the chunks of every ready package, one
+ * package after the other, to find data that rotted on disk. Reads are
+ * limited by a token bucket and stop while the node serves more than a
+ * threshold. Chunks that no longer match are cleared from the completion
+ * bitmap so they are fetched again. The position in the cycle is kept in
+ * SCRUB_FILE in the package directory, a restart resumes from there.
+ * - rate: token bucket limiting the bytes read.
+ * - pause_rate: upload rate in bytes per second above which scrubbing
+ *   waits, 0 to never wait.
+ * - stop: set by scrub_stop, woken through wake.
+ */
+struct scrubber {
+    PackageList* packages;
+    char path[PKG_PATH_LEN];
+    struct token_bucket rate;
+    uint64_t pause_rate;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int stop;
+};
+
+/**
+ * Starts scrubbing the packages of a list.
+ * @param s The scrubber to initialise.
+ * @param packages Registry of managed packages.
+ * @param directory The package directory, holding the progress file.
+ * @param rate Bytes read per second, must not be 0.
+ * @param pause_rate Upload rate in bytes per second that pauses
+ *        scrubbing, 0 to never pause.
+ * @return int 0 on success, -1 if the thread could not be started.
+ */
+int scrub_start(struct scrubber* s, PackageList* packages, const char* directory,
+    uint64_t rate, uint64_t pause_rate);
+
+/**
+ * Records the position in the cycle and stops the scrubbing thread.
+ * @param s A scrubber started by scrub_start.
+ */
+void scrub_stop(struct scrubber* s);
+
+#endif // SCRUB_H
@@ -0,0 +1,326 @@
+/*
+ ============================================================================
+ Name        : netproxy.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SEG_SIZE (16384)
+// Bytes buffered per direction before the proxy stops reading
+#define MAX_QUEUED (1 << 20)
+// Extra delay of a lost segment, one TCP retransmission timeout
+#define LOSS_RTO_MS (200)
+#define MAX_CONNS (4096)
+
+/**
+ * Bytes read from one side, released to the other side at release_ns.
+ */
+struct segment {
+    uint64_t release_ns;
+    size_t len;
+    size_t off;
+    struct segment* next;
+    uint8_t data[SEG_SIZE];
+};
+
+/**
+ * One direction of a proxied connection.
+ * - head, tail: segments still to be written, in order.
+ * - queued: bytes in the queue.
+ * - eof: the source has closed, shut down the sink once drained.
+ */
+struct flow {
+    int src;
+    int dst;
+    struct segment* head;
+    struct segment* tail;
+    size_t queued;
+    int eof;
+    int done;
+};
+
+/**
+ * Proxied connection, a client and the upstream it was connected to.
+ */
+struct conn {
+    struct flow up;
+    struct flow down;
+    int closed;
+};
+
+static uint64_t delay_ns;
+static double loss;
+static struct conn* conns[MAX_CONNS];
+static int nconns;
+
+/**
+ * Returns the current monotonic time.
+ * @return uint64_t Nanoseconds since an arbitrary fixed point.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Sets O_NONBLOCK on a descriptor.
+ * @param fd The descriptor.
+ * @return int 0 on success, -1 on failure.
+ */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Reads what is available from a flow's source and queues it. Segments
+ * keep their order, so a lost segment also holds back the ones after it
+ * as TCP's in-order delivery would.
+ * @param f The flow.
+ * @return int 0 on success, -1 if the connection failed.
+ */
+static int flow_read(struct flow* f) {
+    while (!f->eof && f->queued < MAX_QUEUED) {
+        struct segment* s = malloc(sizeof(struct segment));
+        if (!s) {
+            return -1;
+        }
+        ssize_t n = recv(f->src, s->data, SEG_SIZE, 0);
+        if (n <= 0) {
+            free(s);
+            if (n == 0) {
+                f->eof = 1;
+                return 0;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        uint64_t release = now_ns() + delay_ns;
+        if (loss > 0 && (double)rand() / RAND_MAX < loss) {
+            release += (uint64_t)LOSS_RTO_MS * 1000000;
+        }
+        if (f->tail && f->tail->release_ns > release) {
+            release = f->tail->release_ns;
+        }
+        s->release_ns = release;
+        s->len = (size_t)n;
+        s->off = 0;
+        s->next = NULL;
+        if (f->tail) {
+            f->tail->next = s;
+        } else {
+            f->head = s;
+        }
+        f->tail = s;
+        f->queued += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Writes every segment whose release time has passed.
+ * @param f The flow.
+ * @param now Current time from now_ns.
+ * @return int 0 on success, -1 if the connection failed.
+ */
+static int flow_write(struct flow* f, uint64_t now) {
+    while (f->head && f->head->release_ns <= now) {
+        struct segment* s = f->head;
+        ssize_t n = send(f->dst, s->data + s->off, s->len - s->off, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        s->off += (size_t)n;
+        f->queued -= (size_t)n;
+        if (s->off < s->len) {
+            return 0;
+        }
+        f->head = s->next;
+        if (!f->head) {
+            f->tail = NULL;
+        }
+        free(s);
+    }
+    if (!f->head && f->eof && !f->done) {
+        shutdown(f->dst, SHUT_WR);
+        f->done = 1;
+    }
+    return 0;
+}
+
+/**
+ * Frees a flow's queued segments.
+ * @param f The flow.
+ */
+static void flow_free(struct flow* f) {
+    while (f->head) {
+        struct segment* s = f->head;
+        f->head = s->next;
+        free(s);
+    }
+}
+
+/**
+ * Accepts a client and connects it to the upstream.
+ * @param lfd The listening socket.
+ * @param target Address of the upstream.
+ */
+static void accept_conn(int lfd, struct sockaddr_in* target) {
+    int cfd = accept(lfd, NULL, NULL);
+    if (cfd < 0) {
+        return;
+    }
+    int ufd = socket(AF_INET, SOCK_STREAM, 0);
+    struct conn* c = calloc(1, sizeof(struct conn));
+    if (ufd < 0 || !c || nconns >= MAX_CONNS
+        || connect(ufd, (struct sockaddr*)target, sizeof(*target)) != 0
+        || set_nonblocking(cfd) != 0 || set_nonblocking(ufd) != 0) {
+        close(cfd);
+        if (ufd >= 0) {
+            close(ufd);
+        }
+        free(c);
+        return;
+    }
+    int one = 1;
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(ufd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->up.src = cfd;
+    c->up.dst = ufd;
+    c->down.src = ufd;
+    c->down.dst = cfd;
+    conns[nconns++] = c;
+}
+
+/**
+ * Forwards connections from a local port to an upstream, delaying every
+ * segment and delaying randomly chosen segments by a retransmission
+ * timeout to model loss without corrupting the stream.
+ */
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <listen_port> <target_ip:port> [--delay ms] "
+            "[--loss percent] [--seed n]\n", argv[0]);
+        return 1;
+    }
+    unsigned seed = 1;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--delay") == 0) {
+            delay_ns = (uint64_t)(atof(argv[i + 1]) * 1000000);
+        } else if (strcmp(argv[i], "--loss") == 0) {
+            loss = atof(argv[i + 1]) / 100;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = (unsigned)atoi(argv[i + 1]);
+        }
+    }
+    srand(seed);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in target;
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    char* colon = strrchr(argv[2], ':');
+    if (!colon) {
+        fprintf(stderr, "Invalid target %s\n", argv[2]);
+        return 1;
+    }
+    *colon = '\0';
+    target.sin_port = htons((uint16_t)atoi(colon + 1));
+    if (inet_pton(AF_INET, argv[2], &target.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid target %s\n", argv[2]);
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)atoi(argv[1]));
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(lfd, 256) != 0) {
+        perror("Unable to listen");
+        return 1;
+    }
+
+    static struct pollfd fds[1 + 2 * MAX_CONNS];
+    while (1) {
+        uint64_t now = now_ns();
+        uint64_t wake = UINT64_MAX;
+        int n = 0;
+        fds[n].fd = lfd;
+        fds[n].events = POLLIN;
+        n++;
+        for (int i = 0; i < nconns; i++) {
+            struct flow* flows[2] = { &conns[i]->up, &conns[i]->down };
+            for (int d = 0; d < 2; d++) {
+                struct flow* f = flows[d];
+                struct flow* back = flows[1 - d];
+                fds[n].fd = f->src;
+                fds[n].events = 0;
+                if (!f->eof && f->queued < MAX_QUEUED) {
+                    fds[n].events |= POLLIN;
+                }
+                // The socket read here is the sink of the other flow
+                if (back->head) {
+                    if (back->head->release_ns <= now) {
+                        fds[n].events |= POLLOUT;
+                    } else if (back->head->release_ns < wake) {
+                        wake = back->head->release_ns;
+                    }
+                }
+                n++;
+            }
+        }
+        int timeout = wake == UINT64_MAX ? -1 : (int)((wake - now + 999999) / 1000000);
+        if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_conn(lfd, &target);
+        }
+        now = now_ns();
+        for (int i = 0; i < nconns && 1 + 2 * i < n; i++) {
+            struct conn* c = conns[i];
+            short ev = fds[1 + 2 * i].revents | fds[2 + 2 * i].revents;
+            if ((ev & (POLLERR | POLLNVAL))
+                || flow_read(&c->up) != 0 || flow_read(&c->down) != 0
+                || flow_write(&c->up, now) != 0 || flow_write(&c->down, now) != 0
+                || (c->up.done && c->down.done)) {
+                c->closed = 1;
+            }
+        }
+
+        // Drop finished connections, keeping the array dense
+        for (int i = 0; i < nconns;) {
+            struct conn* c = conns[i];
+            if (!c->closed) {
+                i++;
+                continue;
+            }
+            close(c->up.src);
+            close(c->down.src);
+            flow_free(&c->up);
+            flow_free(&c->down);
+            free(c);
+            conns[i] = conns[--nconns];
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ ============================================================================
+ Name        : merklebuild.c
+ ============================================================================
+ */
+
+#include "tree/merklebuild.h"
+
+// Smallest number of parents worth handing to a worker
+#define BUILD_GRAIN (4096)
+
+/**
+ * Level being computed, shared by the ranges of a parallel for.
+ */
+struct build_level {
+    merkle_hex* nodes;
+    uint32_t arity;
+};
+
+/**
+ * Hashes every parent in a range from its children.
+ * @param nodes The tree.
+ * @param arity Number of children of every parent.
+ * @param first First parent index.
+ * @param last One past the last parent index.
+ */
+static void build_span(merkle_hex* nodes, uint32_t arity, uint32_t first,
+    uint32_t last) {
+    // The children of a run of parents are a run of sibling groups
+    sha256_hash_digest_groups(nodes[arity * first + 1], arity, nodes[first],
+        last - first);
+}
+
+/**
+ * Parallel for body computing one range of a level.
+ * @param arg The struct build_level.
+ * @param first First parent index.
+ * @param last One past the last parent index.
+ */
+static void build_range(void* arg, uint64_t first, uint64_t last) {
+    struct build_level* l = arg;
+    build_span(l->nodes, l->arity, (uint32_t)first, (uint32_t)last);
+}
+
+/**
+ * Fills in every interior node from the leaves, one level at a time.
+ * Levels wide enough are split into ranges hashed on the pool's workers.
+ * @param nodes Array of (arity * nleaves - 1) / (arity - 1) hashes with the
+ *        leaves filled in.
+ * @param nleaves Number of leaves, a power of arity.
+ * @param arity Number of children of every interior node.
+ * @param pool Workers to use, NULL to build on the calling thread.
+ */
+void merkle_build_levels(merkle_hex* nodes, uint32_t nleaves, uint32_t arity,
+    struct pool* pool) {
+    // Parents of the current level occupy [(width - 1) / (arity - 1), + width)
+    for (uint32_t width = nleaves / arity; width >= 1; width /= arity) {
+        uint32_t first = (width - 1) / (arity - 1);
+        uint32_t last = first + width;
+        if (!pool || width < 2 * BUILD_GRAIN) {
+            build_span(nodes, arity, first, last);
+            continue;
+        }
+        // A level depends on the whole level below it, each is joined
+        // before the next starts
+        struct build_level level = { nodes, arity };
+        pool_parallel_for(pool, first, last, BUILD_GRAIN, build_range, &level);
+    }
+}
@@ -0,0 +1,369 @@
+/*
+ ============================================================================
+ Name        : merkleimage.c
+ ============================================================================
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tree/merkleimage.h"
+#include "chk/sidecar.h"
+
+#define IMAGE_MAGIC 0x3145524bu
+#define IMAGE_VERSION 1
+
+// On-disk header
+struct image_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_size;
+    uint32_t nnodes;
+    uint32_t nhashes;
+    uint32_t nchunks;
+    uint32_t size;
+    uint32_t reserved;
+    char root[SHA256_HEXLEN];
+};
+
+/**
+ * Entry sorted to produce the order section.
+ */
+struct image_sort {
+    const char* hash;
+    uint32_t node;
+};
+
+/**
+ * Fills in the header an image of a manifest must have, apart from nnodes.
+ * @param obj The manifest.
+ * @param hdr Receives the header.
+ */
+static void image_header_for(const struct bpkg_obj* obj, struct image_header* hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = IMAGE_MAGIC;
+    hdr->version = IMAGE_VERSION;
+    hdr->node_size = sizeof(struct merkle_image_node);
+    hdr->nhashes = obj->nhashes;
+    hdr->nchunks = obj->nchunks;
+    hdr->size = obj->size;
+    if (obj->nhashes > 0) {
+        memcpy(hdr->root, obj->hashes[0], SHA256_HEXLEN);
+    }
+}
+
+/**
+ * Returns the size of an image.
+ * @param nnodes Number of nodes.
+ * @return size_t Bytes in the image.
+ */
+static size_t image_bytes(uint32_t nnodes) {
+    return sizeof(struct image_header)
+        + (size_t)nnodes * (sizeof(struct merkle_image_node) + sizeof(uint32_t));
+}
+
+/**
+ * Points an image at the sections of its buffer.
+ * @param img The image, base and len set.
+ * @param nnodes Number of nodes.
+ */
+static void image_attach(struct merkle_image* img, uint32_t nnodes) {
+    char* base = img->base;
+    img->nnodes = nnodes;
+    img->nodes = (const struct merkle_image_node*)(base + sizeof(struct image_header));
+    img->order = (const uint32_t*)(base + sizeof(struct image_header)
+        + (size_t)nnodes * sizeof(struct merkle_image_node));
+}
+
+/**
+ * Orders sort entries by hash and then by node.
+ * @param a The first entry.
+ * @param b The second entry.
+ * @return int Negative, zero or positive as a sorts before, with or after b.
+ */
+static int image_sort_cmp(const void* a, const void* b) {
+    const struct image_sort* x = a;
+    const struct image_sort* y = b;
+    int c = memcmp(x->hash, y->hash, SHA256_HEXLEN);
+    if (c != 0) {
+        return c;
+    }
+    return (x->node > y->node) - (x->node < y->node);
+}
+
+/**
+ * Flattens a tree into an image held in memory.
+ * @param tree A tree built by create_merkle_tree from obj.
+ * @param obj The manifest the tree was built from.
+ * @return struct merkle_image* The image, NULL on allocation failure.
+ */
+struct merkle_image* merkle_image_build(const struct merkle_tree* tree,
+    const struct bpkg_obj* obj) {
+    uint32_t depth = (uint32_t)tree->depth;
+    uint32_t width = 1u << (depth - 1);
+
+    // Levels are filled from the left, a level's nodes end at the first
+    // unused slot
+    uint32_t* first = malloc((depth + 1) * sizeof(uint32_t));
+    if (!first) {
+        return NULL;
+    }
+    uint64_t nnodes = 0;
+    for (uint32_t i = 0; i < depth; i++) {
+        first[i] = (uint32_t)nnodes;
+        uint32_t j = 0;
+        while (j < width && tree->treearray[i][j].is_leaf != -1) {
+            j++;
+        }
+        nnodes += j;
+    }
+    first[depth] = (uint32_t)nnodes;
+    if (nnodes >= MERKLE_IMAGE_NONE) {
+        free(first);
+        return NULL;
+    }
+
+    struct merkle_image* img = calloc(1, sizeof(struct merkle_image));
+    struct image_sort* sort = malloc((nnodes + 1) * sizeof(struct image_sort));
+    if (img) {
+        img->len = image_bytes((uint32_t)nnodes);
+        img->base = malloc(img->len);
+    }
+    if (!img || !img->base || !sort) {
+        free(first);
+        free(sort);
+        merkle_image_close(img);
+        return NULL;
+    }
+
+    struct image_header* hdr = img->base;
+    image_header_for(obj, hdr);
+    hdr->nnodes = (uint32_t)nnodes;
+    image_attach(img, (uint32_t)nnodes);
+    struct merkle_image_node* nodes = (struct merkle_image_node*)img->nodes;
+    uint32_t* order = (uint32_t*)img->order;
+
+    for (uint32_t i = 0; i < depth; i++) {
+        for (uint32_t j = 0; j < first[i + 1] - first[i]; j++) {
+            const struct merkle_tree_node* src = &tree->treearray[i][j];
+            struct merkle_image_node* dst = &nodes[first[i] + j];
+            memset(dst, 0, sizeof(*dst));
+            memcpy(dst->hash, src->expected_hash, SHA256_HEXLEN);
+            dst->is_leaf = src->is_leaf == 1;
+            dst->left = MERKLE_IMAGE_NONE;
+            dst->right = MERKLE_IMAGE_NONE;
+            // Children pointing at unused slots of an incomplete tree are
+            // left out, as they hold no node
+            if (!dst->is_leaf && i + 1 < depth) {
+                uint32_t nnext = first[i + 2] - first[i + 1];
+                ptrdiff_t l = src->left - tree->treearray[i + 1];
+                ptrdiff_t r = src->right - tree->treearray[i + 1];
+                if (l >= 0 && l < (ptrdiff_t)nnext) {
+                    dst->left = first[i + 1] + (uint32_t)l;
+                }
+                if (r >= 0 && r < (ptrdiff_t)nnext) {
+                    dst->right = first[i + 1] + (uint32_t)r;
+                }
+            }
+            sort[first[i] + j] = (struct image_sort){ dst->hash, first[i] + j };
+        }
+    }
+
+    qsort(sort, nnodes, sizeof(struct image_sort), image_sort_cmp);
+    for (uint32_t i = 0; i < nnodes; i++) {
+        order[i] = sort[i].node;
+    }
+    free(sort);
+    free(first);
+    return img;
+}
+
+/**
+ * Writes an image to a file, replacing any previous one atomically.
+ * @param img The image.
+ * @param path Path of the file.
+ * @return int 0 on success, -1 on a write failure.
+ */
+int merkle_image_save(const struct merkle_image* img, const char* path) {
+    struct sidecar sc;
+    FILE* file = sidecar_begin(&sc, path, "wb");
+    if (!file) {
+        return -1;
+    }
+    int ok = fwrite(img->base, 1, img->len, file) == img->len;
+    return sidecar_commit(&sc, ok);
+}
+
+/**
+ * Maps an image written by merkle_image_save.
+ * @param path Path of the file.
+ * @param obj The manifest the image must have been built from.
+ * @return struct merkle_image* The image, NULL if there is no file or it
+ *         is not a valid image of this manifest.
+ */
+struct merkle_image* merkle_image_open(const char* path, const struct bpkg_obj* obj) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct image_header)) {
+        close(fd);
+        return NULL;
+    }
+    void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Only the header is checked, the nodes are paged in as queries touch them
+    const struct image_header* hdr = base;
+    struct image_header want;
+    image_header_for(obj, &want);
+    want.nnodes = hdr->nnodes;
+    struct merkle_image* img = NULL;
+    if (memcmp(hdr, &want, sizeof(want)) == 0 && hdr->nnodes < MERKLE_IMAGE_NONE
+        && image_bytes(hdr->nnodes) == (size_t)st.st_size) {
+        img = calloc(1, sizeof(struct merkle_image));
+    }
+    if (!img) {
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+    img->base = base;
+    img->len = (size_t)st.st_size;
+    img->mapped = 1;
+    image_attach(img, hdr->nnodes);
+    return img;
+}
+
+/**
+ * Returns the image of a manifest's tree, mapping the one next to the
+ * manifest if it is still valid. Otherwise the tree is built, and its
+ * image kept next to the manifest if the manifest is large.
+ * @param obj The manifest.
+ * @param bpkgpath Path of the manifest.
+ * @return struct merkle_image* The image, NULL on failure.
+ */
+struct merkle_image* merkle_image_load(struct bpkg_obj* obj, const char* bpkgpath) {
+    char path[SIDECAR_PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s", bpkgpath, MERKLE_IMAGE_SUFFIX);
+    struct merkle_image* img = merkle_image_open(path, obj);
+    if (img) {
+        return img;
+    }
+
+    struct merkle_tree* tree = create_merkle_tree(obj);
+    img = merkle_image_build(tree, obj);
+    free_merkle_tree(tree);
+    struct stat st;
+    if (img && stat(bpkgpath, &st) == 0 && st.st_size >= MERKLE_IMAGE_PERSIST_MIN) {
+        merkle_image_save(img, path);
+    }
+    return img;
+}
+
+/**
+ * Finds a node by its hash in O(log n).
+ * @param img The image.
+ * @param hash The hash to look for, with a terminator.
+ * @return int64_t Index of a node with the hash, -1 if there is none.
+ */
+int64_t merkle_image_find(const struct merkle_image* img, const char* hash) {
+    if (strlen(hash) != SHA256_HEXLEN) {
+        return -1;
+    }
+    uint32_t lo = 0;
+    uint32_t hi = img->nnodes;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t node = img->order[mid];
+        if (node >= img->nnodes) {
+            return -1;
+        }
+        int c = memcmp(img->nodes[node].hash, hash, SHA256_HEXLEN);
+        if (c == 0) {
+            return node;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Adds a hash to a query, doubling its array when it is full.
+ * @param qry The query.
+ * @param hash The hash, without a terminator.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int query_push(struct bpkg_query* qry, const char* hash) {
+    // Capacity is the next power of two at or above len
+    if ((qry->len & (qry->len - 1)) == 0) {
+        size_t cap = qry->len ? (size_t)qry->len * 2 : 1;
+        char** grown = realloc(qry->hashes, cap * sizeof(char*));
+        if (!grown) {
+            return -1;
+        }
+        qry->hashes = grown;
+    }
+    char* copy = malloc(SHA256_HEXLEN + 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, hash, SHA256_HEXLEN);
+    copy[SHA256_HEXLEN] = '\0';
+    qry->hashes[qry->len++] = copy;
+    return 0;
+}
+
+/**
+ * Adds the hashes of the leaves below a node, left to right, to a query,
+ * as inorder does for a tree.
+ * @param img The image.
+ * @param node Index of the node.
+ * @param qry The query, hashes grown as needed.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int merkle_image_leaves(const struct merkle_image* img, uint32_t node,
+    struct bpkg_query* qry) {
+    if (node >= img->nnodes) {
+        return 0;
+    }
+    const struct merkle_image_node* n = &img->nodes[node];
+    // Children always sit on a later level, which bounds the walk even if
+    // the file was damaged
+    if (n->left != MERKLE_IMAGE_NONE && n->left > node
+        && merkle_image_leaves(img, n->left, qry) != 0) {
+        return -1;
+    }
+    if (n->is_leaf && query_push(qry, n->hash) != 0) {
+        return -1;
+    }
+    if (n->right != MERKLE_IMAGE_NONE && n->right > node
+        && merkle_image_leaves(img, n->right, qry) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Unmaps or frees an image.
+ * @param img The image, may be NULL.
+ */
+void merkle_image_close(struct merkle_image* img) {
+    if (!img) {
+        return;
+    }
+    if (img->mapped) {
+        munmap(img->base, img->len);
+    } else {
+        free(img->base);
+    }
+    free(img);
+}
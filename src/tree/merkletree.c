@@ -230,7 +230,119 @@ void inorder(struct merkle_tree_node* node, struct bpkg_query* qry) {
     }
 }
 
+/**
+ * Computes the parent of two nodes, the SHA-256 of their concatenated
+ * hex digests.
+ * @param left Hash of the left child.
+ * @param right Hash of the right child.
+ * @param out Receives the parent hash.
+ */
+void merkle_hash_pair(const char* left, const char* right, char* out) {
+    sha256_hash_pair(left, right, out);
+}
 
+/**
+ * Computes the parent of a node's children, the SHA-256 of their
+ * concatenated hex digests.
+ * @param children arity hashes of 64 characters, stored back to back.
+ * @param arity Number of children.
+ * @param out Receives the parent hash, must not overlap children.
+ */
+void merkle_hash_children(const char* children, uint32_t arity, char* out) {
+    sha256_hash_digests(children, arity, out);
+}
 
+/**
+ * Returns the hash of a node in level order, interior hashes first and
+ * then the chunks.
+ * @param obj The package manifest.
+ * @param i Index of the node.
+ * @return const char* The node's hash.
+ */
+static const char* level_hash(struct bpkg_obj* obj, uint32_t i) {
+    return i < obj->nhashes ? obj->hashes[i] : obj->chunks[i - obj->nhashes].hash;
+}
+
+/**
+ * Returns the root hash of a package's tree.
+ * @param obj The package manifest.
+ * @return const char* The root hash.
+ */
+const char* merkle_root(struct bpkg_obj* obj) {
+    return level_hash(obj, 0);
+}
+
+/**
+ * The merkle_get_proof function collects the sibling path of a chunk in
+ * O(log n), indexing the manifest's level order hashes directly instead
+ * of building the tree.
+ * @param obj The package manifest.
+ * @param index Index of the chunk.
+ * @param proof Receives the proof.
+ * @return int 0 on success, -1 if the index is out of range or the
+ *         manifest is not a complete tree of its arity.
+ */
+int merkle_get_proof(struct bpkg_obj* obj, uint32_t index, struct merkle_proof* proof) {
+    uint32_t k = obj->arity;
+    int height = bpkg_tree_height(obj);
+    if (index >= obj->nchunks || height < 0
+        || (uint32_t)height * (k - 1) > MERKLE_PROOF_MAX) {
+        return -1;
+    }
+    proof->index = index;
+    proof->nleaves = obj->nchunks;
+    proof->arity = k;
+    proof->len = 0;
+    // Node i has children k * i + 1 to k * i + k, siblings share (i - 1) / k
+    for (uint32_t i = obj->nhashes + index; i > 0; i = (i - 1) / k) {
+        uint32_t first = (i - 1) / k * k + 1;
+        for (uint32_t sibling = first; sibling < first + k; sibling++) {
+            if (sibling != i) {
+                memcpy(proof->siblings[proof->len++], level_hash(obj, sibling),
+                    SHA256_HEXLEN);
+            }
+        }
+    }
+    return 0;
+}
 
+/**
+ * The merkle_verify_proof function hashes a leaf up its sibling path and
+ * compares the result against a trusted root, no manifest is needed.
+ * @param leaf Hash of the chunk's data.
+ * @param proof The chunk's inclusion proof.
+ * @param root The trusted root hash.
+ * @return int 1 if the leaf belongs to the tree at proof->index, 0 otherwise.
+ */
+int merkle_verify_proof(const char* leaf, const struct merkle_proof* proof, const char* root) {
+    uint32_t n = proof->nleaves;
+    uint32_t k = proof->arity;
+    if (n == 0 || proof->index >= n || k < 2 || k > BPKG_ARITY_MAX) {
+        return 0;
+    }
+    uint32_t height = 0;
+    for (uint32_t m = n; m > 1; m /= k, height++) {
+        if (m % k != 0) {
+            return 0;
+        }
+    }
+    if (proof->len != height * (k - 1)) {
+        return 0;
+    }
 
+    char hash[SHA256_HEXLEN];
+    char group[BPKG_ARITY_MAX * SHA256_HEXLEN];
+    const char (*sibling)[SHA256_HEXLEN] = proof->siblings;
+    memcpy(hash, leaf, SHA256_HEXLEN);
+    // Level order index of the leaf, below the (n - 1) / (k - 1) interior nodes
+    uint32_t i = (n - 1) / (k - 1) + proof->index;
+    for (; i > 0; i = (i - 1) / k) {
+        uint32_t pos = (i - 1) % k;
+        for (uint32_t c = 0; c < k; c++) {
+            memcpy(group + c * SHA256_HEXLEN, c == pos ? hash : *sibling++,
+                SHA256_HEXLEN);
+        }
+        merkle_hash_children(group, k, hash);
+    }
+    return strncmp(hash, root, SHA256_HEXLEN) == 0;
+}
@@ -0,0 +1,301 @@
+/*
+ ============================================================================
+ Name        : writer.c
+ ============================================================================
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "writer.h"
+#include "metrics.h"
+#include "ratelimit.h"
+
+// Chunks gathered by a single pwritev, the kernel's IOV_MAX on Linux
+#define WRITER_IOV_MAX 1024
+
+/**
+ * Orders queued chunks by package, then by position in the data file.
+ * @param a Pointer to a struct chunk_write pointer.
+ * @param b Pointer to a struct chunk_write pointer.
+ * @return int Negative, zero or positive as for qsort.
+ */
+static int write_compare(const void* a, const void* b) {
+    const struct chunk_write* x = *(struct chunk_write* const*)a;
+    const struct chunk_write* y = *(struct chunk_write* const*)b;
+    if (x->pkg->serial != y->pkg->serial) {
+        return x->pkg->serial < y->pkg->serial ? -1 : 1;
+    }
+    uint32_t xo = x->pkg->obj->chunks[x->index].offset;
+    uint32_t yo = y->pkg->obj->chunks[y->index].offset;
+    return (xo > yo) - (xo < yo);
+}
+
+/**
+ * Writes a run of chunks lying back to back in the data file, resuming
+ * after short writes.
+ * @param fd The data file.
+ * @param run The chunks, in file order.
+ * @param n Number of chunks, at most WRITER_IOV_MAX.
+ * @return int 0 on success, -1 with errno set on failure.
+ */
+static int writer_run(int fd, struct chunk_write** run, size_t n) {
+    struct iovec iov[WRITER_IOV_MAX];
+    for (size_t i = 0; i < n; i++) {
+        iov[i].iov_base = run[i]->data;
+        iov[i].iov_len = run[i]->pkg->obj->chunks[run[i]->index].size;
+    }
+    off_t off = run[0]->pkg->obj->chunks[run[0]->index].offset;
+    struct iovec* v = iov;
+    int count = (int)n;
+    while (count > 0) {
+        ssize_t got = pwritev(fd, v, count, off);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            if (got == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        metrics_add(MC_WRITE_CALLS, 1);
+        metrics_add(MC_WRITE_BYTES, (uint64_t)got);
+        off += got;
+        while (count > 0 && (size_t)got >= v->iov_len) {
+            got -= (ssize_t)v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0) {
+            v->iov_base = (uint8_t*)v->iov_base + got;
+            v->iov_len -= (size_t)got;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the queued chunks of one package, then marks them present and
+ * records the package's journal once. Every chunk is reported to the done
+ * callback and freed.
+ * @param w The writer.
+ * @param batch Chunks of a single package, in file order.
+ * @param n Number of chunks.
+ */
+static void writer_package(struct chunk_writer* w, struct chunk_write** batch, size_t n) {
+    Package* pkg = batch[0]->pkg;
+    struct chunk* chunks = pkg->obj->chunks;
+    int fd = openPackageData(pkg);
+    int ok = fd >= 0;
+    for (size_t i = 0; ok && i < n;) {
+        size_t end = i + 1;
+        while (end < n && end - i < WRITER_IOV_MAX
+            && chunks[batch[end - 1]->index].offset + chunks[batch[end - 1]->index].size
+                == chunks[batch[end]->index].offset) {
+            end++;
+        }
+        ok = writer_run(fd, batch + i, end - i) == 0;
+        i = end;
+    }
+    // The journal must never claim data that could still be lost
+    if (ok && w->sync) {
+        ok = fdatasync(fd) == 0;
+        metrics_add(MC_WRITE_SYNCS, 1);
+    }
+    if (!ok) {
+        perror("Unable to write chunk data");
+    }
+    for (size_t i = 0; ok && i < n; i++) {
+        markChunk(pkg, batch[i]->index);
+        storeChunk(w->packages, pkg, fd, batch[i]->index);
+    }
+    if (ok) {
+        savePackageState(pkg);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    // Every chunk holds a reference, the package stays valid until the last
+    for (size_t i = 0; i < n; i++) {
+        struct chunk_write* c = batch[i];
+        atomic_fetch_sub(&w->queued, chunks[c->index].size);
+        w->done(w->done_arg, pkg, c->index, ok);
+        free(c->data);
+        free(c);
+        releasePackage(pkg);
+    }
+}
+
+/**
+ * Writes a batch of queued chunks, package by package in file order.
+ * @param w The writer.
+ * @param list The chunks, linked through next.
+ */
+static void writer_flush(struct chunk_writer* w, struct chunk_write* list) {
+    size_t n = 0;
+    for (struct chunk_write* c = list; c; c = c->next) {
+        n++;
+    }
+    struct chunk_write** batch = malloc(n * sizeof(struct chunk_write*));
+    if (!batch) {
+        // Without memory to sort, every chunk is written on its own
+        while (list) {
+            struct chunk_write* c = list;
+            list = c->next;
+            writer_package(w, &c, 1);
+        }
+        return;
+    }
+    n = 0;
+    for (struct chunk_write* c = list; c; c = c->next) {
+        batch[n++] = c;
+    }
+    qsort(batch, n, sizeof(struct chunk_write*), write_compare);
+    for (size_t i = 0; i < n;) {
+        size_t end = i + 1;
+        while (end < n && batch[end]->pkg == batch[i]->pkg) {
+            end++;
+        }
+        writer_package(w, batch + i, end - i);
+        i = end;
+    }
+    free(batch);
+}
+
+/**
+ * Body of the writer thread. A batch gathers chunks for delay_ns after the
+ * first one, chunks queued while a batch is being written join the next,
+ * so batches grow with the load.
+ * @param arg The struct chunk_writer.
+ * @return void* NULL.
+ */
+static void* writer_thread(void* arg) {
+    struct chunk_writer* w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->head && !w->stop) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        if (!w->head) {
+            break;
+        }
+        uint64_t deadline = tb_now_ns() + w->delay_ns;
+        while (w->delay_ns && !w->stop && atomic_load(&w->queued) < w->limit / 2) {
+            struct timespec ts = { (time_t)(deadline / 1000000000ULL),
+                (long)(deadline % 1000000000ULL) };
+            if (pthread_cond_timedwait(&w->wake, &w->lock, &ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+        struct chunk_write* list = w->head;
+        w->head = w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+        writer_flush(w, list);
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/**
+ * Starts the writer thread.
+ * @param w The writer to initialise.
+ * @param packages Registry of managed packages, for the chunk store.
+ * @param sync 1 to fdatasync each batch before marking its chunks.
+ * @param delay_ns How long a batch gathers chunks, 0 to write at once.
+ * @param limit Bytes queued above which writer_full reports backpressure.
+ * @param done Called for every chunk handed to writer_put once it has been
+ *        written and marked, or could not be written.
+ * @param arg Argument of done.
+ * @return int 0 on success, -1 if the thread could not be started.
+ */
+int writer_start(struct chunk_writer* w, PackageList* packages, int sync,
+    uint64_t delay_ns, size_t limit,
+    void (*done)(void* arg, Package* pkg, uint32_t index, int ok), void* arg) {
+    w->packages = packages;
+    w->sync = sync;
+    w->delay_ns = delay_ns;
+    w->limit = limit;
+    w->done = done;
+    w->done_arg = arg;
+    w->head = w->tail = NULL;
+    w->stop = 0;
+    atomic_init(&w->queued, 0);
+    pthread_mutex_init(&w->lock, NULL);
+
+    // Batch deadlines are measured on the clock the token buckets use
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        pthread_cond_destroy(&w->wake);
+        pthread_mutex_destroy(&w->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queues a verified chunk for writing, from any thread.
+ * @param w The writer.
+ * @param pkg The package owning the chunk, retained until it is written.
+ * @param index Index of the chunk.
+ * @param data The chunk data, freed by the writer.
+ * @return int 0 on success, -1 on allocation failure, data is then still
+ *         owned by the caller.
+ */
+int writer_put(struct chunk_writer* w, Package* pkg, uint32_t index, uint8_t* data) {
+    struct chunk_write* c = malloc(sizeof(struct chunk_write));
+    if (!c) {
+        return -1;
+    }
+    retainPackage(pkg);
+    c->pkg = pkg;
+    c->index = index;
+    c->data = data;
+    c->next = NULL;
+    atomic_fetch_add(&w->queued, pkg->obj->chunks[index].size);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail) {
+        w->tail->next = c;
+    } else {
+        w->head = c;
+    }
+    w->tail = c;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/**
+ * Checks whether enough data waits for the writer that no more should be
+ * received.
+ * @param w The writer.
+ * @return int 1 if the queue is full.
+ */
+int writer_full(struct chunk_writer* w) {
+    return atomic_load(&w->queued) >= w->limit;
+}
+
+/**
+ * Writes every queued chunk and stops the writer thread.
+ * @param w A writer started by writer_start.
+ */
+void writer_stop(struct chunk_writer* w) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->wake);
+    pthread_mutex_destroy(&w->lock);
+}
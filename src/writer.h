@@ -0,0 +1,95 @@
+/*
+ ============================================================================
+ Name        : writer.h
+ ============================================================================
+ */
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "package.h"
+
+/**
+ * Verified chunk waiting to be written, data holds the whole chunk.
+ */
+struct chunk_write {
+    Package* pkg;
+    uint32_t index;
+    uint8_t* data;
+    struct chunk_write* next;
+};
+
+/**
+ * Thread writing verified chunks to their data files. Everything queued
+ * since the previous pass is written in one batch: chunks are sorted by
+ * package and offset and runs of adjacent chunks go out in a single
+ * pwritev. Chunks are marked present and the journal saved once per
+ * package and batch, after the data has been written and, with sync set,
+ * flushed with fdatasync. A batch gathers chunks for up to delay_ns, or
+ * until half of limit is queued, so writes and flushes are shared.
+ * - queued: bytes of chunks handed over and not yet written, the network
+ *   side stops receiving while it is at least limit.
+ * - done: told about every chunk once it is present, or failed to be
+ *   written, from the writer thread.
+ */
+struct chunk_writer {
+    PackageList* packages;
+    int sync;
+    uint64_t delay_ns;
+    size_t limit;
+    void (*done)(void* arg, Package* pkg, uint32_t index, int ok);
+    void* done_arg;
+    struct chunk_write* head;
+    struct chunk_write* tail;
+    atomic_size_t queued;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+};
+
+/**
+ * Starts the writer thread.
+ * @param w The writer to initialise.
+ * @param packages Registry of managed packages, for the chunk store.
+ * @param sync 1 to fdatasync each batch before marking its chunks.
+ * @param delay_ns How long a batch gathers chunks, 0 to write at once.
+ * @param limit Bytes queued above which writer_full reports backpressure.
+ * @param done Called for every chunk handed to writer_put once it has been
+ *        written and marked, or could not be written.
+ * @param arg Argument of done.
+ * @return int 0 on success, -1 if the thread could not be started.
+ */
+int writer_start(struct chunk_writer* w, PackageList* packages, int sync,
+    uint64_t delay_ns, size_t limit,
+    void (*done)(void* arg, Package* pkg, uint32_t index, int ok), void* arg);
+
+/**
+ * Queues a verified chunk for writing, from any thread.
+ * @param w The writer.
+ * @param pkg The package owning the chunk, retained until it is written.
+ * @param index Index of the chunk.
+ * @param data The chunk data, freed by the writer.
+ * @return int 0 on success, -1 on allocation failure, data is then still
+ *         owned by the caller.
+ */
+int writer_put(struct chunk_writer* w, Package* pkg, uint32_t index, uint8_t* data);
+
+/**
+ * Checks whether enough data waits for the writer that no more should be
+ * received.
+ * @param w The writer.
+ * @return int 1 if the queue is full.
+ */
+int writer_full(struct chunk_writer* w);
+
+/**
+ * Writes every queued chunk and stops the writer thread.
+ * @param w A writer started by writer_start.
+ */
+void writer_stop(struct chunk_writer* w);
+
+#endif // WRITER_H
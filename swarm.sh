@@ -0,0 +1,207 @@
+#!/bin/bash
+
+# Loopback swarm simulator. Starts N btide nodes on 127.0.0.1, seeds a
+# generated package on some of them and has the rest FETCH every chunk,
+# optionally through netproxy to add latency and loss. With -r the
+# leechers also connect to each other and FETCH the package by identifier,
+# spreading the chunks rarest first, instead of being handed the chunks
+# round-robin over the seeds. Prints completion
+# time, aggregate throughput and CPU seconds per GB, the last line is a
+# JSON summary.
+
+usage() {
+    echo "Usage: $0 [-n nodes] [-s seeds] [-m size_mb] [-c chunks] [-d delay_ms] [-l loss_pct] [-p base_port] [-t timeout_s] [-r]"
+    exit 1
+}
+
+nodes=4
+seeds=1
+size_mb=16
+chunks=256
+delay=0
+loss=0
+base_port=20000
+timeout=300
+rarest=0
+btide=$(realpath "${BTIDE:-./btide_release}")
+pkgmake=$(realpath "${PKGMAKE:-./pkgmake}")
+netproxy=$(realpath "${NETPROXY:-./netproxy}")
+
+while getopts "n:s:m:c:d:l:p:t:r" opt; do
+    case $opt in
+        n) nodes=$OPTARG ;;
+        s) seeds=$OPTARG ;;
+        m) size_mb=$OPTARG ;;
+        c) chunks=$OPTARG ;;
+        d) delay=$OPTARG ;;
+        l) loss=$OPTARG ;;
+        p) base_port=$OPTARG ;;
+        t) timeout=$OPTARG ;;
+        r) rarest=1 ;;
+        *) usage ;;
+    esac
+done
+if (( nodes < 2 || seeds < 1 || seeds >= nodes )); then
+    usage
+fi
+leechers=$((nodes - seeds))
+use_proxy=0
+if [ "$delay" != "0" ] || [ "$loss" != "0" ]; then
+    use_proxy=1
+fi
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/swarm.XXXXXX")
+pids=()
+proxies=()
+
+# Stop every process and remove the generated files
+cleanup() {
+    for ((i=0; i<nodes; i++)); do
+        [ -n "${infd[$i]}" ] || continue
+        echo "QUIT" >&"${infd[$i]}" 2>/dev/null
+        eval "exec ${infd[$i]}>&-"
+    done
+    wait "${pids[@]}" 2>/dev/null
+    for p in "${proxies[@]}"; do
+        kill "$p" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# Generate the package once, seeds get the data, leechers only the manifest
+head -c $((size_mb * 1024 * 1024)) /dev/urandom > "$work/swarm.data"
+(cd "$work" && "$pkgmake" swarm.data --nchunks "$chunks" --output swarm.bpkg) || exit 1
+ident=$(sed -n 's/^ident://p' "$work/swarm.bpkg")
+mapfile -t hashes < <(sed -n '/^chunks:/,$p' "$work/swarm.bpkg" | tail -n +2 | cut -d, -f1 | tr -d '\t')
+mapfile -t offsets < <(sed -n '/^chunks:/,$p' "$work/swarm.bpkg" | tail -n +2 | cut -d, -f2)
+
+# Total CPU time of a process in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat" 2>/dev/null || echo 0
+}
+
+# Number of nodes whose log reports the package complete
+count_complete() {
+    local done=0
+    for ((i=$1; i<$2; i++)); do
+        grep -q "COMPLETE 100.0%" "$work/node$i/log" && ((done++))
+    done
+    echo "$done"
+}
+
+# Start the nodes, each reads commands from a fifo kept open here
+for ((i=0; i<nodes; i++)); do
+    dir="$work/node$i"
+    mkdir -p "$dir/pkgs"
+    printf "directory:%s\nmax_peers:%d\nport:%d\n" "$dir/pkgs" $((nodes + 8)) $((base_port + i)) > "$dir/config.cfg"
+    cp "$work/swarm.bpkg" "$dir/pkgs/"
+    if (( i < seeds )); then
+        cp "$work/swarm.data" "$dir/pkgs/"
+    fi
+    mkfifo "$dir/in"
+    "$btide" "$dir/config.cfg" < "$dir/in" > "$dir/log" 2>&1 &
+    pids[$i]=$!
+    exec {fd}>"$dir/in"
+    infd[$i]=$fd
+done
+
+# Seeds are reached directly or through one proxy each
+for ((s=0; s<seeds; s++)); do
+    seed_port[$s]=$((base_port + s))
+    if (( use_proxy )); then
+        port=$((base_port + nodes + s))
+        "$netproxy" "$port" "127.0.0.1:$((base_port + s))" --delay "$delay" --loss "$loss" --seed $((s + 1)) &
+        proxies+=($!)
+        seed_port[$s]=$port
+    fi
+done
+
+# Wait for the seeds to finish verifying their data
+deadline=$((SECONDS + timeout))
+while (( $(count_complete 0 "$seeds") < seeds )); do
+    for ((s=0; s<seeds; s++)); do
+        echo "PACKAGES" >&"${infd[$s]}"
+    done
+    sleep 0.2
+    (( SECONDS > deadline )) && { echo "Seeds did not become ready"; exit 1; }
+done
+
+# Connect every leecher to every seed, and with -r to every earlier leecher
+for ((i=seeds; i<nodes; i++)); do
+    for ((s=0; s<seeds; s++)); do
+        echo "CONNECT 127.0.0.1:${seed_port[$s]}" >&"${infd[$i]}"
+    done
+    if (( rarest )); then
+        for ((j=seeds; j<i; j++)); do
+            echo "CONNECT 127.0.0.1:$((base_port + j))" >&"${infd[$i]}"
+        done
+    fi
+done
+for ((i=seeds; i<nodes; i++)); do
+    # Leecher i has made one connection to each of the i nodes before it
+    want=$seeds
+    if (( rarest )); then
+        want=$i
+    fi
+    while (( $(grep -c "Connection established with peer" "$work/node$i/log") < want )); do
+        sleep 0.05
+        (( SECONDS > deadline )) && { echo "Node $i could not connect"; exit 1; }
+    done
+done
+
+cpu_start=0
+for p in "${pids[@]}" "${proxies[@]}"; do
+    cpu_start=$((cpu_start + $(cpu_ticks "$p")))
+done
+start=$(date +%s.%N)
+
+# Spread the chunks of every leecher round-robin over the seeds
+for ((i=seeds; i<nodes; i++)); do
+    if (( rarest )); then
+        echo "FETCH $ident" >&"${infd[$i]}"
+        continue
+    fi
+    {
+        for ((k=0; k<${#hashes[@]}; k++)); do
+            s=$(((k + i) % seeds))
+            echo "FETCH 127.0.0.1:${seed_port[$s]} $ident ${hashes[$k]} ${offsets[$k]}"
+        done
+    } >&"${infd[$i]}"
+done
+
+# Poll the leechers until all of them hold the whole package
+while (( $(count_complete "$seeds" "$nodes") < leechers )); do
+    for ((i=seeds; i<nodes; i++)); do
+        grep -q "COMPLETE 100.0%" "$work/node$i/log" || echo "PACKAGES" >&"${infd[$i]}"
+    done
+    sleep 0.1
+    (( SECONDS > deadline )) && { echo "Timed out with $(count_complete "$seeds" "$nodes") / $leechers complete"; exit 1; }
+done
+end=$(date +%s.%N)
+
+cpu_end=0
+for p in "${pids[@]}" "${proxies[@]}"; do
+    cpu_end=$((cpu_end + $(cpu_ticks "$p")))
+done
+
+for ((i=seeds; i<nodes; i++)); do
+    if ! cmp -s "$work/swarm.data" "$work/node$i/pkgs/swarm.data"; then
+        echo "Node $i data does not match"
+        exit 1
+    fi
+done
+
+hz=$(getconf CLK_TCK)
+awk -v start="$start" -v end="$end" -v size="$size_mb" -v n="$leechers" \
+    -v cpu=$((cpu_end - cpu_start)) -v hz="$hz" -v nodes="$nodes" -v seeds="$seeds" \
+    -v delay="$delay" -v loss="$loss" 'BEGIN {
+    t = end - start
+    gb = size * n / 1024
+    printf "Nodes: %d (%d seeds), package %d MB, delay %s ms, loss %s%%\n", nodes, seeds, size, delay, loss
+    printf "Completion time: %.3f s\n", t
+    printf "Aggregate throughput: %.2f MB/s\n", size * n / t
+    printf "CPU per GB: %.3f s\n", cpu / hz / gb
+    printf "{\"nodes\":%d,\"seeds\":%d,\"size_mb\":%d,\"delay_ms\":%s,\"loss_pct\":%s,\"completion_s\":%.3f,\"throughput_mb_s\":%.2f,\"cpu_s_per_gb\":%.3f}\n", nodes, seeds, size, delay, loss, t, size * n / t, cpu / hz / gb
+}'